@@ -0,0 +1,75 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Binary form of the server and change logs, used instead of the text files when the server
+    is started with BINLOG_ENV set in its environment.
+
+    Nothing is formatted while the server runs. Every entry is a fixed-size record: a
+    CLOCK_MONOTONIC timestamp in nanoseconds, an event ID naming the message, the interned ID of
+    the file it is about and argument slots. The strings a record refers to (file names, user
+    names, the details of a change) are interned: each one is appended once to `<log>.str` and
+    records carry its ID. The table of interned strings holds at most BINLOG_MAX_STRINGS, so
+    distinct search terms cannot grow the server without bound; once it is full a new string is
+    appended to `<log>.str` again each time it is logged, under a new ID, like a text log would.
+
+    The log is grown in BINLOG_CHUNK_SIZE chunks that are mapped shared. A thread reserves a
+    record with one atomic add and writes it in place, the event ID last; a record still zero
+    was reserved but never finished and is skipped. Record 0 is the file header. Each start of
+    the server writes a BINLOG_START record holding the wall clock and the monotonic clock,
+    which the decoder (src/binlog_decode.c) uses to print the timestamps of the text logs.
+
+    The message of an event is described by a format where %f is the file and %s the next
+    string argument; binlog_render is shared by the decoder and by the text logs, so both
+    print the same lines.
+*/
+
+#define BINLOG_MAGIC "PCDBLOG1" /* First 8 bytes of the header record */
+#define BINLOG_VERSION 1
+#define BINLOG_PATH "server.blog"
+#define BINLOG_STRINGS_SUFFIX ".str"
+#define BINLOG_ENV "PCD_BINARY_LOG" /* Environment variable turning the binary log on */
+#define BINLOG_CHUNK_SIZE (1024 * 1024) /* Bytes the log grows by, one mapping each */
+#define BINLOG_MAX_CHUNKS 4096 /* Records past this size are dropped */
+#define BINLOG_ARGS 6 /* Argument slots of a record */
+#define BINLOG_MAX_STRINGS 65536 /* Strings kept in memory to be found again */
+
+enum {
+    BINLOG_EMPTY, /* Reserved but never written */
+    BINLOG_START, /* args: wall clock in ns, monotonic clock in ns */
+    BINLOG_MESSAGE, /* A fixed message of the server log */
+    BINLOG_CHANGE, /* A line of the change log */
+    BINLOG_USER_BLOCKED,
+    BINLOG_USER_UNBLOCKED,
+    BINLOG_SEARCH_DIRECTORY,
+    BINLOG_CONVERT_DIRECTORY,
+    BINLOG_EVENT_COUNT
+};
+
+/* One entry, 64 bytes */
+typedef struct {
+    uint64_t time; /* CLOCK_MONOTONIC, in ns */
+    uint16_t event; /* Stored last, 0 until the record is complete */
+    uint16_t count; /* Argument slots used */
+    uint32_t file; /* Interned file name, 0 for none */
+    uint64_t args[BINLOG_ARGS]; /* Interned strings, or numbers for BINLOG_START */
+} binlog_record_t;
+
+/* Record 0 */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    char reserved[48];
+} binlog_header_t;
+
+int binlog_open(const char *path); /* Function that opens or creates a binary log and records the start of the server, returns 0 on failure */
+int binlog_enabled(void); /* Function that tells whether binlog_open succeeded */
+void binlog_event(int event, const char *file, const char *first, const char *second); /* Function that appends a record, the arguments are interned; NULL for unused ones */
+const char *binlog_log_name(int event); /* Function that returns the text log an event belongs to, NULL for an unknown event */
+size_t binlog_render(int event, const char *file, const char *const *args, int count, char *out, size_t size); /* Function that writes the text message of an event, returns its length */
+
+#endif // BINLOG_H
@@ -0,0 +1,60 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <time.h>
+#include "server.h"
+
+/*
+    In-memory catalog of everything under the served root.
+
+    Every file and directory has its size, modification time and format; xml and json documents
+    also have the author, title, description and file_size read from them. Listings and metadata
+    lookups are answered from memory, without a readdir or a stat.
+
+    At start the last snapshot is loaded, then the tree is scanned again by several threads
+    (directories and documents are shared out between them) and only the documents whose size or
+    modification time changed since the snapshot are read again. Afterwards an inotify watcher
+    thread keeps the catalog current: events are collected until CATALOG_DEBOUNCE_MS pass without
+    a new one (or CATALOG_MAX_DELAY_MS since the first), then every path they name is checked once
+    and the changed documents are read in a single batch. Hidden entries are listed but not
+    descended into or read. Paths are taken relative to the root, which is the working directory
+    of the server.
+*/
+
+#define CATALOG_SNAPSHOT ".catalog" /* Snapshot file in the root, rewritten after changes settle */
+#define CATALOG_MAX_THREADS 16 /* Threads of the startup scan, at most one per CPU */
+#define CATALOG_DEBOUNCE_MS 200 /* Quiet time that ends a batch of events */
+#define CATALOG_MAX_DELAY_MS 2000 /* A batch is applied after this long even if events keep coming */
+#define CATALOG_MAX_BATCH 4096 /* Paths that end a batch early */
+#define CATALOG_SNAPSHOT_DELAY_MS 5000 /* Quiet time before the snapshot is written again */
+
+/* Kind of an entry */
+typedef enum {
+    CATALOG_OTHER,
+    CATALOG_DIRECTORY,
+    CATALOG_XML,
+    CATALOG_JSON
+} catalog_format;
+
+/* What the catalog knows about one path */
+typedef struct {
+    catalog_format format;
+    long long size;
+    struct timespec mtime;
+    FileMetadata metadata; /* Only for xml and json documents, `found` is 0 otherwise */
+} catalog_info_t;
+
+/* Names in a directory */
+typedef struct {
+    size_t count;
+    char **names; /* In name order */
+} catalog_listing_t;
+
+int catalog_start(const char *root); /* Function that loads the snapshot, scans the root and starts watching it, returns the number of documents */
+int catalog_list(const char *dirname, catalog_listing_t *listing); /* Function that lists a directory, returns 0 if it is not in the catalog */
+void catalog_listing_free(catalog_listing_t *listing); /* Function that frees the names of a listing */
+int catalog_lookup(const char *path, catalog_info_t *info); /* Function that returns what is known about a path, 0 if it is not in the catalog */
+void catalog_refresh(const char *path); /* Function that applies a change made by the server at once, without waiting for its event */
+
+#endif // CATALOG_H
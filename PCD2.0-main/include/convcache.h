@@ -0,0 +1,52 @@
+#ifndef CONVCACHE_H
+#define CONVCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Content-addressed cache of XML to JSON conversions.
+
+    The XML input is hashed with a 128-bit MurmurHash3 in the same pass that pages it in. The
+    JSON produced for a digest, with its path index and tape, is kept under CONVCACHE_DIR named
+    after the digest. When the same content comes again, the cached files are reflinked (or
+    copied where the filesystem cannot share extents) to the new names instead of being
+    converted: the copy gets the modification time the sidecars were built for, so they stay
+    valid. Each copy is written and renamed over its target like any save (savefile.h), so the
+    old document stays in place until the new one is complete.
+
+    Entries are evicted least recently used first once there are more than
+    CONVCACHE_MAX_ENTRIES of them or they take more than CONVCACHE_MAX_BYTES. The store itself is
+    filled with hardlinks of the outputs, renamed in place the same way: no file is rewritten in
+    place, so the stored inode never changes. Outputs are never hardlinked, since reads and
+    writes are locked by inode (filelock.h) and documents sharing one would share their lock.
+*/
+
+#define CONVCACHE_DIR ".convcache" /* Store of the cached outputs, in the served root */
+#define CONVCACHE_MAX_ENTRIES 4096 /* Digests kept */
+#define CONVCACHE_MAX_BYTES (1024LL * 1024 * 1024) /* Bytes of outputs kept, sidecars included */
+
+/* 128-bit digest of an input */
+typedef struct {
+    uint64_t low;
+    uint64_t high;
+} convcache_digest_t;
+
+/* Counters shown to admins */
+typedef struct {
+    long entries;
+    long long bytes;
+    long hits;
+    long misses;
+    long evictions;
+} convcache_stats_t;
+
+void convcache_hash(const void *data, size_t size, convcache_digest_t *digest); /* Function that hashes an input */
+int convcache_init(const char *dirname); /* Function that loads the store of a directory, returns the number of entries */
+int convcache_convert(const char *xml_path, const char *json_path, convcache_digest_t *digest, int *hit); /* Function that converts an XML file or links the cached result, returns 0 if the file is not valid */
+int convcache_convert_fd(int xml_fd, const char *xml_path, const char *json_path, convcache_digest_t *digest, int *hit); /* Function that converts the XML file open on a descriptor (see filelock_read), the descriptor stays the caller's */
+int convcache_link(const convcache_digest_t *digest, const char *json_path); /* Function that links the cached outputs of a digest to a JSON path, counts a hit or a miss */
+void convcache_add(const convcache_digest_t *digest, const char *json_path); /* Function that stores a converted JSON file and its sidecars */
+void convcache_stats(convcache_stats_t *stats); /* Function that reads the counters */
+
+#endif // CONVCACHE_H
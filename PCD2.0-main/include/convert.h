@@ -0,0 +1,31 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+/*
+    Conversion of every XML file of a directory to JSON.
+
+    Files go through four stages connected by bounded queues, each stage running on its own
+    threads of a pool created for the conversion:
+
+        read       maps the XML file, pages it in and hashes it
+        transcode  parses and converts it into JSON text in memory (one pass, no tree), or
+                   links the outputs from the conversion cache when the content was seen before
+        write      writes the JSON file next to the XML one
+        index      writes the tape and the path index from one parse of the JSON file (none for a
+                   file linked from the cache, its sidecars came with it), updates the catalog
+                   and the log
+
+    A stage only waits when its input queue is empty or its output queue is full, so the disk
+    and every core stay busy at once and memory holds at most CONVERT_QUEUE_SIZE files between
+    two stages. Progress and failures are streamed back while the conversion runs; the time
+    every stage spent working and its throughput are reported at the end.
+*/
+
+#define CONVERT_QUEUE_SIZE 16 /* Files waiting between two stages */
+#define CONVERT_MAX_THREADS 16 /* Threads of the transcode and index stages, at most one per CPU */
+#define CONVERT_IO_THREADS 2 /* Threads of the read and write stages */
+#define CONVERT_PROGRESS_MS 1000 /* Time between two progress lines */
+
+int convert_all(const char *dirname, int client_socket); /* Function that converts every XML file of a directory and streams the progress, returns 0 if nothing could be started */
+
+#endif // CONVERT_H
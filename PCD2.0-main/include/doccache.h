@@ -0,0 +1,49 @@
+#ifndef DOCCACHE_H
+#define DOCCACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include "jindex.h"
+#include "jcursor.h"
+
+/*
+    Process-wide cache of parsed documents.
+
+    Entries are keyed by (device, inode, size, mtime) of the file, so a file that is rewritten by
+    an upload or an edit gets a new key and the old parse is never returned again. The cache is
+    split in lock stripes chosen by inode; each stripe keeps its own LRU list and eviction walks
+    the stripes from their cold end until the whole cache fits the byte budget. Callers get a
+    refcounted handle: an evicted document stays alive until the last handle on it is released,
+    and concurrent misses on the same file wait for a single parse.
+    When no document can be returned, errno is EINVAL if the file could be read but not parsed.
+*/
+
+#define DOCCACHE_BUDGET (256 * 1024 * 1024) /* Bytes of parsed documents kept by the whole cache */
+#define DOCCACHE_STRIPES 16 /* Number of independently locked parts of the cache */
+#define DOCCACHE_BUCKETS 64 /* Hash buckets per stripe */
+
+/* Kind of parsed document kept in the cache, one loader per kind */
+typedef struct {
+    const char *name; /* Name used in messages */
+    void *(*load)(int fd, const struct stat *st, size_t *bytes); /* Parse the open file, report the memory used */
+    void (*free)(void *document); /* Free a parsed document */
+} doccache_type_t;
+
+/* A JSON file kept in memory together with its structural index */
+typedef struct {
+    char *data; /* Contents of the file */
+    size_t size; /* Size of the contents */
+    struct timespec mtime; /* Modification time of the file that was read */
+    jindex_t index; /* Structural index of the contents */
+    jspan_t root; /* Top level value */
+} json_document_t;
+
+extern const doccache_type_t doccache_json; /* Loader for json_document_t */
+
+typedef struct doccache_entry doccache_handle_t; /* Reference to a cached document */
+
+void *doccache_acquire(const char *path, const doccache_type_t *type, doccache_handle_t **handle); /* Function that returns the parsed document of a file, parsing it on a miss */
+void *doccache_acquire_fd(int fd, const doccache_type_t *type, doccache_handle_t **handle); /* Function that returns the parsed document of an open file (see filelock_read), the descriptor stays the caller's */
+void doccache_release(doccache_handle_t *handle); /* Function that drops a reference returned by doccache_acquire */
+
+#endif // DOCCACHE_H
@@ -0,0 +1,28 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+/*
+    Search of every file of a directory with one JSON path or XPath expression.
+
+    Files are taken in name order and searched on a pool of worker threads shared by all clients
+    (separate from the pool that serves connections). At most FANOUT_WINDOW files are in flight
+    past the next one to report, and each keeps at most FANOUT_MAX_FILE_OUTPUT bytes of results,
+    so a search holds a bounded amount of memory whatever the size of the directory. Results are
+    sent in file order as soon as the next file is done; once the limit of matches is reached the
+    files still running stop at their next match and the rest are never started.
+*/
+
+#define FANOUT_MAX_THREADS 16 /* Workers of the search pool, at most one per CPU */
+#define FANOUT_QUEUE_SIZE 256 /* Files waiting for a worker, over all searches */
+#define FANOUT_WINDOW 32 /* Files of one search in flight at once */
+#define FANOUT_MAX_FILE_OUTPUT (4 * 1024 * 1024) /* Bytes of results kept for one file */
+
+/* Language of the expression */
+typedef enum {
+    FANOUT_JSON, /* JSON path over the .json files */
+    FANOUT_XPATH /* XPath over the .xml files */
+} fanout_kind;
+
+int fanout_search(const char *dirname, fanout_kind kind, const char *expression, long limit, int client_socket); /* Function that searches a directory and streams the results, `limit` 0 for all matches */
+
+#endif // FANOUT_H
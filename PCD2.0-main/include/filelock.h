@@ -0,0 +1,49 @@
+#ifndef FILELOCK_H
+#define FILELOCK_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+    Coordination of the readers and the writers of a file.
+
+    A document is never changed in place: a writer builds the new version in a new file and
+    renames it over the old one (savefile.h), and a delete only removes the name. A reader that
+    opened a file keeps the version it opened for as long as it holds the descriptor or a mapping
+    of it, whatever is published meanwhile, so readers only take a shared count and never wait.
+
+    Writers of the same file are serialized. The table is keyed by the (device, inode) of the
+    current version, or by the directory and name of a file that does not exist yet, and split in
+    lock stripes chosen by that key like the document cache. A writer that finds another one on
+    the file waits for it, then looks the name up again: if a new version was published meanwhile
+    it moves on to the entry of that version. The lock reports the version a writer replaces, so
+    an editor can refuse to save over a version published after it read the file.
+
+    Every reader of a document takes the read lock, so the status a client asks for counts them
+    all: the searches (tape, path index, parsed JSON, batches, XPath, fan out), the metadata reads,
+    the editor and the XML sources of a conversion. The sidecars (.tape, .idx) are not locked on
+    their own, they are read under the lock of their JSON file and checked against its size and
+    mtime. The server's own stores (history, catalog, conversion cache, logs) have a single writer
+    of their own and are not documents, so they are not locked either.
+*/
+
+#define FILELOCK_STRIPES 16 /* Number of independently locked parts of the table */
+#define FILELOCK_BUCKETS 64 /* Hash buckets per stripe */
+
+/* A read or a write in progress on one version of a file */
+typedef struct {
+    struct filelock_entry *entry; /* NULL when nothing is held */
+    int writer; /* A write rather than a read */
+    int exists; /* The file existed when it was locked */
+    dev_t device; /* Version of the file */
+    ino_t inode;
+    struct timespec mtime;
+} filelock_t;
+
+int filelock_read(const char *path, filelock_t *lock); /* Function that opens the current version of a file for reading and counts the reader; returns the descriptor, -1 on failure */
+int filelock_write(const char *path, filelock_t *lock); /* Function that waits until no other writer works on a file and locks the version it will replace; returns 0 on failure */
+int filelock_same(const filelock_t *lock, const filelock_t *other); /* Function that tells if two locks hold the same version of a file */
+void filelock_release(filelock_t *lock); /* Function that ends a read or a write */
+void filelock_status(const char *path, int *readers, int *writing); /* Function that reads how many readers hold the current version of a file and whether a writer works on it */
+
+#endif // FILELOCK_H
@@ -0,0 +1,45 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <time.h>
+#include "server.h"
+
+/*
+    Indexed history of the changes made to files, kept next to changes.log so that the changes of
+    one file can be listed without reading the whole log.
+
+    Changes are appended to numbered segment files under HISTORY_DIR; a record holds the time,
+    the file, the type of the change and its details, so a segment describes itself. The segment
+    being written is indexed in memory: a hash table maps each file to the offsets and times of
+    its records. Once a segment reaches HISTORY_SEGMENT_SIZE it is sealed: its index is written
+    to `<segment>.idx` (the files sorted by hash, each with its offsets in time order) and mapped
+    read-only, and a new segment is started.
+
+    A query visits the segments in order, skips those that end before the requested time, finds
+    the file by binary search in each sealed index and seeks to the first record at or after the
+    time; only the records of the file are read. At startup sealed segments are mapped and only
+    the segment that was being written is scanned (a record cut by a crash is dropped).
+
+    Files are named relative to the served directory, whether they are given as absolute or
+    relative paths, so that a deleted file is still found under the name it had.
+
+    Recording a change only builds its record and copies it into a queue; a writer thread takes
+    everything queued at once, appends it to the segment with one write, indexes it and seals the
+    segment when it is full, so no request waits for the disk or for the store lock. A request
+    only waits when HISTORY_QUEUE_SIZE bytes are already waiting, and a query first waits until
+    the changes recorded before it are written.
+*/
+
+#define HISTORY_DIR ".history" /* Store of the segments, in the served root */
+#define HISTORY_SEGMENT_SIZE (16 * 1024 * 1024) /* Bytes of a segment before it is sealed */
+#define HISTORY_INDEX_MAGIC "HISTIDX1"
+#define HISTORY_QUEUE_SIZE (1024 * 1024) /* Bytes of records waiting for the writer */
+
+typedef void (*history_callback)(const ChangeLog *change, void *arg);
+
+int history_init(const char *dirname); /* Function that opens the history of a directory, returns the number of changes it holds */
+void history_append(const char *filename, const char *change_type, const char *details); /* Function that records a change */
+long history_query(const char *filename, time_t since, history_callback callback, void *arg); /* Function that calls back for every change of a file from a time on, oldest first, returns how many */
+void history_flush(void); /* Function that waits until every change recorded so far is written */
+
+#endif // HISTORY_H
@@ -0,0 +1,38 @@
+#ifndef JBATCH_H
+#define JBATCH_H
+
+#include "jquery.h"
+
+/*
+    Several compiled queries answered in one walk of a document.
+
+    The queries are merged into a prefix trie of their instructions, so a shared prefix like
+    `store.book` is followed once, and the members of an object (or elements of an array) are
+    read once for all the steps that branch from the same node. Matches are collected per query
+    as spans of the document, in document order.
+*/
+
+#define JBATCH_MAX_PATHS 64 /* Queries accepted in one batch */
+
+/* Matches of one query */
+typedef struct {
+    jspan_t *matches; /* Values found, pointing into the document */
+    int count;
+    int capacity;
+} jbatch_result_t;
+
+typedef struct jbatch_node jbatch_node_t;
+
+/* A batch of queries merged into a trie */
+typedef struct {
+    jbatch_node_t *root; /* Node before the first instruction */
+    int count; /* Number of queries */
+    jbatch_result_t *results; /* Matches of each query, in the order they were given */
+    int failed; /* Set when memory ran out while collecting matches */
+} jbatch_t;
+
+int jbatch_init(jbatch_t *batch, jquery_t **queries, int count); /* Function that merges the queries, which must outlive the batch */
+int jbatch_run(jbatch_t *batch, const jspan_t *root, const jindex_t *index); /* Function that collects the matches of every query in one walk */
+void jbatch_free(jbatch_t *batch); /* Function that frees the trie and the results */
+
+#endif // JBATCH_H
@@ -0,0 +1,56 @@
+#ifndef JCURSOR_H
+#define JCURSOR_H
+
+#include <stddef.h>
+#include "jindex.h"
+
+/*
+    On-demand navigation over raw JSON text.
+
+    Values are located as byte ranges of the input; containers that are not on the requested
+    path are skipped by bracket matching, so nothing is parsed or allocated until the caller
+    decides to materialize a value (for example with cJSON_Parse on the range).
+    When a structural index of the document is available (see jindex.h) it can be passed along
+    and containers are then skipped by a binary search over its positions instead of being scanned.
+*/
+
+/* Types of JSON values, decided from the first byte */
+typedef enum {
+    JSON_TYPE_INVALID,
+    JSON_TYPE_OBJECT,
+    JSON_TYPE_ARRAY,
+    JSON_TYPE_STRING,
+    JSON_TYPE_NUMBER,
+    JSON_TYPE_TRUE,
+    JSON_TYPE_FALSE,
+    JSON_TYPE_NULL
+} json_type;
+
+/* A value (or the raw text of a key, without the quotes) inside the input buffer */
+typedef struct {
+    const char *start; /* First byte */
+    const char *end; /* One past the last byte */
+} jspan_t;
+
+/* Iterator over the members of an object or the elements of an array */
+typedef struct {
+    const char *pos; /* Next byte to read */
+    const char *end; /* End of the container */
+    int count; /* Number of members or elements returned so far */
+    const jindex_t *index; /* Structural index of the document, or NULL */
+} jcursor_t;
+
+int jcursor_document(const char *data, size_t size, jspan_t *root); /* Function that locates the top level value of a document */
+json_type jcursor_type(const jspan_t *value); /* Function that returns the type of a value */
+const char *jcursor_skip_value(const char *pos, const char *end, const jindex_t *index); /* Function that returns the position right after the value starting at `pos` */
+
+int jcursor_enter(jcursor_t *cursor, const jspan_t *container, const jindex_t *index); /* Function that starts iterating an object or an array */
+int jcursor_next_member(jcursor_t *cursor, jspan_t *key, jspan_t *value); /* Function that reads the next key and value of an object */
+int jcursor_next_element(jcursor_t *cursor, jspan_t *value); /* Function that reads the next element of an array */
+
+int jcursor_decode_escape(const char **pos, const char *end, char out[4]); /* Function that decodes the escape after a backslash to UTF-8, returns its length or 0 */
+int jcursor_key_equals(const jspan_t *key, const char *name, size_t name_len); /* Function that compares a raw key (escapes included) with a name */
+int jcursor_find_key(const jspan_t *object, const jindex_t *index, const char *name, size_t name_len, jspan_t *value); /* Function that finds the first member named `name` */
+int jcursor_find_index(const jspan_t *array, const jindex_t *index, int position, jspan_t *value); /* Function that finds the element at `position` */
+
+#endif // JCURSOR_H
@@ -0,0 +1,52 @@
+#ifndef JINDEX_H
+#define JINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Stage-1 structural index of a JSON document (in the style of simdjson).
+
+    One vectorized pass (AVX2 or SSE2, chosen at run time, with a scalar fallback) classifies the
+    input 64 bytes at a time, masks out everything inside strings (escaped quotes included) and
+    records the offset of every structural character: { } [ ] : , and the opening quote of each
+    string. The same pass validates UTF-8, rejects control characters inside strings and checks
+    that brackets nest and match, recording for every opening bracket the slot of its partner so a
+    whole object or array is skipped with one binary search over the positions (O(log n)) instead
+    of a scan of its text.
+
+    The structural characters and the first byte of every scalar are also checked against the
+    grammar (keys, ':' and ',' in their places, a single top level value). The bytes of a scalar
+    themselves are not: "tru" passes here and is rejected when the value is parsed.
+*/
+
+#define JINDEX_MAX_DEPTH 1000 /* Same nesting limit as cJSON */
+
+/* Result of jindex_build */
+typedef enum {
+    JINDEX_OK,
+    JINDEX_ERROR_MEMORY, /* Allocation failed */
+    JINDEX_ERROR_TOO_LARGE, /* Offsets are stored in 32 bits */
+    JINDEX_ERROR_UTF8, /* Invalid UTF-8 sequence */
+    JINDEX_ERROR_STRING, /* Unterminated string or control character inside a string */
+    JINDEX_ERROR_STRUCTURE, /* Unbalanced or mismatched brackets, misplaced characters or values, text after the document */
+    JINDEX_ERROR_DEPTH /* Nesting deeper than JINDEX_MAX_DEPTH */
+} jindex_status;
+
+/* Structural index of one document */
+typedef struct {
+    const char *data; /* The indexed document (not copied) */
+    size_t size; /* Size of the document */
+    uint32_t *positions; /* Offsets of the structural characters, in document order */
+    uint32_t *matches; /* For an opening bracket, the slot of its closing bracket in `positions` */
+    size_t count; /* Number of structural characters */
+    size_t capacity; /* Memory allocated for `positions` and `matches` */
+} jindex_t;
+
+jindex_status jindex_build(jindex_t *index, const char *data, size_t size); /* Function that indexes and validates a document */
+void jindex_free(jindex_t *index); /* Function that frees the memory allocated to the index */
+const char *jindex_skip_container(const jindex_t *index, const char *pos); /* Function that returns the position after the bracket matching the one at `pos` */
+const char *jindex_status_string(jindex_status status); /* Function that describes a status */
+const char *jindex_implementation(void); /* Function that names the kernel selected for this CPU */
+
+#endif // JINDEX_H
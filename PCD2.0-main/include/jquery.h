@@ -0,0 +1,67 @@
+#ifndef JQUERY_H
+#define JQUERY_H
+
+#include <stddef.h>
+#include "jcursor.h"
+
+/*
+    Compiled JSON path queries.
+
+    A path is compiled once into a short list of instructions and then evaluated over the raw
+    document with jcursor, in a single walk that reports every match in document order.
+
+        store.book[0].title     member and array element, like before
+        store.book[*].author    every element of an array (`*` alone: every member or element)
+        store.book[1:3]         elements 1 and 2 (either bound can be left out)
+        ..author                every member named `author`, at any depth
+        store.book[?price=8.95] elements whose member `price` equals a number, string, true, false or null
+
+    Compiled queries are kept in a small shared cache keyed by the path text.
+*/
+
+#define JQUERY_CACHE_SIZE 128 /* Compiled queries kept by jquery_acquire */
+
+/* Instructions of a compiled query */
+typedef enum {
+    JQUERY_KEY, /* Member `name` of an object */
+    JQUERY_WILDCARD, /* Every member of an object or element of an array */
+    JQUERY_INDEX, /* Element `from` of an array */
+    JQUERY_SLICE, /* Elements `from` to `to` (excluded, -1 for the end) of an array */
+    JQUERY_DESCEND, /* Every member called `name` below the value, at any depth (`name` NULL for all) */
+    JQUERY_FILTER /* Elements or members that are objects whose member `name` equals the literal */
+} jquery_opcode;
+
+typedef struct {
+    jquery_opcode op;
+    char *name; /* Member name, NUL terminated */
+    size_t name_len;
+    long from; /* Index or start of the slice */
+    long to; /* End of the slice */
+    json_type literal_type; /* Type of the value a filter compares with */
+    char *literal; /* Text of a string literal */
+    size_t literal_len;
+    double number; /* Value of a number literal */
+} jquery_instr_t;
+
+/* A compiled query */
+typedef struct {
+    char *text; /* Source of the query */
+    jquery_instr_t *code; /* Instructions, applied left to right */
+    int length; /* Number of instructions */
+    int definite; /* The query can match at most one value (only members and indexes) */
+    int refs; /* References held through jquery_acquire, guarded by the cache lock */
+} jquery_t;
+
+/* Called for every match, returns 0 to stop the evaluation */
+typedef int (*jquery_match_fn)(const jspan_t *value, void *arg);
+
+jquery_t *jquery_compile(const char *text, const char **error); /* Function that compiles a path, sets `error` when it is invalid */
+void jquery_free(jquery_t *query); /* Function that frees a query returned by jquery_compile */
+jquery_t *jquery_acquire(const char *text, const char **error); /* Function that returns the cached compiled form of a path */
+void jquery_release(jquery_t *query); /* Function that drops a query returned by jquery_acquire */
+int jquery_canonical_path(const jquery_t *query, char *buffer, size_t size); /* Function that spells a definite query like the path index does */
+int jquery_literal_matches(const jquery_instr_t *instr, json_type type, const jspan_t *text); /* Function that compares a value (string contents or number text) with the literal of a filter */
+int jquery_filter_accepts(const jquery_instr_t *instr, const jspan_t *value, const jindex_t *index); /* Function that checks a value against a filter instruction */
+int jquery_run(const jquery_t *query, const jspan_t *root, const jindex_t *index, jquery_match_fn match, void *arg); /* Function that reports every match, returns how many were found */
+
+#endif // JQUERY_H
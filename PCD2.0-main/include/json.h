@@ -3,6 +3,8 @@
 
 #include <cjson/cJSON.h>
 #include "lxml.h"
+#include "tagindex.h"
+#include "jwrite.h"
 #include <ctype.h>
 #include <ctype.h>
 
@@ -78,25 +80,43 @@ cJSON* XMLNodeToJSON(XMLNode* node) {
             cJSON_AddStringToObject(jsonNode, "__text", text); /* Add the inner text to the object */
     }
     
+    /* Group the children by tag first (case insensitive, like cJSON_GetObjectItem), so a repeated tag
+       goes straight into an array instead of being looked up, copied and replaced for every sibling */
+    tagindex_t groups;
+    if (!tagindex_init(&groups, node->children.size, 1)) {
+        fprintf(stderr, "Error! Could not allocate memory for the child groups in the json parser!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < node->children.size; ++i) {
+        XMLNode* child = node->children.data[i];
+        tagindex_entry_t* group = tagindex_get(&groups, child->tag, strlen(child->tag), NULL);
+        if (!group) {
+            fprintf(stderr, "Error! Could not allocate memory for the child groups in the json parser!\n");
+            exit(EXIT_FAILURE);
+        }
+        if (group->count++ == 1)
+            group->tag = child->tag; /* The array key is spelled like the second sibling, as it used to be */
+    }
+
     /* Iterrate through the children list of the current node */
     for (int i = 0; i < node->children.size; ++i) {
         XMLNode* child = node->children.data[i]; 
+        tagindex_entry_t* group = tagindex_get(&groups, child->tag, strlen(child->tag), NULL);
         cJSON* childJSON = XMLNodeToJSON(child);
-        cJSON* existing = cJSON_GetObjectItem(jsonNode, child->tag);
-
-        if (existing) {
-            if (!cJSON_IsArray(existing)) {
-                cJSON* array = cJSON_CreateArray();
-                cJSON_AddItemToArray(array, cJSON_Duplicate(existing, 1));
-                cJSON_ReplaceItemInObject(jsonNode, child->tag, array);
-                existing = array;
-            }
-            cJSON_AddItemToArray(existing, childJSON);
-        } else {
+
+        if (group->count == 1) {
             cJSON_AddItemToObject(jsonNode, child->tag, childJSON);
+            continue;
         }
+        if (!group->value) { /* First sibling of a repeated tag, the array takes its place in the object */
+            group->value = cJSON_CreateArray();
+            cJSON_AddItemToObject(jsonNode, group->tag, (cJSON*)group->value);
+        }
+        cJSON_AddItemToArray((cJSON*)group->value, childJSON);
     }
 
+    tagindex_free(&groups);
     return jsonNode;
 }
 
@@ -107,13 +127,20 @@ cJSON* XMLDocumentToJSON(XMLDocument* document) {
 
     /* Check for duplicates root tag names, return null if they exist */
     if (document->root->children.size > 0) {
+        tagindex_t root_tags;
+        if (!tagindex_init(&root_tags, document->root->children.size, 0)) {
+            fprintf(stderr, "Error! Could not allocate memory for the root tags in the json parser!\n");
+            exit(EXIT_FAILURE);
+        }
         for (int i = 0; i < document->root->children.size; i++) {
-            for (int j = i + 1; j < document->root->children.size; j++) {
-                if (!strcmp(document->root->children.data[i]->tag, document->root->children.data[j]->tag))
-                    return jsonDoc;
+            const char* tag = document->root->children.data[i]->tag;
+            int created = 0;
+            if (!tagindex_get(&root_tags, tag, strlen(tag), &created) || !created) {
+                tagindex_free(&root_tags);
+                return jsonDoc;
             }
         }
-
+        tagindex_free(&root_tags);
 
         for (int i = 0; i < document->root->children.size; i++) {
             XMLNode* root_child = document->root->children.data[i];
@@ -125,13 +152,8 @@ cJSON* XMLDocumentToJSON(XMLDocument* document) {
 }
 
 void SaveJSONToFile(const char* filename, cJSON* json) {
-    char* jsonString = cJSON_Print(json);
-    FILE* file = fopen(filename, "w");
-    if (file) {
-        fputs(jsonString, file);
-        fclose(file);
-    }
-    cJSON_free(jsonString);
+    // Streamed to the file in fixed-size chunks, the printed document is never held in memory
+    jwrite_file(filename, json, JWRITE_PRETTY);
 }
 
 void convertJSONtoXML(cJSON *json, XMLNode *xmlNode) {
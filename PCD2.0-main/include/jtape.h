@@ -0,0 +1,87 @@
+#ifndef JTAPE_H
+#define JTAPE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "doccache.h"
+#include "jquery.h"
+#include "jwrite.h"
+
+/*
+    Binary form of a JSON file, stored next to it as `<file>.json.tape` and used by reading
+    commands instead of the text; the .json file stays the format that is uploaded and exchanged.
+
+    The document is flattened into a tape of 64-bit words in document order, one per value
+    (two for numbers): the top byte is the type and the rest is the payload.
+        '{' '['   index of the matching '}' or ']' word, so a container is skipped in O(1)
+        '}' ']'   index of the opening word
+        '"'       offset of the string in the pool (keys are strings right before their value)
+        'd'       the next word holds the bits of the double
+        't' 'f' 'n'
+    Pool entries are a 32-bit length, the raw bytes as written in the JSON text and a NUL.
+    The file is mapped read-only and navigated in place. Loading it walks the words once to check
+    that every index and offset stays inside the file (O(n), no text is parsed); the checked
+    mapping is then kept by the document cache, so later searches of the same version do not pay
+    for it again.
+    Like the path index, the header records the size and mtime of the JSON file it describes.
+*/
+
+#define JTAPE_MAGIC "JSONTAPE" /* First 8 bytes of every tape */
+#define JTAPE_VERSION 1
+#define JTAPE_SUFFIX ".tape"
+
+#define JTAPE_PAYLOAD_MASK ((UINT64_C(1) << 56) - 1)
+#define JTAPE_STRING_PLAIN (UINT64_C(1) << 55) /* String payload flag: no escape or control byte, printed as is */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t json_size; /* Size of the JSON file when the tape was written */
+    int64_t json_mtime_sec; /* Modification time of the JSON file */
+    int64_t json_mtime_nsec;
+    uint64_t count; /* Number of tape words */
+    uint64_t strings_size; /* Size of the string pool */
+} jtape_header_t;
+
+/* A tape file mapped in memory, the document type kept by doccache_jtape */
+typedef struct {
+    void *map;
+    size_t size;
+    const jtape_header_t *header;
+    const uint64_t *words; /* The tape, the top level value starts at word 0 */
+    const char *strings; /* The string pool */
+} jtape_t;
+
+/* Iterator over the members of an object or the elements of an array */
+typedef struct {
+    const jtape_t *tape;
+    size_t pos; /* Next word to read */
+    size_t end; /* Closing word of the container */
+    int count; /* Number of members or elements returned so far */
+} jtape_cursor_t;
+
+/* Called for every match of a query, returns 0 to stop the evaluation */
+typedef int (*jtape_match_fn)(const jtape_t *tape, size_t value, void *arg);
+
+extern const doccache_type_t doccache_jtape; /* Loader that maps and checks a tape file */
+
+int jtape_write(const char *json_path, const json_document_t *document); /* Function that writes the tape of a parsed JSON file */
+int jtape_build(const char *json_path); /* Function that parses a JSON file and writes its tape */
+jtape_t *jtape_acquire(const char *json_path, const struct stat *json_st, doccache_handle_t **handle); /* Function that returns the tape of this version of a JSON file, or NULL */
+
+json_type jtape_type(const jtape_t *tape, size_t value); /* Function that returns the type of a value */
+size_t jtape_skip(const jtape_t *tape, size_t value); /* Function that returns the word right after a value */
+jspan_t jtape_text(const jtape_t *tape, size_t value); /* Function that returns the raw text of a string, escapes included */
+double jtape_number(const jtape_t *tape, size_t value); /* Function that returns the value of a number */
+
+int jtape_enter(jtape_cursor_t *cursor, const jtape_t *tape, size_t container); /* Function that starts iterating an object or an array */
+int jtape_next_member(jtape_cursor_t *cursor, size_t *key, size_t *value); /* Function that reads the next key and value of an object */
+int jtape_next_element(jtape_cursor_t *cursor, size_t *value); /* Function that reads the next element of an array */
+int jtape_find_key(const jtape_t *tape, size_t object, const char *name, size_t name_len, size_t *value); /* Function that finds the first member named `name` */
+int jtape_find_index(const jtape_t *tape, size_t array, int position, size_t *value); /* Function that finds the element at `position` */
+
+int jtape_run(const jtape_t *tape, const jquery_t *query, jtape_match_fn match, void *arg); /* Function that reports every match of a query, returns how many were found */
+void jtape_print(const jtape_t *tape, size_t value, jwrite_mode mode, outbuf_t *out); /* Function that prints a value exactly like cJSON_Print or cJSON_PrintUnformatted */
+
+#endif // JTAPE_H
@@ -0,0 +1,43 @@
+#ifndef JWRITE_H
+#define JWRITE_H
+
+#include <stddef.h>
+#include "outbuf.h"
+#include "jcursor.h"
+
+struct cJSON; /* Only pointers are used here, the header of cJSON is not needed */
+
+/*
+    Streaming JSON serializer.
+
+    Values are written straight into an output buffer, which sends its fixed-size chunks to the
+    socket or file whenever it fills up: the first bytes leave as soon as the first chunk is
+    full and memory does not grow with the size of the value. Pretty output is byte for byte
+    what cJSON_Print produces, compact output what cJSON_PrintUnformatted produces.
+
+    A value can come from a cJSON tree or from raw JSON text located with jcursor, in which case
+    it is never parsed into a tree; jtape_print uses the same layout and escaping functions.
+*/
+
+/* Layout of the output */
+typedef enum {
+    JWRITE_COMPACT, /* No whitespace, like cJSON_PrintUnformatted */
+    JWRITE_PRETTY /* Tabs and newlines, like cJSON_Print */
+} jwrite_mode;
+
+void jwrite_string(outbuf_t *out, const char *text, size_t len); /* Function that writes decoded bytes as a quoted string, escaped like cJSON */
+void jwrite_raw_string(outbuf_t *out, const char *text, size_t len, int plain); /* Function that writes the raw contents of a JSON string (escapes included) the way cJSON prints it once parsed, `plain` when it has no escapes */
+void jwrite_number(outbuf_t *out, double d); /* Function that writes a number like cJSON */
+double jwrite_parse_number(const char *text, size_t len); /* Function that reads a number the way cJSON does */
+
+void jwrite_open(outbuf_t *out, jwrite_mode mode, char bracket); /* Function that starts an object ('{') or an array ('[') */
+void jwrite_key_start(outbuf_t *out, jwrite_mode mode, int depth); /* Function that goes before the key of a member of an object at `depth` */
+void jwrite_key_end(outbuf_t *out, jwrite_mode mode); /* Function that separates a key from its value */
+void jwrite_item_end(outbuf_t *out, jwrite_mode mode, char bracket, int more); /* Function that goes after a member or an element, `more` if another one follows */
+void jwrite_close(outbuf_t *out, jwrite_mode mode, char bracket, int depth); /* Function that ends an object or an array at `depth` */
+
+int jwrite_span(outbuf_t *out, jwrite_mode mode, const jspan_t *value, const jindex_t *index); /* Function that writes a value of raw JSON text, returns 0 if it is not valid */
+int jwrite_cjson(outbuf_t *out, jwrite_mode mode, const struct cJSON *item); /* Function that writes a cJSON tree, returns 0 on an invalid item */
+int jwrite_file(const char *filename, const struct cJSON *item, jwrite_mode mode); /* Function that writes a cJSON tree to a file */
+
+#endif // JWRITE_H
@@ -0,0 +1,29 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/*
+    Asynchronous logging.
+
+    A line is formatted on the calling thread and copied into a ring buffer owned by that thread;
+    nothing else is done on the request path: no lock, no open, no write. A background writer
+    drains every ring, groups the lines by destination and appends them with one writev per file.
+    It keeps up to LOGGER_MAX_FDS log files open (reopening one that was deleted meanwhile) and
+    formats the timestamp once per second, from a coarse clock read by the producers.
+
+    Lines of one thread reach a file in the order they were logged. When a ring is full the line
+    is dropped and counted rather than waiting for the writer; the count is reported in the
+    server log.
+*/
+
+#define LOGGER_RING_SIZE (256 * 1024) /* Bytes of lines one thread can have waiting */
+#define LOGGER_MAX_LINE 4096 /* Longer lines are cut */
+#define LOGGER_MAX_FDS 64 /* Log files kept open by the writer */
+#define LOGGER_FLUSH_MS 20 /* Longest a line waits before the writer picks it up */
+#define LOGGER_SERVER_LOG "server.log"
+
+void logger_line(const char *path, int stamped, const char *format, ...) __attribute__((format(printf, 3, 4))); /* Function that appends a line to a log file, prefixed with the time if `stamped` */
+void logger_sidecar(const char *filename, const char *format, ...) __attribute__((format(printf, 2, 3))); /* Function that appends a line to the .log file of a document (its name without the extension) */
+void logger_flush(void); /* Function that waits until every line logged so far is written */
+long logger_dropped(void); /* Function that returns how many lines were dropped because a ring was full */
+
+#endif // LOGGER_H
@@ -0,0 +1,41 @@
+#ifndef METAINDEX_H
+#define METAINDEX_H
+
+#include <stddef.h>
+#include "server.h"
+
+/*
+    Corpus-wide index of document metadata.
+
+    The author, title and description of every indexed xml and json file are split into
+    lowercase words; each word of each field maps to the sorted list of the IDs of the files that
+    contain it. Sizes are kept in a list of (file_size, ID) pairs sorted by size, so a range is
+    found with two binary searches. Queries:
+
+        doe                      the word in any of the three fields
+        author:doe title:xml*    a word of one field, `*` makes it a prefix
+        size:1000..5000          file_size in a range, either bound can be left out
+        a b, a AND b             both
+        a OR b                   either, AND binds tighter than OR
+
+    The index lives in memory. It is filled and kept current by the catalog, which reads the
+    metadata once for both; files are known by their absolute path.
+*/
+
+#define METAINDEX_MAX_RESULTS 1000 /* Paths returned by one query, the total is always counted */
+#define METAINDEX_MAX_WORD 64 /* Longer words are cut */
+
+/* Answer to a query */
+typedef struct {
+    size_t total; /* Number of files matching the query */
+    size_t count; /* Number of paths below, at most METAINDEX_MAX_RESULTS */
+    char **paths; /* Absolute paths of the first files matched, in indexing order */
+} metaindex_result_t;
+
+int metaindex_update(const char *path); /* Function that indexes the metadata of an xml or json file again */
+void metaindex_remove(const char *path); /* Function that drops a file from the index */
+int metaindex_put(const char *path, const FileMetadata *metadata); /* Function that indexes metadata already read from a file */
+int metaindex_find(const char *query, metaindex_result_t *result, const char **error); /* Function that runs a query, sets `error` when it is invalid */
+void metaindex_result_free(metaindex_result_t *result); /* Function that frees the paths of a result */
+
+#endif // METAINDEX_H
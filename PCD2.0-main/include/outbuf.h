@@ -0,0 +1,44 @@
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stddef.h>
+
+#define OUTBUF_SIZE 65536
+
+/*
+    Fixed-size output buffer that is flushed to a file descriptor or a socket when it fills up.
+    A buffer bound to memory instead (fd -1) collects what it flushes in `memory`, up to a limit;
+    going over the limit is a write error like any other. The caller frees `memory`.
+    A discarding buffer only counts what goes through it, to learn the size of an output in advance.
+*/
+typedef struct {
+    int fd; /* Destination file descriptor, -1 for memory */
+    int is_socket; /* Use send() instead of write() */
+    int error; /* Set once a write fails, later writes are dropped */
+    size_t length; /* Number of bytes waiting in the buffer */
+    size_t total; /* Number of bytes handed to the buffer so far */
+    char *memory; /* Bytes flushed to a memory destination */
+    size_t memory_length;
+    size_t memory_capacity;
+    size_t memory_limit; /* Most bytes a memory destination accepts */
+    int discard; /* Drop the bytes, only `total` is kept */
+    char data[OUTBUF_SIZE];
+} outbuf_t;
+
+void outbuf_init(outbuf_t *out, int fd, int is_socket); /* Function that binds the buffer to a destination */
+void outbuf_init_memory(outbuf_t *out, size_t limit); /* Function that binds the buffer to a growing memory block */
+void outbuf_init_discard(outbuf_t *out); /* Function that makes the buffer count bytes without keeping them */
+int outbuf_write(outbuf_t *out, const void *data, size_t size); /* Function that appends bytes to the buffer */
+int outbuf_puts(outbuf_t *out, const char *str); /* Function that appends a string to the buffer */
+int outbuf_flush(outbuf_t *out); /* Function that writes everything buffered to the destination */
+
+/* Append a single character, flushing first if the buffer is full */
+static inline int outbuf_putc(outbuf_t *out, char c) {
+    if (out->length == OUTBUF_SIZE && !outbuf_flush(out))
+        return 0;
+    out->data[out->length++] = c;
+    out->total++;
+    return 1;
+}
+
+#endif // OUTBUF_H
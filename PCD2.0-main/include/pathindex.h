@@ -0,0 +1,60 @@
+#ifndef PATHINDEX_H
+#define PATHINDEX_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "doccache.h"
+
+/*
+    Sidecar index of a JSON file, stored next to it as `<file>.json.idx`.
+
+    It maps the canonical path of every value (`store.book[0].title`, "" for the top level value)
+    to the byte range of that value in the JSON file, so an exact path is answered with one
+    binary search and one pread. The header records the size and mtime of the JSON file it was
+    built from; an index that does not match the file any more is stale and is rebuilt.
+    It is written with the tape (jtape.h) when a file is uploaded or converted, from the same
+    parse. Searches read the tape first; an exact path is answered from the index when the tape
+    is missing or does not match the file, and a search that had to parse the file rewrites the
+    sidecars that were stale.
+
+    Layout: header, entries sorted by path, then the pool of path strings.
+    Members whose name contains '.', '[' or an escape are left out with everything below them,
+    as are later duplicates of a name (lookups take the first one, like cJSON).
+*/
+
+#define PATHINDEX_MAGIC "JPATHIDX" /* First 8 bytes of every index */
+#define PATHINDEX_VERSION 1
+#define PATHINDEX_SUFFIX ".idx"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t json_size; /* Size of the JSON file when the index was built */
+    int64_t json_mtime_sec; /* Modification time of the JSON file */
+    int64_t json_mtime_nsec;
+    uint64_t count; /* Number of entries */
+    uint64_t strings_size; /* Size of the path pool */
+} pathindex_header_t;
+
+typedef struct {
+    uint32_t value_offset; /* First byte of the value in the JSON file (documents are below 4 GB, see jindex.h) */
+    uint32_t value_length;
+    uint32_t path_offset; /* Path of the value in the pool, not terminated */
+    uint32_t path_length;
+} pathindex_entry_t;
+
+/* Result of a lookup */
+typedef enum {
+    PATHINDEX_FOUND,
+    PATHINDEX_NOT_INDEXED, /* The index is valid but has no entry for the path */
+    PATHINDEX_STALE /* There is no usable index for this version of the file */
+} pathindex_result;
+
+extern const doccache_type_t doccache_pathindex; /* Loader that maps an index file */
+
+int pathindex_write(const char *json_path, const json_document_t *document); /* Function that writes the index of a parsed JSON file */
+int pathindex_build(const char *json_path); /* Function that parses a JSON file and writes its index */
+pathindex_result pathindex_find(const char *json_path, const struct stat *json_st, const char *path, uint64_t *offset, uint64_t *length); /* Function that looks up the byte range of a path */
+
+#endif // PATHINDEX_H
@@ -0,0 +1,33 @@
+#ifndef PTABLE_H
+#define PTABLE_H
+
+#include <stddef.h>
+
+/*
+    Piece table holding a file being edited.
+
+    The original file is mapped read-only and never copied; inserted text is appended to an add
+    buffer that only grows. The document is the sequence of pieces (spans of either buffer) kept
+    in a treap ordered by position, each node carrying the bytes and newlines of its subtree, so
+    finding a byte offset or the start of a line is a descent of O(log n) nodes.
+
+    Each buffer keeps the sorted offsets of its newlines, built once for the mapped file and
+    extended as text is added. Splitting a piece counts the newlines of each half by binary
+    search in that index instead of scanning the text, so an edit anywhere in the file costs
+    O(log n) however large the file is. Saving writes the pieces with writev, nothing is
+    assembled in memory.
+*/
+
+typedef struct ptable ptable_t;
+
+ptable_t *ptable_open(int fd); /* Function that maps an open file for editing, the descriptor stays the caller's; NULL on failure */
+void ptable_close(ptable_t *table); /* Function that frees the table and unmaps the file */
+size_t ptable_length(const ptable_t *table); /* Function that returns the length of the document */
+size_t ptable_line_count(const ptable_t *table); /* Function that returns the number of lines, a last line without a newline included */
+int ptable_line_span(const ptable_t *table, size_t line, size_t *start, size_t *end); /* Function that finds where a line starts and ends (after its newline), lines count from 1; returns 0 if there is no such line */
+int ptable_char_at(const ptable_t *table, size_t offset); /* Function that returns the byte at an offset, -1 past the end */
+int ptable_insert(ptable_t *table, size_t offset, const char *text, size_t length); /* Function that inserts text at an offset */
+void ptable_erase(ptable_t *table, size_t offset, size_t length); /* Function that removes a range of bytes */
+int ptable_write(const ptable_t *table, int fd); /* Function that writes the document to a file descriptor */
+
+#endif // PTABLE_H
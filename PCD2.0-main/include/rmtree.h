@@ -0,0 +1,40 @@
+#ifndef RMTREE_H
+#define RMTREE_H
+
+/*
+    Parallel delete of a directory tree.
+
+    Every entry is reached relative to the descriptor of its directory (openat, fstatat,
+    unlinkat): no path is built or resolved again, and a directory swapped for a symbolic link
+    meanwhile is not followed. Each directory is read by one task that unlinks its files and hands
+    its subdirectories to a pool of workers shared by all deletes, so sibling subtrees go in
+    parallel. When the queue is full they wait in a list of the delete, and a task reads them one
+    after the other once it is done with its directory: nothing is deleted recursively. A
+    directory counts the subdirectories it still waits for, and the task that finishes the last
+    one removes it from its own parent, up to the top.
+
+    The descriptors of the directories waiting for their children and of the directory streams
+    count against RMTREE_MAX_FDS per delete; the least recently used ones nobody reads are closed
+    to stay under it, and one evicted is opened again from its parent when a child needs it. A
+    task holds at most two descriptors at a time, so the ones in use stay far below the cap.
+    The delete reports what it removed and the first few errors instead of a line per entry.
+*/
+
+#define RMTREE_MAX_THREADS 8 /* Workers of the delete pool, at most one per CPU */
+#define RMTREE_QUEUE_SIZE 256 /* Directories waiting for a worker, over all deletes */
+#define RMTREE_MAX_FDS 64 /* Directory descriptors kept open by one delete, above two per worker */
+#define RMTREE_MAX_ERRORS 8 /* Errors described in a result */
+#define RMTREE_ERROR_LENGTH 512 /* Length of the description of an error */
+
+/* Summary of a delete */
+typedef struct {
+    long files; /* Files, links and other entries removed */
+    long directories; /* Directories removed, the top one included */
+    long errors; /* Entries that could not be removed */
+    int reported; /* Errors described in `messages` */
+    char messages[RMTREE_MAX_ERRORS][RMTREE_ERROR_LENGTH]; /* The first errors, as "path: reason" */
+} rmtree_result_t;
+
+int rmtree_delete(const char *path, rmtree_result_t *result); /* Function that deletes a directory and everything under it; returns 1 if nothing is left */
+
+#endif // RMTREE_H
@@ -0,0 +1,40 @@
+#ifndef SAVEFILE_H
+#define SAVEFILE_H
+
+#include <stddef.h>
+#include <limits.h>
+
+/*
+    Crash-safe replacement of a file.
+
+    A document is written to a new file in the directory of its target, an anonymous O_TMPFILE
+    where the filesystem has them (a hidden `.name.XXXXXX` file otherwise), and only put in
+    place once complete: it is linked under a temporary name and renamed over the target. A
+    reader sees the old document or the new one, never a part of it, and a crash leaves the old
+    document intact.
+
+    A durable commit makes the data stable before the rename and the directory after it. A file
+    whose data could not be synced is never published; one whose directory could not be synced
+    is in place already, so it is reported as saved but not durable rather than as failed.
+    Commits are handed to a group-commit thread: while it syncs one batch, the commits that
+    arrive form the next one, and a batch of several files costs one syncfs per filesystem and
+    one fsync per directory instead of two syncs per file. src/savefile_bench.c measures both ways.
+*/
+
+#define SAVEFILE_MAX_BATCH 256 /* Commits synced together at most */
+#define SAVEFILE_NOT_DURABLE 2 /* Result of a durable commit that was published but whose directory could not be synced */
+
+typedef struct {
+    int fd; /* Where the new content is written */
+    char path[PATH_MAX]; /* The target */
+    char temp_path[PATH_MAX]; /* Name of the new file before the rename, empty while it is anonymous */
+} savefile_t;
+
+int savefile_open(savefile_t *file, const char *path); /* Function that creates the new file of a target, with the mode of the file it replaces; returns 0 on failure */
+int savefile_write(savefile_t *file, const void *data, size_t size); /* Function that writes all of a buffer to the new file */
+int savefile_commit(savefile_t *file, int durable); /* Function that puts the new file in place, after syncing it if `durable`; closes it and returns 0 on failure, SAVEFILE_NOT_DURABLE if it is in place but the rename may not survive a crash */
+void savefile_abort(savefile_t *file); /* Function that drops the new file */
+void savefile_set_grouping(int enabled); /* Function that makes durable commits sync on the caller's thread (0) or through the group-commit thread (1, the default) */
+void savefile_stats(long *commits, long *syncs); /* Function that reads how many durable commits were made and how many sync calls they cost */
+
+#endif // SAVEFILE_H
@@ -34,6 +34,24 @@ typedef struct {
     char details[1024];
 } ChangeLog;
 
+/* Metadata fields of a document, filled by read_metadata_xml and read_metadata_json */
+#define METADATA_AUTHOR 1
+#define METADATA_TITLE 2
+#define METADATA_DESCRIPTION 4
+#define METADATA_FILE_SIZE 8
+#define METADATA_ALL (METADATA_AUTHOR | METADATA_TITLE | METADATA_DESCRIPTION | METADATA_FILE_SIZE) /* Reading stops once every field was seen */
+
+typedef struct {
+    char author[256];
+    char title[256];
+    char description[1024]; /* Longer values are cut */
+    long long file_size;
+    int found; /* METADATA_* bits of the fields the document has */
+} FileMetadata;
+
+int read_metadata_xml(const char *filename, FileMetadata *metadata); /* Function that reads the metadata of an xml file, errno is EINVAL if it cannot be parsed up to the last field */
+int read_metadata_json(const char *filename, FileMetadata *metadata); /* Function that reads the metadata of a json file, errno is EINVAL if its top level object cannot be read */
+
 void log_change(const char *filename, const char *change_type, const char *details);
 
 #endif // SERVER_H
@@ -0,0 +1,30 @@
+#ifndef TAGINDEX_H
+#define TAGINDEX_H
+
+#include <stddef.h>
+
+/* One group of sibling nodes that share a tag name */
+typedef struct {
+    const char *tag; /* Tag of the first node in the group (not copied) */
+    size_t tag_len; /* Length of the tag */
+    int count; /* Number of siblings with this tag */
+    int first; /* Caller defined index of the first sibling */
+    int last; /* Caller defined index of the last sibling */
+    void *value; /* Caller defined data attached to the group */
+} tagindex_entry_t;
+
+/* Hash table that groups siblings by tag, groups are kept in first-seen order */
+typedef struct {
+    tagindex_entry_t *entries; /* Groups in the order they were first seen */
+    int size; /* Number of groups */
+    int capacity; /* Memory allocated for `entries` */
+    int *slots; /* Open addressing table of indexes into `entries`, -1 when empty */
+    int slot_count; /* Size of the slots table, always a power of two */
+    int nocase; /* Compare tags case insensitively, like cJSON_GetObjectItem */
+} tagindex_t;
+
+int tagindex_init(tagindex_t *index, int expected, int nocase); /* Function that allocates a table for about `expected` groups */
+tagindex_entry_t *tagindex_get(tagindex_t *index, const char *tag, size_t tag_len, int *created); /* Function that finds a group or creates an empty one */
+void tagindex_free(tagindex_t *index); /* Function that frees the memory allocated to the table */
+
+#endif // TAGINDEX_H
@@ -0,0 +1,32 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#include <stddef.h>
+#include "outbuf.h"
+
+/*
+    XML to JSON transcoder that builds no XMLDocument and no cJSON tree.
+
+    Produces exactly what cJSON_Print(XMLDocumentToJSON(...)) produces for the same document
+    (`_attr` keys, `__text`, repeated siblings grouped into arrays, whitespace stripped from mixed content)
+    and writes the JSON text straight into an output buffer, without the printed string in memory.
+
+    One pass of the pull tokenizer (xmlstream.h) records each element as a small entry (name,
+    attributes and text as ranges of the input, its siblings grouped by tag) and the output is
+    written from those entries; both walks keep their own stack, so the time is linear in the
+    document and deep nesting never costs C stack. A malformed document is rejected before
+    anything is written.
+
+    It is not a streaming converter: the input is mapped whole and the entries take memory in
+    proportion to the elements, 88 bytes for each element and 24 for each run of text. The
+    output format leaves no room for less. Siblings with the same tag become one array at the
+    place of the first of them, so what follows a key depends on whether its tag comes again
+    anywhere later among the siblings, and a duplicated top level tag leaves only the
+    declaration; nothing can be written before the end of the document is read.
+*/
+
+int transcode_xml_buffer(const char *data, size_t size, outbuf_t *out); /* Function that transcodes an XML document held in memory */
+int transcode_xml_to_file(const char *data, size_t size, const char *json_path); /* Function that transcodes an XML document held in memory into a JSON file */
+int transcode_xml_to_json(const char *xml_path, const char *json_path); /* Function that transcodes an XML file into a JSON file */
+
+#endif // TRANSCODE_H
@@ -0,0 +1,40 @@
+#ifndef XMLSTREAM_H
+#define XMLSTREAM_H
+
+#include <stddef.h>
+
+/* Events produced by the pull tokenizer */
+typedef enum {
+    XML_EVENT_EOF, /* End of the input */
+    XML_EVENT_DECL, /* <?xml ... ?> declaration */
+    XML_EVENT_START, /* Opening tag <tag ...> */
+    XML_EVENT_EMPTY, /* Inline tag <tag ... /> */
+    XML_EVENT_END, /* Closing tag </tag> */
+    XML_EVENT_TEXT, /* Text between tags (or CDATA content) */
+    XML_EVENT_ERROR /* Malformed input */
+} xml_event_type;
+
+/* A single event, every pointer refers to the input buffer, nothing is copied */
+typedef struct {
+    xml_event_type type;
+    const char *name; /* Tag name for START, EMPTY and END */
+    size_t name_len;
+    const char *attrs; /* Raw attribute area for DECL, START and EMPTY */
+    size_t attrs_len;
+    const char *text; /* Character data for TEXT */
+    size_t text_len;
+    const char *start; /* First byte of the event in the input */
+} xml_event_t;
+
+/* Tokenizer state */
+typedef struct {
+    const char *pos; /* Next byte to read */
+    const char *end; /* End of the input */
+} xml_stream_t;
+
+void xml_stream_init(xml_stream_t *stream, const char *data, size_t size); /* Function that starts tokenizing a buffer */
+xml_event_type xml_stream_next(xml_stream_t *stream, xml_event_t *event); /* Function that reads the next event, comments are skipped */
+int xml_stream_skip(xml_stream_t *stream); /* Function that skips the rest of the element whose START event was just read */
+int xml_attr_next(const char **pos, const char *end, const char **key, size_t *key_len, const char **value, size_t *value_len); /* Function that reads the next key="value" pair of an attribute area */
+
+#endif // XMLSTREAM_H
@@ -0,0 +1,37 @@
+#ifndef XPATHCACHE_H
+#define XPATHCACHE_H
+
+#include <libxml/tree.h>
+#include <libxml/xpath.h>
+#include "doccache.h"
+#include "outbuf.h"
+
+/*
+    Shared state for XPath searches inside the server.
+
+    Parsed XML files are kept in the document cache (doccache_xml) like JSON files are, compiled
+    expressions are kept in a small cache keyed by their text, and every thread evaluates them
+    with its own XPath context, created on first use and reused for every later search.
+    A cached document is only read: its elements are numbered once at load time so that node
+    sets can be sorted without touching the tree. The parser is never cleaned up here,
+    xmlInitParser is called once at server start.
+*/
+
+#define XPATHCACHE_SIZE 128 /* Compiled expressions kept by xpathcache_acquire */
+#define XPATHCACHE_DOC_FACTOR 4 /* Rough size of a parsed tree, in bytes per byte of XML */
+
+/* A compiled expression */
+typedef struct {
+    char *text; /* Source of the expression */
+    xmlXPathCompExprPtr comp; /* Compiled form, shared by every thread */
+    int refs; /* References held through xpathcache_acquire, guarded by the cache lock */
+} xpath_expr_t;
+
+extern const doccache_type_t doccache_xml; /* Loader for xmlDoc */
+
+xpath_expr_t *xpathcache_acquire(const char *text); /* Function that returns the cached compiled form of an expression, NULL if it is invalid */
+void xpathcache_release(xpath_expr_t *expr); /* Function that drops an expression returned by xpathcache_acquire */
+xmlXPathObjectPtr xpathcache_eval(const xpath_expr_t *expr, xmlDocPtr doc); /* Function that evaluates an expression with the context of the calling thread */
+void xpathcache_write_content(xmlNodePtr node, outbuf_t *out); /* Function that writes the text content of a node like xmlNodeGetContent, without copying it */
+
+#endif // XPATHCACHE_H
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "binlog.h"
+#include "logger.h"
+
+#define RECORDS_PER_CHUNK (BINLOG_CHUNK_SIZE / sizeof(binlog_record_t))
+
+/* How an event is printed, and in which text log */
+typedef struct {
+    const char *log;
+    const char *format;
+} event_format_t;
+
+static const event_format_t event_formats[BINLOG_EVENT_COUNT] = {
+    [BINLOG_START] = { LOGGER_SERVER_LOG, "" },
+    [BINLOG_MESSAGE] = { LOGGER_SERVER_LOG, "%s" },
+    [BINLOG_CHANGE] = { "changes.log", "File: %f, Change: %s, Details: %s" },
+    [BINLOG_USER_BLOCKED] = { LOGGER_SERVER_LOG, "User %s has been blocked." },
+    [BINLOG_USER_UNBLOCKED] = { LOGGER_SERVER_LOG, "User %s has been unblocked." },
+    [BINLOG_SEARCH_DIRECTORY] = { LOGGER_SERVER_LOG, "Searched directory '%s' for '%s'" },
+    [BINLOG_CONVERT_DIRECTORY] = { LOGGER_SERVER_LOG, "Converted the XML files of directory '%s'" },
+};
+
+static int enabled;
+static int log_fd = -1;
+static off_t log_size;
+static char *chunks[BINLOG_MAX_CHUNKS]; /* Mapped lazily, never unmapped */
+static uint64_t next_record = 1; /* Record 0 is the header */
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* An interned string and its ID in the strings file */
+typedef struct {
+    char *text;
+    uint32_t id;
+} interned_t;
+
+/* Interned strings: slots hold positions in `strings` plus one, by hash */
+static pthread_rwlock_t strings_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int strings_fd = -1;
+static interned_t *strings;
+static uint32_t string_count, string_capacity; /* At most BINLOG_MAX_STRINGS */
+static uint32_t last_id; /* Strings in the strings file, interned or not */
+static uint32_t *slots;
+static uint32_t slot_count; /* Power of two, kept at least twice the number of strings */
+
+// FNV-1a hash of a string
+static uint32_t hash_string(const char *string) {
+    uint32_t hash = 2166136261u;
+    for (; *string; string++)
+        hash = (hash ^ (unsigned char)*string) * 16777619u;
+    return hash;
+}
+
+// Slot holding a string, or the empty slot where it would go; the caller holds strings_lock
+static uint32_t *find_slot(const char *string, uint32_t hash) {
+    uint32_t mask = slot_count - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        if (slots[i] == 0 || strcmp(strings[slots[i] - 1].text, string) == 0)
+            return &slots[i];
+    }
+}
+
+// Give the next ID to a string written to the strings file, and keep it while the table has room; the caller holds strings_lock for writing
+static uint32_t add_string(const char *string, uint32_t hash) {
+    uint32_t id = ++last_id;
+    if (string_count == BINLOG_MAX_STRINGS)
+        return id;
+    if (string_count == string_capacity) {
+        uint32_t capacity = string_capacity ? string_capacity * 2 : 256;
+        interned_t *grown = (interned_t *)realloc(strings, capacity * sizeof(interned_t));
+        if (!grown)
+            return 0;
+        strings = grown;
+        string_capacity = capacity;
+    }
+    if ((string_count + 1) * 2 > slot_count) {
+        uint32_t count = slot_count ? slot_count * 2 : 512;
+        uint32_t *grown = (uint32_t *)calloc(count, sizeof(uint32_t));
+        if (!grown)
+            return 0;
+        free(slots);
+        slots = grown;
+        slot_count = count;
+        for (uint32_t i = 0; i < string_count; i++)
+            *find_slot(strings[i].text, hash_string(strings[i].text)) = i + 1;
+    }
+    char *copy = strdup(string);
+    if (!copy)
+        return 0;
+    strings[string_count].text = copy;
+    strings[string_count].id = id;
+    string_count++;
+    *find_slot(copy, hash) = string_count;
+    return id;
+}
+
+// ID of an interned string, 0 if it is not in the table; the caller holds strings_lock
+static uint32_t find_id(const char *string, uint32_t hash) {
+    uint32_t at = slot_count ? *find_slot(string, hash) : 0;
+    return at ? strings[at - 1].id : 0;
+}
+
+// ID of a string, appended to the strings file the first time it is seen
+static uint32_t intern(const char *string) {
+    uint32_t hash = hash_string(string);
+    pthread_rwlock_rdlock(&strings_lock);
+    uint32_t id = find_id(string, hash);
+    pthread_rwlock_unlock(&strings_lock);
+    if (id)
+        return id;
+
+    pthread_rwlock_wrlock(&strings_lock);
+    id = find_id(string, hash);
+    if (!id) {
+        // On disk before any record can refer to it
+        uint32_t length = (uint32_t)strlen(string);
+        char *entry = (char *)malloc(sizeof(length) + length);
+        if (entry) {
+            memcpy(entry, &length, sizeof(length));
+            memcpy(entry + sizeof(length), string, length);
+            if (write(strings_fd, entry, sizeof(length) + length) == (ssize_t)(sizeof(length) + length))
+                id = add_string(string, hash);
+            else
+                perror("Could not write the binary log strings");
+            free(entry);
+        }
+    }
+    pthread_rwlock_unlock(&strings_lock);
+    return id;
+}
+
+// Read back the strings of an existing log, cutting an entry a crash left incomplete
+static int load_strings(const char *path) {
+    strings_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (strings_fd < 0) {
+        perror("Could not open the binary log strings");
+        return 0;
+    }
+    struct stat st;
+    if (fstat(strings_fd, &st) != 0 || st.st_size == 0)
+        return 1;
+
+    char *data = (char *)malloc(st.st_size + 1);
+    if (!data || pread(strings_fd, data, st.st_size, 0) != st.st_size) {
+        free(data);
+        return 0;
+    }
+    off_t pos = 0;
+    while (pos + (off_t)sizeof(uint32_t) <= st.st_size) {
+        uint32_t length;
+        memcpy(&length, data + pos, sizeof(length));
+        if (pos + (off_t)sizeof(length) + length > st.st_size)
+            break;
+        char saved = data[pos + sizeof(length) + length];
+        data[pos + sizeof(length) + length] = '\0';
+        if (!add_string(data + pos + sizeof(length), hash_string(data + pos + sizeof(length)))) {
+            free(data);
+            return 0;
+        }
+        data[pos + sizeof(length) + length] = saved;
+        pos += sizeof(length) + length;
+    }
+    if (pos < st.st_size && ftruncate(strings_fd, pos) != 0)
+        perror("Could not repair the binary log strings");
+    free(data);
+    return 1;
+}
+
+// Mapping of a chunk, growing the file when it is past the end
+static char *map_chunk(size_t chunk) {
+    pthread_mutex_lock(&grow_lock);
+    char *map = chunks[chunk];
+    if (!map) {
+        off_t end = (off_t)(chunk + 1) * BINLOG_CHUNK_SIZE;
+        if (log_size < end) {
+            if (ftruncate(log_fd, end) != 0) {
+                perror("Could not grow the binary log");
+                pthread_mutex_unlock(&grow_lock);
+                return NULL;
+            }
+            log_size = end;
+        }
+        map = (char *)mmap(NULL, BINLOG_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, log_fd, (off_t)chunk * BINLOG_CHUNK_SIZE);
+        if (map == MAP_FAILED) {
+            perror("Could not map the binary log");
+            map = NULL;
+        } else {
+            __atomic_store_n(&chunks[chunk], map, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&grow_lock);
+    return map;
+}
+
+static binlog_record_t *record_at(uint64_t index) {
+    uint64_t chunk = index / RECORDS_PER_CHUNK;
+    if (chunk >= BINLOG_MAX_CHUNKS)
+        return NULL;
+    char *map = __atomic_load_n(&chunks[chunk], __ATOMIC_ACQUIRE);
+    if (!map && !(map = map_chunk(chunk)))
+        return NULL;
+    return (binlog_record_t *)map + index % RECORDS_PER_CHUNK;
+}
+
+// Reserve the next record and fill it, the event goes in last
+static void append(int event, uint32_t file, const uint64_t *args, int count) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t index = __atomic_fetch_add(&next_record, 1, __ATOMIC_RELAXED);
+    binlog_record_t *record = record_at(index);
+    if (!record)
+        return;
+    if (index % RECORDS_PER_CHUNK == 0) /* Map the next chunk before anyone waits for it */
+        record_at(index + RECORDS_PER_CHUNK);
+
+    record->time = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->count = (uint16_t)count;
+    record->file = file;
+    memcpy(record->args, args, count * sizeof(uint64_t));
+    __atomic_store_n(&record->event, (uint16_t)event, __ATOMIC_RELEASE);
+}
+
+int binlog_open(const char *path) {
+    char strings_path[PATH_MAX];
+    if (snprintf(strings_path, sizeof(strings_path), "%s%s", path, BINLOG_STRINGS_SUFFIX) >= (int)sizeof(strings_path))
+        return 0;
+
+    log_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (log_fd < 0 || fstat(log_fd, &st) != 0) {
+        perror("Could not open the binary log");
+        return 0;
+    }
+    log_size = st.st_size;
+    if (log_size % BINLOG_CHUNK_SIZE != 0 || log_size / BINLOG_CHUNK_SIZE > BINLOG_MAX_CHUNKS) {
+        fprintf(stderr, "'%s' is not a binary log.\n", path);
+        return 0;
+    }
+
+    binlog_header_t *header = (binlog_header_t *)record_at(0);
+    if (!header)
+        return 0;
+    if (log_size == BINLOG_CHUNK_SIZE && header->magic[0] == '\0') { /* New log */
+        memcpy(header->magic, BINLOG_MAGIC, sizeof(header->magic));
+        header->version = BINLOG_VERSION;
+        header->record_size = sizeof(binlog_record_t);
+    } else if (memcmp(header->magic, BINLOG_MAGIC, sizeof(header->magic)) != 0 || header->version != BINLOG_VERSION) {
+        fprintf(stderr, "'%s' is not a binary log.\n", path);
+        return 0;
+    }
+
+    // Continue after the last record that was started
+    static const binlog_record_t zero;
+    for (uint64_t index = log_size / sizeof(binlog_record_t) - 1; index > 0; index--) {
+        binlog_record_t *record = record_at(index);
+        if (!record)
+            return 0;
+        if (memcmp(record, &zero, sizeof(zero)) != 0) {
+            next_record = index + 1;
+            break;
+        }
+    }
+
+    if (!load_strings(strings_path))
+        return 0;
+
+    struct timespec wall, monotonic;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    uint64_t clocks[2] = {
+        (uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec,
+        (uint64_t)monotonic.tv_sec * 1000000000ULL + monotonic.tv_nsec,
+    };
+    append(BINLOG_START, 0, clocks, 2);
+    enabled = 1;
+    return 1;
+}
+
+int binlog_enabled(void) {
+    return enabled;
+}
+
+void binlog_event(int event, const char *file, const char *first, const char *second) {
+    if (!enabled)
+        return;
+    uint64_t args[2];
+    int count = 0;
+    if (first)
+        args[count++] = intern(first);
+    if (second)
+        args[count++] = intern(second);
+    append(event, file ? intern(file) : 0, args, count);
+}
+
+const char *binlog_log_name(int event) {
+    return event > BINLOG_EMPTY && event < BINLOG_EVENT_COUNT ? event_formats[event].log : NULL;
+}
+
+size_t binlog_render(int event, const char *file, const char *const *args, int count, char *out, size_t size) {
+    size_t length = 0;
+    int used = 0;
+    if (size == 0)
+        return 0;
+    if (binlog_log_name(event)) {
+        for (const char *c = event_formats[event].format; *c && length + 1 < size; c++) {
+            const char *insert = NULL;
+            if (c[0] == '%' && c[1] == 'f')
+                insert = file ? file : "";
+            else if (c[0] == '%' && c[1] == 's')
+                insert = used < count && args[used] ? args[used] : "";
+            if (!insert) {
+                out[length++] = *c;
+                continue;
+            }
+            if (c[1] == 's')
+                used++;
+            c++;
+            size_t insert_length = strlen(insert);
+            if (insert_length > size - 1 - length)
+                insert_length = size - 1 - length;
+            memcpy(out + length, insert, insert_length);
+            length += insert_length;
+        }
+    }
+    out[length] = '\0';
+    return length;
+}
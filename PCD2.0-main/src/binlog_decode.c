@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "binlog.h"
+
+/* Strings of a log, ID i is list[i - 1] */
+typedef struct {
+    char *data;
+    char **list;
+    uint32_t count;
+} string_table_t;
+
+// Read the strings file of a log, NUL terminating every entry in place
+static int load_strings(const char *log_path, string_table_t *table) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", log_path, BINLOG_STRINGS_SUFFIX);
+    memset(table, 0, sizeof(*table));
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Could not open file: %s\n", path);
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    table->data = (char *)malloc(size + 1);
+    table->list = (char **)malloc((size / sizeof(uint32_t) + 1) * sizeof(char *));
+    if (!table->data || !table->list || fread(table->data, 1, size, file) != (size_t)size) {
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+
+    // Each entry is a length and the bytes; the length word of the next entry is where the NUL goes
+    long pos = 0;
+    while (pos + (long)sizeof(uint32_t) <= size) {
+        uint32_t length;
+        memcpy(&length, table->data + pos, sizeof(length));
+        if (pos + (long)sizeof(length) + length > size)
+            break;
+        memmove(table->data + pos, table->data + pos + sizeof(length), length);
+        table->data[pos + length] = '\0';
+        table->list[table->count++] = table->data + pos;
+        pos += sizeof(length) + length;
+    }
+    return 1;
+}
+
+static const char *string_for(const string_table_t *table, uint64_t id) {
+    return id > 0 && id <= table->count ? table->list[id - 1] : "";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) { /* The log must be sent from the command line */
+        printf("Usage: %s <%s> [%s|changes.log]\n", argv[0], BINLOG_PATH, "server.log");
+        return 1;
+    }
+    const char *only = argc > 2 ? argv[2] : NULL; /* Print the lines of one text log */
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(binlog_header_t)) {
+        printf("Could not open file: %s\n", argv[1]);
+        return 1;
+    }
+    const char *map = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const binlog_header_t *header = (const binlog_header_t *)map;
+    if (memcmp(header->magic, BINLOG_MAGIC, sizeof(header->magic)) != 0 || header->version != BINLOG_VERSION || header->record_size != sizeof(binlog_record_t)) {
+        printf("%s is not a binary log\n", argv[1]);
+        return 1;
+    }
+
+    string_table_t strings;
+    if (!load_strings(argv[1], &strings))
+        return 1;
+
+    const binlog_record_t *records = (const binlog_record_t *)map;
+    size_t count = st.st_size / sizeof(binlog_record_t);
+    uint64_t wall = 0, monotonic = 0; /* Clocks of the last start of the server */
+    time_t stamp_second = -1;
+    char stamp[64] = "";
+    char message[8192];
+
+    for (size_t i = 1; i < count; i++) {
+        const binlog_record_t *record = &records[i];
+        const char *log = binlog_log_name(record->event);
+        if (record->event == BINLOG_START && record->count >= 2) {
+            wall = record->args[0];
+            monotonic = record->args[1];
+            continue;
+        }
+        if (!log || (only && strcmp(only, log) != 0))
+            continue;
+
+        const char *args[BINLOG_ARGS];
+        int arg_count = record->count < BINLOG_ARGS ? record->count : BINLOG_ARGS;
+        for (int a = 0; a < arg_count; a++)
+            args[a] = string_for(&strings, record->args[a]);
+        binlog_render(record->event, string_for(&strings, record->file), args, arg_count, message, sizeof(message));
+
+        // The time as ctime prints it in the text logs, formatted once per second
+        time_t second = (time_t)((wall + (record->time - monotonic)) / 1000000000ULL);
+        if (second != stamp_second) {
+            struct tm tm;
+            localtime_r(&second, &tm);
+            strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", &tm);
+            stamp_second = second;
+        }
+        if (only)
+            printf("[%s] %s\n", stamp, message);
+        else
+            printf("%s: [%s] %s\n", log, stamp, message);
+    }
+
+    munmap((void *)map, st.st_size);
+    free(strings.data);
+    free(strings.list);
+    return 0;
+}
+/*
+gcc -o binlog_decode binlog_decode.c binlog.c -I../include -lpthread
+./binlog_decode ../server.blog server.log
+(prints the lines server.log would hold, or the lines of both logs prefixed by their name)
+*/
@@ -0,0 +1,1001 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "catalog.h"
+#include "metaindex.h"
+
+#define NONE 0
+#define ROOT 1
+#define SNAPSHOT_MAGIC "CATALOG1"
+#define SNAPSHOT_VERSION 1
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* A file or directory, IDs are positions in `entries` and are reused after removal */
+typedef struct {
+    char *path; /* Relative to the root, "" for the root itself */
+    size_t name; /* Offset of the last component in `path` */
+    uint32_t parent;
+    uint32_t next; /* Next entry of the same hash bucket */
+    int used;
+    unsigned generation; /* Last full scan that saw the entry */
+    catalog_format format;
+    long long size;
+    struct timespec mtime;
+    int read; /* The metadata was read for this size and modification time */
+    int found; /* METADATA_* bits */
+    char *author;
+    char *title;
+    char *description;
+    long long file_size;
+    uint32_t *children; /* Directories only */
+    uint32_t child_count;
+    uint32_t child_capacity;
+    int scanned; /* The directory was read, its children are complete */
+    int wd; /* inotify watch of a directory, -1 if none */
+} entry_t;
+
+/* Work shared by the threads of one scan */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    uint32_t *dirs; /* Directories to read, `head` is the next one */
+    size_t head;
+    size_t count;
+    size_t capacity;
+    int active; /* Threads reading a directory, which may add more */
+    uint32_t *documents; /* Documents to read once every directory is done */
+    size_t document_count;
+    size_t document_capacity;
+} scan_t;
+
+/* Documents read by the threads of one batch */
+typedef struct {
+    const uint32_t *ids;
+    size_t count;
+    size_t next; /* Next position to take, atomic */
+    int index; /* Also update the metadata index */
+} reading_t;
+
+static pthread_rwlock_t catalog_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int started;
+static char root_path[PATH_MAX];
+
+static entry_t *entries; /* ID 0 is never used, the root is ID 1 */
+static uint32_t entry_count = 1;
+static uint32_t entry_capacity;
+static uint32_t *free_ids;
+static uint32_t free_count;
+static uint32_t free_capacity;
+static uint32_t *buckets; /* Chains of entries by path */
+static size_t bucket_count;
+static size_t used_count;
+
+static int inotify_fd = -1;
+static uint32_t *watches; /* Directory by watch descriptor */
+static size_t watch_capacity;
+static unsigned generation;
+static int snapshot_dirty; /* Atomic, write_snapshot clears it under the read lock */
+static long long snapshot_due; /* Time after which the snapshot is written, in ms */
+
+static int reserve(void **buffer, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity)
+        return 1;
+    size_t grown = *capacity ? *capacity * 2 : 64;
+    while (grown < needed)
+        grown *= 2;
+    void *larger = realloc(*buffer, grown * item_size);
+    if (!larger)
+        return 0;
+    *buffer = larger;
+    *capacity = grown;
+    return 1;
+}
+
+// Same as reserve for 32 bit counters
+static int reserve32(void **buffer, uint32_t *capacity, size_t needed, size_t item_size) {
+    size_t wide = *capacity;
+    if (!reserve(buffer, &wide, needed, item_size) || wide > UINT32_MAX)
+        return 0;
+    *capacity = (uint32_t)wide;
+    return 1;
+}
+
+static uint64_t hash_text(const char *text) {
+    uint64_t hash = 1469598103934665603ULL; /* FNV-1a */
+    for (; *text; text++) {
+        hash ^= (unsigned char)*text;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int has_suffix(const char *text, const char *suffix) {
+    size_t len = strlen(text), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(text + len - suffix_len, suffix) == 0;
+}
+
+static long long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int cpu_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > CATALOG_MAX_THREADS ? CATALOG_MAX_THREADS : (int)cpus;
+}
+
+static catalog_format format_of(const char *name, const struct stat *st) {
+    if (S_ISDIR(st->st_mode))
+        return CATALOG_DIRECTORY;
+    if (S_ISREG(st->st_mode) && has_suffix(name, ".xml"))
+        return CATALOG_XML;
+    if (S_ISREG(st->st_mode) && has_suffix(name, ".json"))
+        return CATALOG_JSON;
+    return CATALOG_OTHER;
+}
+
+// Documents are read and directories descended into unless they are hidden
+static int is_followed(const entry_t *entry) {
+    return entry->format != CATALOG_OTHER && entry->path[entry->name] != '.';
+}
+
+// The snapshot is kept out of the catalog it describes
+static int is_snapshot(uint32_t dir, const char *name) {
+    return dir == ROOT && (strcmp(name, CATALOG_SNAPSHOT) == 0 || strcmp(name, CATALOG_SNAPSHOT ".tmp") == 0);
+}
+
+// Path on the disk of an entry, returns 0 if it does not fit in PATH_MAX
+static int full_path(const char *relative, char path[PATH_MAX]) {
+    return snprintf(path, PATH_MAX, "%s%s%s", root_path, relative[0] ? "/" : "", relative) < PATH_MAX;
+}
+
+// Turn a path given by a client into a path relative to the root, without touching the disk
+static int normalize(const char *path, char relative[PATH_MAX]) {
+    size_t root_len = strlen(root_path), length = 0;
+    if (path[0] == '/') {
+        if (strncmp(path, root_path, root_len) != 0 || (path[root_len] != '/' && path[root_len] != '\0'))
+            return 0; /* Outside the root */
+        path += root_len;
+    }
+
+    relative[0] = '\0';
+    while (*path) {
+        while (*path == '/')
+            path++;
+        const char *end = strchr(path, '/');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if (len == 0 || (len == 1 && path[0] == '.')) {
+            /* Nothing to add */
+        } else if (len == 2 && path[0] == '.' && path[1] == '.') {
+            if (length == 0)
+                return 0; /* Above the root */
+            char *slash = strrchr(relative, '/');
+            length = slash ? (size_t)(slash - relative) : 0;
+            relative[length] = '\0';
+        } else {
+            if (length + (length > 0) + len >= PATH_MAX)
+                return 0;
+            if (length > 0)
+                relative[length++] = '/';
+            memcpy(relative + length, path, len);
+            length += len;
+            relative[length] = '\0';
+        }
+        path += len;
+    }
+    return 1;
+}
+
+static uint32_t find_entry(const char *relative) {
+    if (!bucket_count)
+        return NONE;
+    uint32_t id = buckets[hash_text(relative) & (bucket_count - 1)];
+    while (id != NONE && strcmp(entries[id].path, relative) != 0)
+        id = entries[id].next;
+    return id;
+}
+
+static int grow_buckets(void) {
+    size_t count = bucket_count ? bucket_count * 2 : 1024;
+    uint32_t *grown = (uint32_t *)calloc(count, sizeof(uint32_t));
+    if (!grown)
+        return 0;
+    for (uint32_t id = 1; id < entry_count; id++) {
+        if (!entries[id].used)
+            continue;
+        size_t bucket = hash_text(entries[id].path) & (count - 1);
+        entries[id].next = grown[bucket];
+        grown[bucket] = id;
+    }
+    free(buckets);
+    buckets = grown;
+    bucket_count = count;
+    return 1;
+}
+
+static void mark_dirty(void) {
+    __atomic_store_n(&snapshot_dirty, 1, __ATOMIC_RELAXED);
+    snapshot_due = now_ms() + CATALOG_SNAPSHOT_DELAY_MS;
+}
+
+// Add an entry below a directory, returns NONE when out of memory
+static uint32_t new_entry(uint32_t parent, const char *name, catalog_format format) {
+    if (used_count + 1 > bucket_count && !grow_buckets())
+        return NONE;
+
+    uint32_t id;
+    if (free_count > 0) {
+        id = free_ids[--free_count];
+    } else {
+        if (!reserve32((void **)&entries, &entry_capacity, entry_count + 1, sizeof(entry_t)))
+            return NONE;
+        id = entry_count++;
+    }
+    entry_t *entry = &entries[id];
+    memset(entry, 0, sizeof(*entry));
+    entry->wd = -1;
+    entry->format = format;
+    entry->parent = parent;
+    if (parent == NONE) {
+        entry->path = strdup(name);
+    } else {
+        const char *parent_path = entries[parent].path;
+        size_t length = strlen(parent_path) + strlen(name) + 2;
+        entry->path = (char *)malloc(length);
+        if (entry->path)
+            snprintf(entry->path, length, "%s%s%s", parent_path, parent_path[0] ? "/" : "", name);
+    }
+    if (!entry->path || (parent != NONE && !reserve32((void **)&entries[parent].children, &entries[parent].child_capacity, entries[parent].child_count + 1, sizeof(uint32_t)))) {
+        free(entry->path);
+        if (reserve32((void **)&free_ids, &free_capacity, free_count + 1, sizeof(uint32_t)))
+            free_ids[free_count++] = id;
+        return NONE;
+    }
+    entry->name = parent == NONE ? 0 : strlen(entry->path) - strlen(name);
+    entry->used = 1;
+
+    size_t bucket = hash_text(entry->path) & (bucket_count - 1);
+    entry->next = buckets[bucket];
+    buckets[bucket] = id;
+    used_count++;
+    if (parent != NONE)
+        entries[parent].children[entries[parent].child_count++] = id;
+    mark_dirty();
+    return id;
+}
+
+static void clear_metadata(entry_t *entry) {
+    free(entry->author);
+    free(entry->title);
+    free(entry->description);
+    entry->author = entry->title = entry->description = NULL;
+    entry->found = 0;
+    entry->file_size = 0;
+}
+
+static void set_metadata(entry_t *entry, const FileMetadata *metadata) {
+    clear_metadata(entry);
+    entry->found = metadata->found;
+    if (metadata->found & METADATA_AUTHOR)
+        entry->author = strdup(metadata->author);
+    if (metadata->found & METADATA_TITLE)
+        entry->title = strdup(metadata->title);
+    if (metadata->found & METADATA_DESCRIPTION)
+        entry->description = strdup(metadata->description);
+    entry->file_size = metadata->file_size;
+}
+
+static void copy_text(char *field, size_t size, const char *text) {
+    snprintf(field, size, "%s", text ? text : "");
+}
+
+static void get_metadata(const entry_t *entry, FileMetadata *metadata) {
+    memset(metadata, 0, sizeof(*metadata));
+    metadata->found = entry->found;
+    copy_text(metadata->author, sizeof(metadata->author), entry->author);
+    copy_text(metadata->title, sizeof(metadata->title), entry->title);
+    copy_text(metadata->description, sizeof(metadata->description), entry->description);
+    metadata->file_size = entry->file_size;
+}
+
+// Drop an entry and everything below it
+static void remove_entry(uint32_t id) {
+    entry_t *entry = &entries[id];
+    while (entry->child_count > 0)
+        remove_entry(entry->children[entry->child_count - 1]);
+    if (entry->wd >= 0) {
+        inotify_rm_watch(inotify_fd, entry->wd);
+        if ((size_t)entry->wd < watch_capacity)
+            watches[entry->wd] = NONE;
+    }
+    if (entry->read && is_followed(entry)) {
+        char path[PATH_MAX];
+        if (full_path(entry->path, path))
+            metaindex_remove(path);
+    }
+
+    uint32_t *link = &buckets[hash_text(entry->path) & (bucket_count - 1)];
+    while (*link != id)
+        link = &entries[*link].next;
+    *link = entry->next;
+
+    entry_t *parent = &entries[entry->parent];
+    for (uint32_t i = 0; i < parent->child_count; i++) {
+        if (parent->children[i] == id) {
+            parent->children[i] = parent->children[--parent->child_count];
+            break;
+        }
+    }
+
+    clear_metadata(entry);
+    free(entry->path);
+    free(entry->children);
+    entry->used = 0;
+    used_count--;
+    if (reserve32((void **)&free_ids, &free_capacity, free_count + 1, sizeof(uint32_t)))
+        free_ids[free_count++] = id;
+    mark_dirty();
+}
+
+// Record what stat says about an entry, returns 1 if the metadata has to be read again
+static int update_entry(entry_t *entry, const struct stat *st) {
+    int changed = !entry->read || entry->size != (long long)st->st_size || entry->mtime.tv_sec != st->st_mtim.tv_sec || entry->mtime.tv_nsec != st->st_mtim.tv_nsec;
+    if (entry->size != (long long)st->st_size || entry->mtime.tv_sec != st->st_mtim.tv_sec || entry->mtime.tv_nsec != st->st_mtim.tv_nsec)
+        mark_dirty();
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    if (changed)
+        entry->read = 0;
+    return changed && entry->format != CATALOG_DIRECTORY && is_followed(entry);
+}
+
+// Find or create the entry for a name in a directory, replacing it if it changed between file and directory
+static uint32_t entry_for(uint32_t parent, const char *name, const struct stat *st) {
+    char relative[PATH_MAX];
+    const char *parent_path = entries[parent].path;
+    if (snprintf(relative, sizeof(relative), "%s%s%s", parent_path, parent_path[0] ? "/" : "", name) >= (int)sizeof(relative))
+        return NONE;
+
+    catalog_format format = format_of(name, st);
+    uint32_t id = find_entry(relative);
+    if (id != NONE && entries[id].format != format) {
+        remove_entry(id);
+        id = NONE;
+    }
+    return id != NONE ? id : new_entry(parent, name, format);
+}
+
+static void push_locked(uint32_t **list, size_t *count, size_t *capacity, uint32_t id) {
+    if (reserve((void **)list, capacity, *count + 1, sizeof(uint32_t)))
+        (*list)[(*count)++] = id;
+}
+
+static void push_directory(scan_t *scan, uint32_t id) {
+    pthread_mutex_lock(&scan->lock);
+    push_locked(&scan->dirs, &scan->count, &scan->capacity, id);
+    pthread_cond_signal(&scan->ready);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void push_document(scan_t *scan, uint32_t id) {
+    pthread_mutex_lock(&scan->lock);
+    push_locked(&scan->documents, &scan->document_count, &scan->document_capacity, id);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void set_watch(uint32_t id, int wd) {
+    size_t old_capacity = watch_capacity;
+    if (wd < 0 || !reserve((void **)&watches, &watch_capacity, (size_t)wd + 1, sizeof(uint32_t)))
+        return;
+    memset(watches + old_capacity, 0, (watch_capacity - old_capacity) * sizeof(uint32_t));
+    watches[wd] = id;
+    entries[id].wd = wd;
+}
+
+/* Name and stat of one directory entry, collected before the lock is taken */
+typedef struct {
+    char *name;
+    struct stat st;
+} found_t;
+
+// Read one directory: watch it, stat every name, then update the catalog in one go
+static void scan_directory(scan_t *scan, uint32_t id) {
+    char path[PATH_MAX];
+    pthread_rwlock_rdlock(&catalog_lock);
+    if (!entries[id].used || entries[id].format != CATALOG_DIRECTORY) {
+        pthread_rwlock_unlock(&catalog_lock);
+        return;
+    }
+    int fits = full_path(entries[id].path, path);
+    pthread_rwlock_unlock(&catalog_lock);
+    if (!fits)
+        return;
+
+    // Watch first, so that nothing created while the directory is read is missed
+    int wd = inotify_fd >= 0 ? inotify_add_watch(inotify_fd, path, WATCH_MASK) : -1;
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (!dir) {
+        if (dir_fd >= 0)
+            close(dir_fd);
+        // A watch added for a directory that could not be read is dropped, unless the entry already had it
+        if (wd >= 0) {
+            pthread_rwlock_rdlock(&catalog_lock);
+            int kept = entries[id].used && entries[id].wd == wd;
+            pthread_rwlock_unlock(&catalog_lock);
+            if (!kept)
+                inotify_rm_watch(inotify_fd, wd);
+        }
+        return;
+    }
+
+    found_t *found = NULL;
+    size_t found_count = 0, found_capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || is_snapshot(id, entry->d_name))
+            continue;
+        struct stat st;
+        if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !reserve((void **)&found, &found_capacity, found_count + 1, sizeof(found_t)))
+            continue;
+        if ((found[found_count].name = strdup(entry->d_name)) != NULL)
+            found[found_count++].st = st;
+    }
+    closedir(dir);
+
+    pthread_rwlock_wrlock(&catalog_lock);
+    if (entries[id].used && entries[id].format == CATALOG_DIRECTORY) {
+        set_watch(id, wd);
+        entries[id].scanned = 1;
+        for (size_t i = 0; i < found_count; i++) {
+            uint32_t child = entry_for(id, found[i].name, &found[i].st);
+            if (child == NONE)
+                continue;
+            entries[child].generation = generation;
+            if (update_entry(&entries[child], &found[i].st))
+                push_document(scan, child);
+            else if (entries[child].format == CATALOG_DIRECTORY && is_followed(&entries[child]))
+                push_directory(scan, child);
+        }
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+
+    for (size_t i = 0; i < found_count; i++)
+        free(found[i].name);
+    free(found);
+}
+
+static void *scan_worker(void *arg) {
+    scan_t *scan = (scan_t *)arg;
+    pthread_mutex_lock(&scan->lock);
+    for (;;) {
+        while (scan->head == scan->count && scan->active > 0)
+            pthread_cond_wait(&scan->ready, &scan->lock);
+        if (scan->head == scan->count) /* Nothing queued and nobody can queue more */
+            break;
+        uint32_t id = scan->dirs[scan->head++];
+        scan->active++;
+        pthread_mutex_unlock(&scan->lock);
+
+        scan_directory(scan, id);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->active--;
+        if (scan->head == scan->count && scan->active == 0)
+            pthread_cond_broadcast(&scan->ready);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    return NULL;
+}
+
+static void *read_worker(void *arg) {
+    reading_t *reading = (reading_t *)arg;
+    for (;;) {
+        size_t at = __atomic_fetch_add(&reading->next, 1, __ATOMIC_RELAXED);
+        if (at >= reading->count)
+            return NULL;
+
+        uint32_t id = reading->ids[at];
+        char relative[PATH_MAX], path[PATH_MAX];
+        catalog_format format;
+        pthread_rwlock_rdlock(&catalog_lock);
+        int used = entries[id].used;
+        if (used) {
+            snprintf(relative, sizeof(relative), "%s", entries[id].path);
+            format = entries[id].format;
+        }
+        pthread_rwlock_unlock(&catalog_lock);
+        if (!used || (format != CATALOG_XML && format != CATALOG_JSON))
+            continue;
+
+        // Read outside the lock, the entry may be gone or replaced by then
+        FileMetadata metadata;
+        int ok = full_path(relative, path) && (format == CATALOG_XML ? read_metadata_xml(path, &metadata) : read_metadata_json(path, &metadata));
+        if (!ok)
+            memset(&metadata, 0, sizeof(metadata));
+
+        pthread_rwlock_wrlock(&catalog_lock);
+        if (entries[id].used && strcmp(entries[id].path, relative) == 0) {
+            set_metadata(&entries[id], &metadata);
+            entries[id].read = 1;
+            mark_dirty();
+        }
+        pthread_rwlock_unlock(&catalog_lock);
+
+        if (reading->index) {
+            if (ok)
+                metaindex_put(path, &metadata);
+            else
+                metaindex_remove(path);
+        }
+    }
+}
+
+// Run `worker` on `threads` threads, the calling one included
+static void run_threads(void *(*worker)(void *), void *arg, int threads) {
+    pthread_t ids[CATALOG_MAX_THREADS];
+    int started_threads = 0;
+    for (int i = 1; i < threads && i < CATALOG_MAX_THREADS; i++) {
+        if (pthread_create(&ids[started_threads], NULL, worker, arg) == 0)
+            started_threads++;
+    }
+    worker(arg);
+    for (int i = 0; i < started_threads; i++)
+        pthread_join(ids[i], NULL);
+}
+
+static void read_documents(const uint32_t *ids, size_t count, int threads, int index) {
+    reading_t reading = { ids, count, 0, index };
+    if (count > 0)
+        run_threads(read_worker, &reading, count < 64 ? 1 : threads);
+}
+
+// Read a directory and everything below it, then the documents that changed
+static void scan_tree(uint32_t id, int threads, int index) {
+    scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_cond_init(&scan.ready, NULL);
+    push_directory(&scan, id);
+    run_threads(scan_worker, &scan, threads);
+    read_documents(scan.documents, scan.document_count, threads, index);
+    pthread_mutex_destroy(&scan.lock);
+    pthread_cond_destroy(&scan.ready);
+    free(scan.dirs);
+    free(scan.documents);
+}
+
+// Scan the whole root and drop what is not there any more
+static void reconcile(int threads, int index) {
+    pthread_rwlock_wrlock(&catalog_lock);
+    unsigned current = ++generation;
+    pthread_rwlock_unlock(&catalog_lock);
+
+    scan_tree(ROOT, threads, index);
+
+    pthread_rwlock_wrlock(&catalog_lock);
+    for (uint32_t id = ROOT + 1; id < entry_count; id++) {
+        uint32_t parent = entries[id].parent;
+        if (entries[id].used && entries[id].generation != current && entries[parent].scanned && is_followed(&entries[parent]))
+            remove_entry(id);
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+}
+
+static int write_field(FILE *file, const char *text) {
+    uint16_t length = text ? (uint16_t)strlen(text) : 0;
+    return fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(text ? text : "", 1, length, file) == length;
+}
+
+static int write_entry(FILE *file, const entry_t *entry) {
+    uint8_t format = (uint8_t)entry->format, read = (uint8_t)entry->read;
+    int64_t numbers[4] = { entry->size, entry->mtime.tv_sec, entry->mtime.tv_nsec, entry->file_size };
+    int32_t found = entry->found;
+    return write_field(file, entry->path) && fwrite(&format, 1, 1, file) == 1 && fwrite(&read, 1, 1, file) == 1 &&
+           fwrite(numbers, sizeof(numbers), 1, file) == 1 && fwrite(&found, sizeof(found), 1, file) == 1 &&
+           write_field(file, entry->author) && write_field(file, entry->title) && write_field(file, entry->description);
+}
+
+// Write every entry, parents before their children, to a temporary file renamed over the snapshot
+static void write_snapshot(void) {
+    char path[PATH_MAX], temp_path[PATH_MAX];
+    if (!full_path(CATALOG_SNAPSHOT, path) || !full_path(CATALOG_SNAPSHOT ".tmp", temp_path))
+        return;
+    FILE *file = fopen(temp_path, "wb");
+    if (!file) {
+        perror("Could not write the catalog snapshot");
+        return;
+    }
+
+    pthread_rwlock_rdlock(&catalog_lock);
+    uint32_t version = SNAPSHOT_VERSION, count = (uint32_t)used_count - 1;
+    int ok = fwrite(SNAPSHOT_MAGIC, 8, 1, file) == 1 && fwrite(&version, sizeof(version), 1, file) == 1 && fwrite(&count, sizeof(count), 1, file) == 1;
+    uint32_t *stack = NULL;
+    size_t depth = 0, capacity = 0;
+    push_locked(&stack, &depth, &capacity, ROOT);
+    while (ok && depth > 0) {
+        const entry_t *entry = &entries[stack[--depth]];
+        if (entry != &entries[ROOT])
+            ok = write_entry(file, entry);
+        for (uint32_t i = 0; i < entry->child_count; i++)
+            push_locked(&stack, &depth, &capacity, entry->children[i]);
+    }
+    __atomic_store_n(&snapshot_dirty, 0, __ATOMIC_RELAXED); /* Nothing marks it under the read lock, so no change is lost */
+    pthread_rwlock_unlock(&catalog_lock);
+    free(stack);
+
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+    if (fclose(file) != 0 || !ok || rename(temp_path, path) != 0) {
+        perror("Could not write the catalog snapshot");
+        unlink(temp_path);
+        __atomic_store_n(&snapshot_dirty, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static char *read_field(FILE *file) {
+    uint16_t length;
+    if (fread(&length, sizeof(length), 1, file) != 1)
+        return NULL;
+    char *text = (char *)malloc(length + 1);
+    if (text && fread(text, 1, length, file) != length) {
+        free(text);
+        return NULL;
+    }
+    if (text)
+        text[length] = '\0';
+    return text;
+}
+
+// Fill the catalog from the last snapshot, the scan that follows corrects it
+static void load_snapshot(void) {
+    char path[PATH_MAX], magic[8];
+    uint32_t version, count;
+    if (!full_path(CATALOG_SNAPSHOT, path))
+        return;
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return;
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+        fread(&version, sizeof(version), 1, file) != 1 || version != SNAPSHOT_VERSION || fread(&count, sizeof(count), 1, file) != 1) {
+        fclose(file);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&catalog_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t format, read;
+        int64_t numbers[4];
+        int32_t found;
+        char *relative = read_field(file);
+        int ok = relative && fread(&format, 1, 1, file) == 1 && fread(&read, 1, 1, file) == 1 &&
+                 fread(numbers, sizeof(numbers), 1, file) == 1 && fread(&found, sizeof(found), 1, file) == 1;
+        char *author = ok ? read_field(file) : NULL;
+        char *title = author ? read_field(file) : NULL;
+        char *description = title ? read_field(file) : NULL;
+        if (!description) { /* Truncated, keep what was read */
+            free(relative);
+            free(author);
+            free(title);
+            break;
+        }
+
+        // Parents come first, an entry whose parent is unknown is skipped
+        int known = find_entry(relative) != NONE;
+        char *slash = strrchr(relative, '/');
+        const char *name = slash ? slash + 1 : relative;
+        if (slash)
+            *slash = '\0';
+        uint32_t parent = find_entry(slash ? relative : "");
+        uint32_t id = !known && parent != NONE && entries[parent].format == CATALOG_DIRECTORY && format <= CATALOG_JSON && name[0] ? new_entry(parent, name, (catalog_format)format) : NONE;
+        if (id != NONE) {
+            entry_t *entry = &entries[id];
+            entry->size = numbers[0];
+            entry->mtime.tv_sec = numbers[1];
+            entry->mtime.tv_nsec = numbers[2];
+            entry->file_size = numbers[3];
+            entry->found = found;
+            entry->read = read;
+            entry->author = found & METADATA_AUTHOR ? author : NULL;
+            entry->title = found & METADATA_TITLE ? title : NULL;
+            entry->description = found & METADATA_DESCRIPTION ? description : NULL;
+        }
+        if (id == NONE || !entries[id].author)
+            free(author);
+        if (id == NONE || !entries[id].title)
+            free(title);
+        if (id == NONE || !entries[id].description)
+            free(description);
+        free(relative);
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+    fclose(file);
+}
+
+/* Paths named by the events of one batch */
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+    int overflow; /* Events were lost, the whole tree is scanned again */
+    long long first; /* Time of the first event of the batch, in ms */
+    long long last; /* Time of the latest event */
+} batch_t;
+
+static void batch_add(batch_t *batch, const char *relative) {
+    char *copy = strdup(relative);
+    if (!copy || !reserve((void **)&batch->paths, &batch->capacity, batch->count + 1, sizeof(char *))) {
+        free(copy);
+        batch->overflow = 1;
+        return;
+    }
+    batch->paths[batch->count++] = copy;
+}
+
+static void collect_event(batch_t *batch, const struct inotify_event *event) {
+    char relative[PATH_MAX];
+    if (event->mask & IN_Q_OVERFLOW) {
+        batch->overflow = 1;
+        return;
+    }
+
+    pthread_rwlock_wrlock(&catalog_lock);
+    uint32_t dir = event->wd >= 0 && (size_t)event->wd < watch_capacity ? watches[event->wd] : NONE;
+    if (dir != NONE && (event->mask & IN_IGNORED)) { /* The watch is gone with its directory */
+        watches[event->wd] = NONE;
+        if (entries[dir].wd == event->wd)
+            entries[dir].wd = -1;
+        dir = NONE;
+    }
+    int ok = dir != NONE;
+    if (ok && event->len > 0 && event->name[0]) {
+        const char *name = event->name;
+        if (is_snapshot(dir, name))
+            ok = 0; /* Our own writes */
+        else
+            ok = snprintf(relative, sizeof(relative), "%s%s%s", entries[dir].path, entries[dir].path[0] ? "/" : "", name) < (int)sizeof(relative);
+    } else if (ok) {
+        snprintf(relative, sizeof(relative), "%s", entries[dir].path);
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+    if (ok)
+        batch_add(batch, relative);
+}
+
+// Bring one path up to date, documents to read are added to `documents`
+static void refresh_path(const char *relative, uint32_t **documents, size_t *count, size_t *capacity, int threads) {
+    char path[PATH_MAX];
+    struct stat st;
+    int exists = full_path(relative, path) && lstat(path, &st) == 0;
+
+    pthread_rwlock_wrlock(&catalog_lock);
+    uint32_t id = find_entry(relative), scan = NONE;
+    if (!exists) {
+        if (id > ROOT)
+            remove_entry(id);
+    } else if (relative[0]) {
+        char parent_path[PATH_MAX];
+        snprintf(parent_path, sizeof(parent_path), "%s", relative);
+        char *slash = strrchr(parent_path, '/');
+        const char *name = slash ? relative + (slash - parent_path) + 1 : relative;
+        if (slash)
+            *slash = '\0';
+        uint32_t parent = find_entry(slash ? parent_path : "");
+        if (parent != NONE && entries[parent].scanned) { /* Otherwise the parent is scanned later or not followed */
+            int known = id != NONE;
+            id = entry_for(parent, name, &st);
+            if (id != NONE) {
+                entries[id].generation = generation;
+                if (update_entry(&entries[id], &st))
+                    push_locked(documents, count, capacity, id);
+                else if (entries[id].format == CATALOG_DIRECTORY && is_followed(&entries[id]) && (!known || !entries[id].scanned))
+                    scan = id;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+
+    if (scan != NONE) /* A directory created or moved in */
+        scan_tree(scan, threads, 1);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void apply_batch(batch_t *batch) {
+    int threads = cpu_threads();
+    if (batch->overflow) {
+        reconcile(threads, 1);
+    } else {
+        uint32_t *documents = NULL;
+        size_t count = 0, capacity = 0;
+        qsort(batch->paths, batch->count, sizeof(char *), compare_names);
+        for (size_t i = 0; i < batch->count; i++) {
+            if (i > 0 && strcmp(batch->paths[i], batch->paths[i - 1]) == 0)
+                continue; /* Every path is checked once, however many events it had */
+            refresh_path(batch->paths[i], &documents, &count, &capacity, threads);
+        }
+        read_documents(documents, count, threads, 1);
+        free(documents);
+    }
+
+    for (size_t i = 0; i < batch->count; i++)
+        free(batch->paths[i]);
+    batch->count = 0;
+    batch->overflow = 0;
+}
+
+static void *watch_thread(void *arg) {
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+
+    for (;;) {
+        long long now = now_ms(), timeout = CATALOG_SNAPSHOT_DELAY_MS;
+        if (batch.count > 0 || batch.overflow) {
+            long long quiet = batch.last + CATALOG_DEBOUNCE_MS, latest = batch.first + CATALOG_MAX_DELAY_MS;
+            timeout = (quiet < latest ? quiet : latest) - now;
+        } else {
+            pthread_rwlock_rdlock(&catalog_lock);
+            if (__atomic_load_n(&snapshot_dirty, __ATOMIC_RELAXED))
+                timeout = snapshot_due - now;
+            pthread_rwlock_unlock(&catalog_lock);
+        }
+
+        struct pollfd pfd = { inotify_fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, timeout < 0 ? 0 : (int)timeout);
+        now = now_ms();
+        if (ready > 0) {
+            ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+            if (length > 0 && batch.count == 0 && !batch.overflow)
+                batch.first = now;
+            for (ssize_t pos = 0; pos < length;) {
+                const struct inotify_event *event = (const struct inotify_event *)(buffer + pos);
+                collect_event(&batch, event);
+                pos += sizeof(struct inotify_event) + event->len;
+            }
+            if (length > 0)
+                batch.last = now;
+        }
+
+        if (batch.count > 0 || batch.overflow) {
+            if (now - batch.last >= CATALOG_DEBOUNCE_MS || now - batch.first >= CATALOG_MAX_DELAY_MS || batch.count >= CATALOG_MAX_BATCH)
+                apply_batch(&batch);
+        } else {
+            pthread_rwlock_rdlock(&catalog_lock);
+            int due = __atomic_load_n(&snapshot_dirty, __ATOMIC_RELAXED) && now >= snapshot_due;
+            pthread_rwlock_unlock(&catalog_lock);
+            if (due)
+                write_snapshot();
+        }
+    }
+    return arg;
+}
+
+int catalog_start(const char *root) {
+    if (!realpath(root, root_path)) {
+        perror("Could not open the served root");
+        return 0;
+    }
+
+    struct stat st;
+    pthread_rwlock_wrlock(&catalog_lock);
+    uint32_t id = stat(root_path, &st) == 0 ? new_entry(NONE, "", CATALOG_DIRECTORY) : NONE;
+    if (id == ROOT)
+        update_entry(&entries[ROOT], &st);
+    pthread_rwlock_unlock(&catalog_lock);
+    if (id != ROOT)
+        return 0;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+        perror("inotify_init1, the catalog will not follow changes");
+
+    // The snapshot spares reading the documents that did not change, the scan finds out which
+    load_snapshot();
+    reconcile(cpu_threads(), 0);
+
+    int documents = 0;
+    pthread_rwlock_rdlock(&catalog_lock);
+    for (id = ROOT + 1; id < entry_count; id++) {
+        const entry_t *entry = &entries[id];
+        if (!entry->used || entry->format == CATALOG_DIRECTORY || !is_followed(entry))
+            continue;
+        FileMetadata metadata;
+        char path[PATH_MAX];
+        get_metadata(entry, &metadata);
+        if (!full_path(entry->path, path))
+            continue;
+        metaindex_put(path, &metadata);
+        documents++;
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+    write_snapshot();
+
+    pthread_t thread;
+    if (inotify_fd >= 0 && pthread_create(&thread, NULL, watch_thread, NULL) == 0)
+        pthread_detach(thread);
+    started = 1;
+    return documents;
+}
+
+int catalog_list(const char *dirname, catalog_listing_t *listing) {
+    char relative[PATH_MAX];
+    listing->count = 0;
+    listing->names = NULL;
+    if (!started || !normalize(dirname, relative))
+        return 0;
+
+    pthread_rwlock_rdlock(&catalog_lock);
+    uint32_t id = find_entry(relative);
+    int ok = id != NONE && entries[id].format == CATALOG_DIRECTORY && entries[id].scanned;
+    if (ok && entries[id].child_count > 0) {
+        listing->names = (char **)malloc(entries[id].child_count * sizeof(char *));
+        ok = listing->names != NULL;
+        for (uint32_t i = 0; ok && i < entries[id].child_count; i++) {
+            const entry_t *child = &entries[entries[id].children[i]];
+            if ((listing->names[listing->count] = strdup(child->path + child->name)) != NULL)
+                listing->count++;
+        }
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+
+    if (ok)
+        qsort(listing->names, listing->count, sizeof(char *), compare_names);
+    else
+        catalog_listing_free(listing);
+    return ok;
+}
+
+void catalog_listing_free(catalog_listing_t *listing) {
+    for (size_t i = 0; i < listing->count; i++)
+        free(listing->names[i]);
+    free(listing->names);
+    listing->names = NULL;
+    listing->count = 0;
+}
+
+int catalog_lookup(const char *path, catalog_info_t *info) {
+    char relative[PATH_MAX];
+    if (!started || !normalize(path, relative))
+        return 0;
+
+    pthread_rwlock_rdlock(&catalog_lock);
+    uint32_t id = find_entry(relative);
+    if (id != NONE) {
+        info->format = entries[id].format;
+        info->size = entries[id].size;
+        info->mtime = entries[id].mtime;
+        get_metadata(&entries[id], &info->metadata);
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+    return id != NONE;
+}
+
+void catalog_refresh(const char *path) {
+    char relative[PATH_MAX];
+    if (!started || !normalize(path, relative)) { /* Outside the catalog, only the metadata index follows it */
+        if (access(path, F_OK) == 0)
+            metaindex_update(path);
+        else
+            metaindex_remove(path);
+        return;
+    }
+
+    uint32_t *documents = NULL;
+    size_t count = 0, capacity = 0;
+    refresh_path(relative, &documents, &count, &capacity, 1);
+    read_documents(documents, count, 1, 1);
+    free(documents);
+}
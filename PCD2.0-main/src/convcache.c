@@ -0,0 +1,466 @@
+#define _GNU_SOURCE /* copy_file_range */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "convcache.h"
+#include "transcode.h"
+#include "pathindex.h"
+#include "jtape.h"
+#include "savefile.h"
+
+#define BUCKETS 8192 /* Twice CONVCACHE_MAX_ENTRIES */
+#define DIGEST_HEX 32
+
+/* One cached conversion */
+typedef struct cache_entry {
+    convcache_digest_t digest;
+    long long bytes; /* JSON file and sidecars */
+    long long json_size; /* What the stored JSON file must still be */
+    struct timespec json_mtime;
+    struct cache_entry *newer; /* LRU list, most recently used first */
+    struct cache_entry *older;
+    struct cache_entry *next; /* Same bucket */
+} cache_entry_t;
+
+static const char *const sidecar_suffixes[] = { PATHINDEX_SUFFIX, JTAPE_SUFFIX };
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t *buckets[BUCKETS];
+static cache_entry_t *newest;
+static cache_entry_t *oldest;
+static convcache_stats_t counters;
+static char store_path[PATH_MAX - 64]; /* Leaves room for the digest and a suffix */
+static int ready;
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3_x64_128 with a seed of 0
+void convcache_hash(const void *data, size_t size, convcache_digest_t *digest) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    const uint8_t *bytes = (const uint8_t *)data;
+    size_t blocks = size / 16, tail_len = size & 15;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+
+    for (size_t i = 0; i < blocks; i++) {
+        memcpy(&k1, bytes + i * 16, 8);
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uint8_t *tail = bytes + blocks * 16;
+    k1 = k2 = 0;
+    for (size_t i = tail_len; i > 8; i--)
+        k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+    if (tail_len > 8) {
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    for (size_t i = tail_len < 8 ? tail_len : 8; i > 0; i--)
+        k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+    if (tail_len > 0) {
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    digest->low = h1;
+    digest->high = h2;
+}
+
+// Path of a stored file: the digest in hex, ".json" and the suffix of a sidecar if any
+static void stored_path(const convcache_digest_t *digest, const char *suffix, char path[PATH_MAX]) {
+    snprintf(path, PATH_MAX, "%s/%016llx%016llx.json%s", store_path, (unsigned long long)digest->high, (unsigned long long)digest->low, suffix);
+}
+
+static int parse_digest(const char *name, convcache_digest_t *digest) {
+    char half[17];
+    char *end;
+    if (strlen(name) != DIGEST_HEX + strlen(".json") || strcmp(name + DIGEST_HEX, ".json") != 0)
+        return 0;
+    for (int i = 0; i < 2; i++) {
+        memcpy(half, name + i * 16, 16);
+        half[16] = '\0';
+        unsigned long long value = strtoull(half, &end, 16);
+        if (*end != '\0')
+            return 0;
+        if (i == 0)
+            digest->high = value;
+        else
+            digest->low = value;
+    }
+    return 1;
+}
+
+// Put a hardlink of `source` in place of `target` through a temporary name, so the target is never missing
+static int link_file(const char *source, const char *target) {
+    char temp_path[PATH_MAX];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", target) >= (int)sizeof(temp_path))
+        return 0;
+    for (int attempt = 0;; attempt++) {
+        int fd = mkstemp(temp_path); /* Reserve a unique name, then link the file over it */
+        if (fd < 0)
+            return 0;
+        close(fd);
+        unlink(temp_path);
+        if (link(source, temp_path) == 0)
+            break;
+        if (errno != EEXIST || attempt == 10)
+            return 0;
+        memcpy(temp_path + strlen(temp_path) - 6, "XXXXXX", 6);
+    }
+    if (rename(temp_path, target) != 0) {
+        unlink(temp_path);
+        return 0;
+    }
+    return 1;
+}
+
+// Replace `target` with a copy of `source` that has the same times, reflinked where the filesystem shares extents
+static int copy_file(const char *source, const char *target, int durable) {
+    savefile_t file;
+    struct stat st;
+    int source_fd = open(source, O_RDONLY);
+    if (source_fd < 0)
+        return 0;
+    if (fstat(source_fd, &st) < 0 || !savefile_open(&file, target)) {
+        close(source_fd);
+        return 0;
+    }
+    int ok = ioctl(file.fd, FICLONE, source_fd) == 0;
+    if (!ok) {
+        off_t offset = 0;
+        ok = 1;
+        while (ok && offset < st.st_size) {
+            ssize_t copied = copy_file_range(source_fd, &offset, file.fd, NULL, st.st_size - offset, 0);
+            ok = copied > 0 || (copied < 0 && errno == EINTR);
+        }
+    }
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    ok = ok && futimens(file.fd, times) == 0; /* The sidecars were built for this time */
+    close(source_fd);
+    if (!ok) {
+        savefile_abort(&file);
+        return 0;
+    }
+    return savefile_commit(&file, durable) != 0;
+}
+
+static size_t bucket_of(const convcache_digest_t *digest) {
+    return digest->low & (BUCKETS - 1);
+}
+
+static cache_entry_t *find_entry(const convcache_digest_t *digest) {
+    cache_entry_t *entry = buckets[bucket_of(digest)];
+    while (entry && (entry->digest.low != digest->low || entry->digest.high != digest->high))
+        entry = entry->next;
+    return entry;
+}
+
+static void unlink_lru(cache_entry_t *entry) {
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+static void push_newest(cache_entry_t *entry) {
+    entry->older = newest;
+    entry->newer = NULL;
+    if (newest)
+        newest->newer = entry;
+    newest = entry;
+    if (!oldest)
+        oldest = entry;
+}
+
+// Drop an entry and its files, needs the lock
+static void remove_entry(cache_entry_t *entry) {
+    cache_entry_t **link = &buckets[bucket_of(&entry->digest)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    unlink_lru(entry);
+
+    char path[PATH_MAX];
+    stored_path(&entry->digest, "", path);
+    unlink(path);
+    for (size_t i = 0; i < sizeof(sidecar_suffixes) / sizeof(sidecar_suffixes[0]); i++) {
+        stored_path(&entry->digest, sidecar_suffixes[i], path);
+        unlink(path);
+    }
+    counters.entries--;
+    counters.bytes -= entry->bytes;
+    free(entry);
+}
+
+// Evict the least recently used entries until the cache is within its bounds, `keep` stays
+static void evict(const cache_entry_t *keep) {
+    while (oldest && oldest != keep && (counters.entries > CONVCACHE_MAX_ENTRIES || counters.bytes > CONVCACHE_MAX_BYTES)) {
+        remove_entry(oldest);
+        counters.evictions++;
+    }
+}
+
+// Add an entry as the most recently used one, needs the lock
+static cache_entry_t *insert_entry(const convcache_digest_t *digest, long long bytes, const struct stat *json_st) {
+    cache_entry_t *entry = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+    if (!entry)
+        return NULL;
+    entry->digest = *digest;
+    entry->bytes = bytes;
+    entry->json_size = json_st->st_size;
+    entry->json_mtime = json_st->st_mtim;
+    size_t bucket = bucket_of(digest);
+    entry->next = buckets[bucket];
+    buckets[bucket] = entry;
+    push_newest(entry);
+    counters.entries++;
+    counters.bytes += bytes;
+    return entry;
+}
+
+// Size of the stored JSON file and its sidecars
+static long long stored_bytes(const convcache_digest_t *digest, const struct stat *json_st) {
+    long long bytes = json_st->st_size;
+    for (size_t i = 0; i < sizeof(sidecar_suffixes) / sizeof(sidecar_suffixes[0]); i++) {
+        char path[PATH_MAX];
+        struct stat st;
+        stored_path(digest, sidecar_suffixes[i], path);
+        if (stat(path, &st) == 0)
+            bytes += st.st_size;
+    }
+    return bytes;
+}
+
+/* A stored file found by convcache_init */
+typedef struct {
+    convcache_digest_t digest;
+    struct stat st;
+} stored_t;
+
+static int compare_stored(const void *a, const void *b) {
+    const struct timespec *x = &((const stored_t *)a)->st.st_mtim, *y = &((const stored_t *)b)->st.st_mtim;
+    return x->tv_sec != y->tv_sec ? (x->tv_sec < y->tv_sec ? -1 : 1) : (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+int convcache_init(const char *dirname) {
+    char root[PATH_MAX];
+    if (!realpath(dirname, root) || snprintf(store_path, sizeof(store_path), "%s/%s", root, CONVCACHE_DIR) >= (int)sizeof(store_path))
+        return 0;
+    if (mkdir(store_path, 0755) < 0 && errno != EEXIST) {
+        perror("Could not create the conversion cache");
+        return 0;
+    }
+    DIR *dir = opendir(store_path);
+    if (!dir) {
+        perror("Could not open the conversion cache");
+        return 0;
+    }
+
+    // Oldest first, so that the last one inserted is the most recently used
+    stored_t *stored = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        convcache_digest_t digest;
+        char path[PATH_MAX];
+        if (!parse_digest(entry->d_name, &digest))
+            continue;
+        stored_path(&digest, "", path);
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            stored_t *grown = (stored_t *)realloc(stored, capacity * sizeof(stored_t));
+            if (!grown)
+                break;
+            stored = grown;
+        }
+        if (stat(path, &stored[count].st) == 0) {
+            stored[count].digest = digest;
+            count++;
+        }
+    }
+    closedir(dir);
+    if (count > 0) /* stored is NULL for an empty cache */
+        qsort(stored, count, sizeof(stored_t), compare_stored);
+
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < count; i++) {
+        if (!find_entry(&stored[i].digest))
+            insert_entry(&stored[i].digest, stored_bytes(&stored[i].digest, &stored[i].st), &stored[i].st);
+    }
+    evict(NULL);
+    ready = 1;
+    int entries = (int)counters.entries;
+    pthread_mutex_unlock(&cache_lock);
+    free(stored);
+    return entries;
+}
+
+int convcache_link(const convcache_digest_t *digest, const char *json_path) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *entry = ready ? find_entry(digest) : NULL;
+    long long json_size = 0;
+    struct timespec json_mtime = { 0, 0 };
+    if (entry) {
+        json_size = entry->json_size;
+        json_mtime = entry->json_mtime;
+        unlink_lru(entry);
+        push_newest(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // The stored file must still be what was stored, or the entry is dropped
+    stored_path(digest, "", path);
+    int ok = entry != NULL;
+    if (ok && (stat(path, &st) < 0 || st.st_size != json_size || st.st_mtim.tv_sec != json_mtime.tv_sec || st.st_mtim.tv_nsec != json_mtime.tv_nsec)) {
+        pthread_mutex_lock(&cache_lock);
+        if ((entry = find_entry(digest)) != NULL)
+            remove_entry(entry);
+        pthread_mutex_unlock(&cache_lock);
+        ok = 0;
+    }
+    ok = ok && copy_file(path, json_path, 1);
+
+    // Sidecars come along when they were stored, stale ones of the old file are dropped
+    for (size_t i = 0; ok && i < sizeof(sidecar_suffixes) / sizeof(sidecar_suffixes[0]); i++) {
+        char target[PATH_MAX];
+        stored_path(digest, sidecar_suffixes[i], path);
+        if (snprintf(target, sizeof(target), "%s%s", json_path, sidecar_suffixes[i]) >= (int)sizeof(target))
+            continue;
+        if (access(path, F_OK) < 0 || !copy_file(path, target, 0)) /* A sidecar is rebuilt if lost */
+            unlink(target);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (ok)
+        counters.hits++;
+    else
+        counters.misses++;
+    pthread_mutex_unlock(&cache_lock);
+    return ok;
+}
+
+void convcache_add(const convcache_digest_t *digest, const char *json_path) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    pthread_mutex_lock(&cache_lock);
+    int known = !ready || find_entry(digest) != NULL;
+    pthread_mutex_unlock(&cache_lock);
+    if (known)
+        return;
+
+    stored_path(digest, "", path);
+    if (!link_file(json_path, path))
+        return;
+    for (size_t i = 0; i < sizeof(sidecar_suffixes) / sizeof(sidecar_suffixes[0]); i++) {
+        char source[PATH_MAX], target[PATH_MAX];
+        snprintf(source, sizeof(source), "%s%s", json_path, sidecar_suffixes[i]);
+        stored_path(digest, sidecar_suffixes[i], target);
+        if (access(source, F_OK) < 0 || !link_file(source, target))
+            unlink(target);
+    }
+    if (stat(path, &st) < 0)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *entry = find_entry(digest); /* Stored by another thread meanwhile, same content */
+    if (!entry)
+        entry = insert_entry(digest, stored_bytes(digest, &st), &st);
+    evict(entry);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int convcache_convert_fd(int xml_fd, const char *xml_path, const char *json_path, convcache_digest_t *digest, int *hit) {
+    *hit = 0;
+    struct stat st;
+    if (fstat(xml_fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Error! Could not read file data from '%s'\n", xml_path);
+        return 0;
+    }
+
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, xml_fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Could not map XML file");
+        return 0;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    // Hashing pages the file in, a miss transcodes it from memory right after
+    convcache_hash(data, st.st_size, digest);
+    *hit = convcache_link(digest, json_path);
+    int ok = *hit || transcode_xml_to_file(data, st.st_size, json_path);
+    munmap(data, st.st_size);
+    return ok;
+}
+
+int convcache_convert(const char *xml_path, const char *json_path, convcache_digest_t *digest, int *hit) {
+    *hit = 0;
+    int xml_fd = open(xml_path, O_RDONLY);
+    if (xml_fd < 0) {
+        fprintf(stderr, "Error! Could not load file from '%s'\n", xml_path);
+        return 0;
+    }
+    int ok = convcache_convert_fd(xml_fd, xml_path, json_path, digest, hit);
+    close(xml_fd);
+    return ok;
+}
+
+void convcache_stats(convcache_stats_t *stats) {
+    pthread_mutex_lock(&cache_lock);
+    *stats = counters;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "convert.h"
+#include "threadpool.h"
+#include "outbuf.h"
+#include "transcode.h"
+#include "jtape.h"
+#include "pathindex.h"
+#include "catalog.h"
+#include "convcache.h"
+#include "logger.h"
+#include "server.h"
+#include "savefile.h"
+#include "filelock.h"
+
+#define STAGE_COUNT 4
+
+/* One file on its way through the stages */
+typedef struct convert_item {
+    char xml_path[PATH_MAX];
+    char json_path[PATH_MAX];
+    const char *name; /* File name shown to the client, inside `xml_path` */
+    char *data; /* Mapping of the XML file, until it is transcoded */
+    size_t size;
+    filelock_t source; /* Read lock on the XML file, held with the mapping */
+    char *json; /* JSON text, until it is written */
+    size_t json_length;
+    convcache_digest_t digest; /* Of the XML content, taken by the read stage */
+    int cached; /* The outputs were linked from the conversion cache, nothing to write or index */
+    const char *error; /* Why the file was not converted, the later stages skip it */
+    struct convert_item *next_failed;
+} convert_item_t;
+
+/* Bounded queue between two stages */
+typedef struct {
+    convert_item_t *items[CONVERT_QUEUE_SIZE];
+    int head;
+    int count;
+    int producers; /* Threads of the stage before still running, 0 ends the queue */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} convert_queue_t;
+
+/* Counters of one stage, updated atomically by its threads */
+typedef struct {
+    const char *name;
+    int threads;
+    long files;
+    long long bytes;
+    long long busy_ns; /* Time spent working, summed over the threads */
+} convert_stage_t;
+
+typedef struct convert_job convert_job_t;
+
+/* What one pool task runs */
+typedef struct {
+    convert_job_t *job;
+    int stage;
+} convert_worker_t;
+
+struct convert_job {
+    const char *dirname;
+    struct dirent **names;
+    int file_count;
+    int next_file; /* Next name for the read stage, atomic */
+    int cancelled; /* The client is gone, read without the lock */
+    convert_queue_t queues[STAGE_COUNT - 1]; /* queues[i] goes from stage i to stage i + 1 */
+    convert_stage_t stages[STAGE_COUNT];
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    int converted;
+    int failed;
+    convert_item_t *failures; /* Failed files not reported yet, newest first */
+    int running; /* Pool tasks not finished */
+};
+
+static long long elapsed_ns(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+static void add_ms(struct timespec *time, long ms) {
+    time->tv_sec += ms / 1000;
+    time->tv_nsec += (ms % 1000) * 1000000L;
+    if (time->tv_nsec >= 1000000000L) {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000L;
+    }
+}
+
+static void queue_init(convert_queue_t *queue, int producers) {
+    memset(queue, 0, sizeof(*queue));
+    queue->producers = producers;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+}
+
+static void queue_destroy(convert_queue_t *queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+static void queue_push(convert_queue_t *queue, convert_item_t *item) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == CONVERT_QUEUE_SIZE)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->items[(queue->head + queue->count) % CONVERT_QUEUE_SIZE] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Next item of the queue, NULL once it is empty and nothing can be added any more
+static convert_item_t *queue_pop(convert_queue_t *queue) {
+    convert_item_t *item = NULL;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && queue->producers > 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    if (queue->count > 0) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % CONVERT_QUEUE_SIZE;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+// A producer is done, the consumers are woken up once the last one is
+static void queue_close(convert_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    if (--queue->producers == 0)
+        pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take the next name of the directory for the read stage
+static convert_item_t *next_item(convert_job_t *job) {
+    if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED))
+        return NULL;
+    int at = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED);
+    if (at >= job->file_count)
+        return NULL;
+
+    convert_item_t *item = (convert_item_t *)calloc(1, sizeof(convert_item_t));
+    if (!item)
+        return NULL;
+    const char *name = job->names[at]->d_name;
+    snprintf(item->xml_path, sizeof(item->xml_path), "%s/%s", job->dirname, name);
+    item->name = item->xml_path + strlen(job->dirname) + 1;
+    size_t base = strlen(item->xml_path) - strlen(".xml");
+    if (snprintf(item->json_path, sizeof(item->json_path), "%.*s.json", (int)base, item->xml_path) >= (int)sizeof(item->json_path))
+        item->error = "path too long";
+    return item;
+}
+
+// Unmap the XML file and let its writers go
+static void unmap_source(convert_item_t *item) {
+    munmap(item->data, item->size);
+    item->data = NULL;
+    filelock_release(&item->source);
+}
+
+static void read_stage(convert_item_t *item) {
+    int fd = filelock_read(item->xml_path, &item->source);
+    if (fd < 0) {
+        item->error = strerror(errno);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        item->error = strerror(errno);
+        close(fd);
+        filelock_release(&item->source);
+        return;
+    }
+    if (st.st_size == 0) {
+        item->error = "empty file";
+        close(fd);
+        filelock_release(&item->source);
+        return;
+    }
+
+    /* Populated here, so the transcode stage never waits for the disk */
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        item->error = strerror(errno);
+        filelock_release(&item->source);
+        return;
+    }
+    item->data = (char *)data;
+    item->size = st.st_size;
+    convcache_hash(item->data, item->size, &item->digest);
+}
+
+static void transcode_stage(convert_item_t *item) {
+    filelock_t lock;
+    int linked = filelock_write(item->json_path, &lock) && convcache_link(&item->digest, item->json_path);
+    filelock_release(&lock);
+    if (linked) {
+        item->cached = 1;
+        unmap_source(item);
+        return;
+    }
+
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!out) {
+        item->error = "out of memory";
+        return;
+    }
+    outbuf_init_memory(out, SIZE_MAX);
+    int ok = transcode_xml_buffer(item->data, item->size, out);
+    ok = outbuf_flush(out) && ok;
+    unmap_source(item);
+
+    if (ok) {
+        item->json = out->memory;
+        item->json_length = out->memory_length;
+    } else {
+        item->error = out->error == ENOBUFS ? "out of memory" : "not valid XML";
+        free(out->memory);
+    }
+    free(out);
+}
+
+static void write_stage(convert_item_t *item) {
+    if (item->cached)
+        return;
+    // Renamed into place, so an output shared with the cache is replaced and readers never see half a document.
+    // Not synced: every output can be converted again, and a sync per file would hold up the whole directory
+    savefile_t file;
+    filelock_t lock;
+    errno = 0;
+    if (!filelock_write(item->json_path, &lock) || !savefile_open(&file, item->json_path)) {
+        item->error = strerror(errno);
+    } else if (!savefile_write(&file, item->json, item->json_length)) {
+        item->error = strerror(errno ? errno : EIO);
+        savefile_abort(&file);
+    } else if (!savefile_commit(&file, 0)) {
+        item->error = strerror(errno ? errno : EIO);
+    }
+    filelock_release(&lock);
+    free(item->json);
+    item->json = NULL;
+}
+
+static void index_stage(convert_item_t *item) {
+    // Same follow-up as a single upload
+    if (!item->cached) {
+        if (!jtape_build(item->json_path))
+            fprintf(stderr, "Could not write the tape of '%s'.\n", item->json_path);
+        if (!pathindex_build(item->json_path)) /* Parsed once, the document is still cached */
+            fprintf(stderr, "Could not write the path index of '%s'.\n", item->json_path);
+        convcache_add(&item->digest, item->json_path);
+    }
+    catalog_refresh(item->xml_path);
+    catalog_refresh(item->json_path);
+
+    log_change(item->json_path, "convert", item->cached ? "Linked from the conversion cache" : "Converted from XML");
+    if (item->cached)
+        logger_sidecar(item->json_path, "Linked JSON file '%s' from the cached conversion of identical XML file '%s'", item->json_path, item->xml_path);
+    else
+        logger_sidecar(item->json_path, "Converted XML file '%s' to JSON file '%s'", item->xml_path, item->json_path);
+}
+
+static void (*const stage_functions[STAGE_COUNT])(convert_item_t *) = { read_stage, transcode_stage, write_stage, index_stage };
+
+// Bytes a stage handled for an item, counted before the stage frees them
+static size_t stage_bytes(int stage, const convert_item_t *item) {
+    return stage < 2 ? item->size : item->json_length;
+}
+
+// Leave the pipeline: count the file and report it if it failed
+static void finish_item(convert_job_t *job, convert_item_t *item) {
+    if (item->data)
+        unmap_source(item);
+    free(item->json);
+
+    pthread_mutex_lock(&job->lock);
+    if (item->error) {
+        job->failed++;
+        item->next_failed = job->failures;
+        job->failures = item;
+        item = NULL;
+    } else {
+        job->converted++;
+    }
+    pthread_cond_signal(&job->progress);
+    pthread_mutex_unlock(&job->lock);
+    free(item);
+}
+
+// Task of the pool: one thread of one stage, until its input runs out
+static void run_stage(void *arg) {
+    convert_worker_t *worker = (convert_worker_t *)arg;
+    convert_job_t *job = worker->job;
+    convert_stage_t *stage = &job->stages[worker->stage];
+    int last = worker->stage == STAGE_COUNT - 1;
+
+    for (;;) {
+        convert_item_t *item = worker->stage == 0 ? next_item(job) : queue_pop(&job->queues[worker->stage - 1]);
+        if (!item)
+            break;
+
+        // Failed files still go down the pipeline so that they are counted in one place
+        if (!item->error && !__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            stage_functions[worker->stage](item);
+            __atomic_fetch_add(&stage->busy_ns, elapsed_ns(&start), __ATOMIC_RELAXED);
+            if (!item->error) {
+                __atomic_fetch_add(&stage->files, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&stage->bytes, (long long)stage_bytes(worker->stage, item), __ATOMIC_RELAXED);
+            }
+        } else if (!item->error) {
+            item->error = "cancelled";
+        }
+
+        if (last)
+            finish_item(job, item);
+        else
+            queue_push(&job->queues[worker->stage], item);
+    }
+    if (!last)
+        queue_close(&job->queues[worker->stage]);
+
+    pthread_mutex_lock(&job->lock);
+    job->running--;
+    pthread_cond_signal(&job->progress);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static int filter_xml(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+    if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+        return 0;
+    return len > 4 && strcmp(entry->d_name + len - 4, ".xml") == 0;
+}
+
+// Send the failures collected so far and, when asked, a progress line
+static void report_progress(convert_job_t *job, outbuf_t *out, int with_line) {
+    char line[PATH_MAX + 64];
+    pthread_mutex_lock(&job->lock);
+    convert_item_t *failures = job->failures;
+    int converted = job->converted, failed = job->failed;
+    job->failures = NULL;
+    pthread_mutex_unlock(&job->lock);
+
+    // The list is newest first, send it oldest first
+    convert_item_t *ordered = NULL;
+    while (failures) {
+        convert_item_t *next = failures->next_failed;
+        failures->next_failed = ordered;
+        ordered = failures;
+        failures = next;
+    }
+    while (ordered) {
+        convert_item_t *next = ordered->next_failed;
+        snprintf(line, sizeof(line), "Failed: %s: %s\n", ordered->name, ordered->error);
+        outbuf_puts(out, line);
+        free(ordered);
+        ordered = next;
+    }
+
+    if (with_line) {
+        snprintf(line, sizeof(line), "Converted %d of %d files, %d failed\n", converted, job->file_count, failed);
+        outbuf_puts(out, line);
+    }
+    outbuf_flush(out);
+    if (out->error) /* The client is gone, stop reading new files */
+        __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+static void report_stages(convert_job_t *job, outbuf_t *out, long long total_ns) {
+    char line[256];
+    int slowest = 0;
+    double slowest_busy = 0;
+
+    snprintf(line, sizeof(line), "Converted %d of %d files, %d failed, in %.2f s\n", job->converted, job->file_count, job->failed, total_ns / 1e9);
+    outbuf_puts(out, line);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const convert_stage_t *stage = &job->stages[i];
+        double busy = stage->busy_ns / 1e9, per_thread = busy / stage->threads;
+        snprintf(line, sizeof(line), "%-9s %2d threads, %ld files, %.1f MB, %.2f s busy, %.0f files/s, %.1f MB/s\n",
+                 stage->name, stage->threads, stage->files, stage->bytes / 1e6, busy,
+                 per_thread > 0 ? stage->files / per_thread : 0, per_thread > 0 ? stage->bytes / 1e6 / per_thread : 0);
+        outbuf_puts(out, line);
+        if (per_thread > slowest_busy) {
+            slowest_busy = per_thread;
+            slowest = i;
+        }
+    }
+    if (slowest_busy > 0) {
+        snprintf(line, sizeof(line), "Slowest stage: %s\n", job->stages[slowest].name);
+        outbuf_puts(out, line);
+    }
+    outbuf_flush(out);
+}
+
+int convert_all(const char *dirname, int client_socket) {
+    convert_job_t *job = (convert_job_t *)calloc(1, sizeof(convert_job_t));
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!job || !out) {
+        char error_msg[] = "Memory allocation failed\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        free(job);
+        free(out);
+        return 0;
+    }
+    outbuf_init(out, client_socket, 1);
+
+    job->dirname = dirname;
+    job->file_count = scandir(dirname, &job->names, filter_xml, alphasort);
+    if (job->file_count < 0) {
+        char error_msg[] = "Failed to open directory.\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Failed to open directory");
+        free(job);
+        free(out);
+        return 0;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu_threads = cpus < 1 ? 1 : cpus > CONVERT_MAX_THREADS ? CONVERT_MAX_THREADS : (int)cpus;
+    const char *names[STAGE_COUNT] = { "read", "transcode", "write", "index" };
+    int threads[STAGE_COUNT] = { CONVERT_IO_THREADS, cpu_threads, CONVERT_IO_THREADS, cpu_threads };
+    int total = 0;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        job->stages[i].name = names[i];
+        job->stages[i].threads = threads[i];
+        if (i < STAGE_COUNT - 1)
+            queue_init(&job->queues[i], threads[i]);
+        total += threads[i];
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->progress, NULL);
+
+    // One task per stage thread, every one of them has to start or the queues never close
+    convert_worker_t *workers = (convert_worker_t *)malloc(sizeof(convert_worker_t) * total);
+    threadpool_t *pool = workers ? threadpool_create(total, total) : NULL;
+    int ok = pool != NULL;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ok) {
+        char line[64];
+        snprintf(line, sizeof(line), "Converting %d files\n", job->file_count);
+        outbuf_puts(out, line);
+        outbuf_flush(out);
+
+        job->running = total;
+        for (int i = 0, at = 0; i < STAGE_COUNT; i++) {
+            for (int t = 0; t < threads[i]; t++, at++) {
+                workers[at].job = job;
+                workers[at].stage = i;
+                threadpool_add(pool, run_stage, &workers[at]);
+            }
+        }
+
+        // Report while the stages run: failures as they come, a progress line every CONVERT_PROGRESS_MS
+        struct timespec next_report;
+        clock_gettime(CLOCK_REALTIME, &next_report);
+        add_ms(&next_report, CONVERT_PROGRESS_MS);
+        pthread_mutex_lock(&job->lock);
+        while (job->running > 0) {
+            int due = 0;
+            while (job->running > 0 && !job->failures && !due)
+                due = pthread_cond_timedwait(&job->progress, &job->lock, &next_report) == ETIMEDOUT;
+            pthread_mutex_unlock(&job->lock);
+            if (due)
+                add_ms(&next_report, CONVERT_PROGRESS_MS);
+            report_progress(job, out, due);
+            pthread_mutex_lock(&job->lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+        threadpool_destroy(pool, 0);
+
+        report_progress(job, out, 0);
+        report_stages(job, out, elapsed_ns(&start));
+    } else {
+        char error_msg[] = "Could not start the conversion threads.\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+    }
+
+    for (int i = 0; i < job->file_count; i++)
+        free(job->names[i]);
+    free(job->names);
+    for (int i = 0; i < STAGE_COUNT - 1; i++)
+        queue_destroy(&job->queues[i]);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->progress);
+    free(workers);
+    free(job);
+    free(out);
+    return ok;
+}
@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "doccache.h"
+
+typedef enum {
+    ENTRY_LOADING, /* A thread is parsing the document, others wait for it */
+    ENTRY_READY,
+    ENTRY_FAILED
+} entry_state;
+
+struct doccache_entry {
+    dev_t device; /* Key of the entry */
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    const doccache_type_t *type;
+
+    void *document; /* Parsed document, set once the entry is ready */
+    size_t bytes; /* Memory used by the document */
+    entry_state state;
+    int refs; /* Handles given out plus the one held by a loading thread */
+    int cached; /* Still reachable from the table */
+
+    struct doccache_entry *next; /* Next entry in the same bucket */
+    struct doccache_entry *lru_prev; /* Neighbours in the LRU list, most recent first */
+    struct doccache_entry *lru_next;
+    struct stripe *stripe;
+};
+
+/* One independently locked part of the cache */
+typedef struct stripe {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded; /* Signaled when an entry of this stripe stops loading */
+    struct doccache_entry *buckets[DOCCACHE_BUCKETS];
+    struct doccache_entry *lru_head; /* Most recently used ready entry */
+    struct doccache_entry *lru_tail; /* Least recently used ready entry */
+    size_t entries; /* Entries in the table */
+} stripe_t;
+
+static stripe_t stripes[DOCCACHE_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+static size_t total_bytes; /* Memory used by the ready entries of all stripes, updated atomically */
+
+static void init_stripes(void) {
+    for (int i = 0; i < DOCCACHE_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+        pthread_cond_init(&stripes[i].loaded, NULL);
+    }
+}
+
+// Mix the identity of the file, every version of a file lands in the same bucket
+static size_t hash_file(dev_t device, ino_t inode) {
+    unsigned long long h = (unsigned long long)inode * 0x9E3779B97F4A7C15ULL;
+    h ^= (unsigned long long)device + (h >> 29);
+    return (size_t)(h ^ (h >> 32));
+}
+
+static void lru_unlink(stripe_t *stripe, struct doccache_entry *entry) {
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        stripe->lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        stripe->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(stripe_t *stripe, struct doccache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = stripe->lru_head;
+    if (stripe->lru_head)
+        stripe->lru_head->lru_prev = entry;
+    else
+        stripe->lru_tail = entry;
+    stripe->lru_head = entry;
+}
+
+// Take an entry out of the table, it is freed when its last handle is released
+static void remove_entry(stripe_t *stripe, struct doccache_entry **link) {
+    struct doccache_entry *entry = *link;
+    *link = entry->next;
+    entry->next = NULL;
+    if (entry->state == ENTRY_READY) {
+        lru_unlink(stripe, entry);
+        __atomic_sub_fetch(&total_bytes, entry->bytes, __ATOMIC_RELAXED);
+    }
+    stripe->entries--;
+    entry->cached = 0;
+}
+
+static struct doccache_entry **find_link(stripe_t *stripe, struct doccache_entry *entry) {
+    size_t bucket = hash_file(entry->device, entry->inode) / DOCCACHE_STRIPES % DOCCACHE_BUCKETS;
+    struct doccache_entry **link = &stripe->buckets[bucket];
+    while (*link != entry)
+        link = &(*link)->next;
+    return link;
+}
+
+static void free_entry(struct doccache_entry *entry) {
+    if (entry->state == ENTRY_READY)
+        entry->type->free(entry->document);
+    free(entry);
+}
+
+static int over_budget(void) {
+    return __atomic_load_n(&total_bytes, __ATOMIC_RELAXED) > DOCCACHE_BUDGET;
+}
+
+// Evict unreferenced entries from the cold end of a stripe while the cache is over budget
+static struct doccache_entry *evict(stripe_t *stripe, struct doccache_entry *victims) {
+    struct doccache_entry *entry = stripe->lru_tail;
+
+    while (entry && over_budget()) {
+        struct doccache_entry *prev = entry->lru_prev;
+        if (entry->refs == 0) {
+            remove_entry(stripe, find_link(stripe, entry));
+            entry->next = victims; /* Freed by the caller, outside of the lock */
+            victims = entry;
+        }
+        entry = prev;
+    }
+    return victims;
+}
+
+static void free_victims(struct doccache_entry *victims) {
+    while (victims) {
+        struct doccache_entry *next = victims->next;
+        free_entry(victims);
+        victims = next;
+    }
+}
+
+// Continue evicting in the other stripes, one lock at a time, when the current one was not enough
+static void evict_others(stripe_t *current) {
+    for (int i = 0; i < DOCCACHE_STRIPES && over_budget(); i++) {
+        stripe_t *stripe = &stripes[(current - stripes + 1 + i) % DOCCACHE_STRIPES];
+        if (stripe == current)
+            continue;
+        pthread_mutex_lock(&stripe->lock);
+        struct doccache_entry *victims = evict(stripe, NULL);
+        pthread_mutex_unlock(&stripe->lock);
+        free_victims(victims);
+    }
+}
+
+void *doccache_acquire_fd(int fd, const doccache_type_t *type, doccache_handle_t **handle) {
+    struct doccache_entry *entry, *victims = NULL, **link;
+    struct stat st;
+
+    pthread_once(&stripes_once, init_stripes);
+
+    // The key comes from the open descriptor, so the parse matches the version that was looked up
+    if (fstat(fd, &st) < 0)
+        return NULL;
+
+    size_t hash = hash_file(st.st_dev, st.st_ino);
+    stripe_t *stripe = &stripes[hash % DOCCACHE_STRIPES];
+    link = &stripe->buckets[hash / DOCCACHE_STRIPES % DOCCACHE_BUCKETS];
+
+    pthread_mutex_lock(&stripe->lock);
+    while ((entry = *link) != NULL) {
+        if (entry->device != st.st_dev || entry->inode != st.st_ino || entry->type != type) {
+            link = &entry->next;
+            continue;
+        }
+        if (entry->size == st.st_size && entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            break;
+
+        // An older version of the same file, drop it now instead of waiting for the LRU
+        remove_entry(stripe, link);
+        if (entry->refs == 0) {
+            entry->next = victims;
+            victims = entry;
+        }
+    }
+
+    if (entry) { /* Hit, possibly on a document another thread is still parsing */
+        entry->refs++;
+        while (entry->state == ENTRY_LOADING)
+            pthread_cond_wait(&stripe->loaded, &stripe->lock);
+        if (entry->state == ENTRY_FAILED) {
+            int last = --entry->refs == 0 && !entry->cached;
+            pthread_mutex_unlock(&stripe->lock);
+            if (last)
+                free_entry(entry);
+            free_victims(victims);
+            errno = EINVAL;
+            return NULL;
+        }
+        if (entry->cached) {
+            lru_unlink(stripe, entry);
+            lru_push_front(stripe, entry);
+        }
+        pthread_mutex_unlock(&stripe->lock);
+        free_victims(victims);
+        *handle = entry;
+        return entry->document;
+    }
+
+    // Miss: publish a loading entry so concurrent lookups wait for this parse
+    entry = (struct doccache_entry *)calloc(1, sizeof(*entry));
+    if (!entry) {
+        pthread_mutex_unlock(&stripe->lock);
+        free_victims(victims);
+        return NULL;
+    }
+    entry->device = st.st_dev;
+    entry->inode = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->type = type;
+    entry->state = ENTRY_LOADING;
+    entry->refs = 1;
+    entry->cached = 1;
+    entry->stripe = stripe;
+    entry->next = stripe->buckets[hash / DOCCACHE_STRIPES % DOCCACHE_BUCKETS];
+    stripe->buckets[hash / DOCCACHE_STRIPES % DOCCACHE_BUCKETS] = entry;
+    stripe->entries++;
+    pthread_mutex_unlock(&stripe->lock);
+    free_victims(victims);
+
+    size_t bytes = 0;
+    void *document = type->load(fd, &st, &bytes); /* Parse without holding the lock */
+    struct stat after;
+    int changed = fstat(fd, &after) < 0 || after.st_size != st.st_size || after.st_mtim.tv_sec != st.st_mtim.tv_sec || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec;
+
+    pthread_mutex_lock(&stripe->lock);
+    if (!document) {
+        entry->state = ENTRY_FAILED;
+        if (entry->cached)
+            remove_entry(stripe, find_link(stripe, entry));
+        pthread_cond_broadcast(&stripe->loaded);
+        int last = --entry->refs == 0;
+        pthread_mutex_unlock(&stripe->lock);
+        if (last)
+            free_entry(entry);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    entry->document = document;
+    entry->bytes = bytes;
+    entry->state = ENTRY_READY;
+    victims = NULL;
+    if (entry->cached) {
+        if (changed || bytes > DOCCACHE_BUDGET) { /* Rewritten while loading or too big to keep, it lives as long as its handles */
+            remove_entry(stripe, find_link(stripe, entry));
+        } else {
+            lru_push_front(stripe, entry);
+            __atomic_add_fetch(&total_bytes, bytes, __ATOMIC_RELAXED);
+            victims = evict(stripe, NULL);
+        }
+    }
+    pthread_cond_broadcast(&stripe->loaded);
+    pthread_mutex_unlock(&stripe->lock);
+    free_victims(victims);
+    evict_others(stripe);
+
+    *handle = entry;
+    return document;
+}
+
+void *doccache_acquire(const char *path, const doccache_type_t *type, doccache_handle_t **handle) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    void *document = doccache_acquire_fd(fd, type, handle);
+    int saved = errno; /* EINVAL for a file that could not be parsed */
+    close(fd);
+    errno = saved;
+    return document;
+}
+
+void doccache_release(doccache_handle_t *handle) {
+    stripe_t *stripe = handle->stripe;
+
+    pthread_mutex_lock(&stripe->lock);
+    int last = --handle->refs == 0 && !handle->cached;
+    pthread_mutex_unlock(&stripe->lock);
+    if (last)
+        free_entry(handle);
+}
+
+// Read the file and index it, the copy keeps the document stable while the file is rewritten
+static void *load_json(int fd, const struct stat *st, size_t *bytes) {
+    if (st->st_size <= 0)
+        return NULL;
+
+    json_document_t *document = (json_document_t *)malloc(sizeof(json_document_t));
+    if (!document)
+        return NULL;
+    document->size = st->st_size;
+    document->mtime = st->st_mtim;
+    document->data = (char *)malloc(document->size + 1);
+    if (!document->data) {
+        free(document);
+        return NULL;
+    }
+
+    size_t done = 0;
+    while (done < document->size) {
+        ssize_t n = pread(fd, document->data + done, document->size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    document->data[done] = '\0';
+    document->size = done; /* The file may have shrunk since fstat */
+
+    if (jindex_build(&document->index, document->data, document->size) != JINDEX_OK) {
+        free(document->data);
+        free(document);
+        return NULL;
+    }
+    if (!jcursor_document(document->data, document->size, &document->root)) {
+        jindex_free(&document->index);
+        free(document->data);
+        free(document);
+        return NULL;
+    }
+
+    *bytes = sizeof(json_document_t) + document->size + 1 + document->index.capacity * 2 * sizeof(uint32_t);
+    return document;
+}
+
+static void free_json(void *data) {
+    json_document_t *document = (json_document_t *)data;
+    jindex_free(&document->index);
+    free(document->data);
+    free(document);
+}
+
+const doccache_type_t doccache_json = { "json", load_json, free_json };
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "fanout.h"
+#include "threadpool.h"
+#include "outbuf.h"
+#include "doccache.h"
+#include "filelock.h"
+#include "jquery.h"
+#include "jtape.h"
+#include "xpathcache.h"
+
+typedef struct fanout_job fanout_job_t;
+
+/* One file of a search and what it found */
+typedef struct {
+    fanout_job_t *job;
+    char path[PATH_MAX];
+    const char *name; /* File name shown to the client, inside `path` */
+    int done; /* Set by the worker, guarded by the job lock */
+    char *output; /* Every match, each followed by a newline */
+    size_t *ends; /* End of each match in `output` */
+    long count;
+    long capacity;
+    int truncated; /* More matches were found than fit in FANOUT_MAX_FILE_OUTPUT */
+    const char *error; /* Why the file could not be searched */
+    outbuf_t *out; /* Where the worker prints, only while it runs */
+    const jindex_t *index; /* Structural index of the document searched without a tape */
+} fanout_slot_t;
+
+struct fanout_job {
+    fanout_kind kind;
+    jquery_t *query;
+    xpath_expr_t *expr;
+    long limit; /* No file needs to report more matches than this, 0 for no limit */
+    int cancelled; /* Read by the workers without the lock */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    fanout_slot_t slots[FANOUT_WINDOW];
+};
+
+static threadpool_t *search_pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void create_search_pool(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 2 ? 2 : cpus > FANOUT_MAX_THREADS ? FANOUT_MAX_THREADS : (int)cpus;
+    search_pool = threadpool_create(threads, FANOUT_QUEUE_SIZE);
+}
+
+// Record the end of the match just printed, returns 0 once the file has reported enough
+static int end_match(fanout_slot_t *slot) {
+    outbuf_putc(slot->out, '\n');
+    if (slot->out->error) {
+        slot->truncated = 1;
+        return 0;
+    }
+    if (slot->count == slot->capacity) {
+        long capacity = slot->capacity ? slot->capacity * 2 : 16;
+        size_t *ends = (size_t *)realloc(slot->ends, sizeof(size_t) * capacity);
+        if (!ends) {
+            slot->truncated = 1;
+            return 0;
+        }
+        slot->ends = ends;
+        slot->capacity = capacity;
+    }
+    slot->ends[slot->count++] = slot->out->total;
+    return (slot->job->limit == 0 || slot->count < slot->job->limit) && !__atomic_load_n(&slot->job->cancelled, __ATOMIC_RELAXED);
+}
+
+static int print_tape_match(const jtape_t *tape, size_t value, void *arg) {
+    fanout_slot_t *slot = (fanout_slot_t *)arg;
+    jtape_print(tape, value, JWRITE_PRETTY, slot->out);
+    return end_match(slot);
+}
+
+static int print_span_match(const jspan_t *value, void *arg) {
+    fanout_slot_t *slot = (fanout_slot_t *)arg;
+    if (!jwrite_span(slot->out, JWRITE_PRETTY, value, slot->index)) {
+        slot->error = "could not print a match";
+        return 0;
+    }
+    return end_match(slot);
+}
+
+static void search_json(fanout_slot_t *slot) {
+    struct stat st;
+    doccache_handle_t *handle;
+    filelock_t lock;
+    int fd = filelock_read(slot->path, &lock);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        slot->error = strerror(errno);
+        if (fd >= 0) {
+            close(fd);
+            filelock_release(&lock);
+        }
+        return;
+    }
+
+    jtape_t *tape = jtape_acquire(slot->path, &st, &handle);
+    if (tape) {
+        close(fd);
+        jtape_run(tape, slot->job->query, print_tape_match, slot);
+        doccache_release(handle);
+        filelock_release(&lock);
+        return;
+    }
+
+    // No tape for this version of the file yet: search the parsed text and leave a tape for next time
+    json_document_t *document = doccache_acquire_fd(fd, &doccache_json, &handle);
+    int error = errno;
+    close(fd);
+    if (!document) {
+        slot->error = error == EINVAL ? "not valid JSON" : strerror(error);
+        filelock_release(&lock);
+        return;
+    }
+    slot->index = &document->index;
+    jquery_run(slot->job->query, &document->root, &document->index, print_span_match, slot);
+    jtape_write(slot->path, document);
+    doccache_release(handle);
+    filelock_release(&lock);
+}
+
+static void search_xml(fanout_slot_t *slot) {
+    doccache_handle_t *handle;
+    filelock_t lock;
+    int fd = filelock_read(slot->path, &lock);
+    if (fd < 0) {
+        slot->error = strerror(errno);
+        return;
+    }
+    xmlDocPtr doc = doccache_acquire_fd(fd, &doccache_xml, &handle);
+    int error = errno;
+    close(fd);
+    if (!doc) {
+        slot->error = error == EINVAL ? "not valid XML" : strerror(error);
+        filelock_release(&lock);
+        return;
+    }
+
+    // The XPath context of this worker thread is reused for every file it searches
+    xmlXPathObjectPtr result = xpathcache_eval(slot->job->expr, doc);
+    if (!result) {
+        slot->error = "XPath evaluation failed";
+    } else if (result->type == XPATH_NODESET) {
+        xmlNodeSetPtr nodes = result->nodesetval;
+        for (int i = 0; nodes && i < nodes->nodeNr; i++) {
+            xpathcache_write_content(nodes->nodeTab[i], slot->out);
+            if (!end_match(slot))
+                break;
+        }
+    } else {
+        xmlChar *value = xmlXPathCastToString(result);
+        if (value) {
+            outbuf_puts(slot->out, (const char *)value);
+            xmlFree(value);
+        }
+        end_match(slot);
+    }
+    if (result)
+        xmlXPathFreeObject(result);
+    doccache_release(handle);
+    filelock_release(&lock);
+}
+
+// Task of the search pool: search one file into memory
+static void run_slot(void *arg) {
+    fanout_slot_t *slot = (fanout_slot_t *)arg;
+    fanout_job_t *job = slot->job;
+
+    slot->out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!slot->out) {
+        slot->error = "out of memory";
+    } else if (!__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+        outbuf_init_memory(slot->out, FANOUT_MAX_FILE_OUTPUT);
+        if (job->kind == FANOUT_JSON)
+            search_json(slot);
+        else
+            search_xml(slot);
+        if (!outbuf_flush(slot->out))
+            slot->truncated = 1;
+
+        // Only matches that made it to memory before the limit count
+        slot->output = slot->out->memory;
+        while (slot->count > 0 && slot->ends[slot->count - 1] > slot->out->memory_length)
+            slot->count--;
+    }
+    free(slot->out);
+    slot->out = NULL;
+
+    pthread_mutex_lock(&job->lock);
+    slot->done = 1;
+    pthread_cond_broadcast(&job->done);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Hand a file to the pool, or search it here when the queue is full
+static void dispatch(fanout_job_t *job, fanout_slot_t *slot, const char *dirname, const char *name) {
+    memset(slot, 0, sizeof(*slot));
+    slot->job = job;
+    snprintf(slot->path, sizeof(slot->path), "%s/%s", dirname, name);
+    slot->name = slot->path + strlen(dirname) + 1;
+    if (!search_pool || threadpool_add(search_pool, run_slot, slot) != 0)
+        run_slot(slot);
+}
+
+static void wait_slot(fanout_job_t *job, fanout_slot_t *slot) {
+    pthread_mutex_lock(&job->lock);
+    while (!slot->done)
+        pthread_cond_wait(&job->done, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void free_slot(fanout_slot_t *slot) {
+    free(slot->output);
+    free(slot->ends);
+    slot->output = NULL;
+    slot->ends = NULL;
+}
+
+static __thread fanout_kind filter_kind; /* Kind of the scandir running on this thread, read by filter_files */
+
+// Keep the files searched by this kind of expression
+static int filter_files(const struct dirent *entry) {
+    const char *suffix = filter_kind == FANOUT_JSON ? ".json" : ".xml";
+    size_t len = strlen(entry->d_name), suffix_len = strlen(suffix);
+    if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+        return 0;
+    return len > suffix_len && strcmp(entry->d_name + len - suffix_len, suffix) == 0;
+}
+
+int fanout_search(const char *dirname, fanout_kind kind, const char *expression, long limit, int client_socket) {
+    fanout_job_t *job = (fanout_job_t *)calloc(1, sizeof(fanout_job_t));
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!job || !out) {
+        char error_msg[] = "Memory allocation failed\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        free(job);
+        free(out);
+        return 0;
+    }
+    outbuf_init(out, client_socket, 1);
+
+    // Compile once for every file
+    const char *error = NULL;
+    job->kind = kind;
+    job->limit = limit > 0 ? limit : 0;
+    if (kind == FANOUT_JSON)
+        job->query = jquery_acquire(expression, &error);
+    else if (!(job->expr = xpathcache_acquire(expression)))
+        error = "Error in XPath expression";
+    if (error) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), kind == FANOUT_JSON ? "Invalid path: %s\n" : "%s\n", error);
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        free(job);
+        free(out);
+        return 0;
+    }
+
+    // Files in name order, so the answer does not depend on which worker is faster
+    struct dirent **names;
+    filter_kind = kind;
+    int file_count = scandir(dirname, &names, filter_files, alphasort);
+    if (file_count < 0) {
+        char error_msg[] = "Failed to open directory.\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Failed to open directory");
+        if (job->query)
+            jquery_release(job->query);
+        if (job->expr)
+            xpathcache_release(job->expr);
+        free(job);
+        free(out);
+        return 0;
+    }
+
+    pthread_once(&pool_once, create_search_pool);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    // Keep the window full, report files in order as they complete
+    long matches = 0;
+    int dispatched = 0, reported = 0;
+    char line[PATH_MAX + 64];
+    while (reported < file_count) {
+        while (dispatched < file_count && dispatched < reported + FANOUT_WINDOW && !job->cancelled) {
+            dispatch(job, &job->slots[dispatched % FANOUT_WINDOW], dirname, names[dispatched]->d_name);
+            dispatched++;
+        }
+        if (reported == dispatched)
+            break; /* Cancelled, nothing left in flight */
+
+        fanout_slot_t *slot = &job->slots[reported % FANOUT_WINDOW];
+        wait_slot(job, slot);
+        if (slot->error) {
+            snprintf(line, sizeof(line), "== %s: %s\n", slot->name, slot->error);
+            outbuf_puts(out, line);
+        } else if (slot->count > 0 && !job->cancelled) {
+            long shown = job->limit && slot->count > job->limit - matches ? job->limit - matches : slot->count;
+            snprintf(line, sizeof(line), "== %s (%ld matches%s)\n", slot->name, shown, slot->truncated && shown == slot->count ? ", more not shown" : "");
+            outbuf_puts(out, line);
+            outbuf_write(out, slot->output, slot->ends[shown - 1]);
+            matches += shown;
+        }
+        outbuf_flush(out); /* The client sees each file as soon as it is reported */
+        free_slot(slot);
+        reported++;
+
+        // Stop every other file once the limit is reached or the client is gone
+        if ((job->limit && matches >= job->limit) || out->error)
+            __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+    }
+
+    // Workers still running point into the job
+    for (; reported < dispatched; reported++) {
+        wait_slot(job, &job->slots[reported % FANOUT_WINDOW]);
+        free_slot(&job->slots[reported % FANOUT_WINDOW]);
+    }
+
+    snprintf(line, sizeof(line), "Searched %d of %d files, %ld matches%s\n", dispatched, file_count, matches, job->cancelled && !out->error ? " (limit reached)" : "");
+    outbuf_puts(out, line);
+    outbuf_flush(out);
+
+    for (int i = 0; i < file_count; i++)
+        free(names[i]);
+    free(names);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->done);
+    if (job->query)
+        jquery_release(job->query);
+    if (job->expr)
+        xpathcache_release(job->expr);
+    free(job);
+    free(out);
+    return 1;
+}
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "filelock.h"
+
+/* What a path leads to: an inode, or the directory and name of a file that does not exist */
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    unsigned long long name; /* Hash of the name, 0 for an inode */
+    struct timespec mtime;
+} file_key_t;
+
+struct filelock_entry {
+    dev_t device; /* Key of the entry */
+    ino_t inode;
+    unsigned long long name;
+    int readers; /* Readers holding this version */
+    int writer; /* A writer works on the file */
+    int waiting; /* Writers waiting for it */
+    struct filelock_entry *next; /* Next entry in the same bucket */
+    struct stripe *stripe;
+};
+
+/* One independently locked part of the table */
+typedef struct stripe {
+    pthread_mutex_t lock;
+    pthread_cond_t released; /* Signaled when a writer of this stripe is done */
+    struct filelock_entry *buckets[FILELOCK_BUCKETS];
+} stripe_t;
+
+static stripe_t stripes[FILELOCK_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+static void init_stripes(void) {
+    for (int i = 0; i < FILELOCK_STRIPES; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+        pthread_cond_init(&stripes[i].released, NULL);
+    }
+}
+
+static size_t hash_key(dev_t device, ino_t inode, unsigned long long name) {
+    unsigned long long h = (unsigned long long)inode * 0x9E3779B97F4A7C15ULL;
+    h ^= (unsigned long long)device + (h >> 29);
+    h ^= name;
+    return (size_t)(h ^ (h >> 32));
+}
+
+// FNV-1a of a file name, never 0
+static unsigned long long hash_name(const char *name) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (; *name; name++) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ULL;
+    }
+    return h | 1;
+}
+
+// Look a path up
+static int lookup(const char *path, file_key_t *key) {
+    struct stat st;
+    memset(key, 0, sizeof(*key));
+    if (stat(path, &st) == 0) {
+        key->device = st.st_dev;
+        key->inode = st.st_ino;
+        key->mtime = st.st_mtim;
+        return 1;
+    }
+    if (errno != ENOENT)
+        return 0;
+
+    // A file about to be created is known by its directory and its name
+    char parent[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+        strcpy(parent, ".");
+    else if (slash == path)
+        strcpy(parent, "/");
+    else
+        snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+    if (stat(parent, &st) != 0)
+        return 0;
+    key->device = st.st_dev;
+    key->inode = st.st_ino;
+    key->name = hash_name(slash ? slash + 1 : path);
+    return 1;
+}
+
+static stripe_t *stripe_of(const file_key_t *key) {
+    return &stripes[hash_key(key->device, key->inode, key->name) % FILELOCK_STRIPES];
+}
+
+static struct filelock_entry **bucket_of(stripe_t *stripe, dev_t device, ino_t inode, unsigned long long name) {
+    return &stripe->buckets[hash_key(device, inode, name) / FILELOCK_STRIPES % FILELOCK_BUCKETS];
+}
+
+// Entry of a key, created if `create`; the stripe is locked
+static struct filelock_entry *find_entry(stripe_t *stripe, const file_key_t *key, int create) {
+    struct filelock_entry **bucket = bucket_of(stripe, key->device, key->inode, key->name), *entry;
+    for (entry = *bucket; entry; entry = entry->next) {
+        if (entry->device == key->device && entry->inode == key->inode && entry->name == key->name)
+            return entry;
+    }
+    if (!create || !(entry = (struct filelock_entry *)calloc(1, sizeof(*entry))))
+        return NULL;
+    entry->device = key->device;
+    entry->inode = key->inode;
+    entry->name = key->name;
+    entry->stripe = stripe;
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
+// Free an entry nobody holds or waits for; the stripe is locked
+static void drop_if_unused(struct filelock_entry *entry) {
+    if (entry->readers || entry->writer || entry->waiting)
+        return;
+    struct filelock_entry **link = bucket_of(entry->stripe, entry->device, entry->inode, entry->name);
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    free(entry);
+}
+
+static void end_write(struct filelock_entry *entry) {
+    stripe_t *stripe = entry->stripe;
+    pthread_mutex_lock(&stripe->lock);
+    entry->writer = 0;
+    if (entry->waiting)
+        pthread_cond_broadcast(&stripe->released);
+    drop_if_unused(entry);
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+int filelock_read(const char *path, filelock_t *lock) {
+    struct stat st;
+    memset(lock, 0, sizeof(*lock));
+    pthread_once(&stripes_once, init_stripes);
+
+    // The version is the one the descriptor opened, later renames over the name do not change it
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    file_key_t key = { st.st_dev, st.st_ino, 0, st.st_mtim };
+    stripe_t *stripe = stripe_of(&key);
+    pthread_mutex_lock(&stripe->lock);
+    lock->entry = find_entry(stripe, &key, 1); /* Without an entry the reader is just not counted */
+    if (lock->entry)
+        lock->entry->readers++;
+    pthread_mutex_unlock(&stripe->lock);
+
+    lock->exists = 1;
+    lock->device = st.st_dev;
+    lock->inode = st.st_ino;
+    lock->mtime = st.st_mtim;
+    return fd;
+}
+
+int filelock_write(const char *path, filelock_t *lock) {
+    file_key_t key, now;
+    memset(lock, 0, sizeof(*lock));
+    pthread_once(&stripes_once, init_stripes);
+    if (!lookup(path, &key))
+        return 0;
+
+    for (;;) {
+        stripe_t *stripe = stripe_of(&key);
+        pthread_mutex_lock(&stripe->lock);
+        struct filelock_entry *entry = find_entry(stripe, &key, 1);
+        if (!entry) {
+            pthread_mutex_unlock(&stripe->lock);
+            errno = ENOMEM;
+            return 0;
+        }
+        entry->waiting++;
+        while (entry->writer)
+            pthread_cond_wait(&stripe->released, &stripe->lock);
+        entry->waiting--;
+        entry->writer = 1;
+        pthread_mutex_unlock(&stripe->lock);
+
+        // The writer before may have published a new version or deleted the file, lock what the name leads to now
+        if (!lookup(path, &now)) {
+            end_write(entry);
+            return 0;
+        }
+        if (now.device == key.device && now.inode == key.inode && now.name == key.name) {
+            lock->entry = entry;
+            lock->writer = 1;
+            lock->exists = now.name == 0;
+            lock->device = now.device;
+            lock->inode = now.inode;
+            lock->mtime = now.mtime;
+            return 1;
+        }
+        end_write(entry);
+        key = now;
+    }
+}
+
+int filelock_same(const filelock_t *lock, const filelock_t *other) {
+    return lock->exists && other->exists && lock->device == other->device && lock->inode == other->inode &&
+           lock->mtime.tv_sec == other->mtime.tv_sec && lock->mtime.tv_nsec == other->mtime.tv_nsec;
+}
+
+void filelock_release(filelock_t *lock) {
+    struct filelock_entry *entry = lock->entry;
+    if (!entry)
+        return;
+    lock->entry = NULL;
+    if (lock->writer) {
+        end_write(entry);
+        return;
+    }
+    stripe_t *stripe = entry->stripe; /* The entry may be freed before the unlock */
+    pthread_mutex_lock(&stripe->lock);
+    entry->readers--;
+    drop_if_unused(entry);
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+void filelock_status(const char *path, int *readers, int *writing) {
+    file_key_t key;
+    *readers = *writing = 0;
+    pthread_once(&stripes_once, init_stripes);
+    if (!lookup(path, &key))
+        return;
+    stripe_t *stripe = stripe_of(&key);
+    pthread_mutex_lock(&stripe->lock);
+    struct filelock_entry *entry = find_entry(stripe, &key, 0);
+    if (entry) {
+        *readers = entry->readers;
+        *writing = entry->writer;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
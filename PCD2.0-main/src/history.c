@@ -0,0 +1,685 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+#define SEGMENT_SUFFIX ".seg"
+#define INDEX_SUFFIX ".idx"
+#define MAX_RECORD (sizeof(record_header_t) + sizeof(((ChangeLog *)0)->filename) + sizeof(((ChangeLog *)0)->change_type) + sizeof(((ChangeLog *)0)->details))
+
+/* A change in a segment, followed by the file name, the change type and the details */
+typedef struct {
+    uint32_t size; /* Whole record, header included */
+    uint16_t filename_length;
+    uint16_t change_length;
+    uint32_t details_length;
+    uint32_t reserved;
+    int64_t time;
+} record_header_t;
+
+/* Start of a sealed index, followed by the files, the entries and the names */
+typedef struct {
+    char magic[8];
+    uint32_t file_count;
+    uint32_t record_count;
+    int64_t first_time;
+    int64_t last_time;
+    uint64_t names_size;
+} index_header_t;
+
+/* A file of a sealed index, sorted by hash then name */
+typedef struct {
+    uint64_t hash;
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint32_t first; /* First of its entries */
+    uint32_t count;
+} index_file_t;
+
+/* A record of a file */
+typedef struct {
+    int64_t time;
+    uint64_t offset;
+} index_entry_t;
+
+/* A file of the segment being written */
+typedef struct active_file {
+    char *name;
+    uint64_t hash;
+    index_entry_t *entries; /* In time order */
+    uint32_t count;
+    uint32_t capacity;
+    struct active_file *next;
+} active_file_t;
+
+/* In-memory index of a segment that is not sealed */
+typedef struct {
+    active_file_t **buckets;
+    uint32_t bucket_count; /* Power of two */
+    uint32_t file_count;
+    uint32_t record_count;
+} active_index_t;
+
+typedef struct {
+    unsigned number;
+    int fd;
+    off_t size;
+    int64_t first_time;
+    int64_t last_time;
+    void *map; /* Sealed index, NULL for the segment being written */
+    size_t map_size;
+    const index_header_t *header;
+    const index_file_t *files;
+    const index_entry_t *entries;
+    const char *names;
+} segment_t;
+
+/* A record found by a query, read once the store is unlocked */
+typedef struct {
+    int fd;
+    uint64_t offset;
+} position_t;
+
+static pthread_rwlock_t history_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char root[PATH_MAX];
+static char store_path[PATH_MAX - 64];
+static segment_t *segments; /* Oldest first, the last one is being written */
+static size_t segment_count;
+static active_index_t active;
+
+/* Records waiting for the writer thread; the queue and the batch being written are swapped */
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER; /* Records were queued */
+static pthread_cond_t queue_written = PTHREAD_COND_INITIALIZER; /* A batch was written */
+static char queue_buffers[2][HISTORY_QUEUE_SIZE];
+static char *queue = queue_buffers[0];
+static size_t queue_length;
+static unsigned long queued_count; /* Records queued so far */
+static unsigned long written_count; /* Records handed to the segment so far */
+static int writer_running;
+
+// FNV-1a hash of a name
+static uint64_t hash_name(const char *name, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// Name of a file relative to the served root, also for files that no longer exist
+static void relative_name(const char *filename, char *name, size_t size) {
+    char resolved[PATH_MAX];
+    const char *path = realpath(filename, resolved) ? resolved : filename;
+    size_t root_length = strlen(root);
+    if (strncmp(path, root, root_length) == 0 && path[root_length] == '/')
+        path += root_length + 1;
+    while (strncmp(path, "./", 2) == 0)
+        path += 2;
+    size_t length = strlen(path) < size ? strlen(path) : size - 1;
+    memcpy(name, path, length);
+    name[length] = '\0';
+}
+
+static void segment_path(unsigned number, const char *suffix, char *path) {
+    snprintf(path, PATH_MAX, "%s/%08u%s", store_path, number, suffix);
+}
+
+static active_file_t *find_active(const active_index_t *index, const char *name, size_t length, uint64_t hash) {
+    if (!index->bucket_count)
+        return NULL;
+    for (active_file_t *file = index->buckets[hash & (index->bucket_count - 1)]; file; file = file->next) {
+        if (file->hash == hash && strncmp(file->name, name, length) == 0 && file->name[length] == '\0')
+            return file;
+    }
+    return NULL;
+}
+
+// Index a record of the segment being written
+static int active_add(active_index_t *index, const char *name, size_t length, int64_t time, uint64_t offset) {
+    uint64_t hash = hash_name(name, length);
+    active_file_t *file = find_active(index, name, length, hash);
+    if (!file) {
+        if (index->file_count >= index->bucket_count) {
+            uint32_t count = index->bucket_count ? index->bucket_count * 2 : 1024;
+            active_file_t **buckets = (active_file_t **)calloc(count, sizeof(active_file_t *));
+            if (!buckets)
+                return 0;
+            for (uint32_t i = 0; i < index->bucket_count; i++) {
+                while (index->buckets[i]) {
+                    active_file_t *moved = index->buckets[i];
+                    index->buckets[i] = moved->next;
+                    moved->next = buckets[moved->hash & (count - 1)];
+                    buckets[moved->hash & (count - 1)] = moved;
+                }
+            }
+            free(index->buckets);
+            index->buckets = buckets;
+            index->bucket_count = count;
+        }
+        file = (active_file_t *)calloc(1, sizeof(active_file_t));
+        if (!file || !(file->name = strndup(name, length))) {
+            free(file);
+            return 0;
+        }
+        file->hash = hash;
+        file->next = index->buckets[hash & (index->bucket_count - 1)];
+        index->buckets[hash & (index->bucket_count - 1)] = file;
+        index->file_count++;
+    }
+    if (file->count == file->capacity) {
+        uint32_t capacity = file->capacity ? file->capacity * 2 : 4;
+        index_entry_t *grown = (index_entry_t *)realloc(file->entries, capacity * sizeof(index_entry_t));
+        if (!grown)
+            return 0;
+        file->entries = grown;
+        file->capacity = capacity;
+    }
+    file->entries[file->count].time = time;
+    file->entries[file->count].offset = offset;
+    file->count++;
+    index->record_count++;
+    return 1;
+}
+
+static void active_free(active_index_t *index) {
+    for (uint32_t i = 0; i < index->bucket_count; i++) {
+        while (index->buckets[i]) {
+            active_file_t *file = index->buckets[i];
+            index->buckets[i] = file->next;
+            free(file->name);
+            free(file->entries);
+            free(file);
+        }
+    }
+    free(index->buckets);
+    memset(index, 0, sizeof(*index));
+}
+
+// Index every record of a segment, cutting a record a crash left incomplete
+static int scan_segment(segment_t *segment, active_index_t *index) {
+    struct stat st;
+    if (fstat(segment->fd, &st) != 0)
+        return 0;
+    segment->size = 0;
+    if (st.st_size == 0)
+        return 1;
+
+    char *data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, segment->fd, 0);
+    if (data == MAP_FAILED)
+        return 0;
+    off_t pos = 0;
+    while (pos + (off_t)sizeof(record_header_t) <= st.st_size) {
+        record_header_t header;
+        memcpy(&header, data + pos, sizeof(header));
+        if (header.size != sizeof(header) + header.filename_length + header.change_length + header.details_length || header.size > MAX_RECORD || pos + header.size > st.st_size)
+            break;
+        if (!active_add(index, data + pos + sizeof(header), header.filename_length, header.time, pos))
+            break;
+        if (index->record_count == 1)
+            segment->first_time = header.time;
+        segment->last_time = header.time;
+        pos += header.size;
+    }
+    munmap(data, st.st_size);
+    if (pos < st.st_size && ftruncate(segment->fd, pos) != 0)
+        perror("Could not repair a history segment");
+    segment->size = pos;
+    return 1;
+}
+
+// Map the sealed index of a segment
+static int map_index(segment_t *segment) {
+    char path[PATH_MAX];
+    segment_path(segment->number, INDEX_SUFFIX, path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    void *map = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(index_header_t) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    const index_header_t *header = (const index_header_t *)map;
+    size_t expected = sizeof(index_header_t) + header->file_count * sizeof(index_file_t) + header->record_count * sizeof(index_entry_t) + header->names_size;
+    if (memcmp(header->magic, HISTORY_INDEX_MAGIC, sizeof(header->magic)) != 0 || expected != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+    segment->map = map;
+    segment->map_size = st.st_size;
+    segment->header = header;
+    segment->files = (const index_file_t *)(header + 1);
+    segment->entries = (const index_entry_t *)(segment->files + header->file_count);
+    segment->names = (const char *)(segment->entries + header->record_count);
+    segment->first_time = header->first_time;
+    segment->last_time = header->last_time;
+    return 1;
+}
+
+static int compare_active(const void *a, const void *b) {
+    const active_file_t *first = *(const active_file_t *const *)a, *second = *(const active_file_t *const *)b;
+    if (first->hash != second->hash)
+        return first->hash < second->hash ? -1 : 1;
+    return strcmp(first->name, second->name);
+}
+
+// Write the index of a segment from its in-memory form and map it
+static int seal_segment(segment_t *segment, const active_index_t *index) {
+    active_file_t **files = (active_file_t **)malloc((index->file_count + 1) * sizeof(active_file_t *));
+    if (!files)
+        return 0;
+    uint32_t count = 0;
+    uint64_t names_size = 0;
+    for (uint32_t i = 0; i < index->bucket_count; i++) {
+        for (active_file_t *file = index->buckets[i]; file; file = file->next) {
+            files[count++] = file;
+            names_size += strlen(file->name);
+        }
+    }
+    if (count > 0)
+        qsort(files, count, sizeof(active_file_t *), compare_active);
+
+    char path[PATH_MAX], temp_path[PATH_MAX + 8];
+    segment_path(segment->number, INDEX_SUFFIX, path);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *out = fopen(temp_path, "wb");
+    if (!out) {
+        perror("Could not write a history index");
+        free(files);
+        return 0;
+    }
+    index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HISTORY_INDEX_MAGIC, sizeof(header.magic));
+    header.file_count = count;
+    header.record_count = index->record_count;
+    header.first_time = segment->first_time;
+    header.last_time = segment->last_time;
+    header.names_size = names_size;
+    fwrite(&header, sizeof(header), 1, out);
+
+    uint32_t first = 0, name_offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        index_file_t entry = { files[i]->hash, name_offset, (uint32_t)strlen(files[i]->name), first, files[i]->count };
+        fwrite(&entry, sizeof(entry), 1, out);
+        first += files[i]->count;
+        name_offset += entry.name_length;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        fwrite(files[i]->entries, sizeof(index_entry_t), files[i]->count, out);
+    for (uint32_t i = 0; i < count; i++)
+        fputs(files[i]->name, out);
+    free(files);
+
+    int ok = !ferror(out);
+    if (fclose(out) != 0 || !ok || rename(temp_path, path) != 0) {
+        perror("Could not write a history index");
+        unlink(temp_path);
+        return 0;
+    }
+    return map_index(segment);
+}
+
+static segment_t *add_segment(unsigned number) {
+    segment_t *grown = (segment_t *)realloc(segments, (segment_count + 1) * sizeof(segment_t));
+    if (!grown)
+        return NULL;
+    segments = grown;
+    segment_t *segment = &segments[segment_count];
+    memset(segment, 0, sizeof(*segment));
+    segment->number = number;
+
+    char path[PATH_MAX];
+    segment_path(number, SEGMENT_SUFFIX, path);
+    segment->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (segment->fd < 0) {
+        perror("Could not open a history segment");
+        return NULL;
+    }
+    segment_count++;
+    return segment;
+}
+
+static int compare_numbers(const void *a, const void *b) {
+    unsigned first = *(const unsigned *)a, second = *(const unsigned *)b;
+    return first < second ? -1 : first > second;
+}
+
+int history_init(const char *dirname) {
+    if (!realpath(dirname, root) || snprintf(store_path, sizeof(store_path), "%s/%s", root, HISTORY_DIR) >= (int)sizeof(store_path))
+        return 0;
+    if (mkdir(store_path, 0755) < 0 && errno != EEXIST) {
+        perror("Could not create the history");
+        return 0;
+    }
+    DIR *dir = opendir(store_path);
+    if (!dir) {
+        perror("Could not open the history");
+        return 0;
+    }
+    unsigned *numbers = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned number;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%u%7s", &number, suffix) != 2 || strcmp(suffix, SEGMENT_SUFFIX) != 0)
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            unsigned *grown = (unsigned *)realloc(numbers, capacity * sizeof(unsigned));
+            if (!grown)
+                break;
+            numbers = grown;
+        }
+        numbers[count++] = number;
+    }
+    closedir(dir);
+    if (count > 0) /* numbers is NULL for an empty history */
+        qsort(numbers, count, sizeof(unsigned), compare_numbers);
+
+    // Sealed segments are only mapped; one left without an index by a crash is indexed again
+    long records = 0;
+    pthread_rwlock_wrlock(&history_lock);
+    for (size_t i = 0; i < count; i++) {
+        segment_t *segment = add_segment(numbers[i]);
+        if (!segment)
+            continue;
+        if (map_index(segment)) {
+            records += segment->header->record_count;
+            continue;
+        }
+        if (!scan_segment(segment, &active))
+            perror("Could not read a history segment");
+        records += active.record_count;
+        if (i + 1 < count) {
+            seal_segment(segment, &active);
+            active_free(&active);
+        }
+    }
+    free(numbers);
+    if (segment_count == 0 || segments[segment_count - 1].map) /* Start a new segment to write */
+        add_segment(segment_count ? segments[segment_count - 1].number + 1 : 1);
+    pthread_rwlock_unlock(&history_lock);
+    return (int)records;
+}
+
+// Append whole records to the segment being written and index them; the store is locked
+static int append_run(segment_t *segment, const char *data, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t written = write(segment->fd, data + done, length - done);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            perror("Could not write the history");
+            if (done > 0 && ftruncate(segment->fd, segment->size) != 0) /* No record may be left cut */
+                perror("Could not repair a history segment");
+            return 0;
+        }
+        done += written;
+    }
+    for (size_t pos = 0; pos < length;) {
+        record_header_t header;
+        memcpy(&header, data + pos, sizeof(header));
+        if (active.record_count == 0)
+            segment->first_time = header.time;
+        segment->last_time = header.time;
+        active_add(&active, data + pos + sizeof(header), header.filename_length, header.time, segment->size);
+        segment->size += header.size;
+        pos += header.size;
+    }
+    return 1;
+}
+
+// Write a batch of records, sealing the segment each time it fills up
+static void write_records(char *data, size_t length) {
+    pthread_rwlock_wrlock(&history_lock);
+    if (segment_count == 0) {
+        pthread_rwlock_unlock(&history_lock);
+        return;
+    }
+    segment_t *segment = &segments[segment_count - 1];
+    int64_t last_time = segment->last_time;
+    size_t start = 0, end = 0;
+    int sealable = 1;
+    while (end < length) {
+        record_header_t header;
+        memcpy(&header, data + end, sizeof(header));
+        off_t size = segment->size + (off_t)(end - start);
+        if (sealable && size > 0 && size + header.size > HISTORY_SEGMENT_SIZE) {
+            int written = end == start || append_run(segment, data + start, end - start);
+            start = end;
+            if (!written)
+                break;
+            if (!seal_segment(segment, &active)) {
+                sealable = 0; /* Keep writing to it, the next batch tries again */
+                continue;
+            }
+            active_free(&active);
+            if (!(segment = add_segment(segment->number + 1)))
+                break;
+            segment->last_time = last_time;
+            continue;
+        }
+
+        // Times never go back inside the store, so that a seek by time is a binary search
+        if (header.time < last_time) {
+            header.time = last_time;
+            memcpy(data + end, &header, sizeof(header));
+        }
+        last_time = header.time;
+        end += header.size;
+    }
+    if (segment && end > start)
+        append_run(segment, data + start, end - start);
+    pthread_rwlock_unlock(&history_lock);
+}
+
+static void *writer_thread(void *arg) {
+    static int current;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_length == 0)
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        char *data = queue;
+        size_t length = queue_length;
+        unsigned long count = queued_count;
+        current ^= 1;
+        queue = queue_buffers[current];
+        queue_length = 0;
+        pthread_mutex_unlock(&queue_lock);
+
+        write_records(data, length);
+
+        pthread_mutex_lock(&queue_lock);
+        written_count = count;
+        pthread_cond_broadcast(&queue_written);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return arg;
+}
+
+static void start_writer(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_thread, NULL) == 0) {
+        pthread_detach(thread);
+        pthread_mutex_lock(&queue_lock);
+        writer_running = 1;
+        pthread_mutex_unlock(&queue_lock);
+        atexit(history_flush);
+    } else {
+        perror("Could not start the history writer");
+    }
+}
+
+void history_append(const char *filename, const char *change_type, const char *details) {
+    ChangeLog change;
+    relative_name(filename, change.filename, sizeof(change.filename));
+    snprintf(change.change_type, sizeof(change.change_type), "%s", change_type);
+    snprintf(change.details, sizeof(change.details), "%s", details);
+    change.timestamp = time(NULL);
+
+    record_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.filename_length = (uint16_t)strlen(change.filename);
+    header.change_length = (uint16_t)strlen(change.change_type);
+    header.details_length = (uint32_t)strlen(change.details);
+    header.size = sizeof(header) + header.filename_length + header.change_length + header.details_length;
+    header.time = (int64_t)change.timestamp; /* Raised by the writer if an earlier record is later */
+
+    char record[MAX_RECORD];
+    char *pos = record + sizeof(header);
+    memcpy(record, &header, sizeof(header));
+    memcpy(pos, change.filename, header.filename_length);
+    pos += header.filename_length;
+    memcpy(pos, change.change_type, header.change_length);
+    pos += header.change_length;
+    memcpy(pos, change.details, header.details_length);
+
+    pthread_once(&writer_once, start_writer);
+    if (!writer_running) { /* Without the thread the record is written here */
+        write_records(record, header.size);
+        return;
+    }
+
+    // Queue it for the writer, waiting only if it is that far behind
+    pthread_mutex_lock(&queue_lock);
+    while (queue_length + header.size > HISTORY_QUEUE_SIZE)
+        pthread_cond_wait(&queue_written, &queue_lock);
+    memcpy(queue + queue_length, record, header.size);
+    queue_length += header.size;
+    queued_count++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void history_flush(void) {
+    pthread_mutex_lock(&queue_lock);
+    unsigned long target = queued_count;
+    while (writer_running && written_count < target)
+        pthread_cond_wait(&queue_written, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// First entry at or after a time
+static uint32_t seek_time(const index_entry_t *entries, uint32_t count, int64_t since) {
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (entries[middle].time < since)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// Entries of a file in a sealed index, found by binary search on the hash
+static const index_file_t *find_sealed(const segment_t *segment, const char *name, uint64_t hash) {
+    uint32_t low = 0, high = segment->header->file_count;
+    size_t length = strlen(name);
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (segment->files[middle].hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    for (; low < segment->header->file_count && segment->files[low].hash == hash; low++) {
+        const index_file_t *file = &segment->files[low];
+        if (file->name_length == length && memcmp(segment->names + file->name_offset, name, length) == 0)
+            return file;
+    }
+    return NULL;
+}
+
+static int add_positions(position_t **positions, size_t *count, size_t *capacity, int fd, const index_entry_t *entries, uint32_t entry_count, int64_t since) {
+    for (uint32_t i = seek_time(entries, entry_count, since); i < entry_count; i++) {
+        if (*count == *capacity) {
+            size_t grown_capacity = *capacity ? *capacity * 2 : 64;
+            position_t *grown = (position_t *)realloc(*positions, grown_capacity * sizeof(position_t));
+            if (!grown)
+                return 0;
+            *positions = grown;
+            *capacity = grown_capacity;
+        }
+        (*positions)[*count].fd = fd;
+        (*positions)[*count].offset = entries[i].offset;
+        (*count)++;
+    }
+    return 1;
+}
+
+// Read a record back into a ChangeLog
+static int read_record(int fd, uint64_t offset, ChangeLog *change) {
+    char record[MAX_RECORD];
+    ssize_t length = pread(fd, record, sizeof(record), (off_t)offset);
+    record_header_t header;
+    if (length < (ssize_t)sizeof(header))
+        return 0;
+    memcpy(&header, record, sizeof(header));
+    if (header.size > (size_t)length || header.filename_length >= sizeof(change->filename) || header.change_length >= sizeof(change->change_type) || header.details_length >= sizeof(change->details))
+        return 0;
+
+    const char *pos = record + sizeof(header);
+    memcpy(change->filename, pos, header.filename_length);
+    change->filename[header.filename_length] = '\0';
+    pos += header.filename_length;
+    memcpy(change->change_type, pos, header.change_length);
+    change->change_type[header.change_length] = '\0';
+    pos += header.change_length;
+    memcpy(change->details, pos, header.details_length);
+    change->details[header.details_length] = '\0';
+    change->timestamp = (time_t)header.time;
+    return 1;
+}
+
+long history_query(const char *filename, time_t since, history_callback callback, void *arg) {
+    char name[sizeof(((ChangeLog *)0)->filename)];
+    relative_name(filename, name, sizeof(name));
+    uint64_t hash = hash_name(name, strlen(name));
+
+    // Positions are collected under the lock and the records read after it, segments are append-only
+    history_flush(); /* Changes recorded before the query are part of its answer */
+    position_t *positions = NULL;
+    size_t count = 0, capacity = 0;
+    pthread_rwlock_rdlock(&history_lock);
+    for (size_t i = 0; i < segment_count; i++) {
+        const segment_t *segment = &segments[i];
+        if (segment->last_time < (int64_t)since)
+            continue;
+        if (segment->map) {
+            const index_file_t *file = find_sealed(segment, name, hash);
+            if (file)
+                add_positions(&positions, &count, &capacity, segment->fd, segment->entries + file->first, file->count, since);
+        } else {
+            const active_file_t *file = find_active(&active, name, strlen(name), hash);
+            if (file)
+                add_positions(&positions, &count, &capacity, segment->fd, file->entries, file->count, since);
+        }
+    }
+    pthread_rwlock_unlock(&history_lock);
+
+    long found = 0;
+    for (size_t i = 0; i < count; i++) {
+        ChangeLog change;
+        if (read_record(positions[i].fd, positions[i].offset, &change)) {
+            callback(&change, arg);
+            found++;
+        }
+    }
+    free(positions);
+    return found;
+}
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include "jbatch.h"
+
+struct jbatch_node {
+    const jquery_instr_t *instr; /* Step leading to this node, NULL for the root */
+    jbatch_node_t **children;
+    int child_count;
+    int *ends; /* Queries whose last step is this node */
+    int end_count;
+};
+
+// Two steps can share a trie node if they select exactly the same values
+static int same_instr(const jquery_instr_t *a, const jquery_instr_t *b) {
+    if (a->op != b->op || a->from != b->from || a->to != b->to || a->name_len != b->name_len)
+        return 0;
+    if (a->name_len && memcmp(a->name, b->name, a->name_len))
+        return 0;
+    if ((a->name == NULL) != (b->name == NULL))
+        return 0;
+    if (a->op != JQUERY_FILTER)
+        return 1;
+    if (a->literal_type != b->literal_type)
+        return 0;
+    if (a->literal_type == JSON_TYPE_NUMBER)
+        return a->number == b->number;
+    if (a->literal_type == JSON_TYPE_STRING)
+        return a->literal_len == b->literal_len && !memcmp(a->literal, b->literal, a->literal_len);
+    return 1;
+}
+
+static jbatch_node_t *child_for(jbatch_node_t *node, const jquery_instr_t *instr) {
+    for (int i = 0; i < node->child_count; i++) {
+        if (same_instr(node->children[i]->instr, instr))
+            return node->children[i];
+    }
+
+    jbatch_node_t **children = (jbatch_node_t **)realloc(node->children, sizeof(jbatch_node_t *) * (node->child_count + 1));
+    if (!children)
+        return NULL;
+    node->children = children;
+
+    jbatch_node_t *child = (jbatch_node_t *)calloc(1, sizeof(jbatch_node_t));
+    if (!child)
+        return NULL;
+    child->instr = instr;
+    node->children[node->child_count++] = child;
+    return child;
+}
+
+static void free_node(jbatch_node_t *node) {
+    for (int i = 0; i < node->child_count; i++)
+        free_node(node->children[i]);
+    free(node->children);
+    free(node->ends);
+    free(node);
+}
+
+int jbatch_init(jbatch_t *batch, jquery_t **queries, int count) {
+    memset(batch, 0, sizeof(*batch));
+    if (count > JBATCH_MAX_PATHS)
+        return 0;
+
+    batch->root = (jbatch_node_t *)calloc(1, sizeof(jbatch_node_t));
+    batch->results = (jbatch_result_t *)calloc(count > 0 ? count : 1, sizeof(jbatch_result_t));
+    if (!batch->root || !batch->results) {
+        jbatch_free(batch);
+        return 0;
+    }
+    batch->count = count;
+
+    // Insert every query, steps shared with earlier queries reuse their nodes
+    for (int q = 0; q < count; q++) {
+        jbatch_node_t *node = batch->root;
+        for (int pc = 0; pc < queries[q]->length && node; pc++)
+            node = child_for(node, &queries[q]->code[pc]);
+
+        int *ends = node ? (int *)realloc(node->ends, sizeof(int) * (node->end_count + 1)) : NULL;
+        if (!ends) {
+            jbatch_free(batch);
+            return 0;
+        }
+        node->ends = ends;
+        node->ends[node->end_count++] = q;
+    }
+    return 1;
+}
+
+void jbatch_free(jbatch_t *batch) {
+    if (batch->root)
+        free_node(batch->root);
+    if (batch->results) {
+        for (int i = 0; i < batch->count; i++)
+            free(batch->results[i].matches);
+        free(batch->results);
+    }
+    memset(batch, 0, sizeof(*batch));
+}
+
+static void add_match(jbatch_t *batch, int query, const jspan_t *value) {
+    jbatch_result_t *result = &batch->results[query];
+    if (result->count == result->capacity) {
+        int capacity = result->capacity ? result->capacity * 2 : 4;
+        jspan_t *matches = (jspan_t *)realloc(result->matches, sizeof(jspan_t) * capacity);
+        if (!matches) {
+            batch->failed = 1;
+            return;
+        }
+        result->matches = matches;
+        result->capacity = capacity;
+    }
+    result->matches[result->count++] = *value;
+}
+
+static void visit(jbatch_t *batch, const jbatch_node_t *node, const jspan_t *value, const jindex_t *index);
+
+// Apply a recursive descent step to every member (or element, for `..*`) below `value`
+static void descend(jbatch_t *batch, const jbatch_node_t *child, const jspan_t *value, const jindex_t *index) {
+    const jquery_instr_t *instr = child->instr;
+    jcursor_t cursor;
+    jspan_t key, item;
+
+    if (!jcursor_enter(&cursor, value, index))
+        return;
+    if (jcursor_type(value) == JSON_TYPE_OBJECT) {
+        while (jcursor_next_member(&cursor, &key, &item)) {
+            if (!instr->name || jcursor_key_equals(&key, instr->name, instr->name_len))
+                visit(batch, child, &item, index);
+            descend(batch, child, &item, index);
+        }
+    } else {
+        while (jcursor_next_element(&cursor, &item)) {
+            if (!instr->name)
+                visit(batch, child, &item, index);
+            descend(batch, child, &item, index);
+        }
+    }
+}
+
+// Record the queries ending at `node`, then follow every branch of the trie from `value`
+static void visit(jbatch_t *batch, const jbatch_node_t *node, const jspan_t *value, const jindex_t *index) {
+    json_type type = jcursor_type(value);
+    char found[JBATCH_MAX_PATHS] = {0}; /* Member steps already matched, the first member with a name wins */
+    int keys = 0, wildcard = 0, positional = 0;
+    jcursor_t cursor;
+    jspan_t key, item;
+
+    for (int i = 0; i < node->end_count; i++)
+        add_match(batch, node->ends[i], value);
+
+    // Steps that need a pass of their own
+    for (int i = 0; i < node->child_count; i++) {
+        const jbatch_node_t *child = node->children[i];
+        switch (child->instr->op) {
+            case JQUERY_KEY: keys++; break;
+            case JQUERY_WILDCARD: wildcard = 1; break;
+            case JQUERY_INDEX:
+            case JQUERY_SLICE: positional = 1; break;
+            case JQUERY_DESCEND: descend(batch, child, value, index); break;
+            case JQUERY_FILTER:
+                if (!jcursor_enter(&cursor, value, index))
+                    break;
+                while (type == JSON_TYPE_OBJECT ? jcursor_next_member(&cursor, &key, &item) : jcursor_next_element(&cursor, &item)) {
+                    if (jquery_filter_accepts(child->instr, &item, index))
+                        visit(batch, child, &item, index);
+                }
+                break;
+        }
+    }
+
+    // One pass over the members serves every member and wildcard step
+    if (type == JSON_TYPE_OBJECT && (keys || wildcard) && jcursor_enter(&cursor, value, index)) {
+        while ((keys || wildcard) && jcursor_next_member(&cursor, &key, &item)) {
+            for (int i = 0; i < node->child_count; i++) {
+                const jbatch_node_t *child = node->children[i];
+                if (child->instr->op == JQUERY_WILDCARD) {
+                    visit(batch, child, &item, index);
+                } else if (child->instr->op == JQUERY_KEY && !found[i] && jcursor_key_equals(&key, child->instr->name, child->instr->name_len)) {
+                    found[i] = 1;
+                    keys--; /* Once every name was seen and nothing else needs the members, stop reading */
+                    visit(batch, child, &item, index);
+                }
+            }
+        }
+    }
+
+    // One pass over the elements serves every index, slice and wildcard step
+    if (type == JSON_TYPE_ARRAY && (positional || wildcard) && jcursor_enter(&cursor, value, index)) {
+        while (jcursor_next_element(&cursor, &item)) {
+            long position = cursor.count - 1;
+            for (int i = 0; i < node->child_count; i++) {
+                const jbatch_node_t *child = node->children[i];
+                const jquery_instr_t *instr = child->instr;
+                if (instr->op == JQUERY_WILDCARD || (instr->op == JQUERY_INDEX && instr->from == position) ||
+                    (instr->op == JQUERY_SLICE && position >= instr->from && (instr->to < 0 || position < instr->to)))
+                    visit(batch, child, &item, index);
+            }
+        }
+    }
+}
+
+int jbatch_run(jbatch_t *batch, const jspan_t *root, const jindex_t *index) {
+    visit(batch, batch->root, root, index);
+    return !batch->failed;
+}
@@ -0,0 +1,299 @@
+#include <string.h>
+#include "jcursor.h"
+
+static const char *skip_whitespace(const char *pos, const char *end) {
+    while (pos < end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t'))
+        pos++;
+    return pos;
+}
+
+// Return the position right after the closing quote of the string starting at `pos`
+static const char *skip_string(const char *pos, const char *end) {
+    pos++; /* Opening quote */
+    while (pos < end) {
+        const char *quote = memchr(pos, '"', end - pos);
+        if (!quote)
+            return NULL;
+
+        /* The quote is escaped if it follows an odd number of backslashes */
+        const char *back = quote;
+        while (back > pos && back[-1] == '\\')
+            back--;
+        if (((quote - back) & 1) == 0)
+            return quote + 1;
+        pos = quote + 1;
+    }
+    return NULL;
+}
+
+// Return the position right after the object or array starting at `pos`, by bracket matching
+static const char *skip_container(const char *pos, const char *end) {
+    int depth = 0;
+    while (pos < end) {
+        char c = *pos;
+        if (c == '"') {
+            pos = skip_string(pos, end);
+            if (!pos)
+                return NULL;
+            continue;
+        }
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0)
+                return pos + 1;
+        }
+        pos++;
+    }
+    return NULL;
+}
+
+const char *jcursor_skip_value(const char *pos, const char *end, const jindex_t *index) {
+    if (pos >= end)
+        return NULL;
+
+    switch (*pos) {
+        case '"':
+            return skip_string(pos, end);
+        case '{':
+        case '[': {
+            const char *after = jindex_skip_container(index, pos); /* Matching bracket recorded by the index */
+            return after ? after : skip_container(pos, end);
+        }
+        case 't':
+            return (end - pos >= 4 && !memcmp(pos, "true", 4)) ? pos + 4 : NULL;
+        case 'f':
+            return (end - pos >= 5 && !memcmp(pos, "false", 5)) ? pos + 5 : NULL;
+        case 'n':
+            return (end - pos >= 4 && !memcmp(pos, "null", 4)) ? pos + 4 : NULL;
+        default: {
+            const char *scan = pos; /* Numbers run until the next separator */
+            while (scan < end && (*scan == '-' || *scan == '+' || *scan == '.' || *scan == 'e' || *scan == 'E' || (*scan >= '0' && *scan <= '9')))
+                scan++;
+            return scan > pos ? scan : NULL;
+        }
+    }
+}
+
+json_type jcursor_type(const jspan_t *value) {
+    if (!value->start || value->start >= value->end)
+        return JSON_TYPE_INVALID;
+
+    switch (*value->start) {
+        case '{': return JSON_TYPE_OBJECT;
+        case '[': return JSON_TYPE_ARRAY;
+        case '"': return JSON_TYPE_STRING;
+        case 't': return JSON_TYPE_TRUE;
+        case 'f': return JSON_TYPE_FALSE;
+        case 'n': return JSON_TYPE_NULL;
+        default: return JSON_TYPE_NUMBER;
+    }
+}
+
+int jcursor_document(const char *data, size_t size, jspan_t *root) {
+    const char *end = data + size;
+
+    /* Trim the whitespace around the top level value without scanning it */
+    root->start = skip_whitespace(data, end);
+    while (end > root->start && (end[-1] == ' ' || end[-1] == '\n' || end[-1] == '\r' || end[-1] == '\t' || end[-1] == '\0'))
+        end--;
+    root->end = end;
+
+    switch (jcursor_type(root)) {
+        case JSON_TYPE_OBJECT:
+            return end[-1] == '}' && end - root->start >= 2;
+        case JSON_TYPE_ARRAY:
+            return end[-1] == ']' && end - root->start >= 2;
+        case JSON_TYPE_INVALID:
+            return 0;
+        default: /* Scalars are short, check them completely */
+            return jcursor_skip_value(root->start, end, NULL) == end;
+    }
+}
+
+int jcursor_enter(jcursor_t *cursor, const jspan_t *container, const jindex_t *index) {
+    json_type type = jcursor_type(container);
+    if (type != JSON_TYPE_OBJECT && type != JSON_TYPE_ARRAY)
+        return 0;
+
+    cursor->pos = container->start + 1; /* After the opening bracket */
+    cursor->end = container->end - 1; /* The closing bracket */
+    cursor->count = 0;
+    cursor->index = index;
+    return 1;
+}
+
+// Move past the separator in front of the next member or element, returns 0 at the end of the container
+static int next_item(jcursor_t *cursor) {
+    const char *pos = skip_whitespace(cursor->pos, cursor->end);
+    if (pos >= cursor->end)
+        return 0;
+
+    if (cursor->count > 0) {
+        if (*pos != ',') { /* Malformed container, stop iterating */
+            cursor->pos = cursor->end;
+            return 0;
+        }
+        pos = skip_whitespace(pos + 1, cursor->end);
+    }
+    cursor->pos = pos;
+    return pos < cursor->end;
+}
+
+int jcursor_next_member(jcursor_t *cursor, jspan_t *key, jspan_t *value) {
+    if (!next_item(cursor) || *cursor->pos != '"')
+        return 0;
+
+    const char *pos = skip_string(cursor->pos, cursor->end);
+    if (!pos)
+        return 0;
+    key->start = cursor->pos + 1;
+    key->end = pos - 1;
+
+    pos = skip_whitespace(pos, cursor->end);
+    if (pos >= cursor->end || *pos != ':')
+        return 0;
+    pos = skip_whitespace(pos + 1, cursor->end);
+
+    value->start = pos;
+    value->end = jcursor_skip_value(pos, cursor->end, cursor->index);
+    if (!value->end)
+        return 0;
+
+    cursor->pos = value->end;
+    cursor->count++;
+    return 1;
+}
+
+int jcursor_next_element(jcursor_t *cursor, jspan_t *value) {
+    if (!next_item(cursor))
+        return 0;
+
+    value->start = cursor->pos;
+    value->end = jcursor_skip_value(cursor->pos, cursor->end, cursor->index);
+    if (!value->end)
+        return 0;
+
+    cursor->pos = value->end;
+    cursor->count++;
+    return 1;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int read_hex4(const char *pos, const char *end, unsigned int *code) {
+    if (end - pos < 4)
+        return 0;
+    *code = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_value(pos[i]);
+        if (digit < 0)
+            return 0;
+        *code = (*code << 4) | digit;
+    }
+    return 1;
+}
+
+// Decode the escape sequence at `*pos` (just after the backslash) into UTF-8, returns the number of bytes
+int jcursor_decode_escape(const char **pos, const char *end, char out[4]) {
+    char c = *(*pos)++;
+    switch (c) {
+        case 'b': out[0] = '\b'; return 1;
+        case 'f': out[0] = '\f'; return 1;
+        case 'n': out[0] = '\n'; return 1;
+        case 'r': out[0] = '\r'; return 1;
+        case 't': out[0] = '\t'; return 1;
+        case '"': case '\\': case '/': out[0] = c; return 1;
+        case 'u': break;
+        default: return 0;
+    }
+
+    unsigned int code;
+    if (!read_hex4(*pos, end, &code))
+        return 0;
+    *pos += 4;
+    if (code >= 0xD800 && code <= 0xDBFF) { /* Surrogate pair */
+        unsigned int low;
+        if (end - *pos < 6 || (*pos)[0] != '\\' || (*pos)[1] != 'u' || !read_hex4(*pos + 2, end, &low))
+            return 0;
+        *pos += 6;
+        code = 0x10000 + (((code & 0x3FF) << 10) | (low & 0x3FF));
+    }
+
+    if (code < 0x80) {
+        out[0] = code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = 0xC0 | (code >> 6);
+        out[1] = 0x80 | (code & 0x3F);
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = 0xE0 | (code >> 12);
+        out[1] = 0x80 | ((code >> 6) & 0x3F);
+        out[2] = 0x80 | (code & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (code >> 18);
+    out[1] = 0x80 | ((code >> 12) & 0x3F);
+    out[2] = 0x80 | ((code >> 6) & 0x3F);
+    out[3] = 0x80 | (code & 0x3F);
+    return 4;
+}
+
+int jcursor_key_equals(const jspan_t *key, const char *name, size_t name_len) {
+    size_t key_len = key->end - key->start;
+
+    if (!memchr(key->start, '\\', key_len)) /* Common case, the raw bytes are the key */
+        return key_len == name_len && !memcmp(key->start, name, name_len);
+
+    const char *pos = key->start;
+    size_t matched = 0;
+    while (pos < key->end) {
+        char decoded[4];
+        int decoded_len = 1;
+        if (*pos == '\\') {
+            pos++;
+            decoded_len = jcursor_decode_escape(&pos, key->end, decoded);
+            if (decoded_len == 0)
+                return 0;
+        } else {
+            decoded[0] = *pos++;
+        }
+        if (matched + decoded_len > name_len || memcmp(name + matched, decoded, decoded_len))
+            return 0;
+        matched += decoded_len;
+    }
+    return matched == name_len;
+}
+
+int jcursor_find_key(const jspan_t *object, const jindex_t *index, const char *name, size_t name_len, jspan_t *value) {
+    jcursor_t cursor;
+    jspan_t key;
+
+    if (jcursor_type(object) != JSON_TYPE_OBJECT || !jcursor_enter(&cursor, object, index))
+        return 0;
+    while (jcursor_next_member(&cursor, &key, value)) {
+        if (jcursor_key_equals(&key, name, name_len)) /* First match wins, like cJSON */
+            return 1;
+    }
+    return 0;
+}
+
+int jcursor_find_index(const jspan_t *array, const jindex_t *index, int position, jspan_t *value) {
+    jcursor_t cursor;
+
+    if (position < 0 || jcursor_type(array) != JSON_TYPE_ARRAY || !jcursor_enter(&cursor, array, index))
+        return 0;
+    while (jcursor_next_element(&cursor, value)) {
+        if (cursor.count - 1 == position)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,406 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "jindex.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JINDEX_X86 1
+#endif
+
+/* Bit masks describing one 64 byte block, bit i is byte i of the block */
+typedef struct {
+    uint64_t backslash; /* '\\' */
+    uint64_t quote; /* '"' */
+    uint64_t op; /* { } [ ] : , */
+    uint64_t control; /* Bytes below 0x20 */
+    uint64_t space; /* ' ', '\t', '\n' and '\r' */
+    uint64_t high; /* Bytes with the high bit set (non ASCII) */
+} block_masks_t;
+
+typedef void (*classify_fn)(const unsigned char *block, block_masks_t *masks);
+
+static void classify_scalar(const unsigned char *block, block_masks_t *masks) {
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = 1ULL << i;
+        unsigned char c = block[i];
+        if (c == '\\') masks->backslash |= bit;
+        else if (c == '"') masks->quote |= bit;
+        else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') masks->op |= bit;
+        else if (c == ' ') masks->space |= bit;
+        else if (c >= 0x80) masks->high |= bit;
+        if (c < 0x20) masks->control |= bit;
+        if (c == '\t' || c == '\n' || c == '\r') masks->space |= bit;
+    }
+}
+
+#ifdef JINDEX_X86
+static void classify_sse2(const unsigned char *block, block_masks_t *masks) {
+    const __m128i backslash = _mm_set1_epi8('\\'), quote = _mm_set1_epi8('"');
+    const __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}'), case_bit = _mm_set1_epi8(0x20);
+    const __m128i colon = _mm_set1_epi8(':'), comma = _mm_set1_epi8(','), control = _mm_set1_epi8(0x1F);
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), newline = _mm_set1_epi8('\n'), carriage = _mm_set1_epi8('\r');
+
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+        __m128i folded = _mm_or_si128(v, case_bit); /* '[' and ']' differ from '{' and '}' only by 0x20 */
+        __m128i op = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+        __m128i blank = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+                                     _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, carriage)));
+        int shift = 16 * i;
+
+        masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash)) << shift;
+        masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << shift;
+        masks->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << shift;
+        masks->control |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, control), v)) << shift;
+        masks->space |= (uint64_t)(uint16_t)_mm_movemask_epi8(blank) << shift;
+        masks->high |= (uint64_t)(uint16_t)_mm_movemask_epi8(v) << shift;
+    }
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const unsigned char *block, block_masks_t *masks) {
+    const __m256i backslash = _mm256_set1_epi8('\\'), quote = _mm256_set1_epi8('"');
+    const __m256i open = _mm256_set1_epi8('{'), close = _mm256_set1_epi8('}'), case_bit = _mm256_set1_epi8(0x20);
+    const __m256i colon = _mm256_set1_epi8(':'), comma = _mm256_set1_epi8(','), control = _mm256_set1_epi8(0x1F);
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), newline = _mm256_set1_epi8('\n'), carriage = _mm256_set1_epi8('\r');
+
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(block + 32 * i));
+        __m256i folded = _mm256_or_si256(v, case_bit);
+        __m256i op = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(folded, open), _mm256_cmpeq_epi8(folded, close)),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, comma)));
+        __m256i blank = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(v, newline), _mm256_cmpeq_epi8(v, carriage)));
+        int shift = 32 * i;
+
+        masks->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, backslash)) << shift;
+        masks->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)) << shift;
+        masks->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << shift;
+        masks->control |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v)) << shift;
+        masks->space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(blank) << shift;
+        masks->high |= (uint64_t)(uint32_t)_mm256_movemask_epi8(v) << shift;
+    }
+}
+#endif
+
+/* Kernel picked once for the running CPU */
+static classify_fn classify = classify_scalar;
+static const char *classify_name = "scalar";
+static pthread_once_t classify_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void) {
+#ifdef JINDEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        classify = classify_avx2;
+        classify_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        classify = classify_sse2;
+        classify_name = "sse2";
+    }
+#endif
+}
+
+const char *jindex_implementation(void) {
+    pthread_once(&classify_once, select_kernel);
+    return classify_name;
+}
+
+// Bytes escaped by an odd run of backslashes, carrying runs across blocks (simdjson's algorithm)
+static uint64_t find_escaped(uint64_t backslash, uint64_t *prev_ends_odd) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    const uint64_t odd_bits = ~even_bits;
+
+    uint64_t start_edges = backslash & ~(backslash << 1);
+    uint64_t even_start_mask = even_bits ^ *prev_ends_odd;
+    uint64_t even_starts = start_edges & even_start_mask;
+    uint64_t odd_starts = start_edges & ~even_start_mask;
+    uint64_t even_carries = backslash + even_starts;
+    uint64_t odd_carries = backslash + odd_starts;
+    int ends_odd = odd_carries < backslash; /* The addition overflowed into the next block */
+
+    odd_carries |= *prev_ends_odd;
+    *prev_ends_odd = ends_odd ? 1 : 0;
+
+    uint64_t even_carry_ends = even_carries & ~backslash;
+    uint64_t odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+}
+
+// Running xor of the bits, turns quote positions into a mask of the bytes inside strings
+static uint64_t prefix_xor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+/* UTF-8 decoder state carried between blocks */
+typedef struct {
+    int pending; /* Continuation bytes still expected */
+    unsigned char low; /* Allowed range for the next continuation byte */
+    unsigned char high;
+} utf8_state_t;
+
+static int validate_utf8(const unsigned char *bytes, size_t len, utf8_state_t *state) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = bytes[i];
+        if (state->pending) {
+            if (c < state->low || c > state->high)
+                return 0;
+            state->low = 0x80;
+            state->high = 0xBF;
+            state->pending--;
+            continue;
+        }
+        if (c < 0x80)
+            continue;
+
+        state->low = 0x80;
+        state->high = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            state->pending = 1;
+        } else if (c == 0xE0) { /* No overlong three byte forms */
+            state->pending = 2;
+            state->low = 0xA0;
+        } else if (c == 0xED) { /* No surrogates */
+            state->pending = 2;
+            state->high = 0x9F;
+        } else if (c >= 0xE1 && c <= 0xEF) {
+            state->pending = 2;
+        } else if (c == 0xF0) { /* No overlong four byte forms */
+            state->pending = 3;
+            state->low = 0x90;
+        } else if (c >= 0xF1 && c <= 0xF3) {
+            state->pending = 3;
+        } else if (c == 0xF4) { /* Nothing above U+10FFFF */
+            state->pending = 3;
+            state->high = 0x8F;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* What may come next, checked on every structural character and on the first byte of every scalar */
+typedef enum {
+    EXPECT_VALUE, /* The document, after ':' or after ',' in an array */
+    EXPECT_VALUE_OR_CLOSE, /* After '[' */
+    EXPECT_KEY, /* After ',' in an object */
+    EXPECT_KEY_OR_CLOSE, /* After '{' */
+    EXPECT_COLON, /* After a key */
+    EXPECT_COMMA_OR_CLOSE, /* After a value inside a container */
+    EXPECT_END /* After the top level value */
+} expect_t;
+
+static int index_grow(jindex_t *index) {
+    size_t capacity = index->capacity * 2;
+    uint32_t *positions = (uint32_t *)realloc(index->positions, sizeof(uint32_t) * capacity);
+    if (!positions)
+        return 0;
+    index->positions = positions;
+
+    uint32_t *matches = (uint32_t *)realloc(index->matches, sizeof(uint32_t) * capacity);
+    if (!matches)
+        return 0;
+    index->matches = matches;
+
+    index->capacity = capacity;
+    return 1;
+}
+
+jindex_status jindex_build(jindex_t *index, const char *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint64_t prev_escaped = 0, prev_in_string = 0, prev_scalar = 0;
+    utf8_state_t utf8 = {0, 0x80, 0xBF};
+    uint32_t stack[JINDEX_MAX_DEPTH]; /* Slots of the brackets still open */
+    int depth = 0;
+    expect_t expect = EXPECT_VALUE;
+    jindex_status status = JINDEX_OK;
+
+    pthread_once(&classify_once, select_kernel);
+
+    memset(index, 0, sizeof(*index));
+    index->data = data;
+    index->size = size;
+    if (size >= UINT32_MAX)
+        return JINDEX_ERROR_TOO_LARGE;
+
+    index->capacity = size / 8 + 64;
+    index->positions = (uint32_t *)malloc(sizeof(uint32_t) * index->capacity);
+    index->matches = (uint32_t *)malloc(sizeof(uint32_t) * index->capacity);
+    if (!index->positions || !index->matches) {
+        jindex_free(index);
+        return JINDEX_ERROR_MEMORY;
+    }
+
+    for (size_t offset = 0; offset < size && status == JINDEX_OK; offset += 64) {
+        const unsigned char *block = bytes + offset;
+        unsigned char tail[64];
+        size_t block_len = size - offset;
+        block_masks_t masks;
+
+        if (block_len < 64) { /* Pad the last block with whitespace */
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, block_len);
+            block = tail;
+        } else {
+            block_len = 64;
+        }
+
+        classify(block, &masks);
+
+        uint64_t escaped = find_escaped(masks.backslash, &prev_escaped);
+        uint64_t quotes = masks.quote & ~escaped;
+        uint64_t in_string = prefix_xor(quotes) ^ prev_in_string; /* Opening quotes included, closing quotes excluded */
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        if (masks.control & in_string) {
+            status = JINDEX_ERROR_STRING;
+            break;
+        }
+        if (masks.backslash & ~in_string) { /* Escapes only exist inside strings */
+            status = JINDEX_ERROR_STRUCTURE;
+            break;
+        }
+        if ((masks.high || utf8.pending) && !validate_utf8(block, block_len, &utf8)) { /* ASCII blocks skip the decoder */
+            status = JINDEX_ERROR_UTF8;
+            break;
+        }
+
+        if (masks.control & ~masks.space & ~in_string) { /* Control characters outside strings */
+            status = JINDEX_ERROR_STRUCTURE;
+            break;
+        }
+
+        // Scalars (numbers, true, false, null) are runs of the other bytes outside strings, only their first byte is checked
+        uint64_t scalar = ~(masks.op | masks.quote | masks.space | in_string);
+        uint64_t scalar_starts = scalar & ~((scalar << 1) | prev_scalar);
+        prev_scalar = scalar >> 63;
+
+        uint64_t structurals = (masks.op & ~in_string) | (quotes & in_string);
+        uint64_t tokens = structurals | scalar_starts;
+        while (tokens) {
+            uint64_t bit = tokens & -tokens;
+            uint32_t position = (uint32_t)(offset + __builtin_ctzll(tokens));
+            uint32_t slot = (uint32_t)index->count;
+            char c = data[position];
+            tokens &= tokens - 1;
+
+            if (bit & scalar_starts) { /* Not recorded, it only has to stand where a value may */
+                if (expect != EXPECT_VALUE && expect != EXPECT_VALUE_OR_CLOSE) {
+                    status = JINDEX_ERROR_STRUCTURE;
+                    break;
+                }
+                expect = depth ? EXPECT_COMMA_OR_CLOSE : EXPECT_END;
+                continue;
+            }
+            if (index->count == index->capacity && !index_grow(index)) {
+                status = JINDEX_ERROR_MEMORY;
+                break;
+            }
+            index->positions[slot] = position;
+            index->matches[slot] = slot;
+            index->count++;
+
+            int valid;
+            if (c == '{' || c == '[') {
+                valid = expect == EXPECT_VALUE || expect == EXPECT_VALUE_OR_CLOSE;
+                if (valid && depth == JINDEX_MAX_DEPTH) {
+                    status = JINDEX_ERROR_DEPTH;
+                    break;
+                }
+                if (valid) {
+                    stack[depth++] = slot;
+                    expect = c == '{' ? EXPECT_KEY_OR_CLOSE : EXPECT_VALUE_OR_CLOSE;
+                }
+            } else if (c == '}' || c == ']') {
+                valid = depth > 0 && data[index->positions[stack[depth - 1]]] == (c == '}' ? '{' : '[') && /* Mismatched brackets */
+                        (expect == EXPECT_COMMA_OR_CLOSE || expect == (c == '}' ? EXPECT_KEY_OR_CLOSE : EXPECT_VALUE_OR_CLOSE));
+                if (valid) {
+                    index->matches[stack[--depth]] = slot;
+                    expect = depth ? EXPECT_COMMA_OR_CLOSE : EXPECT_END;
+                }
+            } else if (c == ':') {
+                valid = expect == EXPECT_COLON;
+                expect = EXPECT_VALUE;
+            } else if (c == ',') {
+                valid = expect == EXPECT_COMMA_OR_CLOSE;
+                expect = depth && data[index->positions[stack[depth - 1]]] == '{' ? EXPECT_KEY : EXPECT_VALUE;
+            } else if (expect == EXPECT_KEY || expect == EXPECT_KEY_OR_CLOSE) { /* A string: key or value */
+                valid = 1;
+                expect = EXPECT_COLON;
+            } else {
+                valid = expect == EXPECT_VALUE || expect == EXPECT_VALUE_OR_CLOSE;
+                expect = depth ? EXPECT_COMMA_OR_CLOSE : EXPECT_END;
+            }
+            if (!valid) {
+                status = JINDEX_ERROR_STRUCTURE;
+                break;
+            }
+        }
+    }
+
+    if (status == JINDEX_OK) {
+        if (prev_in_string)
+            status = JINDEX_ERROR_STRING;
+        else if (expect != EXPECT_END) /* Open brackets, or no value at all */
+            status = JINDEX_ERROR_STRUCTURE;
+        else if (utf8.pending)
+            status = JINDEX_ERROR_UTF8;
+    }
+
+    if (status != JINDEX_OK)
+        jindex_free(index);
+    return status;
+}
+
+void jindex_free(jindex_t *index) {
+    free(index->positions);
+    free(index->matches);
+    index->positions = NULL;
+    index->matches = NULL;
+    index->count = index->capacity = 0;
+}
+
+const char *jindex_skip_container(const jindex_t *index, const char *pos) {
+    if (!index || !index->positions || pos < index->data || pos >= index->data + index->size)
+        return NULL;
+
+    /* Binary search of the bracket among the structural positions */
+    uint32_t target = (uint32_t)(pos - index->data);
+    size_t low = 0, high = index->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (index->positions[middle] < target)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == index->count || index->positions[low] != target || index->matches[low] == low)
+        return NULL;
+
+    return index->data + index->positions[index->matches[low]] + 1;
+}
+
+const char *jindex_status_string(jindex_status status) {
+    switch (status) {
+        case JINDEX_OK: return "ok";
+        case JINDEX_ERROR_MEMORY: return "out of memory";
+        case JINDEX_ERROR_TOO_LARGE: return "document too large";
+        case JINDEX_ERROR_UTF8: return "invalid UTF-8";
+        case JINDEX_ERROR_STRING: return "unterminated string or control character in string";
+        case JINDEX_ERROR_STRUCTURE: return "unbalanced brackets or misplaced characters";
+        case JINDEX_ERROR_DEPTH: return "nesting too deep";
+    }
+    return "unknown error";
+}
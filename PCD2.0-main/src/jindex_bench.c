@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cJSON.h"
+#include "jindex.h"
+
+#define ROUNDS 20 /* Each file is processed this many times by each parser */
+
+// Function to read the entire file into a string
+static char *read_file(const char *filename, size_t *length) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        printf("Could not open file: %s\n", filename);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *content = (char *)malloc(*length + 1);
+    if (!content) {
+        fclose(file);
+        printf("Memory allocation failed\n");
+        return NULL;
+    }
+    *length = fread(content, 1, *length, file);
+    content[*length] = '\0';
+    fclose(file);
+    return content;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Print the throughput of one parser over `rounds` runs
+static void report(const char *name, size_t length, double seconds) {
+    double megabytes = (double)length * ROUNDS / (1024.0 * 1024.0);
+    printf("  %-14s %9.3f ms/run %9.1f MB/s\n", name, seconds * 1000.0 / ROUNDS, megabytes / seconds);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) { /* At least one file must be sent from the command line */
+        printf("Usage: %s <file.json> [file.json ...]\n", argv[0]);
+        return 1;
+    }
+
+    printf("Structural index kernel: %s\n", jindex_implementation());
+    for (int i = 1; i < argc; i++) {
+        size_t length;
+        char *json_string = read_file(argv[i], &length);
+        if (!json_string)
+            continue;
+
+        printf("%s (%zu bytes)\n", argv[i], length);
+
+        // Stage-1 indexing and validation
+        jindex_t index;
+        jindex_status status = JINDEX_OK;
+        double start = now_seconds();
+        for (int round = 0; round < ROUNDS && status == JINDEX_OK; round++) {
+            status = jindex_build(&index, json_string, length);
+            if (status == JINDEX_OK)
+                jindex_free(&index);
+        }
+        if (status != JINDEX_OK)
+            printf("  jindex_build   failed: %s\n", jindex_status_string(status));
+        else
+            report("jindex_build", length, now_seconds() - start);
+
+        // Full tree parse, what the server did before
+        int parsed = 1;
+        start = now_seconds();
+        for (int round = 0; round < ROUNDS && parsed; round++) {
+            cJSON *json = cJSON_Parse(json_string);
+            parsed = json != NULL;
+            cJSON_Delete(json);
+        }
+        if (!parsed)
+            printf("  cJSON_Parse    failed\n");
+        else
+            report("cJSON_Parse", length, now_seconds() - start);
+
+        free(json_string);
+    }
+    return 0;
+}
+/*
+gcc -O2 -o jindex_bench jindex_bench.c jindex.c -I../include -I/home/alex/cJSON -L/home/alex/cJSON -lcjson -lpthread
+./jindex_bench fisier1.json fisier2.json
+*/
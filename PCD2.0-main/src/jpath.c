@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "cJSON.h"
+#include "jquery.h"
 
 // Function to read the entire file into a string
 char *read_file(const char *filename) {
@@ -25,41 +26,47 @@ char *read_file(const char *filename) {
     return content; /* Return the content */
 }
 
-// Function to search cJSON object recursively based on JSON path
-void search_json(cJSON *json, const char *path) {
-    cJSON *current = json; /* Current cJSON node */
-
-    // Tokenize the JSON path
-    char *token = strtok((char *)path, ".");
-    while (token != NULL) { 
-        // Check if the token contains array indexing
-        char *index_str = strchr(token, '[');
-        if (index_str != NULL) {
-            // Separate array index from the rest of the token
-            *index_str = '\0'; // Terminate token at '['
-            int index = atoi(index_str + 1); // Extract array index
-            cJSON *array = cJSON_GetObjectItemCaseSensitive(current, token); /* Add the current token*/
-            if (array == NULL || !cJSON_IsArray(array)) { /* If the array is null, print an error message and exit */
-                printf("Path not found: %s\n", path);
-                return;
-            }
-            current = cJSON_GetArrayItem(array, index); /* Get the current cJSON node */
-        } else {
-            // Handle regular object key
-            current = cJSON_GetObjectItemCaseSensitive(current, token);
-        }
+// Function to print one match, only the value that was found is parsed
+int print_match(const jspan_t *value, void *arg) {
+    // Copy the value so cJSON sees a terminated string
+    size_t value_length = value->end - value->start;
+    char *value_string = (char *)malloc(value_length + 1);
+    if (!value_string) {
+        printf("Memory allocation failed\n");
+        return 0;
+    }
+    memcpy(value_string, value->start, value_length);
+    value_string[value_length] = '\0';
 
-        if (current == NULL) { /* If the node is null, print an error message and exit */
-            printf("Path not found: %s\n", path);
-            return;
-        }
-        token = strtok(NULL, "."); /* Mode to the next token */
+    cJSON *json = cJSON_Parse(value_string);
+    free(value_string);
+    if (json == NULL) {
+        printf("Error parsing JSON\n");
+        return 0;
     }
 
     // Print the result
-    char *result = cJSON_Print(current); 
+    char *result = cJSON_Print(json); 
     printf("Result: %s\n", result); /* Print the cJSON node */
     free(result); /* Free the memory allocated to the `result` */
+    cJSON_Delete(json);
+    return 1;
+}
+
+// Function to search the JSON text based on JSON path, printing every match
+void search_json(const char *json_string, size_t length, const jindex_t *index, const char *path) {
+    const char *error;
+    jspan_t root;
+
+    jquery_t *query = jquery_compile(path, &error); /* Compile the path once */
+    if (!query) {
+        printf("Invalid path: %s (%s)\n", path, error);
+        return;
+    }
+
+    if (!jcursor_document(json_string, length, &root) || jquery_run(query, &root, index, print_match, NULL) == 0)
+        printf("Path not found: %s\n", path);
+    jquery_free(query);
 }
 
 int main(int argc, char **argv) {
@@ -76,20 +83,23 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    cJSON *json = cJSON_Parse(json_string); /* Parse the json data */
-    free(json_string); /* Free the memroy allocated */
-
-    if (json == NULL) { /* If the data is null, print an error message and exit */
-        printf("Error parsing JSON\n");
+    jindex_t index;
+    size_t length = strlen(json_string);
+    jindex_status status = jindex_build(&index, json_string, length); /* Validate and index the json data */
+    if (status != JINDEX_OK) { /* If the data is not valid, print an error message and exit */
+        printf("Error parsing JSON: %s\n", jindex_status_string(status));
+        free(json_string);
         return 1;
     }
 
-    search_json(json, json_path); /* Search for the json file */
+    search_json(json_string, length, &index, json_path); /* Search for the json file */
 
-    cJSON_Delete(json); /* Delete the json node */
+    jindex_free(&index);
+    free(json_string); /* Free the memroy allocated */
     return 0;
 }
 /*
-gcc -o json_search jpath.c -I/home/alex/cJSON -L/home/alex/cJSON -lcjson
+gcc -o json_search jpath.c jquery.c jcursor.c jindex.c -I../include -I/home/alex/cJSON -L/home/alex/cJSON -lcjson -lpthread
 ./json_search numefisier.json store.book[0](numerotarea incepe de la 0, se parcurge cu .)
+./json_search numefisier.json "store.book[*].author"  (also [a:b], ..key, [?key=value])
 */
\ No newline at end of file
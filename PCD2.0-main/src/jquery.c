@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "jquery.h"
+
+// Add an instruction to the query, returns NULL when out of memory
+static jquery_instr_t *emit(jquery_t *query, jquery_opcode op, int *capacity) {
+    if (query->length == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 8;
+        jquery_instr_t *code = (jquery_instr_t *)realloc(query->code, sizeof(jquery_instr_t) * new_capacity);
+        if (!code)
+            return NULL;
+        query->code = code;
+        *capacity = new_capacity;
+    }
+    jquery_instr_t *instr = &query->code[query->length++];
+    memset(instr, 0, sizeof(*instr));
+    instr->op = op;
+    if (op != JQUERY_KEY && op != JQUERY_INDEX)
+        query->definite = 0;
+    return instr;
+}
+
+static char *copy_text(const char *start, size_t len) {
+    char *copy = (char *)malloc(len + 1);
+    if (copy) {
+        memcpy(copy, start, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static void trim(const char **start, const char **end) {
+    while (*start < *end && isspace((unsigned char)**start))
+        (*start)++;
+    while (*end > *start && isspace((unsigned char)(*end)[-1]))
+        (*end)--;
+}
+
+// Read a non-negative integer, returns 0 if the text is not one
+static int parse_number(const char *start, const char *end, long *value) {
+    trim(&start, &end);
+    if (start == end)
+        return 0;
+    *value = 0;
+    for (const char *pos = start; pos < end; pos++) {
+        if (!isdigit((unsigned char)*pos))
+            return 0;
+        *value = *value * 10 + (*pos - '0');
+    }
+    return 1;
+}
+
+// Compile the literal of a filter: "text", 'text', a number, true, false or null
+static const char *compile_literal(jquery_instr_t *instr, const char *start, const char *end) {
+    trim(&start, &end);
+    if (start == end)
+        return "missing value in filter";
+
+    if ((*start == '"' || *start == '\'') && end - start >= 2 && end[-1] == *start) {
+        instr->literal_type = JSON_TYPE_STRING;
+        instr->literal_len = end - start - 2;
+        instr->literal = copy_text(start + 1, instr->literal_len);
+        return instr->literal ? NULL : "out of memory";
+    }
+    if (end - start == 4 && !memcmp(start, "true", 4)) {
+        instr->literal_type = JSON_TYPE_TRUE;
+        return NULL;
+    }
+    if (end - start == 5 && !memcmp(start, "false", 5)) {
+        instr->literal_type = JSON_TYPE_FALSE;
+        return NULL;
+    }
+    if (end - start == 4 && !memcmp(start, "null", 4)) {
+        instr->literal_type = JSON_TYPE_NULL;
+        return NULL;
+    }
+
+    char *number_end;
+    char *text = copy_text(start, end - start);
+    if (!text)
+        return "out of memory";
+    instr->number = strtod(text, &number_end);
+    int valid = number_end != text && *number_end == '\0';
+    free(text);
+    if (!valid)
+        return "invalid value in filter";
+    instr->literal_type = JSON_TYPE_NUMBER;
+    return NULL;
+}
+
+// Compile the text between brackets: *, n, a:b or ?key=value
+static const char *compile_selector(jquery_t *query, int *capacity, const char *start, const char *end) {
+    jquery_instr_t *instr;
+    trim(&start, &end);
+
+    if (end - start == 1 && *start == '*')
+        return emit(query, JQUERY_WILDCARD, capacity) ? NULL : "out of memory";
+
+    if (start < end && *start == '?') {
+        start++;
+        trim(&start, &end);
+        if (start < end && *start == '(' && end[-1] == ')') {
+            start++;
+            end--;
+            trim(&start, &end);
+        }
+        if (end - start >= 2 && start[0] == '@' && start[1] == '.')
+            start += 2;
+
+        const char *equals = memchr(start, '=', end - start);
+        if (!equals)
+            return "filters must compare a member with '='";
+        const char *name_end = equals;
+        const char *value_start = equals + 1;
+        if (value_start < end && *value_start == '=') /* Accept == as well */
+            value_start++;
+        trim(&start, &name_end);
+        if (start == name_end)
+            return "missing member name in filter";
+
+        if (!(instr = emit(query, JQUERY_FILTER, capacity)))
+            return "out of memory";
+        instr->name_len = name_end - start;
+        if (!(instr->name = copy_text(start, instr->name_len)))
+            return "out of memory";
+        return compile_literal(instr, value_start, end);
+    }
+
+    const char *colon = memchr(start, ':', end - start);
+    if (colon) {
+        long from = 0, to = -1;
+        const char *from_end = colon, *to_start = colon + 1;
+        trim(&start, &from_end);
+        trim(&to_start, &end);
+        if ((start < from_end && !parse_number(start, from_end, &from)) || (to_start < end && !parse_number(to_start, end, &to)))
+            return "slice bounds must be non-negative numbers";
+        if (!(instr = emit(query, JQUERY_SLICE, capacity)))
+            return "out of memory";
+        instr->from = from;
+        instr->to = to;
+        return NULL;
+    }
+
+    long position;
+    if (!parse_number(start, end, &position))
+        return "array indexes must be non-negative numbers";
+    if (!(instr = emit(query, JQUERY_INDEX, capacity)))
+        return "out of memory";
+    instr->from = position;
+    return NULL;
+}
+
+// Find the bracket closing a selector, quotes in filter values may contain brackets
+static const char *find_closing_bracket(const char *pos) {
+    char quote = 0;
+    for (; *pos != '\0'; pos++) {
+        if (quote) {
+            if (*pos == quote)
+                quote = 0;
+        } else if (*pos == '"' || *pos == '\'') {
+            quote = *pos;
+        } else if (*pos == ']') {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+jquery_t *jquery_compile(const char *text, const char **error) {
+    jquery_t *query = (jquery_t *)calloc(1, sizeof(jquery_t));
+    int capacity = 0;
+
+    *error = NULL;
+    if (!query || !(query->text = copy_text(text, strlen(text)))) {
+        free(query);
+        *error = "out of memory";
+        return NULL;
+    }
+    query->definite = 1;
+
+    const char *pos = text;
+    if (*pos == '$') /* Optional root marker */
+        pos++;
+
+    while (*pos != '\0' && !*error) {
+        const char *name = NULL;
+        jquery_opcode op = JQUERY_KEY;
+
+        if (pos[0] == '.' && pos[1] == '.') { /* Recursive descent */
+            pos += 2;
+            op = JQUERY_DESCEND;
+            if (*pos == '*') {
+                pos++;
+                if (!emit(query, JQUERY_DESCEND, &capacity))
+                    *error = "out of memory";
+                continue;
+            }
+            name = pos;
+        } else if (*pos == '.') {
+            pos++;
+            if (*pos == '.' || *pos == '[' || *pos == '\0') /* Empty step, ignored like before */
+                continue;
+            name = pos;
+        } else if (*pos == '[') {
+            const char *close = find_closing_bracket(pos + 1);
+            if (!close) {
+                *error = "missing ']'";
+                break;
+            }
+            *error = compile_selector(query, &capacity, pos + 1, close);
+            pos = close + 1;
+            continue;
+        } else if (pos == text || (pos == text + 1 && *text == '$')) { /* The first member needs no dot */
+            name = pos;
+        } else {
+            *error = "expected '.' or '['";
+            break;
+        }
+
+        size_t name_len = strcspn(name, ".[");
+        if (name_len == 0) {
+            *error = "missing member name";
+            break;
+        }
+        pos = name + name_len;
+
+        if (op == JQUERY_KEY && name_len == 1 && *name == '*')
+            op = JQUERY_WILDCARD;
+        jquery_instr_t *instr = emit(query, op, &capacity);
+        if (!instr) {
+            *error = "out of memory";
+            break;
+        }
+        if (op != JQUERY_WILDCARD) {
+            instr->name_len = name_len;
+            if (!(instr->name = copy_text(name, name_len)))
+                *error = "out of memory";
+        }
+    }
+
+    if (*error) {
+        jquery_free(query);
+        return NULL;
+    }
+    return query;
+}
+
+void jquery_free(jquery_t *query) {
+    if (!query)
+        return;
+    for (int i = 0; i < query->length; i++) {
+        free(query->code[i].name);
+        free(query->code[i].literal);
+    }
+    free(query->code);
+    free(query->text);
+    free(query);
+}
+
+int jquery_canonical_path(const jquery_t *query, char *buffer, size_t size) {
+    size_t length = 0;
+
+    if (!query->definite || size == 0)
+        return 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < query->length; i++) {
+        const jquery_instr_t *instr = &query->code[i];
+        int written;
+        if (instr->op == JQUERY_KEY)
+            written = snprintf(buffer + length, size - length, "%s%s", length ? "." : "", instr->name);
+        else
+            written = snprintf(buffer + length, size - length, "[%ld]", instr->from);
+        if (written < 0 || (size_t)written >= size - length)
+            return 0;
+        length += written;
+    }
+    return 1;
+}
+
+int jquery_literal_matches(const jquery_instr_t *instr, json_type type, const jspan_t *text) {
+    switch (instr->literal_type) {
+        case JSON_TYPE_STRING:
+            return type == JSON_TYPE_STRING && jcursor_key_equals(text, instr->literal, instr->literal_len);
+        case JSON_TYPE_NUMBER: {
+            char number[64];
+            size_t len = text->end - text->start;
+            if (type != JSON_TYPE_NUMBER || len >= sizeof(number))
+                return 0;
+            memcpy(number, text->start, len);
+            number[len] = '\0';
+            return strtod(number, NULL) == instr->number;
+        }
+        default:
+            return type == instr->literal_type;
+    }
+}
+
+int jquery_filter_accepts(const jquery_instr_t *instr, const jspan_t *value, const jindex_t *index) {
+    jspan_t member;
+    if (!jcursor_find_key(value, index, instr->name, instr->name_len, &member))
+        return 0;
+
+    json_type type = jcursor_type(&member);
+    jspan_t text = member;
+    if (type == JSON_TYPE_STRING) { /* Without the quotes */
+        text.start++;
+        text.end--;
+    }
+    return jquery_literal_matches(instr, type, &text);
+}
+
+typedef struct {
+    const jquery_t *query;
+    const jindex_t *index;
+    jquery_match_fn match;
+    void *arg;
+    int count; /* Matches reported so far */
+} run_t;
+
+static int eval(run_t *run, int pc, const jspan_t *value);
+
+// Apply the rest of the query to every member called `name` (every member if NULL) below `value`
+static int descend(run_t *run, int pc, const jspan_t *value) {
+    const jquery_instr_t *instr = &run->query->code[pc];
+    jcursor_t cursor;
+    jspan_t key, child;
+
+    if (!jcursor_enter(&cursor, value, run->index))
+        return 1;
+    if (jcursor_type(value) == JSON_TYPE_OBJECT) {
+        while (jcursor_next_member(&cursor, &key, &child)) {
+            if ((!instr->name || jcursor_key_equals(&key, instr->name, instr->name_len)) && !eval(run, pc + 1, &child))
+                return 0;
+            if (!descend(run, pc, &child))
+                return 0;
+        }
+    } else {
+        while (jcursor_next_element(&cursor, &child)) {
+            if (!instr->name && !eval(run, pc + 1, &child))
+                return 0;
+            if (!descend(run, pc, &child))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// Apply the instructions from `pc` on to `value`, returns 0 once the callback asked to stop
+static int eval(run_t *run, int pc, const jspan_t *value) {
+    if (pc == run->query->length) {
+        run->count++;
+        return run->match(value, run->arg);
+    }
+
+    const jquery_instr_t *instr = &run->query->code[pc];
+    json_type type = jcursor_type(value);
+    jcursor_t cursor;
+    jspan_t key, child;
+
+    switch (instr->op) {
+        case JQUERY_KEY:
+            if (jcursor_find_key(value, run->index, instr->name, instr->name_len, &child))
+                return eval(run, pc + 1, &child);
+            return 1;
+
+        case JQUERY_INDEX:
+            if (jcursor_find_index(value, run->index, (int)instr->from, &child))
+                return eval(run, pc + 1, &child);
+            return 1;
+
+        case JQUERY_WILDCARD:
+        case JQUERY_FILTER:
+            if (!jcursor_enter(&cursor, value, run->index))
+                return 1;
+            while (type == JSON_TYPE_OBJECT ? jcursor_next_member(&cursor, &key, &child) : jcursor_next_element(&cursor, &child)) {
+                if (instr->op == JQUERY_FILTER && !jquery_filter_accepts(instr, &child, run->index))
+                    continue;
+                if (!eval(run, pc + 1, &child))
+                    return 0;
+            }
+            return 1;
+
+        case JQUERY_SLICE:
+            if (type != JSON_TYPE_ARRAY || !jcursor_enter(&cursor, value, run->index))
+                return 1;
+            while ((instr->to < 0 || cursor.count < instr->to) && jcursor_next_element(&cursor, &child)) {
+                if (cursor.count - 1 >= instr->from && !eval(run, pc + 1, &child))
+                    return 0;
+            }
+            return 1;
+
+        case JQUERY_DESCEND:
+            return descend(run, pc, value);
+    }
+    return 1;
+}
+
+int jquery_run(const jquery_t *query, const jspan_t *root, const jindex_t *index, jquery_match_fn match, void *arg) {
+    run_t run = { query, index, match, arg, 0 };
+    eval(&run, 0, root);
+    return run.count;
+}
+
+/* Cache of compiled queries, the least recently used one is replaced when it is full */
+static struct {
+    jquery_t *query;
+    unsigned long used; /* Value of `clock` at the last lookup */
+} cache[JQUERY_CACHE_SIZE];
+static unsigned long cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+jquery_t *jquery_acquire(const char *text, const char **error) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < JQUERY_CACHE_SIZE; i++) {
+        if (cache[i].query && strcmp(cache[i].query->text, text) == 0) {
+            cache[i].used = ++cache_clock;
+            cache[i].query->refs++;
+            pthread_mutex_unlock(&cache_lock);
+            *error = NULL;
+            return cache[i].query;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    jquery_t *query = jquery_compile(text, error); /* Compile outside of the lock */
+    if (!query)
+        return NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    int slot = 0;
+    for (int i = 1; i < JQUERY_CACHE_SIZE; i++) {
+        if (!cache[slot].query)
+            break;
+        if (!cache[i].query || cache[i].used < cache[slot].used)
+            slot = i;
+    }
+    jquery_t *evicted = cache[slot].query;
+    if (evicted && --evicted->refs > 0) /* Still in use, freed by its last jquery_release */
+        evicted = NULL;
+    cache[slot].query = query;
+    cache[slot].used = ++cache_clock;
+    query->refs = 2; /* One for the cache, one for the caller */
+    pthread_mutex_unlock(&cache_lock);
+
+    jquery_free(evicted);
+    return query;
+}
+
+void jquery_release(jquery_t *query) {
+    pthread_mutex_lock(&cache_lock);
+    int last = --query->refs == 0;
+    pthread_mutex_unlock(&cache_lock);
+    if (last)
+        jquery_free(query);
+}
@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include "jtape.h"
+
+#define WORD(type, payload) (((uint64_t)(unsigned char)(type) << 56) | (payload))
+#define TYPE_OF(word) ((char)((word) >> 56))
+#define PAYLOAD_OF(word) ((word) & JTAPE_PAYLOAD_MASK)
+
+/* Tape and pool collected while walking a document */
+typedef struct {
+    const jindex_t *index;
+    uint64_t *words;
+    size_t count;
+    size_t capacity;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+    int failed; /* Out of memory or a value that could not be read */
+} builder_t;
+
+static int reserve(void **buffer, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity)
+        return 1;
+    size_t new_capacity = *capacity ? *capacity : 256;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    void *grown = realloc(*buffer, new_capacity * item_size);
+    if (!grown)
+        return 0;
+    *buffer = grown;
+    *capacity = new_capacity;
+    return 1;
+}
+
+// Append a word to the tape, returns its index
+static size_t push_word(builder_t *b, uint64_t word) {
+    if (!reserve((void **)&b->words, &b->capacity, b->count + 1, sizeof(uint64_t))) {
+        b->failed = 1;
+        return 0;
+    }
+    b->words[b->count] = word;
+    return b->count++;
+}
+
+// Copy the raw text of a string to the pool and append its word
+static void push_string(builder_t *b, const char *text, size_t len) {
+    if (len > UINT32_MAX || !reserve((void **)&b->strings, &b->strings_capacity, b->strings_size + sizeof(uint32_t) + len + 1, 1)) {
+        b->failed = 1;
+        return;
+    }
+
+    uint64_t payload = b->strings_size;
+    uint32_t length = (uint32_t)len;
+    memcpy(b->strings + b->strings_size, &length, sizeof(length));
+    memcpy(b->strings + b->strings_size + sizeof(length), text, len);
+    b->strings[b->strings_size + sizeof(length) + len] = '\0';
+    b->strings_size += sizeof(length) + len + 1;
+
+    // Strings without escapes or control bytes are printed without looking at them
+    int plain = !memchr(text, '\\', len);
+    for (size_t i = 0; plain && i < len; i++) {
+        if ((unsigned char)text[i] < 32)
+            plain = 0;
+    }
+    push_word(b, WORD('"', payload | (plain ? JTAPE_STRING_PLAIN : 0)));
+}
+
+// Read a number the way cJSON does and store its value
+static void push_number(builder_t *b, const jspan_t *value) {
+    double d = jwrite_parse_number(value->start, value->end - value->start);
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    push_word(b, WORD('d', 0));
+    push_word(b, bits);
+}
+
+// Flatten a value and everything below it
+static void walk(builder_t *b, const jspan_t *value) {
+    jcursor_t cursor;
+    jspan_t key, child;
+    json_type type = jcursor_type(value);
+
+    switch (type) {
+        case JSON_TYPE_OBJECT:
+        case JSON_TYPE_ARRAY: {
+            size_t start = push_word(b, WORD(type == JSON_TYPE_OBJECT ? '{' : '[', 0));
+            if (b->failed || !jcursor_enter(&cursor, value, b->index)) {
+                b->failed = 1;
+                return;
+            }
+            if (type == JSON_TYPE_OBJECT) {
+                while (!b->failed && jcursor_next_member(&cursor, &key, &child)) {
+                    push_string(b, key.start, key.end - key.start);
+                    walk(b, &child);
+                }
+            } else {
+                while (!b->failed && jcursor_next_element(&cursor, &child))
+                    walk(b, &child);
+            }
+            size_t end = push_word(b, WORD(type == JSON_TYPE_OBJECT ? '}' : ']', start));
+            if (!b->failed)
+                b->words[start] |= end;
+            return;
+        }
+        case JSON_TYPE_STRING:
+            push_string(b, value->start + 1, value->end - value->start - 2);
+            return;
+        case JSON_TYPE_NUMBER:
+            push_number(b, value);
+            return;
+        case JSON_TYPE_TRUE: push_word(b, WORD('t', 0)); return;
+        case JSON_TYPE_FALSE: push_word(b, WORD('f', 0)); return;
+        case JSON_TYPE_NULL: push_word(b, WORD('n', 0)); return;
+        default:
+            b->failed = 1;
+            return;
+    }
+}
+
+int jtape_write(const char *json_path, const json_document_t *document) {
+    builder_t b;
+    memset(&b, 0, sizeof(b));
+    b.index = &document->index;
+
+    walk(&b, &document->root);
+    if (b.failed) {
+        free(b.words);
+        free(b.strings);
+        return 0;
+    }
+
+    jtape_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JTAPE_MAGIC, sizeof(header.magic));
+    header.version = JTAPE_VERSION;
+    header.json_size = document->size;
+    header.json_mtime_sec = document->mtime.tv_sec;
+    header.json_mtime_nsec = document->mtime.tv_nsec;
+    header.count = b.count;
+    header.strings_size = b.strings_size;
+
+    // Write next to the JSON file and rename, a mapped tape is never changed under its readers
+    char temp_path[PATH_MAX];
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    int fd = -1, ok = 0;
+    if (out && snprintf(temp_path, sizeof(temp_path), "%s%s.XXXXXX", json_path, JTAPE_SUFFIX) < (int)sizeof(temp_path))
+        fd = mkstemp(temp_path);
+    if (fd >= 0) {
+        outbuf_init(out, fd, 0);
+        outbuf_write(out, &header, sizeof(header));
+        outbuf_write(out, b.words, sizeof(uint64_t) * b.count);
+        outbuf_write(out, b.strings, b.strings_size);
+        ok = outbuf_flush(out) && fchmod(fd, 0644) == 0;
+        close(fd);
+
+        char tape_path[PATH_MAX];
+        snprintf(tape_path, sizeof(tape_path), "%s%s", json_path, JTAPE_SUFFIX);
+        if (!ok || rename(temp_path, tape_path) < 0) {
+            perror("Failed to write JSON tape");
+            unlink(temp_path);
+            ok = 0;
+        }
+    }
+
+    free(out);
+    free(b.words);
+    free(b.strings);
+    return ok;
+}
+
+int jtape_build(const char *json_path) {
+    doccache_handle_t *handle;
+    json_document_t *document = doccache_acquire(json_path, &doccache_json, &handle);
+    if (!document)
+        return 0;
+    int ok = jtape_write(json_path, document);
+    doccache_release(handle);
+    return ok;
+}
+
+jtape_t *jtape_acquire(const char *json_path, const struct stat *json_st, doccache_handle_t **handle) {
+    char tape_path[PATH_MAX];
+    if (snprintf(tape_path, sizeof(tape_path), "%s%s", json_path, JTAPE_SUFFIX) >= (int)sizeof(tape_path))
+        return NULL;
+
+    jtape_t *tape = doccache_acquire(tape_path, &doccache_jtape, handle);
+    if (!tape)
+        return NULL;
+
+    // The tape must describe this exact version of the JSON file
+    const jtape_header_t *header = tape->header;
+    if (header->json_size != (uint64_t)json_st->st_size || header->json_mtime_sec != json_st->st_mtim.tv_sec || header->json_mtime_nsec != json_st->st_mtim.tv_nsec) {
+        doccache_release(*handle);
+        return NULL;
+    }
+    return tape;
+}
+
+json_type jtape_type(const jtape_t *tape, size_t value) {
+    switch (TYPE_OF(tape->words[value])) {
+        case '{': return JSON_TYPE_OBJECT;
+        case '[': return JSON_TYPE_ARRAY;
+        case '"': return JSON_TYPE_STRING;
+        case 'd': return JSON_TYPE_NUMBER;
+        case 't': return JSON_TYPE_TRUE;
+        case 'f': return JSON_TYPE_FALSE;
+        case 'n': return JSON_TYPE_NULL;
+        default: return JSON_TYPE_INVALID;
+    }
+}
+
+size_t jtape_skip(const jtape_t *tape, size_t value) {
+    uint64_t word = tape->words[value];
+    switch (TYPE_OF(word)) {
+        case '{':
+        case '[': return PAYLOAD_OF(word) + 1;
+        case 'd': return value + 2;
+        default: return value + 1;
+    }
+}
+
+jspan_t jtape_text(const jtape_t *tape, size_t value) {
+    const char *entry = tape->strings + (PAYLOAD_OF(tape->words[value]) & ~JTAPE_STRING_PLAIN);
+    uint32_t length;
+    memcpy(&length, entry, sizeof(length));
+    jspan_t text = { entry + sizeof(length), entry + sizeof(length) + length };
+    return text;
+}
+
+double jtape_number(const jtape_t *tape, size_t value) {
+    double d;
+    memcpy(&d, &tape->words[value + 1], sizeof(d));
+    return d;
+}
+
+int jtape_enter(jtape_cursor_t *cursor, const jtape_t *tape, size_t container) {
+    char type = TYPE_OF(tape->words[container]);
+    if (type != '{' && type != '[')
+        return 0;
+    cursor->tape = tape;
+    cursor->pos = container + 1;
+    cursor->end = PAYLOAD_OF(tape->words[container]);
+    cursor->count = 0;
+    return 1;
+}
+
+int jtape_next_member(jtape_cursor_t *cursor, size_t *key, size_t *value) {
+    if (cursor->pos >= cursor->end)
+        return 0;
+    *key = cursor->pos;
+    *value = cursor->pos + 1;
+    cursor->pos = jtape_skip(cursor->tape, *value);
+    cursor->count++;
+    return 1;
+}
+
+int jtape_next_element(jtape_cursor_t *cursor, size_t *value) {
+    if (cursor->pos >= cursor->end)
+        return 0;
+    *value = cursor->pos;
+    cursor->pos = jtape_skip(cursor->tape, *value);
+    cursor->count++;
+    return 1;
+}
+
+int jtape_find_key(const jtape_t *tape, size_t object, const char *name, size_t name_len, size_t *value) {
+    jtape_cursor_t cursor;
+    size_t key;
+
+    if (TYPE_OF(tape->words[object]) != '{' || !jtape_enter(&cursor, tape, object))
+        return 0;
+    while (jtape_next_member(&cursor, &key, value)) {
+        jspan_t text = jtape_text(tape, key);
+        if (jcursor_key_equals(&text, name, name_len))
+            return 1;
+    }
+    return 0;
+}
+
+int jtape_find_index(const jtape_t *tape, size_t array, int position, size_t *value) {
+    jtape_cursor_t cursor;
+
+    if (TYPE_OF(tape->words[array]) != '[' || position < 0 || !jtape_enter(&cursor, tape, array))
+        return 0;
+    while (jtape_next_element(&cursor, value)) {
+        if (cursor.count - 1 == position)
+            return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const jtape_t *tape;
+    const jquery_t *query;
+    jtape_match_fn match;
+    void *arg;
+    int count; /* Matches reported so far */
+} run_t;
+
+// Check a value against a filter instruction, numbers are compared with their stored value
+static int filter_accepts(const jtape_t *tape, const jquery_instr_t *instr, size_t value) {
+    size_t member;
+    if (!jtape_find_key(tape, value, instr->name, instr->name_len, &member))
+        return 0;
+
+    json_type type = jtape_type(tape, member);
+    if (type == JSON_TYPE_NUMBER)
+        return instr->literal_type == JSON_TYPE_NUMBER && jtape_number(tape, member) == instr->number;
+    jspan_t text = { NULL, NULL };
+    if (type == JSON_TYPE_STRING)
+        text = jtape_text(tape, member);
+    return jquery_literal_matches(instr, type, &text);
+}
+
+static int eval(run_t *run, int pc, size_t value);
+
+// Apply the rest of the query to every member called `name` (every member if NULL) below `value`
+static int descend(run_t *run, int pc, size_t value) {
+    const jquery_instr_t *instr = &run->query->code[pc];
+    jtape_cursor_t cursor;
+    size_t key, child;
+
+    if (!jtape_enter(&cursor, run->tape, value))
+        return 1;
+    if (jtape_type(run->tape, value) == JSON_TYPE_OBJECT) {
+        while (jtape_next_member(&cursor, &key, &child)) {
+            jspan_t text = jtape_text(run->tape, key);
+            if ((!instr->name || jcursor_key_equals(&text, instr->name, instr->name_len)) && !eval(run, pc + 1, child))
+                return 0;
+            if (!descend(run, pc, child))
+                return 0;
+        }
+    } else {
+        while (jtape_next_element(&cursor, &child)) {
+            if (!instr->name && !eval(run, pc + 1, child))
+                return 0;
+            if (!descend(run, pc, child))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// Apply the instructions from `pc` on to `value`, same semantics as jquery_run
+static int eval(run_t *run, int pc, size_t value) {
+    if (pc == run->query->length) {
+        run->count++;
+        return run->match(run->tape, value, run->arg);
+    }
+
+    const jquery_instr_t *instr = &run->query->code[pc];
+    json_type type = jtape_type(run->tape, value);
+    jtape_cursor_t cursor;
+    size_t key, child;
+
+    switch (instr->op) {
+        case JQUERY_KEY:
+            if (jtape_find_key(run->tape, value, instr->name, instr->name_len, &child))
+                return eval(run, pc + 1, child);
+            return 1;
+
+        case JQUERY_INDEX:
+            if (jtape_find_index(run->tape, value, (int)instr->from, &child))
+                return eval(run, pc + 1, child);
+            return 1;
+
+        case JQUERY_WILDCARD:
+        case JQUERY_FILTER:
+            if (!jtape_enter(&cursor, run->tape, value))
+                return 1;
+            while (type == JSON_TYPE_OBJECT ? jtape_next_member(&cursor, &key, &child) : jtape_next_element(&cursor, &child)) {
+                if (instr->op == JQUERY_FILTER && !filter_accepts(run->tape, instr, child))
+                    continue;
+                if (!eval(run, pc + 1, child))
+                    return 0;
+            }
+            return 1;
+
+        case JQUERY_SLICE:
+            if (type != JSON_TYPE_ARRAY || !jtape_enter(&cursor, run->tape, value))
+                return 1;
+            while ((instr->to < 0 || cursor.count < instr->to) && jtape_next_element(&cursor, &child)) {
+                if (cursor.count - 1 >= instr->from && !eval(run, pc + 1, child))
+                    return 0;
+            }
+            return 1;
+
+        case JQUERY_DESCEND:
+            return descend(run, pc, value);
+    }
+    return 1;
+}
+
+int jtape_run(const jtape_t *tape, const jquery_t *query, jtape_match_fn match, void *arg) {
+    run_t run = { tape, query, match, arg, 0 };
+    eval(&run, 0, 0);
+    return run.count;
+}
+
+static void print_string(const jtape_t *tape, size_t value, outbuf_t *out) {
+    jspan_t text = jtape_text(tape, value);
+    jwrite_raw_string(out, text.start, text.end - text.start, (tape->words[value] & JTAPE_STRING_PLAIN) != 0);
+}
+
+static void print_value(const jtape_t *tape, size_t value, jwrite_mode mode, int depth, outbuf_t *out) {
+    jtape_cursor_t cursor;
+    size_t key, child;
+
+    switch (TYPE_OF(tape->words[value])) {
+        case '{':
+            jwrite_open(out, mode, '{');
+            jtape_enter(&cursor, tape, value);
+            while (jtape_next_member(&cursor, &key, &child)) {
+                jwrite_key_start(out, mode, depth);
+                print_string(tape, key, out);
+                jwrite_key_end(out, mode);
+                print_value(tape, child, mode, depth + 1, out);
+                jwrite_item_end(out, mode, '{', cursor.pos < cursor.end);
+            }
+            jwrite_close(out, mode, '{', depth);
+            return;
+        case '[':
+            jwrite_open(out, mode, '[');
+            jtape_enter(&cursor, tape, value);
+            while (jtape_next_element(&cursor, &child)) {
+                print_value(tape, child, mode, depth + 1, out);
+                jwrite_item_end(out, mode, '[', cursor.pos < cursor.end);
+            }
+            jwrite_close(out, mode, '[', depth);
+            return;
+        case '"': print_string(tape, value, out); return;
+        case 'd': jwrite_number(out, jtape_number(tape, value)); return;
+        case 't': outbuf_write(out, "true", 4); return;
+        case 'f': outbuf_write(out, "false", 5); return;
+        case 'n': outbuf_write(out, "null", 4); return;
+    }
+}
+
+void jtape_print(const jtape_t *tape, size_t value, jwrite_mode mode, outbuf_t *out) {
+    print_value(tape, value, mode, 0, out);
+}
+
+// Check that a string word points to a complete pool entry
+static int check_string(const jtape_header_t *header, const char *strings, uint64_t word) {
+    uint64_t offset = PAYLOAD_OF(word) & ~JTAPE_STRING_PLAIN;
+    uint32_t length;
+    if (offset > header->strings_size || header->strings_size - offset < sizeof(length) + 1)
+        return 0;
+    memcpy(&length, strings + offset, sizeof(length));
+    return header->strings_size - offset - sizeof(length) - 1 >= length && strings[offset + sizeof(length) + length] == '\0';
+}
+
+// Walk the whole tape once so that navigation can trust it: links, key positions and pool offsets
+static int check_tape(const jtape_header_t *header, const uint64_t *words, const char *strings) {
+    uint64_t stack[JINDEX_MAX_DEPTH]; /* Containers still open */
+    int expect_key[JINDEX_MAX_DEPTH]; /* The next word of this object is a key */
+    int depth = 0;
+
+    for (uint64_t i = 0; i < header->count; i++) {
+        uint64_t word = words[i];
+        char type = TYPE_OF(word);
+        int completed = 1; /* A value ends at this word */
+
+        if (depth > 0 && expect_key[depth - 1] && type != '}') {
+            if (type != '"' || !check_string(header, strings, word))
+                return 0;
+            expect_key[depth - 1] = 0;
+            continue;
+        }
+        if (depth == 0 && i > 0) /* Only one top level value */
+            return 0;
+
+        switch (type) {
+            case '{':
+            case '[':
+                if (depth == JINDEX_MAX_DEPTH || PAYLOAD_OF(word) <= i || PAYLOAD_OF(word) >= header->count)
+                    return 0;
+                stack[depth] = i;
+                expect_key[depth++] = type == '{';
+                completed = 0;
+                break;
+            case '}':
+            case ']':
+                if (depth == 0 || PAYLOAD_OF(word) != stack[depth - 1] || PAYLOAD_OF(words[stack[depth - 1]]) != i ||
+                    TYPE_OF(words[stack[depth - 1]]) != (type == '}' ? '{' : '['))
+                    return 0;
+                depth--;
+                break;
+            case '"':
+                if (!check_string(header, strings, word))
+                    return 0;
+                break;
+            case 'd':
+                if (++i == header->count)
+                    return 0;
+                break;
+            case 't':
+            case 'f':
+            case 'n':
+                break;
+            default:
+                return 0;
+        }
+
+        if (completed && depth > 0 && TYPE_OF(words[stack[depth - 1]]) == '{')
+            expect_key[depth - 1] = 1;
+    }
+    return header->count > 0 && depth == 0;
+}
+
+// Map a tape file and check it completely, later lookups do no bounds checks
+static void *load_tape(int fd, const struct stat *st, size_t *bytes) {
+    if ((size_t)st->st_size < sizeof(jtape_header_t))
+        return NULL;
+
+    void *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const jtape_header_t *header = (const jtape_header_t *)map;
+    const uint64_t *words = (const uint64_t *)(header + 1);
+    if (memcmp(header->magic, JTAPE_MAGIC, sizeof(header->magic)) != 0 || header->version != JTAPE_VERSION ||
+        header->count > (st->st_size - sizeof(jtape_header_t)) / sizeof(uint64_t) ||
+        header->strings_size != st->st_size - sizeof(jtape_header_t) - header->count * sizeof(uint64_t) ||
+        !check_tape(header, words, (const char *)(words + header->count))) {
+        munmap(map, st->st_size);
+        return NULL;
+    }
+
+    jtape_t *tape = (jtape_t *)malloc(sizeof(jtape_t));
+    if (!tape) {
+        munmap(map, st->st_size);
+        return NULL;
+    }
+    tape->map = map;
+    tape->size = st->st_size;
+    tape->header = header;
+    tape->words = words;
+    tape->strings = (const char *)(words + header->count);
+
+    *bytes = sizeof(jtape_t) + st->st_size;
+    return tape;
+}
+
+static void free_tape(void *data) {
+    jtape_t *tape = (jtape_t *)data;
+    munmap(tape->map, tape->size);
+    free(tape);
+}
+
+const doccache_type_t doccache_jtape = { "JSON tape", load_tape, free_tape };
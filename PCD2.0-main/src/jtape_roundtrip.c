@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cJSON.h"
+#include "jtape.h"
+
+// Function to read the entire file into a string
+static char *read_file(FILE *file, size_t *length) {
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *content = (char *)malloc(*length + 1);
+    if (!content) {
+        printf("Memory allocation failed\n");
+        return NULL;
+    }
+    *length = fread(content, 1, *length, file);
+    content[*length] = '\0';
+    return content;
+}
+
+// Print the top level value of a tape the way the server prints search results
+static char *print_tape(const jtape_t *tape, jwrite_mode mode, size_t *length) {
+    FILE *file = tmpfile();
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    char *printed = NULL;
+    if (file && out) {
+        outbuf_init(out, fileno(file), 0);
+        jtape_print(tape, 0, mode, out);
+        if (outbuf_flush(out))
+            printed = read_file(file, length);
+    }
+    free(out);
+    if (file)
+        fclose(file);
+    return printed;
+}
+
+// Convert one JSON file to its tape and check that the tape prints the same document back
+static int round_trip(const char *filename) {
+    size_t length, printed_length;
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        printf("%s: could not open file\n", filename);
+        return 0;
+    }
+    char *json_string = read_file(file, &length);
+    fclose(file);
+    if (!json_string)
+        return 0;
+
+    // What cJSON makes of the same text is the reference, in both layouts
+    cJSON *json = cJSON_Parse(json_string);
+    char *expected = json ? cJSON_Print(json) : NULL;
+    char *expected_compact = json ? cJSON_PrintUnformatted(json) : NULL;
+    cJSON_Delete(json);
+    if (!expected || !expected_compact) {
+        free(expected);
+        free(expected_compact);
+        printf("%s: not valid JSON\n", filename);
+        free(json_string);
+        return 0;
+    }
+
+    struct stat st;
+    doccache_handle_t *handle = NULL;
+    jtape_t *tape = NULL;
+    if (jtape_build(filename) && stat(filename, &st) == 0)
+        tape = jtape_acquire(filename, &st, &handle);
+    if (!tape) {
+        printf("%s: could not write or map the tape\n", filename);
+        free(expected);
+        free(expected_compact);
+        free(json_string);
+        return 0;
+    }
+
+    char *printed = print_tape(tape, JWRITE_PRETTY, &printed_length);
+    size_t expected_length = strlen(expected), at = 0;
+    int ok = printed && printed_length == expected_length && !memcmp(printed, expected, expected_length);
+    if (ok) {
+        size_t compact_length;
+        char *compact = print_tape(tape, JWRITE_COMPACT, &compact_length);
+        if (!compact || compact_length != strlen(expected_compact) || memcmp(compact, expected_compact, compact_length)) {
+            printf("%s: MISMATCH in the compact layout\n", filename);
+            ok = -1;
+        }
+        free(compact);
+    }
+    if (ok == 1) {
+        printf("%s: OK, %llu words, %llu bytes of strings%s\n", filename, (unsigned long long)tape->header->count,
+               (unsigned long long)tape->header->strings_size,
+               length == expected_length && !memcmp(json_string, expected, length) ? ", identical to the file" : "");
+    } else if (printed && ok == 0) {
+        while (at < printed_length && at < expected_length && printed[at] == expected[at])
+            at++;
+        printf("%s: MISMATCH at byte %zu (tape %zu bytes, cJSON %zu bytes)\n", filename, at, printed_length, expected_length);
+    } else if (!printed) {
+        printf("%s: could not print the tape\n", filename);
+    }
+
+    doccache_release(handle);
+    free(printed);
+    free(expected);
+    free(expected_compact);
+    free(json_string);
+    return ok == 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) { /* At least one file must be sent from the command line */
+        printf("Usage: %s <file.json> [file.json ...]\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!round_trip(argv[i]))
+            failed++;
+    }
+    return failed ? 1 : 0;
+}
+/*
+gcc -o jtape_roundtrip jtape_roundtrip.c jtape.c doccache.c jquery.c jcursor.c jindex.c jwrite.c savefile.c outbuf.c -I../include -I/home/alex/cJSON -L/home/alex/cJSON -lcjson -lpthread -lm
+./jtape_roundtrip fisier1.json fisier2.json
+(writes fisier1.json.tape next to each file, like the server does after a conversion)
+*/
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cjson/cJSON.h>
+#include "jwrite.h"
+#include "savefile.h"
+
+// Write one byte of a string with the escapes cJSON uses
+static void write_string_byte(outbuf_t *out, unsigned char c) {
+    char escape[8];
+    switch (c) {
+        case '"': outbuf_write(out, "\\\"", 2); return;
+        case '\\': outbuf_write(out, "\\\\", 2); return;
+        case '\b': outbuf_write(out, "\\b", 2); return;
+        case '\f': outbuf_write(out, "\\f", 2); return;
+        case '\n': outbuf_write(out, "\\n", 2); return;
+        case '\r': outbuf_write(out, "\\r", 2); return;
+        case '\t': outbuf_write(out, "\\t", 2); return;
+    }
+    if (c < 32) {
+        snprintf(escape, sizeof(escape), "\\u%04x", c);
+        outbuf_write(out, escape, 6);
+    } else {
+        outbuf_putc(out, c);
+    }
+}
+
+void jwrite_string(outbuf_t *out, const char *text, size_t len) {
+    outbuf_putc(out, '"');
+    for (size_t i = 0; i < len; i++)
+        write_string_byte(out, (unsigned char)text[i]);
+    outbuf_putc(out, '"');
+}
+
+void jwrite_raw_string(outbuf_t *out, const char *text, size_t len, int plain) {
+    const char *pos = text, *end = text + len;
+
+    outbuf_putc(out, '"');
+    if (plain) {
+        outbuf_write(out, text, len);
+    } else {
+        // Decode the escapes of the source and escape again like cJSON would
+        while (pos < end) {
+            char decoded[4];
+            int decoded_len = 1;
+            if (*pos == '\\') {
+                pos++;
+                decoded_len = pos < end ? jcursor_decode_escape(&pos, end, decoded) : 0;
+                if (decoded_len == 0) { /* Keep a sequence that cannot be decoded as it is */
+                    decoded[0] = '\\';
+                    decoded_len = 1;
+                }
+            } else {
+                decoded[0] = *pos++;
+            }
+            if (decoded[0] == '\0') /* cJSON strings end at a NUL */
+                break;
+            for (int i = 0; i < decoded_len; i++)
+                write_string_byte(out, decoded[i]);
+        }
+    }
+    outbuf_putc(out, '"');
+}
+
+// Same formatting as cJSON: integers without decimals, else the shortest of 15 or 17 digits that reads back
+void jwrite_number(outbuf_t *out, double d) {
+    char number[32];
+    int length;
+    int as_int = d >= INT_MAX ? INT_MAX : d <= (double)INT_MIN ? INT_MIN : (int)d;
+
+    if (isnan(d) || isinf(d)) {
+        length = snprintf(number, sizeof(number), "null");
+    } else if (d == (double)as_int) {
+        length = snprintf(number, sizeof(number), "%d", as_int);
+    } else {
+        double test = 0.0;
+        length = snprintf(number, sizeof(number), "%1.15g", d);
+        if (sscanf(number, "%lg", &test) != 1 || fabs(test - d) > fmax(fabs(test), fabs(d)) * DBL_EPSILON)
+            length = snprintf(number, sizeof(number), "%1.17g", d);
+    }
+    outbuf_write(out, number, length);
+}
+
+double jwrite_parse_number(const char *text, size_t len) {
+    char number[64];
+    if (len >= sizeof(number)) /* cJSON reads at most 63 characters too */
+        len = sizeof(number) - 1;
+    memcpy(number, text, len);
+    number[len] = '\0';
+    return strtod(number, NULL);
+}
+
+static void write_tabs(outbuf_t *out, int count) {
+    for (int i = 0; i < count; i++)
+        outbuf_putc(out, '\t');
+}
+
+void jwrite_open(outbuf_t *out, jwrite_mode mode, char bracket) {
+    outbuf_putc(out, bracket);
+    if (bracket == '{' && mode == JWRITE_PRETTY)
+        outbuf_putc(out, '\n');
+}
+
+void jwrite_key_start(outbuf_t *out, jwrite_mode mode, int depth) {
+    if (mode == JWRITE_PRETTY)
+        write_tabs(out, depth + 1);
+}
+
+void jwrite_key_end(outbuf_t *out, jwrite_mode mode) {
+    if (mode == JWRITE_PRETTY)
+        outbuf_write(out, ":\t", 2);
+    else
+        outbuf_putc(out, ':');
+}
+
+void jwrite_item_end(outbuf_t *out, jwrite_mode mode, char bracket, int more) {
+    if (more)
+        outbuf_putc(out, ',');
+    if (mode == JWRITE_PRETTY) {
+        if (bracket == '{')
+            outbuf_putc(out, '\n');
+        else if (more)
+            outbuf_putc(out, ' ');
+    }
+}
+
+void jwrite_close(outbuf_t *out, jwrite_mode mode, char bracket, int depth) {
+    if (bracket == '{') {
+        if (mode == JWRITE_PRETTY)
+            write_tabs(out, depth);
+        outbuf_putc(out, '}');
+    } else {
+        outbuf_putc(out, ']');
+    }
+}
+
+// Write a value of raw text and everything below it
+static int write_span(outbuf_t *out, jwrite_mode mode, const jspan_t *value, const jindex_t *index, int depth) {
+    jcursor_t cursor;
+    jspan_t key, child;
+    json_type type = jcursor_type(value);
+
+    switch (type) {
+        case JSON_TYPE_OBJECT:
+            if (!jcursor_enter(&cursor, value, index))
+                return 0;
+            jwrite_open(out, mode, '{');
+            if (jcursor_next_member(&cursor, &key, &child)) {
+                for (;;) {
+                    jwrite_key_start(out, mode, depth);
+                    jwrite_raw_string(out, key.start, key.end - key.start, !memchr(key.start, '\\', key.end - key.start));
+                    jwrite_key_end(out, mode);
+                    if (!write_span(out, mode, &child, index, depth + 1))
+                        return 0;
+                    int more = jcursor_next_member(&cursor, &key, &child);
+                    jwrite_item_end(out, mode, '{', more);
+                    if (!more)
+                        break;
+                }
+            }
+            jwrite_close(out, mode, '{', depth);
+            return !out->error;
+        case JSON_TYPE_ARRAY:
+            if (!jcursor_enter(&cursor, value, index))
+                return 0;
+            jwrite_open(out, mode, '[');
+            if (jcursor_next_element(&cursor, &child)) {
+                for (;;) {
+                    if (!write_span(out, mode, &child, index, depth + 1))
+                        return 0;
+                    int more = jcursor_next_element(&cursor, &child);
+                    jwrite_item_end(out, mode, '[', more);
+                    if (!more)
+                        break;
+                }
+            }
+            jwrite_close(out, mode, '[', depth);
+            return !out->error;
+        case JSON_TYPE_STRING:
+            if (value->end - value->start < 2)
+                return 0;
+            jwrite_raw_string(out, value->start + 1, value->end - value->start - 2, !memchr(value->start, '\\', value->end - value->start));
+            return 1;
+        case JSON_TYPE_NUMBER:
+            jwrite_number(out, jwrite_parse_number(value->start, value->end - value->start));
+            return 1;
+        case JSON_TYPE_TRUE: outbuf_write(out, "true", 4); return 1;
+        case JSON_TYPE_FALSE: outbuf_write(out, "false", 5); return 1;
+        case JSON_TYPE_NULL: outbuf_write(out, "null", 4); return 1;
+        default: return 0;
+    }
+}
+
+int jwrite_span(outbuf_t *out, jwrite_mode mode, const jspan_t *value, const jindex_t *index) {
+    return write_span(out, mode, value, index, 0);
+}
+
+// Write an item of a cJSON tree and everything below it, the same walk as cJSON's print_value
+static int write_cjson(outbuf_t *out, jwrite_mode mode, const cJSON *item, int depth) {
+    switch (item->type & 0xFF) {
+        case cJSON_NULL: outbuf_write(out, "null", 4); return 1;
+        case cJSON_False: outbuf_write(out, "false", 5); return 1;
+        case cJSON_True: outbuf_write(out, "true", 4); return 1;
+        case cJSON_Number: jwrite_number(out, item->valuedouble); return 1;
+        case cJSON_Raw:
+            if (!item->valuestring)
+                return 0;
+            outbuf_puts(out, item->valuestring);
+            return 1;
+        case cJSON_String:
+            if (item->valuestring)
+                jwrite_string(out, item->valuestring, strlen(item->valuestring));
+            else
+                outbuf_write(out, "\"\"", 2);
+            return 1;
+        case cJSON_Array:
+            jwrite_open(out, mode, '[');
+            for (const cJSON *child = item->child; child; child = child->next) {
+                if (!write_cjson(out, mode, child, depth + 1))
+                    return 0;
+                jwrite_item_end(out, mode, '[', child->next != NULL);
+            }
+            jwrite_close(out, mode, '[', depth);
+            return !out->error;
+        case cJSON_Object:
+            jwrite_open(out, mode, '{');
+            for (const cJSON *child = item->child; child; child = child->next) {
+                jwrite_key_start(out, mode, depth);
+                if (child->string)
+                    jwrite_string(out, child->string, strlen(child->string));
+                else
+                    outbuf_write(out, "\"\"", 2);
+                jwrite_key_end(out, mode);
+                if (!write_cjson(out, mode, child, depth + 1))
+                    return 0;
+                jwrite_item_end(out, mode, '{', child->next != NULL);
+            }
+            jwrite_close(out, mode, '{', depth);
+            return !out->error;
+        default:
+            return 0;
+    }
+}
+
+int jwrite_cjson(outbuf_t *out, jwrite_mode mode, const cJSON *item) {
+    return item && write_cjson(out, mode, item, 0);
+}
+
+int jwrite_file(const char *filename, const cJSON *item, jwrite_mode mode) {
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!out) {
+        perror("Memory allocation failed");
+        return 0;
+    }
+
+    // Written to a new file that replaces the old one only once complete
+    savefile_t file;
+    if (!savefile_open(&file, filename)) {
+        perror("Failed to open file");
+        free(out);
+        return 0;
+    }
+
+    outbuf_init(out, file.fd, 0);
+    int ok = jwrite_cjson(out, mode, item);
+    ok = outbuf_flush(out) && ok;
+    free(out);
+    if (!ok) {
+        savefile_abort(&file);
+        return 0;
+    }
+    return savefile_commit(&file, 1);
+}
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "logger.h"
+
+#define BATCH_IOVECS 256 /* Pieces gathered for one writev */
+#define STAMP_SLOTS 16 /* Distinct seconds formatted during one drain */
+#define STAMP_SIZE 40
+
+/* Header of a line in a ring, followed by the path and the text */
+typedef struct {
+    uint32_t size; /* Whole record rounded up to 8 bytes, 0 marks the unused end of the ring */
+    uint32_t text_length;
+    uint16_t path_length;
+    uint16_t stamped;
+    int64_t time; /* Seconds, from the coarse clock */
+} record_t;
+
+/* Lines of one thread, it is the only producer and the writer the only consumer */
+typedef struct ring {
+    char *data;
+    size_t head; /* Bytes produced so far, written by the owner */
+    size_t tail; /* Bytes consumed so far, written by the writer */
+    size_t taken; /* Where the writer stopped reading in the current drain */
+    int abandoned; /* The owner exited, the ring is freed once drained */
+    struct ring *next;
+} ring_t;
+
+/* A log file kept open by the writer and the pieces waiting for it */
+typedef struct {
+    char path[PATH_MAX];
+    int fd; /* -1 when the slot is free */
+    unsigned long used; /* Drain that last wrote to it, for eviction */
+    unsigned long checked; /* Drain that last made sure it still exists */
+    struct iovec iov[BATCH_IOVECS];
+    int iov_count;
+} log_file_t;
+
+/* A formatted "[time] " prefix */
+typedef struct {
+    int64_t time;
+    char text[STAMP_SIZE];
+    size_t length;
+} stamp_t;
+
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread ring_t *thread_ring;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ring_t *rings;
+
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static unsigned long drain_count; /* Drains finished, guarded by wake_lock */
+static long dropped; /* Atomic */
+static long dropped_reported; /* Writer only */
+
+/* Writer state */
+static log_file_t files[LOGGER_MAX_FDS];
+static stamp_t stamps[STAMP_SLOTS];
+static int stamp_count;
+static unsigned long drain_number;
+
+static void *writer_thread(void *arg);
+
+// The owner is gone, the writer frees the ring once it has written what is left
+static void abandon_ring(void *arg) {
+    ring_t *ring = (ring_t *)arg;
+    __atomic_store_n(&ring->abandoned, 1, __ATOMIC_RELEASE);
+}
+
+static void flush_at_exit(void) {
+    logger_flush();
+}
+
+static void start_writer(void) {
+    pthread_t thread;
+    pthread_key_create(&ring_key, abandon_ring);
+    for (int i = 0; i < LOGGER_MAX_FDS; i++)
+        files[i].fd = -1;
+    if (pthread_create(&thread, NULL, writer_thread, NULL) == 0) {
+        pthread_detach(thread);
+        atexit(flush_at_exit);
+    } else {
+        perror("Could not start the log writer");
+    }
+}
+
+static ring_t *get_ring(void) {
+    if (thread_ring)
+        return thread_ring;
+    pthread_once(&logger_once, start_writer);
+
+    ring_t *ring = (ring_t *)calloc(1, sizeof(ring_t));
+    if (!ring || !(ring->data = (char *)malloc(LOGGER_RING_SIZE))) {
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+// Copy a line into the ring of the calling thread, never waits for the writer
+static void push_line(const char *path, int stamped, const char *text, size_t text_length) {
+    ring_t *ring = get_ring();
+    size_t path_length = strlen(path);
+    if (!ring || path_length >= PATH_MAX) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t size = (sizeof(record_t) + path_length + text_length + 7) & ~(size_t)7;
+    size_t head = ring->head, tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t pos = head % LOGGER_RING_SIZE, room = LOGGER_RING_SIZE - pos;
+    size_t needed = size + (room < size ? room : 0); /* A record never wraps around */
+    if (LOGGER_RING_SIZE - (head - tail) < needed) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&wake);
+        return;
+    }
+    if (room < size) {
+        ((record_t *)(ring->data + pos))->size = 0;
+        head += room;
+        pos = 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    record_t *record = (record_t *)(ring->data + pos);
+    record->size = (uint32_t)size;
+    record->text_length = (uint32_t)text_length;
+    record->path_length = (uint16_t)path_length;
+    record->stamped = (uint16_t)stamped;
+    record->time = now.tv_sec;
+    memcpy(record + 1, path, path_length);
+    memcpy((char *)(record + 1) + path_length, text, text_length);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+
+    if (head + size - tail > LOGGER_RING_SIZE / 2) /* Filling up, do not wait for the timer */
+        pthread_cond_signal(&wake);
+}
+
+static void push_formatted(const char *path, int stamped, const char *format, va_list args) {
+    char text[LOGGER_MAX_LINE];
+    int length = vsnprintf(text, sizeof(text), format, args);
+    if (length < 0)
+        return;
+    push_line(path, stamped, text, (size_t)length < sizeof(text) ? (size_t)length : sizeof(text) - 1);
+}
+
+void logger_line(const char *path, int stamped, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    push_formatted(path, stamped, format, args);
+    va_end(args);
+}
+
+void logger_sidecar(const char *filename, const char *format, ...) {
+    char path[PATH_MAX];
+    const char *slash = strrchr(filename, '/'), *dot = strrchr(filename, '.');
+    size_t length = dot && (!slash || dot > slash) ? (size_t)(dot - filename) : strlen(filename);
+    if (snprintf(path, sizeof(path), "%.*s.log", (int)length, filename) >= (int)sizeof(path))
+        return;
+
+    va_list args;
+    va_start(args, format);
+    push_formatted(path, 0, format, args);
+    va_end(args);
+}
+
+// Write every piece, retrying after a partial write
+static void write_pieces(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            perror("Could not write log file");
+            return;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+static void flush_file(log_file_t *file) {
+    if (file->iov_count > 0)
+        write_pieces(file->fd, file->iov, file->iov_count);
+    file->iov_count = 0;
+}
+
+static void flush_all(void) {
+    for (int i = 0; i < LOGGER_MAX_FDS; i++) {
+        if (files[i].fd >= 0)
+            flush_file(&files[i]);
+    }
+    stamp_count = 0;
+}
+
+// Open log file for a path: cached, reopened if it was deleted, else the least recently used slot is reused
+static log_file_t *file_for(const char *path, size_t path_length) {
+    log_file_t *free_slot = NULL, *oldest = NULL;
+    for (int i = 0; i < LOGGER_MAX_FDS; i++) {
+        log_file_t *file = &files[i];
+        if (file->fd < 0) {
+            if (!free_slot)
+                free_slot = file;
+            continue;
+        }
+        if (strncmp(file->path, path, path_length) == 0 && file->path[path_length] == '\0') {
+            struct stat st;
+            if (file->checked != drain_number && fstat(file->fd, &st) == 0 && st.st_nlink == 0) {
+                flush_file(file); /* Lines queued before the deletion go with the old file */
+                close(file->fd);
+                file->fd = -1;
+                free_slot = file;
+                break;
+            }
+            file->checked = drain_number;
+            file->used = drain_number;
+            return file;
+        }
+        if (!oldest || file->used < oldest->used)
+            oldest = file;
+    }
+
+    log_file_t *file = free_slot ? free_slot : oldest;
+    if (file->fd >= 0) {
+        flush_file(file);
+        close(file->fd);
+    }
+    memcpy(file->path, path, path_length);
+    file->path[path_length] = '\0';
+    file->fd = open(file->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (file->fd < 0) {
+        perror("Could not open log file");
+        return NULL;
+    }
+    file->used = drain_number;
+    file->checked = drain_number;
+    file->iov_count = 0;
+    return file;
+}
+
+// "[time] " as ctime writes it, without its newline, formatted once per second
+static const stamp_t *stamp_for(int64_t time) {
+    for (int i = stamp_count - 1; i >= 0; i--) {
+        if (stamps[i].time == time)
+            return &stamps[i];
+    }
+    if (stamp_count == STAMP_SLOTS) /* Pieces point into the slots, write them before reusing one */
+        flush_all();
+
+    stamp_t *stamp = &stamps[stamp_count++];
+    struct tm tm;
+    time_t seconds = (time_t)time;
+    localtime_r(&seconds, &tm);
+    stamp->time = time;
+    stamp->length = strftime(stamp->text, sizeof(stamp->text), "[%a %b %e %H:%M:%S %Y] ", &tm);
+    return stamp;
+}
+
+static void add_piece(log_file_t *file, const void *data, size_t length) {
+    if (file->iov_count == BATCH_IOVECS)
+        flush_file(file);
+    file->iov[file->iov_count].iov_base = (void *)data;
+    file->iov[file->iov_count].iov_len = length;
+    file->iov_count++;
+}
+
+static void add_line(const char *path, size_t path_length, int stamped, int64_t time, const char *text, size_t text_length) {
+    static const char newline = '\n';
+    log_file_t *file = file_for(path, path_length);
+    if (!file)
+        return;
+    if (file->iov_count + 3 > BATCH_IOVECS) /* A line is never split between two writes */
+        flush_file(file);
+    if (stamped) {
+        const stamp_t *stamp = stamp_for(time);
+        add_piece(file, stamp->text, stamp->length);
+    }
+    add_piece(file, text, text_length);
+    add_piece(file, &newline, 1);
+}
+
+// Write what every ring holds, then give the space back
+static void drain(void) {
+    drain_number++;
+    pthread_mutex_lock(&rings_lock);
+    for (ring_t *ring = rings; ring; ring = ring->next) {
+        size_t tail = ring->tail, head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail < head) {
+            size_t pos = tail % LOGGER_RING_SIZE;
+            const record_t *record = (const record_t *)(ring->data + pos);
+            if (record->size == 0) {
+                tail += LOGGER_RING_SIZE - pos;
+                continue;
+            }
+            const char *path = (const char *)(record + 1);
+            add_line(path, record->path_length, record->stamped, record->time, path + record->path_length, record->text_length);
+            tail += record->size;
+        }
+        ring->taken = tail;
+    }
+
+    // Pieces point into the rings until they are written
+    flush_all();
+    long lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (lost != dropped_reported) {
+        char text[128];
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        int length = snprintf(text, sizeof(text), "Dropped %ld log lines, the log buffers were full", lost - dropped_reported);
+        add_line(LOGGER_SERVER_LOG, strlen(LOGGER_SERVER_LOG), 1, now.tv_sec, text, length);
+        flush_all();
+        dropped_reported = lost;
+    }
+
+    ring_t **link = &rings;
+    while (*link) {
+        ring_t *ring = *link;
+        int abandoned = __atomic_load_n(&ring->abandoned, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&ring->tail, ring->taken, __ATOMIC_RELEASE);
+        if (abandoned && ring->taken == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            *link = ring->next;
+            free(ring->data);
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void *writer_thread(void *arg) {
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOGGER_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_timedwait(&wake, &wake_lock, &deadline);
+        pthread_mutex_unlock(&wake_lock);
+
+        drain();
+
+        pthread_mutex_lock(&wake_lock);
+        drain_count++;
+        pthread_cond_broadcast(&drained);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return arg;
+}
+
+void logger_flush(void) {
+    pthread_once(&logger_once, start_writer);
+    pthread_mutex_lock(&wake_lock);
+    unsigned long target = drain_count + 2; /* The drain running now may have missed the latest lines */
+    pthread_cond_signal(&wake);
+    while (drain_count < target) {
+        pthread_cond_signal(&wake);
+        pthread_cond_wait(&drained, &wake_lock);
+    }
+    pthread_mutex_unlock(&wake_lock);
+}
+
+long logger_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
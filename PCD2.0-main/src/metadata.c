@@ -2,94 +2,289 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
-#include <cjson/cJSON.h>
+#include <libxml/xmlreader.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "jcursor.h"
+#include "jtape.h"
+#include "filelock.h"
+#include "logger.h"
+#include "binlog.h"
+#include "history.h"
+
+// Copy the text of a metadata value, cut to the size of the field
+static void copy_field(char *field, size_t size, const char *text, size_t len) {
+    if (len >= size)
+        len = size - 1;
+    memcpy(field, text, len);
+    field[len] = '\0';
+}
+
+// Read a whole number from metadata text, returns 0 if the text is not one
+static int parse_file_size(const char *text, long long *value) {
+    char *end;
+    while (*text == ' ' || *text == '\t' || *text == '\n' || *text == '\r')
+        text++;
+    *value = strtoll(text, &end, 10);
+    while (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r')
+        end++;
+    return end != text && *end == '\0';
+}
+
+int read_metadata_xml(const char *filename, FileMetadata *metadata) {
+    memset(metadata, 0, sizeof(*metadata));
+    filelock_t lock;
+    int fd = filelock_read(filename, &lock); /* The reader parses the version the lock counts */
+    if (fd < 0)
+        return 0;
+    xmlTextReaderPtr reader = xmlReaderForFd(fd, filename, NULL, XML_PARSE_NONET);
+    if (reader == NULL) {
+        close(fd);
+        filelock_release(&lock);
+        errno = EINVAL;
+        return 0;
+    }
+
+    // Pull the document one node at a time, only the children of the root that hold metadata are built
+    int status = xmlTextReaderRead(reader);
+    while (status == 1 && metadata->found != METADATA_ALL) {
+        if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT || xmlTextReaderDepth(reader) != 1) {
+            status = xmlTextReaderRead(reader);
+            continue;
+        }
+        const char *name = (const char *)xmlTextReaderConstLocalName(reader);
+        int field = strcmp(name, "author") == 0 ? METADATA_AUTHOR : strcmp(name, "title") == 0 ? METADATA_TITLE :
+                    strcmp(name, "description") == 0 ? METADATA_DESCRIPTION : strcmp(name, "file_size") == 0 ? METADATA_FILE_SIZE : 0;
+        if (field == 0 || (metadata->found & field)) { /* The first element with a name wins, others are skipped whole */
+            status = xmlTextReaderNext(reader);
+            continue;
+        }
+
+        xmlNodePtr node = xmlTextReaderExpand(reader);
+        char *content = node ? (char *)xmlNodeGetContent(node) : NULL;
+        status = node ? xmlTextReaderNext(reader) : -1;
+        if (!content)
+            continue;
+        if (field == METADATA_AUTHOR)
+            copy_field(metadata->author, sizeof(metadata->author), content, strlen(content));
+        else if (field == METADATA_TITLE)
+            copy_field(metadata->title, sizeof(metadata->title), content, strlen(content));
+        else if (field == METADATA_DESCRIPTION)
+            copy_field(metadata->description, sizeof(metadata->description), content, strlen(content));
+        if (field != METADATA_FILE_SIZE || parse_file_size(content, &metadata->file_size))
+            metadata->found |= field;
+        xmlFree(content);
+    }
+    xmlFreeTextReader(reader);
+    close(fd);
+    filelock_release(&lock);
+
+    // The rest of the document is never read once every field was found
+    if (status < 0 && metadata->found != METADATA_ALL) {
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
 
 // Modificați `extract_metadata_xml` și `extract_metadata_json` să nu mai afișeze pe consolă
 void extract_metadata_xml(const char *filename) {
-    xmlDoc *document = xmlReadFile(filename, NULL, 0);
-    if (document == NULL) {
+    FileMetadata metadata;
+    if (!read_metadata_xml(filename, &metadata)) {
         log_change(filename, "extract", "Failed to parse XML");
         return;
     }
 
-    xmlNode *root = xmlDocGetRootElement(document);
-    xmlNode *cur_node = NULL;
-
-    for (cur_node = root->children; cur_node; cur_node = cur_node->next) {
-        if (cur_node->type == XML_ELEMENT_NODE) {
-            if (strcmp((const char *)cur_node->name, "author") == 0) {
-                // printf("Author: %s\n", (const char *)xmlNodeGetContent(cur_node));
-                log_change(filename, "extract", "Extracted author");
-            } else if (strcmp((const char *)cur_node->name, "title") == 0) {
-                // printf("Title: %s\n", (const char *)xmlNodeGetContent(cur_node));
-                log_change(filename, "extract", "Extracted title");
-            } else if (strcmp((const char *)cur_node->name, "description") == 0) {
-                // printf("Description: %s\n", (const char *)xmlNodeGetContent(cur_node));
-                log_change(filename, "extract", "Extracted description");
-            } else if (strcmp((const char *)cur_node->name, "file_size") == 0) {
-                // printf("File Size: %s\n", (const char *)xmlNodeGetContent(cur_node));
-                log_change(filename, "extract", "Extracted file_size");
-            }
+    if (metadata.found & METADATA_AUTHOR)
+        log_change(filename, "extract", "Extracted author");
+    if (metadata.found & METADATA_TITLE)
+        log_change(filename, "extract", "Extracted title");
+    if (metadata.found & METADATA_DESCRIPTION)
+        log_change(filename, "extract", "Extracted description");
+    if (metadata.found & METADATA_FILE_SIZE)
+        log_change(filename, "extract", "Extracted file_size");
+}
+
+// Compare a raw key with a metadata name, ignoring case like cJSON_GetObjectItem
+static int key_is(const jspan_t *key, const char *name) {
+    size_t len = strlen(name);
+    return (size_t)(key->end - key->start) == len && strncasecmp(key->start, name, len) == 0;
+}
+
+// Metadata field named by a top level key, 0 for other members
+static int metadata_field(const jspan_t *key) {
+    if (key_is(key, "author"))
+        return METADATA_AUTHOR;
+    if (key_is(key, "title"))
+        return METADATA_TITLE;
+    if (key_is(key, "description"))
+        return METADATA_DESCRIPTION;
+    if (key_is(key, "file_size"))
+        return METADATA_FILE_SIZE;
+    return 0;
+}
+
+// Decode the raw text of a JSON string into a field, cut to its size
+static void copy_json_string(char *field, size_t size, const jspan_t *text) {
+    const char *pos = text->start;
+    size_t length = 0;
+    while (pos < text->end) {
+        char decoded[4];
+        int decoded_len = 1;
+        if (*pos == '\\') {
+            pos++;
+            decoded_len = jcursor_decode_escape(&pos, text->end, decoded);
+            if (decoded_len == 0)
+                break;
+        } else {
+            decoded[0] = *pos++;
         }
+        if (length + decoded_len >= size)
+            break;
+        memcpy(field + length, decoded, decoded_len);
+        length += decoded_len;
     }
-    xmlFreeDoc(document);
+    field[length] = '\0';
 }
 
-void extract_metadata_json(const char *filename) {
-    FILE *file = fopen(filename, "r"); /* Open the file in reading mode */
-    if (!file) { /* If the file cannot be opened, print an error message and exit */
-        log_change(filename, "extract", "Failed to open JSON file");
+// Record one top level member, the first member with a name wins even if its value has the wrong type
+static void note_member(FileMetadata *metadata, int *seen, const jspan_t *key, json_type type, const jspan_t *text, double number) {
+    int field = metadata_field(key);
+    if (field == 0 || (*seen & field))
+        return;
+    *seen |= field;
+
+    if (field == METADATA_FILE_SIZE) {
+        if (type == JSON_TYPE_NUMBER) {
+            metadata->file_size = (long long)number;
+            metadata->found |= field;
+        }
         return;
     }
+    if (type != JSON_TYPE_STRING)
+        return;
+    if (field == METADATA_AUTHOR)
+        copy_json_string(metadata->author, sizeof(metadata->author), text);
+    else if (field == METADATA_TITLE)
+        copy_json_string(metadata->title, sizeof(metadata->title), text);
+    else
+        copy_json_string(metadata->description, sizeof(metadata->description), text);
+    metadata->found |= field;
+}
 
-    char buffer[1024]; /* Define the buffer */
-    fread(buffer, 1, sizeof(buffer), file); /* Read the data from the file in the buffer */
-    fclose(file); /* Close the file */
+// Read the top level members from the JSON text itself, returns 0 if the top level cannot be read
+static int scan_json_text(int fd, const struct stat *st, FileMetadata *metadata) {
+    // Map the file, only the pages up to the last metadata member are read
+    char *data = MAP_FAILED;
+    if (st->st_size > 0)
+        data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return 0;
+    madvise(data, st->st_size, MADV_SEQUENTIAL);
 
-    cJSON *json = cJSON_Parse(buffer); /* Parse the buffer to a json node */
-    if (!json) { /* If the node is null, print an error message and exit */
-        log_change(filename, "extract", "Failed to parse JSON");
-        return;
+    jspan_t root;
+    if (!jcursor_document(data, st->st_size, &root)) {
+        munmap(data, st->st_size);
+        return 0;
     }
 
-    cJSON *author = cJSON_GetObjectItem(json, "author"); /* Get the author from the json node */
-    if (cJSON_IsString(author)) {
-        // printf("Author: %s\n", author->valuestring);
-        log_change(filename, "extract", "Extracted author"); /* Log the author data */
+    // One pass over the top level members, nested values are skipped by bracket matching without an index
+    jcursor_t cursor;
+    jspan_t key, value;
+    int seen = 0, valid = 1;
+    if (jcursor_type(&root) == JSON_TYPE_OBJECT && jcursor_enter(&cursor, &root, NULL)) {
+        while (seen != METADATA_ALL && jcursor_next_member(&cursor, &key, &value)) {
+            json_type type = jcursor_type(&value);
+            jspan_t text = { value.start + 1, value.end - 1 }; /* Without the quotes */
+            double number = 0;
+            if (type == JSON_TYPE_NUMBER) {
+                char digits[64];
+                copy_field(digits, sizeof(digits), value.start, value.end - value.start);
+                number = strtod(digits, NULL);
+            }
+            note_member(metadata, &seen, &key, type, &text, number);
+        }
+
+        // Without every field the whole object was read, it has to end where the cursor stopped
+        const char *pos = cursor.pos;
+        while (seen != METADATA_ALL && pos < cursor.end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r'))
+            pos++;
+        valid = seen == METADATA_ALL || pos == cursor.end;
     }
+    munmap(data, st->st_size);
+    return valid;
+}
 
-    cJSON *title = cJSON_GetObjectItem(json, "title"); /* Get the title form the json node */
-    if (cJSON_IsString(title)) {
-        // printf("Title: %s\n", title->valuestring);
-        log_change(filename, "extract", "Extracted title"); /* Log the file title */
+int read_metadata_json(const char *filename, FileMetadata *metadata) {
+    memset(metadata, 0, sizeof(*metadata));
+    filelock_t lock;
+    int fd = filelock_read(filename, &lock); /* Open the file in reading mode, a writer waits for us */
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) {
+            close(fd);
+            filelock_release(&lock);
+        }
+        return 0;
     }
 
-    cJSON *description = cJSON_GetObjectItem(json, "description"); /* Get the file description */
-    if (cJSON_IsString(description)) {
-        // printf("Description: %s\n", description->valuestring);
-        log_change(filename, "extract", "Extracted description"); /* Log the description data */
+    // The tape written at conversion already has the top level members, the text is only read without one
+    doccache_handle_t *handle;
+    jtape_t *tape = jtape_acquire(filename, &st, &handle);
+    if (tape) {
+        jtape_cursor_t cursor;
+        size_t key, value;
+        int seen = 0;
+        if (jtape_enter(&cursor, tape, 0) && jtape_type(tape, 0) == JSON_TYPE_OBJECT) {
+            while (seen != METADATA_ALL && jtape_next_member(&cursor, &key, &value)) {
+                json_type type = jtape_type(tape, value);
+                jspan_t name = jtape_text(tape, key);
+                jspan_t text = type == JSON_TYPE_STRING ? jtape_text(tape, value) : name;
+                note_member(metadata, &seen, &name, type, &text, type == JSON_TYPE_NUMBER ? jtape_number(tape, value) : 0);
+            }
+        }
+        doccache_release(handle);
+    } else if (!scan_json_text(fd, &st, metadata)) {
+        close(fd);
+        filelock_release(&lock);
+        errno = EINVAL;
+        return 0;
     }
+    close(fd);
+    filelock_release(&lock);
+    return 1;
+}
 
-    cJSON *file_size = cJSON_GetObjectItem(json, "file_size"); /* Get the file size */
-    if (cJSON_IsNumber(file_size)) {
-        // printf("File Size: %d\n", file_size->valueint);
-        log_change(filename, "extract", "Extracted file_size"); /* Log the file ize */
+void extract_metadata_json(const char *filename) {
+    FileMetadata metadata;
+    if (!read_metadata_json(filename, &metadata)) { /* If the file cannot be opened or parsed, log it and exit */
+        log_change(filename, "extract", errno == EINVAL ? "Failed to parse JSON" : "Failed to open JSON file");
+        return;
     }
 
-    cJSON_Delete(json); /* Delete the json node */
+    if (metadata.found & METADATA_AUTHOR)
+        log_change(filename, "extract", "Extracted author"); /* Log the author data */
+    if (metadata.found & METADATA_TITLE)
+        log_change(filename, "extract", "Extracted title"); /* Log the file title */
+    if (metadata.found & METADATA_DESCRIPTION)
+        log_change(filename, "extract", "Extracted description"); /* Log the description data */
+    if (metadata.found & METADATA_FILE_SIZE)
+        log_change(filename, "extract", "Extracted file_size"); /* Log the file size */
 }
 
 
 void log_change(const char *filename, const char *change_type, const char *details) {
-    FILE *change_log_file = fopen("changes.log", "a"); /* Open the changes log in appending mode */
-    if (change_log_file == NULL) { /* If the file is null, print an error message and exti */
-        perror("Could not open change log file");
-        return;
-    }
-    time_t now = time(NULL); /* Start the time counter */
-    /* Write the data in th log file */
-    fprintf(change_log_file, "[%s] File: %s, Change: %s, Details: %s\n", ctime(&now), filename, change_type, details); 
-    fclose(change_log_file); /* Close the data*/
+    history_append(filename, change_type, details); /* Indexed, for the admin history command */
+
+    /* Either a record of the binary log or a line queued for the log thread */
+    if (binlog_enabled())
+        binlog_event(BINLOG_CHANGE, filename, change_type, details);
+    else
+        logger_line("changes.log", 1, "File: %s, Change: %s, Details: %s", filename, change_type, details);
 }
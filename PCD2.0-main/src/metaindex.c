@@ -0,0 +1,631 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include "metaindex.h"
+#include "server.h"
+
+/* A word of one field and the files that contain it */
+typedef struct {
+    char *text; /* Field letter, ':' and the word, e.g. "a:doe" */
+    uint32_t *ids; /* Sorted IDs of the files */
+    uint32_t count;
+    uint32_t capacity;
+} term_t;
+
+/* A file known to the index, IDs are positions in `files` and are never reused */
+typedef struct {
+    char *path; /* Absolute path, kept after removal so a new file at the same path gets the same ID */
+    term_t **terms; /* Terms that list this file */
+    uint32_t term_count;
+    long long file_size;
+    int has_size; /* The file is in the size list */
+} file_t;
+
+/* Entry of the size list */
+typedef struct {
+    long long size;
+    uint32_t id;
+} size_entry_t;
+
+/* A sorted list of file IDs built while answering a query */
+typedef struct {
+    uint32_t *ids;
+    size_t count;
+} idlist_t;
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static file_t *files; /* ID 0 is never used */
+static uint32_t file_count = 1;
+static uint32_t file_capacity;
+static uint32_t *path_slots; /* Open addressing table of IDs by path, 0 when empty */
+static size_t path_slot_count;
+
+static term_t **term_slots; /* Open addressing table of terms by text */
+static size_t term_slot_count;
+static size_t term_count;
+static term_t **sorted_terms; /* Terms in text order, for prefixes; rebuilt after new terms appear */
+static size_t sorted_count;
+static int sorted_dirty;
+
+static size_entry_t *sizes; /* Sorted by size, then ID */
+static size_t size_count;
+static size_t size_capacity;
+
+static const struct {
+    const char *name;
+    char letter;
+} fields[] = { { "author", 'a' }, { "title", 't' }, { "description", 'd' } };
+#define FIELD_COUNT 3
+
+static uint64_t hash_text(const char *text) {
+    uint64_t hash = 1469598103934665603ULL; /* FNV-1a */
+    while (*text) {
+        hash ^= (unsigned char)*text++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int has_suffix(const char *text, const char *suffix) {
+    size_t len = strlen(text), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(text + len - suffix_len, suffix) == 0;
+}
+
+static int isalnum_ascii(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Read the next word of a text: letters and digits, lowercased; bytes of UTF-8 sequences are kept as they are
+static size_t next_word(const char **pos, char word[METAINDEX_MAX_WORD]) {
+    const unsigned char *p = (const unsigned char *)*pos;
+    size_t len = 0;
+    while (*p && !(isalnum_ascii(*p) || *p >= 0x80))
+        p++;
+    while (*p && (isalnum_ascii(*p) || *p >= 0x80)) {
+        if (len < METAINDEX_MAX_WORD - 1)
+            word[len++] = (*p >= 'A' && *p <= 'Z') ? *p + ('a' - 'A') : *p;
+        p++;
+    }
+    word[len] = '\0';
+    *pos = (const char *)p;
+    return len;
+}
+
+/* Grow an array to hold `needed` items */
+static int reserve(void **buffer, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity)
+        return 1;
+    size_t new_capacity = *capacity ? *capacity : 16;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    void *grown = realloc(*buffer, new_capacity * item_size);
+    if (!grown)
+        return 0;
+    *buffer = grown;
+    *capacity = new_capacity;
+    return 1;
+}
+
+// Find a file ID by path, 0 if the path was never indexed
+static uint32_t find_file(const char *path) {
+    if (!path_slot_count)
+        return 0;
+    for (size_t slot = hash_text(path) & (path_slot_count - 1);; slot = (slot + 1) & (path_slot_count - 1)) {
+        uint32_t id = path_slots[slot];
+        if (id == 0 || strcmp(files[id].path, path) == 0)
+            return id;
+    }
+}
+
+// Find or create the ID of a path, 0 when out of memory
+static uint32_t file_for(const char *path) {
+    uint32_t id = find_file(path);
+    if (id)
+        return id;
+
+    if (file_count * 2 >= path_slot_count) { /* Keep the table at most half full */
+        size_t new_count = path_slot_count ? path_slot_count * 2 : 1024;
+        uint32_t *slots = (uint32_t *)calloc(new_count, sizeof(uint32_t));
+        if (!slots)
+            return 0;
+        for (uint32_t i = 1; i < file_count; i++) {
+            size_t slot = hash_text(files[i].path) & (new_count - 1);
+            while (slots[slot])
+                slot = (slot + 1) & (new_count - 1);
+            slots[slot] = i;
+        }
+        free(path_slots);
+        path_slots = slots;
+        path_slot_count = new_count;
+    }
+
+    size_t capacity = file_capacity;
+    char *copy = strdup(path);
+    if (!copy || !reserve((void **)&files, &capacity, file_count + 1, sizeof(file_t))) {
+        free(copy);
+        return 0;
+    }
+    file_capacity = capacity;
+    id = file_count++;
+    memset(&files[id], 0, sizeof(file_t));
+    files[id].path = copy;
+
+    size_t slot = hash_text(path) & (path_slot_count - 1);
+    while (path_slots[slot])
+        slot = (slot + 1) & (path_slot_count - 1);
+    path_slots[slot] = id;
+    return id;
+}
+
+static term_t *find_term(const char *text) {
+    if (!term_slot_count)
+        return NULL;
+    for (size_t slot = hash_text(text) & (term_slot_count - 1);; slot = (slot + 1) & (term_slot_count - 1)) {
+        term_t *term = term_slots[slot];
+        if (!term || strcmp(term->text, text) == 0)
+            return term;
+    }
+}
+
+// Find or create a term, NULL when out of memory
+static term_t *term_for(const char *text) {
+    term_t *term = find_term(text);
+    if (term)
+        return term;
+
+    if ((term_count + 1) * 2 >= term_slot_count) {
+        size_t new_count = term_slot_count ? term_slot_count * 2 : 1024;
+        term_t **slots = (term_t **)calloc(new_count, sizeof(term_t *));
+        if (!slots)
+            return NULL;
+        for (size_t i = 0; i < term_slot_count; i++) {
+            if (!term_slots[i])
+                continue;
+            size_t slot = hash_text(term_slots[i]->text) & (new_count - 1);
+            while (slots[slot])
+                slot = (slot + 1) & (new_count - 1);
+            slots[slot] = term_slots[i];
+        }
+        free(term_slots);
+        term_slots = slots;
+        term_slot_count = new_count;
+    }
+
+    term = (term_t *)calloc(1, sizeof(term_t));
+    if (!term || !(term->text = strdup(text))) {
+        free(term);
+        return NULL;
+    }
+    size_t slot = hash_text(text) & (term_slot_count - 1);
+    while (term_slots[slot])
+        slot = (slot + 1) & (term_slot_count - 1);
+    term_slots[slot] = term;
+    term_count++;
+    sorted_dirty = 1;
+    return term;
+}
+
+// First position in a sorted ID list that is not below `id`
+static size_t lower_bound(const uint32_t *ids, size_t count, uint32_t id) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (ids[middle] < id)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// Add a file to a posting list, returns 0 if it was already there or memory ran out
+static int posting_add(term_t *term, uint32_t id) {
+    size_t at = lower_bound(term->ids, term->count, id); /* New files have the highest ID, this is usually an append */
+    if (at < term->count && term->ids[at] == id)
+        return 0;
+    size_t capacity = term->capacity;
+    if (!reserve((void **)&term->ids, &capacity, term->count + 1, sizeof(uint32_t)))
+        return 0;
+    term->capacity = capacity;
+    memmove(term->ids + at + 1, term->ids + at, (term->count - at) * sizeof(uint32_t));
+    term->ids[at] = id;
+    term->count++;
+    return 1;
+}
+
+static void posting_remove(term_t *term, uint32_t id) {
+    size_t at = lower_bound(term->ids, term->count, id);
+    if (at < term->count && term->ids[at] == id) {
+        memmove(term->ids + at, term->ids + at + 1, (term->count - at - 1) * sizeof(uint32_t));
+        term->count--;
+    }
+}
+
+// Position of a (size, ID) pair in the size list, or of the first pair after it
+static size_t size_position(long long size, uint32_t id) {
+    size_t low = 0, high = size_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (sizes[middle].size < size || (sizes[middle].size == size && sizes[middle].id < id))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// Remove everything a file contributed to the index, keeping its ID
+static void clear_file(uint32_t id) {
+    file_t *file = &files[id];
+    for (uint32_t i = 0; i < file->term_count; i++)
+        posting_remove(file->terms[i], id);
+    free(file->terms);
+    file->terms = NULL;
+    file->term_count = 0;
+
+    if (file->has_size) {
+        size_t at = size_position(file->file_size, id);
+        if (at < size_count && sizes[at].id == id) {
+            memmove(sizes + at, sizes + at + 1, (size_count - at - 1) * sizeof(size_entry_t));
+            size_count--;
+        }
+        file->has_size = 0;
+    }
+}
+
+// Index the words of one field of a file
+static void add_field(uint32_t id, char letter, const char *text, size_t *capacity) {
+    file_t *file = &files[id];
+    char word[METAINDEX_MAX_WORD], key[METAINDEX_MAX_WORD + 2];
+    while (next_word(&text, word)) {
+        snprintf(key, sizeof(key), "%c:%s", letter, word);
+        term_t *term = term_for(key);
+        if (!term || !posting_add(term, id)) /* Repeated words are listed once */
+            continue;
+        if (!reserve((void **)&file->terms, capacity, file->term_count + 1, sizeof(term_t *))) {
+            posting_remove(term, id);
+            continue;
+        }
+        file->terms[file->term_count++] = term;
+    }
+}
+
+// Canonical form of a path, the path itself once the file is gone
+static void canonical_path(const char *path, char resolved[PATH_MAX]) {
+    if (!realpath(path, resolved))
+        snprintf(resolved, PATH_MAX, "%s", path);
+}
+
+int metaindex_update(const char *path) {
+    char resolved[PATH_MAX];
+    canonical_path(path, resolved);
+
+    // Read the metadata before taking the lock
+    FileMetadata metadata;
+    int ok;
+    if (has_suffix(resolved, ".json"))
+        ok = read_metadata_json(resolved, &metadata);
+    else if (has_suffix(resolved, ".xml"))
+        ok = read_metadata_xml(resolved, &metadata);
+    else
+        return 0;
+    if (!ok) { /* Unreadable now, whatever was indexed before is wrong */
+        metaindex_remove(resolved);
+        return 0;
+    }
+    return metaindex_put(resolved, &metadata);
+}
+
+int metaindex_put(const char *path, const FileMetadata *metadata) {
+    char resolved[PATH_MAX];
+    canonical_path(path, resolved);
+
+    pthread_rwlock_wrlock(&index_lock);
+    uint32_t id = file_for(resolved);
+    if (id) {
+        clear_file(id);
+        size_t capacity = 0;
+        if (metadata->found & METADATA_AUTHOR)
+            add_field(id, 'a', metadata->author, &capacity);
+        if (metadata->found & METADATA_TITLE)
+            add_field(id, 't', metadata->title, &capacity);
+        if (metadata->found & METADATA_DESCRIPTION)
+            add_field(id, 'd', metadata->description, &capacity);
+        if ((metadata->found & METADATA_FILE_SIZE) && reserve((void **)&sizes, &size_capacity, size_count + 1, sizeof(size_entry_t))) {
+            size_t at = size_position(metadata->file_size, id);
+            memmove(sizes + at + 1, sizes + at, (size_count - at) * sizeof(size_entry_t));
+            sizes[at].size = metadata->file_size;
+            sizes[at].id = id;
+            size_count++;
+            files[id].file_size = metadata->file_size;
+            files[id].has_size = 1;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return id != 0;
+}
+
+void metaindex_remove(const char *path) {
+    char resolved[PATH_MAX];
+    canonical_path(path, resolved);
+
+    pthread_rwlock_wrlock(&index_lock);
+    uint32_t id = find_file(resolved);
+    if (id)
+        clear_file(id);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+static int compare_terms(const void *a, const void *b) {
+    return strcmp((*(term_t *const *)a)->text, (*(term_t *const *)b)->text);
+}
+
+// Sort the terms again if new ones appeared, needs the write lock
+static void sort_terms(void) {
+    term_t **sorted = (term_t **)realloc(sorted_terms, (term_count ? term_count : 1) * sizeof(term_t *));
+    if (!sorted)
+        return;
+    sorted_terms = sorted;
+    sorted_count = 0;
+    for (size_t i = 0; i < term_slot_count; i++) {
+        if (term_slots[i])
+            sorted_terms[sorted_count++] = term_slots[i];
+    }
+    qsort(sorted_terms, sorted_count, sizeof(term_t *), compare_terms);
+    sorted_dirty = 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Turn a list of IDs with repeats into a sorted set
+static void sort_unique(idlist_t *list) {
+    if (list->count < 2)
+        return;
+    qsort(list->ids, list->count, sizeof(uint32_t), compare_ids);
+    size_t kept = 1;
+    for (size_t i = 1; i < list->count; i++) {
+        if (list->ids[i] != list->ids[kept - 1])
+            list->ids[kept++] = list->ids[i];
+    }
+    list->count = kept;
+}
+
+// Append the IDs of a posting list, returns 0 when out of memory
+static int append_ids(idlist_t *list, size_t *capacity, const uint32_t *ids, size_t count) {
+    if (!reserve((void **)&list->ids, capacity, list->count + count, sizeof(uint32_t)))
+        return 0;
+    memcpy(list->ids + list->count, ids, count * sizeof(uint32_t));
+    list->count += count;
+    return 1;
+}
+
+// Files whose field `letter` has the word, or a word starting with it
+static int collect_word(idlist_t *list, size_t *capacity, char letter, const char *word, int prefix) {
+    char key[METAINDEX_MAX_WORD + 2];
+    snprintf(key, sizeof(key), "%c:%s", letter, word);
+    if (!prefix) {
+        term_t *term = find_term(key);
+        return !term || append_ids(list, capacity, term->ids, term->count);
+    }
+
+    // Every term in the sorted range that starts with the key
+    size_t key_len = strlen(key), low = 0, high = sorted_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strcmp(sorted_terms[middle]->text, key) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    for (; low < sorted_count && strncmp(sorted_terms[low]->text, key, key_len) == 0; low++) {
+        if (!append_ids(list, capacity, sorted_terms[low]->ids, sorted_terms[low]->count))
+            return 0;
+    }
+    return 1;
+}
+
+// Keep the IDs of `a` that are also in `b`, walking the shorter list and binary searching the longer one
+static void intersect(idlist_t *a, const idlist_t *b) {
+    const idlist_t *walk = a->count <= b->count ? a : b, *search = walk == a ? b : a;
+    size_t kept = 0, from = 0;
+    for (size_t i = 0; i < walk->count && from < search->count; i++) {
+        uint32_t id = walk->ids[i];
+        from += lower_bound(search->ids + from, search->count - from, id);
+        if (from < search->count && search->ids[from] == id)
+            a->ids[kept++] = id; /* Never ahead of the position read in `a` */
+    }
+    a->count = kept;
+}
+
+// Parse a whole number bound of a size range, an empty bound keeps the default
+static int parse_bound(const char *start, const char *end, long long *value) {
+    if (start == end)
+        return 1;
+    char number[32];
+    if ((size_t)(end - start) >= sizeof(number))
+        return 0;
+    memcpy(number, start, end - start);
+    number[end - start] = '\0';
+    char *stop;
+    *value = strtoll(number, &stop, 10);
+    return *stop == '\0';
+}
+
+// Evaluate one operand of a query into a sorted set of IDs
+static const char *eval_operand(const char *operand, idlist_t *list) {
+    size_t capacity = 0;
+    const char *colon = strchr(operand, ':');
+    list->ids = NULL;
+    list->count = 0;
+
+    // size:lo..hi, size:n
+    if (colon && (size_t)(colon - operand) == 4 && strncmp(operand, "size", 4) == 0) {
+        const char *range = colon + 1, *dots = strstr(range, "..");
+        long long low = LLONG_MIN, high = LLONG_MAX;
+        if (dots ? !parse_bound(range, dots, &low) || !parse_bound(dots + 2, range + strlen(range), &high)
+                 : !*range || !parse_bound(range, range + strlen(range), &low))
+            return "bad size range";
+        if (!dots)
+            high = low;
+        for (size_t at = size_position(low, 0); at < size_count && sizes[at].size <= high; at++) {
+            if (!append_ids(list, &capacity, &sizes[at].id, 1))
+                return "out of memory";
+        }
+        sort_unique(list);
+        return NULL;
+    }
+
+    // [field:]words[*]
+    int field = -1;
+    const char *text = operand;
+    if (colon) {
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            if ((size_t)(colon - operand) == strlen(fields[i].name) && strncmp(operand, fields[i].name, colon - operand) == 0)
+                field = i;
+        }
+        if (field < 0)
+            return "unknown field";
+        text = colon + 1;
+    }
+    int prefix = text[0] && text[strlen(text) - 1] == '*';
+
+    // Words split by punctuation must all be there, the prefix applies to the last one
+    char word[METAINDEX_MAX_WORD];
+    int words = 0;
+    const char *pos = text;
+    while (next_word(&pos, word)) {
+        char next[METAINDEX_MAX_WORD];
+        const char *after = pos;
+        int last = next_word(&after, next) == 0;
+
+        idlist_t found = { NULL, 0 };
+        size_t found_capacity = 0;
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            if ((field < 0 || field == i) && !collect_word(&found, &found_capacity, fields[i].letter, word, prefix && last)) {
+                free(found.ids);
+                return "out of memory";
+            }
+        }
+        if ((prefix && last) || field < 0) /* Lists of several terms overlap */
+            sort_unique(&found);
+
+        if (words++ == 0) {
+            free(list->ids);
+            *list = found;
+        } else {
+            intersect(list, &found);
+            free(found.ids);
+        }
+    }
+    return words ? NULL : "empty term";
+}
+
+int metaindex_find(const char *query, metaindex_result_t *result, const char **error) {
+    memset(result, 0, sizeof(*result));
+    *error = NULL;
+
+    // Copy the query to split it in place
+    char *text = strdup(query);
+    if (!text) {
+        *error = "out of memory";
+        return 0;
+    }
+    char *operands[64];
+    int count = 0;
+    for (char *token = strtok(text, " \t"); token; token = strtok(NULL, " \t")) {
+        if (count == 64) {
+            *error = "too many terms";
+            free(text);
+            return 0;
+        }
+        operands[count++] = token;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    if (sorted_dirty && strchr(query, '*')) { /* Prefixes need the terms in order */
+        pthread_rwlock_unlock(&index_lock);
+        pthread_rwlock_wrlock(&index_lock);
+        if (sorted_dirty)
+            sort_terms();
+        pthread_rwlock_unlock(&index_lock);
+        pthread_rwlock_rdlock(&index_lock);
+    }
+
+    // OR of groups of operands joined by AND
+    idlist_t matches = { NULL, 0 }, group = { NULL, 0 };
+    size_t matches_capacity = 0;
+    int group_size = 0, expect_operand = 1;
+    for (int i = 0; i <= count && !*error; i++) {
+        int is_or = i < count && strcasecmp(operands[i], "OR") == 0;
+        if (i == count || is_or) { /* Close the group */
+            if (expect_operand) {
+                *error = "missing term";
+                break;
+            }
+            if (!append_ids(&matches, &matches_capacity, group.ids, group.count))
+                *error = "out of memory";
+            free(group.ids);
+            group.ids = NULL;
+            group.count = 0;
+            group_size = 0;
+            expect_operand = 1;
+            continue;
+        }
+        if (strcasecmp(operands[i], "AND") == 0) {
+            if (expect_operand)
+                *error = "missing term";
+            expect_operand = 1;
+            continue;
+        }
+
+        idlist_t list;
+        *error = eval_operand(operands[i], &list);
+        if (*error) {
+            free(list.ids);
+            break;
+        }
+        if (group_size++ == 0) {
+            group = list;
+        } else {
+            intersect(&group, &list);
+            free(list.ids);
+        }
+        expect_operand = 0;
+    }
+    free(group.ids);
+    free(text);
+    if (*error) {
+        pthread_rwlock_unlock(&index_lock);
+        free(matches.ids);
+        return 0;
+    }
+    sort_unique(&matches);
+
+    // Copy the paths while the files cannot go away
+    result->total = matches.count;
+    result->paths = (char **)malloc(sizeof(char *) * (matches.count < METAINDEX_MAX_RESULTS ? matches.count + 1 : METAINDEX_MAX_RESULTS));
+    for (size_t i = 0; result->paths && i < matches.count && result->count < METAINDEX_MAX_RESULTS; i++) {
+        char *path = strdup(files[matches.ids[i]].path);
+        if (!path)
+            break;
+        result->paths[result->count++] = path;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    free(matches.ids);
+    return 1;
+}
+
+void metaindex_result_free(metaindex_result_t *result) {
+    for (size_t i = 0; i < result->count; i++)
+        free(result->paths[i]);
+    free(result->paths);
+    memset(result, 0, sizeof(*result));
+}
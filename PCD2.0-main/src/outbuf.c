@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "outbuf.h"
+
+void outbuf_init(outbuf_t *out, int fd, int is_socket) {
+    out->fd = fd;
+    out->is_socket = is_socket;
+    out->error = 0;
+    out->length = 0;
+    out->total = 0;
+    out->memory = NULL;
+    out->memory_length = out->memory_capacity = out->memory_limit = 0;
+    out->discard = 0;
+}
+
+void outbuf_init_discard(outbuf_t *out) {
+    outbuf_init(out, -1, 0);
+    out->discard = 1;
+}
+
+void outbuf_init_memory(outbuf_t *out, size_t limit) {
+    outbuf_init(out, -1, 0);
+    out->memory_limit = limit;
+}
+
+// Append the buffer to the memory destination, growing it up to its limit
+static int flush_to_memory(outbuf_t *out) {
+    size_t needed = out->memory_length + out->length;
+    if (needed > out->memory_limit) {
+        out->error = ENOBUFS;
+        out->length = 0;
+        return 0;
+    }
+    if (needed > out->memory_capacity) {
+        size_t capacity = out->memory_capacity ? out->memory_capacity : OUTBUF_SIZE;
+        while (capacity < needed)
+            capacity *= 2;
+        char *grown = (char *)realloc(out->memory, capacity < out->memory_limit ? capacity : out->memory_limit);
+        if (!grown) {
+            out->error = ENOMEM;
+            out->length = 0;
+            return 0;
+        }
+        out->memory = grown;
+        out->memory_capacity = capacity < out->memory_limit ? capacity : out->memory_limit;
+    }
+    memcpy(out->memory + out->memory_length, out->data, out->length);
+    out->memory_length = needed;
+    out->length = 0;
+    return 1;
+}
+
+// Write the whole buffer to the destination, retrying on short writes
+int outbuf_flush(outbuf_t *out) {
+    size_t done = 0;
+
+    if (out->error) { /* A previous write failed, drop the data */
+        out->length = 0;
+        return 0;
+    }
+    if (out->discard) {
+        out->length = 0;
+        return 1;
+    }
+    if (out->fd < 0)
+        return flush_to_memory(out);
+
+    while (done < out->length) {
+        ssize_t n;
+        if (out->is_socket)
+            n = send(out->fd, out->data + done, out->length - done, MSG_NOSIGNAL);
+        else
+            n = write(out->fd, out->data + done, out->length - done);
+
+        if (n < 0) {
+            if (errno == EINTR) /* Interrupted by a signal, try again */
+                continue;
+            out->error = errno;
+            out->length = 0;
+            return 0;
+        }
+        done += n;
+    }
+
+    out->length = 0; /* Everything was written, reset the buffer */
+    return 1;
+}
+
+int outbuf_write(outbuf_t *out, const void *data, size_t size) {
+    const char *bytes = (const char *)data;
+
+    while (size > 0) {
+        if (out->length == OUTBUF_SIZE && !outbuf_flush(out))
+            return 0;
+
+        size_t room = OUTBUF_SIZE - out->length; /* Free space left in the buffer */
+        size_t chunk = size < room ? size : room;
+        memcpy(out->data + out->length, bytes, chunk);
+        out->length += chunk;
+        out->total += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    return !out->error;
+}
+
+int outbuf_puts(outbuf_t *out, const char *str) {
+    return outbuf_write(out, str, strlen(str));
+}
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include "pathindex.h"
+#include "tagindex.h"
+#include "outbuf.h"
+
+/* An index file mapped in memory, the document type kept by doccache_pathindex */
+typedef struct {
+    void *map;
+    size_t size;
+    const pathindex_header_t *header;
+    const pathindex_entry_t *entries;
+    const char *strings;
+} pathindex_t;
+
+/* Entries and paths collected while walking a document */
+typedef struct {
+    const char *base; /* Start of the JSON text, offsets are relative to it */
+    const jindex_t *index;
+    pathindex_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    char *strings; /* Pool of paths */
+    size_t strings_size;
+    size_t strings_capacity;
+    char *path; /* Path of the value being visited */
+    size_t path_len;
+    size_t path_capacity;
+    int failed; /* Out of memory or over the 4 GB limit of the pool */
+} builder_t;
+
+static int reserve(void **buffer, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity)
+        return 1;
+    size_t new_capacity = *capacity ? *capacity : 256;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    void *grown = realloc(*buffer, new_capacity * item_size);
+    if (!grown)
+        return 0;
+    *buffer = grown;
+    *capacity = new_capacity;
+    return 1;
+}
+
+static void add_entry(builder_t *b, const jspan_t *value) {
+    if (!reserve((void **)&b->entries, &b->capacity, b->count + 1, sizeof(pathindex_entry_t)) ||
+        !reserve((void **)&b->strings, &b->strings_capacity, b->strings_size + b->path_len, 1) ||
+        b->strings_size + b->path_len > UINT32_MAX) {
+        b->failed = 1;
+        return;
+    }
+
+    pathindex_entry_t *entry = &b->entries[b->count++];
+    entry->value_offset = (uint32_t)(value->start - b->base);
+    entry->value_length = (uint32_t)(value->end - value->start);
+    entry->path_offset = (uint32_t)b->strings_size;
+    entry->path_length = (uint32_t)b->path_len;
+    memcpy(b->strings + b->strings_size, b->path, b->path_len);
+    b->strings_size += b->path_len;
+}
+
+// Append a step to the current path, returns the length to restore afterwards
+static size_t push_step(builder_t *b, const char *prefix, const char *text, size_t text_len) {
+    size_t saved = b->path_len;
+    size_t prefix_len = strlen(prefix);
+    if (!reserve((void **)&b->path, &b->path_capacity, b->path_len + prefix_len + text_len, 1)) {
+        b->failed = 1;
+        return saved;
+    }
+    memcpy(b->path + b->path_len, prefix, prefix_len);
+    memcpy(b->path + b->path_len + prefix_len, text, text_len);
+    b->path_len += prefix_len + text_len;
+    return saved;
+}
+
+// Record the value and, for containers, everything below it
+static void walk(builder_t *b, const jspan_t *value) {
+    jcursor_t cursor;
+    jspan_t key, child;
+
+    add_entry(b, value);
+    if (b->failed || !jcursor_enter(&cursor, value, b->index))
+        return;
+
+    if (jcursor_type(value) == JSON_TYPE_OBJECT) {
+        tagindex_t seen; /* Names met so far in this object, only the first of each is reachable */
+        if (!tagindex_init(&seen, 8, 0)) {
+            b->failed = 1;
+            return;
+        }
+        while (!b->failed && jcursor_next_member(&cursor, &key, &child)) {
+            size_t key_len = key.end - key.start;
+            int created;
+            if (key_len == 0 || memchr(key.start, '.', key_len) || memchr(key.start, '[', key_len) || memchr(key.start, '\\', key_len))
+                continue; /* Not expressible as a plain path */
+            if (!tagindex_get(&seen, key.start, key_len, &created)) {
+                b->failed = 1;
+                break;
+            }
+            if (!created)
+                continue;
+            size_t saved = push_step(b, b->path_len ? "." : "", key.start, key_len);
+            walk(b, &child);
+            b->path_len = saved;
+        }
+        tagindex_free(&seen);
+    } else {
+        while (!b->failed && jcursor_next_element(&cursor, &child)) {
+            char step[32];
+            int step_len = snprintf(step, sizeof(step), "[%d]", cursor.count - 1);
+            size_t saved = push_step(b, "", step, step_len);
+            walk(b, &child);
+            b->path_len = saved;
+        }
+    }
+}
+
+static __thread const char *sort_strings; /* Pool used by compare_entries */
+
+static int compare_paths(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int order = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (order != 0)
+        return order;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const pathindex_entry_t *x = (const pathindex_entry_t *)a, *y = (const pathindex_entry_t *)b;
+    return compare_paths(sort_strings + x->path_offset, x->path_length, sort_strings + y->path_offset, y->path_length);
+}
+
+int pathindex_write(const char *json_path, const json_document_t *document) {
+    builder_t b;
+    memset(&b, 0, sizeof(b));
+    b.base = document->data;
+    b.index = &document->index;
+
+    walk(&b, &document->root);
+    if (b.failed) {
+        free(b.entries);
+        free(b.strings);
+        free(b.path);
+        return 0;
+    }
+    sort_strings = b.strings;
+    qsort(b.entries, b.count, sizeof(pathindex_entry_t), compare_entries);
+
+    pathindex_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PATHINDEX_MAGIC, sizeof(header.magic));
+    header.version = PATHINDEX_VERSION;
+    header.json_size = document->size;
+    header.json_mtime_sec = document->mtime.tv_sec;
+    header.json_mtime_nsec = document->mtime.tv_nsec;
+    header.count = b.count;
+    header.strings_size = b.strings_size;
+
+    // Write next to the JSON file and rename, readers never see a partial index
+    char temp_path[PATH_MAX];
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    int fd = -1, ok = 0;
+    if (out && snprintf(temp_path, sizeof(temp_path), "%s%s.XXXXXX", json_path, PATHINDEX_SUFFIX) < (int)sizeof(temp_path))
+        fd = mkstemp(temp_path);
+    if (fd >= 0) {
+        outbuf_init(out, fd, 0);
+        outbuf_write(out, &header, sizeof(header));
+        outbuf_write(out, b.entries, sizeof(pathindex_entry_t) * b.count);
+        outbuf_write(out, b.strings, b.strings_size);
+        ok = outbuf_flush(out) && fchmod(fd, 0644) == 0;
+        close(fd);
+
+        char index_path[PATH_MAX];
+        snprintf(index_path, sizeof(index_path), "%s%s", json_path, PATHINDEX_SUFFIX);
+        if (!ok || rename(temp_path, index_path) < 0) {
+            perror("Failed to write path index");
+            unlink(temp_path);
+            ok = 0;
+        }
+    }
+
+    free(out);
+    free(b.entries);
+    free(b.strings);
+    free(b.path);
+    return ok;
+}
+
+int pathindex_build(const char *json_path) {
+    doccache_handle_t *handle;
+    json_document_t *document = doccache_acquire(json_path, &doccache_json, &handle);
+    if (!document)
+        return 0;
+    int ok = pathindex_write(json_path, document);
+    doccache_release(handle);
+    return ok;
+}
+
+pathindex_result pathindex_find(const char *json_path, const struct stat *json_st, const char *path, uint64_t *offset, uint64_t *length) {
+    char index_path[PATH_MAX];
+    if (snprintf(index_path, sizeof(index_path), "%s%s", json_path, PATHINDEX_SUFFIX) >= (int)sizeof(index_path))
+        return PATHINDEX_STALE;
+
+    doccache_handle_t *handle;
+    pathindex_t *index = doccache_acquire(index_path, &doccache_pathindex, &handle);
+    if (!index)
+        return PATHINDEX_STALE;
+
+    // The index must describe this exact version of the JSON file
+    const pathindex_header_t *header = index->header;
+    if (header->json_size != (uint64_t)json_st->st_size || header->json_mtime_sec != json_st->st_mtim.tv_sec || header->json_mtime_nsec != json_st->st_mtim.tv_nsec) {
+        doccache_release(handle);
+        return PATHINDEX_STALE;
+    }
+
+    pathindex_result result = PATHINDEX_NOT_INDEXED;
+    size_t path_len = strlen(path), low = 0, high = header->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const pathindex_entry_t *entry = &index->entries[middle];
+        if ((uint64_t)entry->path_offset + entry->path_length > header->strings_size) { /* Damaged index */
+            result = PATHINDEX_STALE;
+            break;
+        }
+        int order = compare_paths(index->strings + entry->path_offset, entry->path_length, path, path_len);
+        if (order == 0) {
+            if ((uint64_t)entry->value_offset + entry->value_length > header->json_size) {
+                result = PATHINDEX_STALE;
+                break;
+            }
+            *offset = entry->value_offset;
+            *length = entry->value_length;
+            result = PATHINDEX_FOUND;
+            break;
+        }
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    doccache_release(handle);
+    return result;
+}
+
+// Map an index file and check that its parts fit in it
+static void *load_index(int fd, const struct stat *st, size_t *bytes) {
+    if ((size_t)st->st_size < sizeof(pathindex_header_t))
+        return NULL;
+
+    void *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const pathindex_header_t *header = (const pathindex_header_t *)map;
+    size_t entries_size = header->count * sizeof(pathindex_entry_t);
+    if (memcmp(header->magic, PATHINDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != PATHINDEX_VERSION ||
+        header->count > (st->st_size - sizeof(pathindex_header_t)) / sizeof(pathindex_entry_t) ||
+        header->strings_size != st->st_size - sizeof(pathindex_header_t) - entries_size) {
+        munmap(map, st->st_size);
+        return NULL;
+    }
+
+    pathindex_t *index = (pathindex_t *)malloc(sizeof(pathindex_t));
+    if (!index) {
+        munmap(map, st->st_size);
+        return NULL;
+    }
+    index->map = map;
+    index->size = st->st_size;
+    index->header = header;
+    index->entries = (const pathindex_entry_t *)(header + 1);
+    index->strings = (const char *)(index->entries + header->count);
+
+    *bytes = sizeof(pathindex_t) + st->st_size;
+    return index;
+}
+
+static void free_index(void *data) {
+    pathindex_t *index = (pathindex_t *)data;
+    munmap(index->map, index->size);
+    free(index);
+}
+
+const doccache_type_t doccache_pathindex = { "path index", load_index, free_index };
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "ptable.h"
+
+#define WRITE_IOVECS 64 /* Pieces handed to one writev */
+
+enum { ORIGINAL, ADDED };
+
+/* A buffer the pieces point into, with the offsets of its newlines */
+typedef struct {
+    const char *data;
+    size_t length;
+    size_t *newlines; /* Sorted */
+    size_t newline_count;
+    size_t newline_capacity;
+} source_t;
+
+/* A piece, and the subtree it is the root of */
+typedef struct node {
+    int source;
+    size_t start; /* In its source */
+    size_t length;
+    size_t newlines; /* Newlines in the piece */
+    uint32_t priority; /* Treap heap order */
+    struct node *left;
+    struct node *right;
+    size_t total_length; /* Bytes of the subtree */
+    size_t total_newlines; /* Newlines of the subtree */
+} node_t;
+
+struct ptable {
+    source_t sources[2];
+    void *map;
+    size_t map_size;
+    char *added; /* Writable view of the add buffer */
+    size_t added_capacity;
+    node_t *root;
+    uint32_t seed;
+};
+
+static size_t subtree_length(const node_t *node) {
+    return node ? node->total_length : 0;
+}
+
+static size_t subtree_newlines(const node_t *node) {
+    return node ? node->total_newlines : 0;
+}
+
+static void update(node_t *node) {
+    node->total_length = subtree_length(node->left) + node->length + subtree_length(node->right);
+    node->total_newlines = subtree_newlines(node->left) + node->newlines + subtree_newlines(node->right);
+}
+
+// First newline of a source at or after an offset
+static size_t newline_rank(const source_t *source, size_t offset) {
+    size_t low = 0, high = source->newline_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (source->newlines[middle] < offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+static size_t count_newlines(const source_t *source, size_t start, size_t length) {
+    return newline_rank(source, start + length) - newline_rank(source, start);
+}
+
+// Record the newlines of bytes just added to a source
+static int index_newlines(source_t *source, size_t start, size_t length) {
+    const char *data = source->data + start, *end = data + length;
+    while ((data = (const char *)memchr(data, '\n', end - data)) != NULL) {
+        if (source->newline_count == source->newline_capacity) {
+            size_t capacity = source->newline_capacity ? source->newline_capacity * 2 : 256;
+            size_t *grown = (size_t *)realloc(source->newlines, capacity * sizeof(size_t));
+            if (!grown)
+                return 0;
+            source->newlines = grown;
+            source->newline_capacity = capacity;
+        }
+        source->newlines[source->newline_count++] = data - source->data;
+        data++;
+    }
+    return 1;
+}
+
+static node_t *new_node(ptable_t *table, int source, size_t start, size_t length) {
+    node_t *node = (node_t *)calloc(1, sizeof(node_t));
+    if (!node)
+        return NULL;
+    table->seed ^= table->seed << 13; /* xorshift32 */
+    table->seed ^= table->seed >> 17;
+    table->seed ^= table->seed << 5;
+    node->source = source;
+    node->start = start;
+    node->length = length;
+    node->newlines = count_newlines(&table->sources[source], start, length);
+    node->priority = table->seed;
+    update(node);
+    return node;
+}
+
+static void free_tree(node_t *node) {
+    while (node) {
+        free_tree(node->left);
+        node_t *right = node->right;
+        free(node);
+        node = right;
+    }
+}
+
+// Concatenate two trees, every byte of `left` coming first
+static node_t *merge(node_t *left, node_t *right) {
+    if (!left)
+        return right;
+    if (!right)
+        return left;
+    if (left->priority > right->priority) {
+        left->right = merge(left->right, right);
+        update(left);
+        return left;
+    }
+    right->left = merge(left, right->left);
+    update(right);
+    return right;
+}
+
+// Split a tree at a byte offset; a piece that spans it keeps its first part and the rest is handed back as `tail`
+static int split_tree(ptable_t *table, node_t *node, size_t offset, node_t **left, node_t **right, node_t **tail) {
+    if (!node) {
+        *left = *right = NULL;
+        return 1;
+    }
+    size_t before = subtree_length(node->left);
+    if (offset <= before) {
+        node_t *inner;
+        if (!split_tree(table, node->left, offset, left, &inner, tail))
+            return 0;
+        node->left = inner;
+        update(node);
+        *right = node;
+        return 1;
+    }
+    if (offset >= before + node->length) {
+        node_t *inner;
+        if (!split_tree(table, node->right, offset - before - node->length, &inner, right, tail))
+            return 0;
+        node->right = inner;
+        update(node);
+        *left = node;
+        return 1;
+    }
+
+    // The offset falls inside this piece: it keeps the first part, the rest becomes a new node
+    size_t keep = offset - before;
+    node_t *cut = new_node(table, node->source, node->start + keep, node->length - keep);
+    if (!cut)
+        return 0;
+    node->length = keep;
+    node->newlines -= cut->newlines;
+    *right = node->right;
+    node->right = NULL;
+    update(node);
+    *left = node;
+    *tail = cut;
+    return 1;
+}
+
+// Split a tree at a byte offset, cutting the piece that spans it in two; returns 0 if out of memory
+static int split(ptable_t *table, node_t *node, size_t offset, node_t **left, node_t **right) {
+    node_t *tail = NULL;
+    if (!split_tree(table, node, offset, left, right, &tail))
+        return 0;
+    *right = merge(tail, *right); /* The new node has a priority of its own, it is merged in rather than left where the cut was */
+    return 1;
+}
+
+ptable_t *ptable_open(int fd) {
+    ptable_t *table = (ptable_t *)calloc(1, sizeof(ptable_t));
+    if (!table)
+        return NULL;
+    table->seed = 2463534242u;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        free(table);
+        return NULL;
+    }
+    if (st.st_size > 0) {
+        table->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (table->map == MAP_FAILED) {
+            free(table);
+            return NULL;
+        }
+        table->map_size = st.st_size;
+        madvise(table->map, st.st_size, MADV_SEQUENTIAL); /* The newline index reads it once */
+    }
+
+    source_t *original = &table->sources[ORIGINAL];
+    original->data = (const char *)table->map;
+    original->length = table->map_size;
+    if (!index_newlines(original, 0, original->length) || (original->length && !(table->root = new_node(table, ORIGINAL, 0, original->length)))) {
+        ptable_close(table);
+        return NULL;
+    }
+    return table;
+}
+
+void ptable_close(ptable_t *table) {
+    if (!table)
+        return;
+    free_tree(table->root);
+    if (table->map)
+        munmap(table->map, table->map_size);
+    free(table->sources[ORIGINAL].newlines);
+    free(table->sources[ADDED].newlines);
+    free(table->added);
+    free(table);
+}
+
+size_t ptable_length(const ptable_t *table) {
+    return subtree_length(table->root);
+}
+
+size_t ptable_line_count(const ptable_t *table) {
+    size_t length = ptable_length(table);
+    size_t lines = subtree_newlines(table->root);
+    return length > 0 && ptable_char_at(table, length - 1) != '\n' ? lines + 1 : lines;
+}
+
+// Offset right after the n-th newline of the document, n counting from 1
+static size_t after_newline(const ptable_t *table, size_t n) {
+    const node_t *node = table->root;
+    size_t base = 0;
+    while (node) {
+        size_t left_newlines = subtree_newlines(node->left);
+        if (n <= left_newlines) {
+            node = node->left;
+            continue;
+        }
+        n -= left_newlines;
+        base += subtree_length(node->left);
+        if (n <= node->newlines) {
+            const source_t *source = &table->sources[node->source];
+            size_t newline = source->newlines[newline_rank(source, node->start) + n - 1];
+            return base + newline - node->start + 1;
+        }
+        n -= node->newlines;
+        base += node->length;
+        node = node->right;
+    }
+    return base;
+}
+
+int ptable_line_span(const ptable_t *table, size_t line, size_t *start, size_t *end) {
+    size_t newlines = subtree_newlines(table->root), length = ptable_length(table);
+    if (line == 0 || line > ptable_line_count(table))
+        return 0;
+    *start = line == 1 ? 0 : after_newline(table, line - 1);
+    *end = line <= newlines ? after_newline(table, line) : length;
+    return 1;
+}
+
+int ptable_char_at(const ptable_t *table, size_t offset) {
+    const node_t *node = table->root;
+    while (node) {
+        size_t before = subtree_length(node->left);
+        if (offset < before) {
+            node = node->left;
+        } else if (offset < before + node->length) {
+            return (unsigned char)table->sources[node->source].data[node->start + offset - before];
+        } else {
+            offset -= before + node->length;
+            node = node->right;
+        }
+    }
+    return -1;
+}
+
+// Append text to the add buffer, returns where it starts
+static int append_added(ptable_t *table, const char *text, size_t length, size_t *start) {
+    source_t *added = &table->sources[ADDED];
+    if (added->length + length > table->added_capacity) {
+        size_t capacity = table->added_capacity ? table->added_capacity : 4096;
+        while (capacity < added->length + length)
+            capacity *= 2;
+        char *grown = (char *)realloc(table->added, capacity);
+        if (!grown)
+            return 0;
+        table->added = grown;
+        table->added_capacity = capacity;
+        added->data = grown; /* Pieces hold offsets, not pointers */
+    }
+    memcpy(table->added + added->length, text, length);
+    *start = added->length;
+    added->length += length;
+    return index_newlines(added, *start, length);
+}
+
+int ptable_insert(ptable_t *table, size_t offset, const char *text, size_t length) {
+    size_t start;
+    if (length == 0)
+        return 1;
+    if (offset > ptable_length(table) || !append_added(table, text, length, &start))
+        return 0;
+    node_t *node = new_node(table, ADDED, start, length), *left, *right;
+    if (!node)
+        return 0;
+    if (!split(table, table->root, offset, &left, &right)) {
+        free(node);
+        return 0;
+    }
+    table->root = merge(merge(left, node), right);
+    return 1;
+}
+
+void ptable_erase(ptable_t *table, size_t offset, size_t length) {
+    node_t *left, *middle, *right;
+    if (length == 0 || offset >= ptable_length(table))
+        return;
+    if (!split(table, table->root, offset, &left, &right))
+        return;
+    if (!split(table, right, length, &middle, &right)) {
+        table->root = merge(left, right);
+        return;
+    }
+    free_tree(middle);
+    table->root = merge(left, right);
+}
+
+// Write a batch of pieces, going on from where writev stopped
+static int write_batch(int fd, struct iovec *iov, int count) {
+    int done = 0;
+    while (done < count) {
+        ssize_t written = writev(fd, iov + done, count - done);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return 0;
+        while (done < count && (size_t)written >= iov[done].iov_len)
+            written -= iov[done++].iov_len;
+        if (done < count) {
+            iov[done].iov_base = (char *)iov[done].iov_base + written;
+            iov[done].iov_len -= written;
+        }
+    }
+    return 1;
+}
+
+// Hand the pieces to writev in order, a batch at a time
+static int write_pieces(const ptable_t *table, const node_t *node, int fd, struct iovec *iov, int *count) {
+    while (node) {
+        if (!write_pieces(table, node->left, fd, iov, count))
+            return 0;
+        if (*count == WRITE_IOVECS) {
+            if (!write_batch(fd, iov, *count))
+                return 0;
+            *count = 0;
+        }
+        iov[*count].iov_base = (void *)(table->sources[node->source].data + node->start);
+        iov[*count].iov_len = node->length;
+        (*count)++;
+        node = node->right;
+    }
+    return 1;
+}
+
+int ptable_write(const ptable_t *table, int fd) {
+    struct iovec iov[WRITE_IOVECS];
+    int count = 0;
+    return write_pieces(table, table->root, fd, iov, &count) && write_batch(fd, iov, count);
+}
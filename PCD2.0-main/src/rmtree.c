@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "rmtree.h"
+#include "threadpool.h"
+
+/* A directory being deleted */
+typedef struct rmnode {
+    struct rmnode *parent;
+    struct rmtree_job *job;
+    char *name; /* Name in the parent, NULL for the directory holding the tree */
+    int fd; /* -1 while closed */
+    int users; /* Tasks using the descriptor now */
+    int pending; /* Subdirectories not deleted yet, plus one while the directory is read */
+    int kept; /* Something under it could not be removed, so it stays too */
+    struct rmnode *lru_prev; /* Neighbours among the open descriptors nobody uses, most recent first */
+    struct rmnode *lru_next;
+    struct rmnode *next_waiting; /* Next directory waiting for the task that found it */
+} rmnode_t;
+
+/* One delete, shared by its tasks */
+typedef struct rmtree_job {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int finished;
+    int open_fds; /* Descriptors of the nodes and of the directory streams, the ones in use included */
+    rmnode_t *lru_head;
+    rmnode_t *lru_tail;
+    rmnode_t *waiting; /* Subdirectories the pool had no room for, last found first */
+    rmtree_result_t *result;
+} rmtree_job_t;
+
+static threadpool_t *delete_pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void create_delete_pool(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 2 ? 2 : cpus > RMTREE_MAX_THREADS ? RMTREE_MAX_THREADS : (int)cpus;
+    delete_pool = threadpool_create(threads, RMTREE_QUEUE_SIZE);
+}
+
+static void lru_unlink(rmtree_job_t *job, rmnode_t *node) {
+    if (node->lru_prev)
+        node->lru_prev->lru_next = node->lru_next;
+    else
+        job->lru_head = node->lru_next;
+    if (node->lru_next)
+        node->lru_next->lru_prev = node->lru_prev;
+    else
+        job->lru_tail = node->lru_prev;
+    node->lru_prev = node->lru_next = NULL;
+}
+
+static void lru_push_front(rmtree_job_t *job, rmnode_t *node) {
+    node->lru_prev = NULL;
+    node->lru_next = job->lru_head;
+    if (job->lru_head)
+        job->lru_head->lru_prev = node;
+    else
+        job->lru_tail = node;
+    job->lru_head = node;
+}
+
+// Close the least recently used descriptors until one more fits; the job is locked
+static void make_room(rmtree_job_t *job) {
+    while (job->open_fds >= RMTREE_MAX_FDS && job->lru_tail) {
+        rmnode_t *victim = job->lru_tail;
+        lru_unlink(job, victim);
+        close(victim->fd);
+        victim->fd = -1;
+        job->open_fds--;
+    }
+}
+
+// The job is locked
+static void release_fd(rmnode_t *node) {
+    if (--node->users == 0 && node->fd >= 0)
+        lru_push_front(node->job, node);
+}
+
+// Descriptor of a directory, opened again from its parent if it was evicted; the job is locked
+static int acquire_fd(rmnode_t *node) {
+    rmtree_job_t *job = node->job;
+    if (node->fd < 0) {
+        if (!node->parent)
+            return -1;
+        int parent_fd = acquire_fd(node->parent);
+        if (parent_fd < 0)
+            return -1;
+        make_room(job);
+        node->fd = openat(parent_fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int saved = errno;
+        release_fd(node->parent);
+        if (node->fd < 0) {
+            errno = saved;
+            return -1;
+        }
+        job->open_fds++;
+    } else if (node->users == 0) {
+        lru_unlink(job, node);
+    }
+    node->users++;
+    return node->fd;
+}
+
+// Close the descriptor of a directory nobody uses any more; the job is locked
+static void close_fd(rmnode_t *node) {
+    if (node->fd < 0)
+        return;
+    lru_unlink(node->job, node);
+    close(node->fd);
+    node->fd = -1;
+    node->job->open_fds--;
+}
+
+// Path of an entry from the top of the tree, built only to describe an error
+static int describe(const rmnode_t *node, char *buffer, size_t size) {
+    if (!node->name)
+        return 0;
+    int length = describe(node->parent, buffer, size);
+    if ((size_t)length >= size)
+        return length;
+    return length + snprintf(buffer + length, size - length, "%s%s", length ? "/" : "", node->name);
+}
+
+// Count an entry that could not be removed, and describe the first ones; the job is locked
+static void record_error(rmnode_t *node, const char *name, int error) {
+    rmtree_result_t *result = node->job->result;
+    result->errors++;
+    if (result->reported == RMTREE_MAX_ERRORS)
+        return;
+    char *message = result->messages[result->reported++];
+    size_t length = describe(node, message, RMTREE_ERROR_LENGTH);
+    if (length < RMTREE_ERROR_LENGTH && name)
+        length += snprintf(message + length, RMTREE_ERROR_LENGTH - length, "/%s", name);
+    if (length < RMTREE_ERROR_LENGTH)
+        snprintf(message + length, RMTREE_ERROR_LENGTH - length, ": %s", strerror(error));
+}
+
+static void delete_directory(void *arg);
+
+// Hand a subdirectory to the pool, or keep it for this task when the queue is full
+static void dispatch(rmnode_t *node) {
+    if (delete_pool && threadpool_add(delete_pool, delete_directory, node) == 0)
+        return;
+    /* Read after the current directory rather than inside it, so a task never holds more than one directory open */
+    rmtree_job_t *job = node->job;
+    pthread_mutex_lock(&job->lock);
+    node->next_waiting = job->waiting;
+    job->waiting = node;
+    pthread_mutex_unlock(&job->lock);
+}
+
+// A directory read or a subdirectory done: the last one removes the directory and goes on with its parent
+static void finish(rmnode_t *node) {
+    rmtree_job_t *job = node->job;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        if (--node->pending > 0) {
+            pthread_mutex_unlock(&job->lock);
+            return;
+        }
+        rmnode_t *parent = node->parent;
+        if (!parent) {
+            job->finished = 1;
+            pthread_cond_signal(&job->done);
+            pthread_mutex_unlock(&job->lock);
+            return;
+        }
+        close_fd(node);
+        int kept = node->kept;
+        int parent_fd = kept ? -1 : acquire_fd(parent);
+        if (!kept && parent_fd < 0) {
+            record_error(node, NULL, errno);
+            kept = 1;
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        // Everything under it is gone
+        int error = 0;
+        if (!kept && unlinkat(parent_fd, node->name, AT_REMOVEDIR) != 0)
+            error = errno;
+
+        pthread_mutex_lock(&job->lock);
+        if (parent_fd >= 0)
+            release_fd(parent);
+        if (error && error != ENOENT) {
+            record_error(node, NULL, error);
+            kept = 1;
+        } else if (!kept) {
+            job->result->directories++;
+        }
+        if (kept)
+            parent->kept = 1;
+        pthread_mutex_unlock(&job->lock);
+        free(node->name);
+        free(node);
+        node = parent;
+    }
+}
+
+// Read a directory: unlink its files, dispatch its subdirectories; returns the next directory waiting for a task
+static rmnode_t *read_directory(rmnode_t *node) {
+    rmtree_job_t *job = node->job;
+    long files = 0;
+
+    pthread_mutex_lock(&job->lock);
+    int fd = acquire_fd(node); /* Held until the end, so it is not evicted while in use */
+    int error = errno;
+    int list_fd = -1; /* The stream owns its descriptor, it counts against the cap like the others */
+    if (fd >= 0) {
+        make_room(job);
+        list_fd = dup(fd);
+        if (list_fd < 0)
+            error = errno;
+        else
+            job->open_fds++;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+    if (!dir) {
+        if (list_fd >= 0) {
+            error = errno;
+            close(list_fd);
+        }
+        pthread_mutex_lock(&job->lock);
+        record_error(node, NULL, error);
+        node->kept = 1;
+        pthread_mutex_unlock(&job->lock);
+    } else {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+
+            int is_dir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) { /* The filesystem does not fill in the type */
+                struct stat st;
+                is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (!is_dir) {
+                if (unlinkat(fd, name, 0) == 0) {
+                    files++;
+                } else if (errno != ENOENT) {
+                    error = errno;
+                    pthread_mutex_lock(&job->lock);
+                    record_error(node, name, error);
+                    node->kept = 1;
+                    pthread_mutex_unlock(&job->lock);
+                }
+                continue;
+            }
+
+            rmnode_t *child = (rmnode_t *)calloc(1, sizeof(rmnode_t));
+            if (child)
+                child->name = strdup(name);
+            if (!child || !child->name) {
+                free(child);
+                pthread_mutex_lock(&job->lock);
+                record_error(node, name, ENOMEM);
+                node->kept = 1;
+                pthread_mutex_unlock(&job->lock);
+                continue;
+            }
+            child->parent = node;
+            child->job = job;
+            child->fd = -1;
+            child->pending = 1;
+            pthread_mutex_lock(&job->lock);
+            node->pending++;
+            pthread_mutex_unlock(&job->lock);
+            dispatch(child);
+        }
+        closedir(dir);
+    }
+
+    // Take the next waiting directory before finishing: once the last one is done the job may be gone
+    pthread_mutex_lock(&job->lock);
+    if (list_fd >= 0)
+        job->open_fds--;
+    if (fd >= 0)
+        release_fd(node);
+    job->result->files += files;
+    rmnode_t *next = job->waiting;
+    if (next)
+        job->waiting = next->next_waiting;
+    pthread_mutex_unlock(&job->lock);
+    finish(node);
+    return next;
+}
+
+// Pool task: delete a directory, then the ones waiting for a task
+static void delete_directory(void *arg) {
+    rmnode_t *node = (rmnode_t *)arg;
+    while (node)
+        node = read_directory(node);
+}
+
+int rmtree_delete(const char *path, rmtree_result_t *result) {
+    char parent_path[PATH_MAX];
+    memset(result, 0, sizeof(*result));
+    pthread_once(&pool_once, create_delete_pool);
+
+    // The top directory is removed from its parent like any other
+    size_t length = strlen(path), base_start;
+    while (length > 1 && path[length - 1] == '/')
+        length--;
+    for (base_start = length; base_start > 0 && path[base_start - 1] != '/'; base_start--)
+        ;
+    const char *base = path + base_start;
+    size_t base_length = length - base_start;
+    if (base_start == 0)
+        strcpy(parent_path, ".");
+    else if (base_start == 1)
+        strcpy(parent_path, "/");
+    else
+        snprintf(parent_path, sizeof(parent_path), "%.*s", (int)(base_start - 1), path);
+    if (base_length == 0 || base_start > sizeof(parent_path) || (base_length == 1 && base[0] == '.') || (base_length == 2 && strncmp(base, "..", 2) == 0)) {
+        snprintf(result->messages[0], RMTREE_ERROR_LENGTH, "%s: %s", path, strerror(EINVAL));
+        result->errors = result->reported = 1;
+        return 0;
+    }
+
+    rmtree_job_t job;
+    rmnode_t top = { 0 }, *root = (rmnode_t *)calloc(1, sizeof(rmnode_t));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done, NULL);
+    job.finished = 0;
+    job.open_fds = 0;
+    job.lru_head = job.lru_tail = NULL;
+    job.waiting = NULL;
+    job.result = result;
+
+    top.job = &job;
+    top.fd = open(parent_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    top.users = 1; /* Never evicted */
+    top.pending = 1;
+    if (top.fd >= 0)
+        job.open_fds++;
+    if (!root || !(root->name = strndup(base, base_length)) || top.fd < 0) {
+        int error = top.fd < 0 ? errno : ENOMEM;
+        snprintf(result->messages[0], RMTREE_ERROR_LENGTH, "%s: %s", path, strerror(error));
+        result->errors = result->reported = 1;
+    } else {
+        root->parent = &top;
+        root->job = &job;
+        root->fd = -1;
+        root->pending = 1;
+        delete_directory(root);
+
+        pthread_mutex_lock(&job.lock);
+        while (!job.finished)
+            pthread_cond_wait(&job.done, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        root = NULL; /* Freed by the task that removed it */
+    }
+
+    if (root) {
+        free(root->name);
+        free(root);
+    }
+    if (top.fd >= 0)
+        close(top.fd);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done);
+    return result->errors == 0;
+}
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE /* O_TMPFILE, syncfs */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "savefile.h"
+
+/* A durable commit waiting for the group-commit thread */
+typedef struct commit {
+    savefile_t *file;
+    int done;
+    int ok;
+    struct commit *next;
+} commit_t;
+
+static pthread_once_t committer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static commit_t *pending_head, *pending_tail;
+static int grouping = 1;
+static int committer_running;
+static long commit_count, sync_count; /* Atomic */
+
+// Directory part of a path, "." when there is none
+static void parent_of(const char *path, char *parent) {
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+        strcpy(parent, ".");
+    else if (slash == path)
+        strcpy(parent, "/");
+    else
+        snprintf(parent, PATH_MAX, "%.*s", (int)(slash - path), path);
+}
+
+// Create a hidden file next to the target with a name nobody uses
+static int create_temp(savefile_t *file) {
+    const char *slash = strrchr(file->path, '/');
+    int base = slash ? (int)(slash - file->path + 1) : 0;
+    if (snprintf(file->temp_path, sizeof(file->temp_path), "%.*s.%s.XXXXXX", base, file->path, file->path + base) >= (int)sizeof(file->temp_path))
+        return -1;
+    return mkstemp(file->temp_path);
+}
+
+int savefile_open(savefile_t *file, const char *path) {
+    char parent[PATH_MAX];
+    struct stat st;
+    if (snprintf(file->path, sizeof(file->path), "%s", path) >= (int)sizeof(file->path)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    file->temp_path[0] = '\0';
+    parent_of(path, parent);
+    int existing = stat(path, &st) == 0;
+
+    file->fd = open(parent, O_TMPFILE | O_WRONLY | O_CLOEXEC, existing ? st.st_mode & 07777 : 0666);
+    if (file->fd < 0) /* The filesystem has no anonymous files */
+        file->fd = create_temp(file);
+    if (file->fd < 0)
+        return 0;
+    if (existing || file->temp_path[0]) /* Keep the mode of the file it replaces, which the umask may have cut */
+        fchmod(file->fd, existing ? st.st_mode & 07777 : 0644);
+    return 1;
+}
+
+int savefile_write(savefile_t *file, const void *data, size_t size) {
+    const char *pos = (const char *)data;
+    while (size > 0) {
+        ssize_t written = write(file->fd, pos, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return 0;
+        pos += written;
+        size -= written;
+    }
+    return 1;
+}
+
+// Give the new file a name, if it has none yet, and rename it over the target
+static int publish(savefile_t *file) {
+    if (!file->temp_path[0]) {
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", file->fd);
+        for (int attempt = 0;; attempt++) {
+            int fd = create_temp(file); /* Reserve a unique name, then link the file over it */
+            if (fd < 0)
+                return 0;
+            close(fd);
+            unlink(file->temp_path);
+            if (linkat(AT_FDCWD, proc_path, AT_FDCWD, file->temp_path, AT_SYMLINK_FOLLOW) == 0)
+                break;
+            if (errno != EEXIST || attempt == 10) {
+                file->temp_path[0] = '\0';
+                return 0;
+            }
+        }
+    }
+    if (rename(file->temp_path, file->path) != 0) {
+        unlink(file->temp_path);
+        return 0;
+    }
+    file->temp_path[0] = '\0';
+    return 1;
+}
+
+// Make the data of new files stable: fdatasync for one, one syncfs per filesystem for several
+static int sync_data(savefile_t **files, int count) {
+    if (count == 1) {
+        __atomic_fetch_add(&sync_count, 1, __ATOMIC_RELAXED);
+        return fdatasync(files[0]->fd) == 0;
+    }
+    dev_t devices[SAVEFILE_MAX_BATCH];
+    int device_count = 0, ok = 1;
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        if (fstat(files[i]->fd, &st) != 0)
+            return 0;
+        int seen = 0;
+        for (int d = 0; d < device_count && !seen; d++)
+            seen = devices[d] == st.st_dev;
+        if (seen)
+            continue;
+        devices[device_count++] = st.st_dev;
+        __atomic_fetch_add(&sync_count, 1, __ATOMIC_RELAXED);
+        ok = syncfs(files[i]->fd) == 0 && ok;
+    }
+    return ok;
+}
+
+// Make the renames stable, one fsync per directory; a file whose directory fails is in place but not durable
+static void sync_directories(savefile_t **files, int *ok, int count) {
+    struct stat synced[SAVEFILE_MAX_BATCH];
+    int synced_error[SAVEFILE_MAX_BATCH]; /* errno of the fsync of each directory, 0 if it worked */
+    int synced_count = 0;
+    for (int i = 0; i < count; i++) {
+        char parent[PATH_MAX];
+        struct stat st;
+        int d, error;
+        if (!ok[i])
+            continue;
+        parent_of(files[i]->path, parent);
+        int fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            error = errno;
+        } else {
+            for (d = 0; d < synced_count; d++) {
+                if (synced[d].st_dev == st.st_dev && synced[d].st_ino == st.st_ino)
+                    break;
+            }
+            if (d == synced_count) {
+                synced[synced_count] = st;
+                __atomic_fetch_add(&sync_count, 1, __ATOMIC_RELAXED);
+                synced_error[synced_count++] = fsync(fd) == 0 ? 0 : errno;
+            }
+            error = synced_error[d];
+        }
+        if (fd >= 0)
+            close(fd);
+        if (error) {
+            fprintf(stderr, "'%s' was saved but its directory could not be synced: %s\n", files[i]->path, strerror(error));
+            ok[i] = SAVEFILE_NOT_DURABLE;
+        }
+    }
+}
+
+// Commit a batch: data, then names, then directories; nothing is published unless its data is stable
+static void commit_batch(savefile_t **files, int *ok, int count) {
+    int synced = sync_data(files, count);
+    for (int i = 0; i < count; i++)
+        ok[i] = synced && publish(files[i]);
+    sync_directories(files, ok, count);
+    __atomic_fetch_add(&commit_count, count, __ATOMIC_RELAXED);
+}
+
+static void *committer_thread(void *arg) {
+    savefile_t *files[SAVEFILE_MAX_BATCH];
+    int ok[SAVEFILE_MAX_BATCH];
+    commit_t *batch[SAVEFILE_MAX_BATCH];
+    for (;;) {
+        pthread_mutex_lock(&commit_lock);
+        while (!pending_head)
+            pthread_cond_wait(&commit_ready, &commit_lock);
+        int count = 0;
+        while (pending_head && count < SAVEFILE_MAX_BATCH) {
+            batch[count] = pending_head;
+            files[count] = pending_head->file;
+            pending_head = pending_head->next;
+            count++;
+        }
+        if (!pending_head)
+            pending_tail = NULL;
+        pthread_mutex_unlock(&commit_lock);
+
+        // Commits arriving meanwhile wait for the next batch
+        commit_batch(files, ok, count);
+
+        pthread_mutex_lock(&commit_lock);
+        for (int i = 0; i < count; i++) {
+            batch[i]->ok = ok[i];
+            batch[i]->done = 1;
+        }
+        pthread_cond_broadcast(&commit_done);
+        pthread_mutex_unlock(&commit_lock);
+    }
+    return arg;
+}
+
+static void start_committer(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, committer_thread, NULL) == 0) {
+        pthread_detach(thread);
+        committer_running = 1;
+    } else {
+        perror("Could not start the group commit thread");
+    }
+}
+
+int savefile_commit(savefile_t *file, int durable) {
+    int ok;
+    if (!durable) {
+        ok = publish(file);
+    } else if (__atomic_load_n(&grouping, __ATOMIC_RELAXED) && (pthread_once(&committer_once, start_committer), committer_running)) {
+        commit_t commit = { file, 0, 0, NULL };
+        pthread_mutex_lock(&commit_lock);
+        if (pending_tail)
+            pending_tail->next = &commit;
+        else
+            pending_head = &commit;
+        pending_tail = &commit;
+        pthread_cond_signal(&commit_ready);
+        while (!commit.done)
+            pthread_cond_wait(&commit_done, &commit_lock);
+        pthread_mutex_unlock(&commit_lock);
+        ok = commit.ok;
+    } else {
+        commit_batch(&file, &ok, 1);
+    }
+    if (!ok && file->temp_path[0]) /* Not synced, so never renamed */
+        unlink(file->temp_path);
+    close(file->fd);
+    file->fd = -1;
+    return ok;
+}
+
+void savefile_abort(savefile_t *file) {
+    if (file->fd >= 0)
+        close(file->fd);
+    if (file->temp_path[0])
+        unlink(file->temp_path);
+    file->fd = -1;
+    file->temp_path[0] = '\0';
+}
+
+void savefile_set_grouping(int enabled) {
+    __atomic_store_n(&grouping, enabled, __ATOMIC_RELAXED);
+}
+
+void savefile_stats(long *commits, long *syncs) {
+    *commits = __atomic_load_n(&commit_count, __ATOMIC_RELAXED);
+    *syncs = __atomic_load_n(&sync_count, __ATOMIC_RELAXED);
+}
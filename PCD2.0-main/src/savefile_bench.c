@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "savefile.h"
+
+#define SAVES 200 /* Saves made by each thread in each round */
+#define FILES_PER_THREAD 8 /* Each thread keeps replacing the same few documents */
+#define DOCUMENT_SIZE 4096
+
+/* What one thread of a round saves */
+typedef struct {
+    const char *dirname;
+    int id;
+    int failed;
+} worker_t;
+
+static char document[DOCUMENT_SIZE];
+
+static void *save_documents(void *arg) {
+    worker_t *worker = (worker_t *)arg;
+    char path[4096];
+    for (int i = 0; i < SAVES; i++) {
+        savefile_t file;
+        snprintf(path, sizeof(path), "%s/bench-%d-%d.json", worker->dirname, worker->id, i % FILES_PER_THREAD);
+        if (!savefile_open(&file, path) || !savefile_write(&file, document, sizeof(document)) || !savefile_commit(&file, 1))
+            worker->failed++;
+    }
+    return NULL;
+}
+
+// Save from several threads at once and print the rate
+static void run_round(const char *dirname, int threads, int grouped) {
+    pthread_t thread_ids[threads];
+    worker_t workers[threads];
+    long commits_before, syncs_before, commits, syncs;
+    struct timespec start, end;
+
+    savefile_set_grouping(grouped);
+    savefile_stats(&commits_before, &syncs_before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        workers[i].dirname = dirname;
+        workers[i].id = i;
+        workers[i].failed = 0;
+        pthread_create(&thread_ids[i], NULL, save_documents, &workers[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(thread_ids[i], NULL);
+        failed += workers[i].failed;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    savefile_stats(&commits, &syncs);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    commits -= commits_before;
+    syncs -= syncs_before;
+    printf("%-10s %2d threads: %6ld saves in %6.2f s, %8.1f saves/s, %.2f syncs per save%s\n",
+           grouped ? "grouped" : "ungrouped", threads, commits, seconds, commits / seconds,
+           commits ? (double)syncs / commits : 0.0, failed ? " (some saves failed)" : "");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) { /* The directory must be sent from the command line */
+        printf("Usage: %s <directory> [threads ...]\n", argv[0]);
+        return 1;
+    }
+    memset(document, 'x', sizeof(document));
+
+    int default_threads[] = { 1, 4, 16 };
+    int count = argc > 2 ? argc - 2 : 3;
+    for (int i = 0; i < count; i++) {
+        int threads = argc > 2 ? atoi(argv[i + 2]) : default_threads[i];
+        if (threads <= 0)
+            continue;
+        run_round(argv[1], threads, 0);
+        run_round(argv[1], threads, 1);
+    }
+    return 0;
+}
+/*
+gcc -o savefile_bench savefile_bench.c savefile.c -I../include -lpthread
+./savefile_bench /path/on/the/disk/to/measure 1 4 16
+(every save is durable: the file data and the directory are synced before it returns)
+*/
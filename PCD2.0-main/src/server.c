@@ -15,6 +15,29 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include "json.h"
+#include "transcode.h"
+#include "jcursor.h"
+#include "doccache.h"
+#include "jquery.h"
+#include "jbatch.h"
+#include "pathindex.h"
+#include "jtape.h"
+#include "xpathcache.h"
+#include "metaindex.h"
+#include "catalog.h"
+#include "convert.h"
+#include "convcache.h"
+#include "jwrite.h"
+#include "fanout.h"
+#include "outbuf.h"
+#include "logger.h"
+#include "binlog.h"
+#include "history.h"
+#include "ptable.h"
+#include "savefile.h"
+#include "filelock.h"
+#include "rmtree.h"
+#include <fcntl.h>
 #include <time.h>
 #include <asm-generic/socket.h>
 
@@ -25,6 +48,7 @@
 #define QUEUE_SIZE 10
 #define MAX_BLOCKED_USERS 100
 #define MAX_CLIENTS 100
+#define BATCH_MAX_PAYLOAD (256 * 1024 * 1024) /* Largest answer to one path of a batch, held in memory to learn its size */
 
 pthread_mutex_t connection_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t admin_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -46,240 +70,565 @@ void trim_newline(char *str) {
 }
 void create_log_file(const char *filename, const char *log_message) {
     char log_filename[MAX_BUFFER_LENGTH];
-    char *extension_position = strrchr(filename, '.'); // Find last occurrence of '.'
+    const char *slash = strrchr(filename, '/'), *extension_position = strrchr(filename, '.'); // Find last occurrence of '.'
 
-    // Remove file extension if it exists
-    if (extension_position != NULL) {
-        *extension_position = '\0'; // Replace '.' with '\0' to truncate the string
-    }
-
-    snprintf(log_filename, sizeof(log_filename), "%s.log", filename); // Add .log extension
+    // Leave out the file extension if it exists
+    int length = extension_position && (!slash || extension_position > slash) ? (int)(extension_position - filename) : (int)strlen(filename);
+    snprintf(log_filename, sizeof(log_filename), "%.*s.log", length, filename); // Add .log extension
 
-    FILE *log_file = fopen(log_filename, "a"); /* Oppen the file in appending mode */
-    if (log_file == NULL) { /* If the file could not be oppened print error message and exit */
-        perror("Could not open log file");
+    logger_line(log_filename, 1, "%s", log_message); /* Written by the log thread */
+}
+// Convert XML to JSON and save to file
+void convert_xml_to_json(const char *xml_path, const char *json_path) {
+    /* The document is transcoded in one pass, no XMLDocument or cJSON tree is built; content seen before is linked from the cache */
+    convcache_digest_t digest;
+    filelock_t lock, source;
+    int cached;
+    if (!ends_with(xml_path, ".xml")) {
+        fprintf(stderr, "Invalid XML file.\n");
         return;
     }
-
-    time_t now = time(NULL); /* Start the timer */
-    fprintf(log_file, "[%s] %s\n", ctime(&now), log_message);
-    fclose(log_file); /* Close the file */
-}
-// Load and validate XML file
-int load_and_validate_xml(const char *path, XMLDocument *document) {
-    if (!ends_with(path, ".xml")) { /* Check for .xml */
-        fprintf(stderr, "Ok\n");
-        return 0;
+    if (!filelock_write(json_path, &lock)) {
+        perror("Could not lock the JSON file");
+        return;
     }
-
-    if (!XMLDocument_load(document, path)) {
-        fprintf(stderr, "Succes\n"); 
-        return 0;
+    int source_fd = filelock_read(xml_path, &source); /* The version converted is the one counted among the readers */
+    if (source_fd < 0) {
+        filelock_release(&lock);
+        fprintf(stderr, "Error! Could not load file from '%s'\n", xml_path);
+        return;
     }
-
-    return 1;
-}
-
-// Convert XML to JSON and save to file
-void convert_xml_to_json(const char *xml_path, const char *json_path) {
-    XMLDocument document;
-    if (!load_and_validate_xml(xml_path, &document)) {
+    int ok = convcache_convert_fd(source_fd, xml_path, json_path, &digest, &cached);
+    close(source_fd);
+    filelock_release(&source);
+    filelock_release(&lock);
+    if (!ok) {
         fprintf(stderr, "Invalid XML file.\n");
         return;
     }
 
-    cJSON *json = XMLDocumentToJSON(&document);
-    SaveJSONToFile(json_path, json);
+    if (!cached) {
+        // Write the binary tape that searches and metadata read instead of the text, and the index of exact paths
+        if (!jtape_build(json_path))
+            fprintf(stderr, "Could not write the tape of '%s'.\n", json_path);
+        if (!pathindex_build(json_path)) /* Parsed once, the document is still cached */
+            fprintf(stderr, "Could not write the path index of '%s'.\n", json_path);
 
-    cJSON_Delete(json);
-    XMLDocument_free(&document);
-
-    // Log changes to the JSON file
-    char json_log_path[BUFFER_SIZE];
-    char *json_extension_position = strrchr(json_path, '.'); // Find last occurrence of '.'
-    if (json_extension_position != NULL) {
-        *json_extension_position = '\0'; // Remove file extension
+        convcache_add(&digest, json_path);
     }
-    snprintf(json_log_path, sizeof(json_log_path), "%s.log", json_path); // Add .log extension
 
-    FILE *json_log_file = fopen(json_log_path, "a"); /* Open in appending mode */
-    if (json_log_file) { /* If the file was opened, write in the file and close it */
-        fprintf(json_log_file, "Converted XML file '%s' to JSON file '%s'\n", xml_path, json_path);
-        fclose(json_log_file);
-    }
+    // Catalog the new file and make both documents findable by their metadata
+    catalog_refresh(xml_path);
+    catalog_refresh(json_path);
+
+    // Log changes to the JSON file
+    log_change(json_path, "convert", cached ? "Linked from the conversion cache" : "Converted from XML");
+    if (cached)
+        logger_sidecar(json_path, "Linked JSON file '%s' from the cached conversion of identical XML file '%s'", json_path, xml_path);
+    else
+        logger_sidecar(json_path, "Converted XML file '%s' to JSON file '%s'", xml_path, json_path);
 }
 
 
 // Extract metadata from a file and send it to the client
 void extract_metadata(const char *filename, int client_socket) {
     char buffer[BUFFER_SIZE];
-    FILE *file = fopen(filename, "rb");
-    if (file) {
-        size_t n;
-        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    filelock_t lock;
+    // The version opened is sent whole, even if an edit publishes a new one meanwhile
+    int fd = filelock_read(filename, &lock);
+    if (fd >= 0) {
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
             send(client_socket, buffer, n, 0);
         }
-        fclose(file);
+        close(fd);
+        filelock_release(&lock);
         // Log extraction
-        char log_path[BUFFER_SIZE];
-        char *extension_position = strrchr(filename, '.'); // Find last occurrence of '.'
-        if (extension_position != NULL) {
-            *extension_position = '\0'; // Remove file extension
-        }
-        snprintf(log_path, sizeof(log_path), "%s.log", filename); // Add .log extension
-
-        FILE *log_file = fopen(log_path, "a");
-        if (log_file) {
-            fprintf(log_file, "Metadata extracted from file '%s'\n", filename);
-            fclose(log_file);
-        }
+        logger_sidecar(filename, "Metadata extracted from file '%s'", filename);
     } else {
         send(client_socket, "Failed to open file.\n", strlen("Failed to open file.\n"), 0);
         perror("Failed to open file");
     }
 }
+/* State of one search, shared with the callback that prints the matches */
+typedef struct {
+    outbuf_t out; /* Buffered answer to the client */
+    int definite; /* The path names a single value, printed without a separator like before */
+    int failed; /* A match could not be printed */
+    const jindex_t *index; /* Structural index of the document the matches come from */
+} search_output_t;
+
+// Print one value found by a search, streamed from the text of the document
+static int print_json_match(const jspan_t *value, void *arg) {
+    search_output_t *output = (search_output_t *)arg;
+
+    if (!jwrite_span(&output->out, JWRITE_PRETTY, value, output->index)) {
+        outbuf_puts(&output->out, "Error parsing JSON\n");
+        output->failed = 1;
+        return 0;
+    }
+    if (!output->definite)
+        outbuf_putc(&output->out, '\n');
+    return !output->out.error; /* Stop once the client is gone */
+}
+
+// Print one match found on a tape, straight from the mapped file
+static int print_tape_match(const jtape_t *tape, size_t value, void *arg) {
+    search_output_t *output = (search_output_t *)arg;
+    jtape_print(tape, value, JWRITE_PRETTY, &output->out);
+    if (!output->definite)
+        outbuf_putc(&output->out, '\n');
+    return !output->out.error; /* Stop once the client is gone */
+}
+
+// Parsed document of the version of a file held by a read lock, NULL with errno set (EINVAL if it could not be parsed)
+static void *acquire_document(const char *filename, const doccache_type_t *type, doccache_handle_t **handle, filelock_t *lock) {
+    int fd = filelock_read(filename, lock);
+    if (fd < 0)
+        return NULL;
+    void *document = doccache_acquire_fd(fd, type, handle);
+    int saved = errno;
+    close(fd);
+    if (!document)
+        filelock_release(lock);
+    errno = saved;
+    return document;
+}
+
+// Answer a search from the binary tape of the file, returns 0 when there is no tape for this version of it
+static int search_with_tape(const char *filename, const jquery_t *query, int client_socket, int *stale) {
+    filelock_t lock;
+    int fd = filelock_read(filename, &lock);
+    if (fd < 0)
+        return 0; /* The regular search reports the error */
+
+    // The tape has to describe the version the lock holds
+    struct stat st;
+    doccache_handle_t *handle;
+    jtape_t *tape = fstat(fd, &st) == 0 ? jtape_acquire(filename, &st, &handle) : NULL;
+    close(fd);
+    if (!tape) {
+        filelock_release(&lock);
+        *stale = 1;
+        return 0;
+    }
+
+    search_output_t *output = (search_output_t *)malloc(sizeof(search_output_t));
+    if (!output) {
+        doccache_release(handle);
+        filelock_release(&lock);
+        return 0;
+    }
+    outbuf_init(&output->out, client_socket, 1);
+    output->definite = query->definite;
+    output->failed = 0;
+    output->index = NULL;
+    if (jtape_run(tape, query, print_tape_match, output) == 0) { /* If the path does not exist, send an error message */
+        outbuf_puts(&output->out, "Path not found\n");
+        perror("Path not found");
+    }
+    outbuf_flush(&output->out);
+    free(output);
+    doccache_release(handle);
+    filelock_release(&lock);
+    return 1;
+}
+
+// Answer a definite path from the sidecar index, returns 0 when the full document has to be searched
+static int search_with_path_index(const char *filename, const jquery_t *query, int client_socket, int *stale) {
+    char path[BUFFER_SIZE];
+    if (!jquery_canonical_path(query, path, sizeof(path)))
+        return 0;
+
+    filelock_t lock;
+    int fd = filelock_read(filename, &lock);
+    if (fd < 0)
+        return 0; /* The regular search reports the error */
+
+    struct stat st;
+    uint64_t offset, length;
+    pathindex_result result = PATHINDEX_STALE;
+    if (fstat(fd, &st) == 0)
+        result = pathindex_find(filename, &st, path, &offset, &length);
+    if (result != PATHINDEX_FOUND) {
+        *stale = result == PATHINDEX_STALE;
+        close(fd);
+        filelock_release(&lock);
+        return 0;
+    }
+
+    // Read only the bytes of the value
+    char *value_string = (char *)malloc(length + 1);
+    if (!value_string) {
+        close(fd);
+        filelock_release(&lock);
+        return 0;
+    }
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, value_string + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+    filelock_release(&lock);
+
+    // Check the bytes before anything is sent, the file may have changed under the index
+    jindex_t index;
+    jspan_t value;
+    outbuf_t *out = NULL;
+    int valid = done == length && jindex_build(&index, value_string, done) == JINDEX_OK;
+    if (valid) {
+        out = (outbuf_t *)malloc(sizeof(outbuf_t));
+        if (out && jcursor_document(value_string, done, &value)) {
+            outbuf_init(out, client_socket, 1);
+            jwrite_span(out, JWRITE_PRETTY, &value, &index);
+            outbuf_flush(out);
+        } else {
+            valid = 0;
+        }
+        jindex_free(&index);
+    }
+    free(out);
+    free(value_string);
+    if (!valid) { /* Fall back to a full search */
+        *stale = 1;
+        return 0;
+    }
+    return 1;
+}
+
 //Search json path
 void search_and_print_json(const char *filename, const char *json_path, int client_socket) {
-    FILE *file = fopen(filename, "rb"); /* Open the file in binary reading mode */
-    if (!file) { /* If the file could not be oppened, print an error message, send it to the client and exit */
-        char error_msg[] = "Failed to open file.\n";
+    // Paths are compiled once and shared between searches
+    const char *error;
+    jquery_t *query = jquery_acquire(json_path, &error);
+    if (!query) {
+        char error_msg[BUFFER_SIZE];
+        snprintf(error_msg, sizeof(error_msg), "Invalid path: %s\n", error);
         send(client_socket, error_msg, strlen(error_msg), 0);
-        perror("Failed to open file");
         return;
     }
 
-    // Read the entire file into a string
-    fseek(file, 0, SEEK_END);
-    long length = ftell(file); /* Get teh file size */
-    fseek(file, 0, SEEK_SET);
-    char *json_string = (char *)malloc(length + 1); /* Allocate memory to the buffer */
-    if (!json_string) { /* If the buffer is null , print an error message and exit */
-        fclose(file);
-        char error_msg[] = "Memory allocation failed\n";
-        send(client_socket, error_msg, strlen(error_msg), 0); /* Send the error message to the client */
-        perror("Memory allocation failed");
+    // The tape of the file answers any path without parsing the text
+    int tape_stale = 0;
+    if (search_with_tape(filename, query, client_socket, &tape_stale)) {
+        jquery_release(query);
         return;
     }
-    fread(json_string, 1, length, file); /* Read the data from the file into the buffer  */
-    fclose(file); /* Close the file*/
-    json_string[length] = '\0'; /* Set the ending of the string */
 
-    // Parse JSON
-    cJSON *json = cJSON_Parse(json_string);
-    free(json_string);
-    if (!json) {
-        char error_msg[] = "Error parsing JSON\n";
-        send(client_socket, error_msg, strlen(error_msg), 0);
-        perror("Error parsing JSON");
+    // Without a tape, a path that names one value is answered from the sidecar index with a single read
+    int index_stale = 0;
+    if (query->definite && search_with_path_index(filename, query, client_socket, &index_stale)) {
+        jquery_release(query);
         return;
     }
 
-    // Search JSON based on the provided path
-    cJSON *current = json;
-    char *token = strtok((char *)json_path, "."); /* Tokenize the string */
-    while (token != NULL) { /* Parse while the token is not null */
-        char *index_str = strchr(token, '[');
-        if (index_str != NULL) {
-            *index_str = '\0'; /* Set the ending of the string */
-            int index = atoi(index_str + 1); /* Get teh index */
-            cJSON *array = cJSON_GetObjectItemCaseSensitive(current, token);
-            if (!array || !cJSON_IsArray(array)) { /* If the array is null, send the error message to the client and exit */
-                char error_msg[] = "Path not found\n";
-                send(client_socket, error_msg, strlen(error_msg), 0);
-                perror("Path not found");
-                cJSON_Delete(json);
-                return;
+    // Parsed documents are shared between searches until the file changes
+    doccache_handle_t *handle;
+    filelock_t lock;
+    json_document_t *document = acquire_document(filename, &doccache_json, &handle, &lock);
+    if (!document) {
+        if (errno == EINVAL) { /* The file could be read but is not valid JSON */
+            char error_msg[] = "Error parsing JSON\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            perror("Error parsing JSON");
+        } else { /* If the file could not be oppened, print an error message, send it to the client and exit */
+            char error_msg[] = "Failed to open file.\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            perror("Failed to open file");
+        }
+        jquery_release(query);
+        return;
+    }
+
+    // Stream every match in one walk of the document, containers off the path are skipped through the index
+    search_output_t *output = (search_output_t *)malloc(sizeof(search_output_t));
+    if (!output) {
+        char error_msg[] = "Memory allocation failed\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Memory allocation failed");
+    } else {
+        outbuf_init(&output->out, client_socket, 1);
+        output->definite = query->definite;
+        output->failed = 0;
+        output->index = &document->index;
+        int matches = jquery_run(query, &document->root, &document->index, print_json_match, output);
+        if (matches == 0) { /* If the path does not exist, send an error message */
+            outbuf_puts(&output->out, "Path not found\n");
+            perror("Path not found");
+        }
+        outbuf_flush(&output->out);
+        free(output);
+    }
+
+    // Bring the sidecars that did not match this version up to date from the parse we already have
+    if (tape_stale)
+        jtape_write(filename, document);
+    if (index_stale)
+        pathindex_write(filename, document);
+    doccache_release(handle);
+    filelock_release(&lock);
+    jquery_release(query);
+}
+// Read paths, one per line, until an empty line; returns 0 if the client disconnected, -1 if the list does not fit
+static int read_path_list(int client_socket, char *list, size_t size) {
+    char chunk[BUFFER_SIZE];
+    size_t length = 0, line_length = 0;
+    int too_long = 0;
+    list[0] = '\0';
+    for (;;) {
+        // Take what arrived only up to the end of a line, the bytes after the empty line are the next command
+        ssize_t bytes_read = recv(client_socket, chunk, sizeof(chunk), MSG_PEEK);
+        if (bytes_read <= 0)
+            return 0;
+        char *newline = memchr(chunk, '\n', bytes_read);
+        bytes_read = read(client_socket, chunk, newline ? (size_t)(newline - chunk) + 1 : (size_t)bytes_read);
+        if (bytes_read <= 0)
+            return 0;
+
+        for (ssize_t i = 0; i < bytes_read; i++) {
+            char c = chunk[i];
+            if (c == '\n' && line_length == 0) { /* The empty line ends the list */
+                list[length] = '\0';
+                return too_long ? -1 : 1;
             }
-            current = cJSON_GetArrayItem(array, index); /* Get the item at the position index from the array */
-        } else {
-            current = cJSON_GetObjectItemCaseSensitive(current, token); /* Get the object from the token */
+            line_length = c == '\n' ? 0 : c == '\r' ? line_length : line_length + 1;
+            if (length < size - 1) /* The rest of a list too long is read and dropped */
+                list[length++] = c;
+            else
+                too_long = 1;
         }
+    }
+}
 
-        if (!current) { /* IF the buffer is null, send an error message and exit */
-            char error_msg[] = "Path not found\n";
+//Search several json paths in one walk of the file
+void search_and_print_json_batch(const char *filename, char *path_list, int client_socket) {
+    jquery_t *queries[JBATCH_MAX_PATHS]; /* Compiled form of every path, NULL if invalid */
+    const char *errors[JBATCH_MAX_PATHS];
+    char *paths[JBATCH_MAX_PATHS];
+    int count = 0;
+
+    // One path per line, blank lines are skipped
+    char *saveptr;
+    for (char *line = strtok_r(path_list, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        if (count == JBATCH_MAX_PATHS) {
+            char error_msg[BUFFER_SIZE];
+            snprintf(error_msg, sizeof(error_msg), "Too many paths (at most %d).\n", JBATCH_MAX_PATHS);
             send(client_socket, error_msg, strlen(error_msg), 0);
-            perror("Path not found");
-            cJSON_Delete(json);
+            for (int i = 0; i < count; i++)
+                if (queries[i])
+                    jquery_release(queries[i]);
             return;
         }
-        token = strtok(NULL, ".");
-    }
-
-    // Print the result
-    char *result = cJSON_Print(current);
-    send(client_socket, result, strlen(result), 0);
-    free(result);
-
-    cJSON_Delete(json);
-}
-// //Search xml path
-// void search_and_print_xpath(const char *filename, const char *xpathExpr, int client_socket) {
-//     FILE *file = fopen(filename, "rb");
-//     if (!file) {
-//         char error_msg[] = "Failed to open file.\n";
-//         send(client_socket, error_msg, strlen(error_msg), 0);
-//         perror("Failed to open file");
-//         return;
-//     }
-
-//     // Read the entire file into a string
-//     fseek(file, 0, SEEK_END);
-//     long length = ftell(file);
-//     fseek(file, 0, SEEK_SET);
-//     char *xml_string = (char *)malloc(length + 1);
-//     if (!xml_string) {
-//         fclose(file);
-//         char error_msg[] = "Memory allocation failed\n";
-//         send(client_socket, error_msg, strlen(error_msg), 0);
-//         perror("Memory allocation failed");
-//         return;
-//     }
-//     fread(xml_string, 1, length, file);
-//     fclose(file);
-//     xml_string[length] = '\0';
-
-//     // Parse XML
-//     xmlDocPtr doc = xmlReadMemory(xml_string, length, "noname.xml", NULL, 0);
-//     free(xml_string);
-//     if (doc == NULL) {
-//         char error_msg[] = "Error parsing XML\n";
-//         send(client_socket, error_msg, strlen(error_msg), 0);
-//         perror("Error parsing XML");
-//         return;
-//     }
-
-//     // Perform XPath search
-//     xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
-//     xmlXPathObjectPtr xpathObj = xmlXPathEvalExpression((xmlChar *)xpathExpr, xpathCtx);
-
-//     if (xpathObj == NULL) {
-//         char error_msg[] = "Error in XPath expression\n";
-//         send(client_socket, error_msg, strlen(error_msg), 0);
-//         perror("Error in XPath expression");
-//         xmlXPathFreeContext(xpathCtx);
-//         xmlFreeDoc(doc);
-//         xmlCleanupParser();
-//         return;
-//     }
-
-//     xmlNodeSetPtr nodes = xpathObj->nodesetval;
-//     if (nodes->nodeNr == 0) {
-//         char error_msg[] = "No results found for XPath\n";
-//         send(client_socket, error_msg, strlen(error_msg), 0);
-//     } else {
-//         for (int i = 0; i < nodes->nodeNr; ++i) {
-//             xmlChar *content = xmlNodeGetContent(nodes->nodeTab[i]);
-//             send(client_socket, content, strlen(content), 0);
-//             xmlFree(content);
-//         }
-//     }
-
-//     xmlXPathFreeObject(xpathObj);
-//     xmlXPathFreeContext(xpathCtx);
-//     xmlFreeDoc(doc);
-//     xmlCleanupParser();
-// }
+        paths[count] = line;
+        queries[count] = jquery_acquire(line, &errors[count]);
+        count++;
+    }
 
+    // Merge the valid paths into one trie
+    jquery_t *valid[JBATCH_MAX_PATHS];
+    int valid_count = 0;
+    for (int i = 0; i < count; i++)
+        if (queries[i])
+            valid[valid_count++] = queries[i];
+
+    doccache_handle_t *handle = NULL;
+    filelock_t lock;
+    json_document_t *document = NULL;
+    jbatch_t batch;
+    int ready = jbatch_init(&batch, valid, valid_count);
+    if (!ready) {
+        char error_msg[] = "Memory allocation failed\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Memory allocation failed");
+    } else if (!(document = acquire_document(filename, &doccache_json, &handle, &lock))) {
+        if (errno == EINVAL) { /* The file could be read but is not valid JSON */
+            char error_msg[] = "Error parsing JSON\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            perror("Error parsing JSON");
+        } else {
+            char error_msg[] = "Failed to open file.\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            perror("Failed to open file");
+        }
+    } else if (!jbatch_run(&batch, &document->root, &document->index)) {
+        char error_msg[] = "Memory allocation failed\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Memory allocation failed");
+    } else {
+        // Framed answer: a header line per path with its status, number of matches and payload size
+        outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+        outbuf_t *payload = (outbuf_t *)malloc(sizeof(outbuf_t));
+        if (out && payload) {
+            char header[128]; /* The numbers of a header, the path is written after them as it is */
+            outbuf_init(out, client_socket, 1);
+            outbuf_init_memory(payload, BATCH_MAX_PAYLOAD);
+            snprintf(header, sizeof(header), "BATCH %d\n", count);
+            outbuf_puts(out, header);
+
+            for (int i = 0, q = 0; i < count && !out->error; i++) {
+                if (!queries[i]) {
+                    snprintf(header, sizeof(header), "PATH %d INVALID 0 %zu ", i, strlen(errors[i]) + 1);
+                    outbuf_puts(out, header);
+                    outbuf_puts(out, paths[i]);
+                    outbuf_putc(out, '\n');
+                    outbuf_puts(out, errors[i]);
+                    outbuf_putc(out, '\n');
+                    continue;
+                }
+
+                // Print the matches once into memory, the header carries the size of the payload
+                jbatch_result_t *result = &batch.results[q++];
+                payload->memory_length = 0; /* The block of the previous path is reused */
+                payload->error = 0;
+                int valid = 1;
+                for (int m = 0; valid && m < result->count; m++) {
+                    valid = jwrite_span(payload, JWRITE_PRETTY, &result->matches[m], &document->index);
+                    outbuf_putc(payload, '\n');
+                }
+                valid = outbuf_flush(payload) && valid;
+
+                snprintf(header, sizeof(header), "PATH %d %s %d %zu ", i, !valid ? "ERROR" : result->count ? "OK" : "NOT_FOUND", valid ? result->count : 0, valid ? payload->memory_length : 0);
+                outbuf_puts(out, header);
+                outbuf_puts(out, paths[i]);
+                outbuf_putc(out, '\n');
+                if (valid)
+                    outbuf_write(out, payload->memory, payload->memory_length);
+            }
+            outbuf_puts(out, "END\n");
+            outbuf_flush(out);
+            free(payload->memory);
+        } else {
+            char error_msg[] = "Memory allocation failed\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            perror("Memory allocation failed");
+        }
+        free(out);
+        free(payload);
+    }
+
+    if (handle) {
+        doccache_release(handle);
+        filelock_release(&lock);
+    }
+    if (ready)
+        jbatch_free(&batch);
+    for (int i = 0; i < count; i++)
+        if (queries[i])
+            jquery_release(queries[i]);
+}
+//Search xml path
+void search_and_print_xpath(const char *filename, const char *xpathExpr, int client_socket) {
+    // Expressions are compiled once and shared between searches
+    xpath_expr_t *expr = xpathcache_acquire(xpathExpr);
+    if (!expr) {
+        char error_msg[] = "Error in XPath expression\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Error in XPath expression");
+        return;
+    }
+
+    // Parsed documents are shared between searches until the file changes
+    doccache_handle_t *handle;
+    filelock_t lock;
+    xmlDocPtr doc = acquire_document(filename, &doccache_xml, &handle, &lock);
+    if (!doc) {
+        if (errno == EINVAL) { /* The file could be read but is not valid XML */
+            char error_msg[] = "Error parsing XML\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            perror("Error parsing XML");
+        } else {
+            char error_msg[] = "Failed to open file.\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            perror("Failed to open file");
+        }
+        xpathcache_release(expr);
+        return;
+    }
+
+    // Perform XPath search with the context of this thread
+    xmlXPathObjectPtr xpathObj = xpathcache_eval(expr, doc);
+    outbuf_t *out = xpathObj ? (outbuf_t *)malloc(sizeof(outbuf_t)) : NULL;
+    if (!xpathObj) {
+        char error_msg[] = "Error in XPath expression\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Error in XPath expression");
+    } else if (!out) {
+        char error_msg[] = "Memory allocation failed\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Memory allocation failed");
+    } else {
+        // Stream the text of every node found, one per line
+        outbuf_init(out, client_socket, 1);
+        if (xpathObj->type == XPATH_NODESET) {
+            xmlNodeSetPtr nodes = xpathObj->nodesetval;
+            if (!nodes || nodes->nodeNr == 0) {
+                outbuf_puts(out, "No results found for XPath\n");
+            } else {
+                for (int i = 0; i < nodes->nodeNr && !out->error; ++i) {
+                    xpathcache_write_content(nodes->nodeTab[i], out);
+                    outbuf_putc(out, '\n');
+                }
+            }
+        } else { /* count(), string(), boolean expressions */
+            xmlChar *value = xmlXPathCastToString(xpathObj);
+            if (value) {
+                outbuf_puts(out, (const char *)value);
+                xmlFree(value);
+            }
+            outbuf_putc(out, '\n');
+        }
+        outbuf_flush(out);
+    }
+
+    free(out);
+    if (xpathObj)
+        xmlXPathFreeObject(xpathObj);
+    doccache_release(handle);
+    filelock_release(&lock);
+    xpathcache_release(expr);
+}
+
+
+// Find documents by their metadata and send their paths
+void find_documents(const char *query, int client_socket) {
+    metaindex_result_t result;
+    const char *error;
+    if (!metaindex_find(query, &result, &error)) {
+        char error_msg[BUFFER_SIZE];
+        snprintf(error_msg, sizeof(error_msg), "Invalid query: %s\n", error);
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        return;
+    }
+
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!out) {
+        char error_msg[] = "Memory allocation failed\n";
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        perror("Memory allocation failed");
+        metaindex_result_free(&result);
+        return;
+    }
+    outbuf_init(out, client_socket, 1);
+    char line[64];
+    snprintf(line, sizeof(line), "Found %zu files\n", result.total);
+    outbuf_puts(out, line);
+    for (size_t i = 0; i < result.count; i++) {
+        outbuf_puts(out, result.paths[i]);
+        outbuf_putc(out, '\n');
+    }
+    if (result.total > result.count) {
+        snprintf(line, sizeof(line), "... and %zu more\n", result.total - result.count);
+        outbuf_puts(out, line);
+    }
+    outbuf_flush(out);
+    free(out);
+    metaindex_result_free(&result);
+}
 
 // Authentication function
 int authenticate_client(const char *username, const char *password) {
@@ -305,14 +654,22 @@ const char* get_role(const char *username) {
 
 // Function to log activity
 void log_activity(const char *message) {
-    FILE *log_file = fopen("server.log", "a");
-    if (log_file == NULL) {
-        perror("Could not open server log file");
+    if (binlog_enabled())
+        binlog_event(BINLOG_MESSAGE, NULL, message, NULL);
+    else
+        logger_line(LOGGER_SERVER_LOG, 1, "%s", message);
+}
+
+// Log an event with arguments, its message is only formatted for the text log
+static void log_event(int event, const char *first, const char *second) {
+    if (binlog_enabled()) {
+        binlog_event(event, NULL, first, second);
         return;
     }
-    time_t now = time(NULL);
-    fprintf(log_file, "[%s] %s\n", ctime(&now), message);
-    fclose(log_file);
+    const char *args[2] = { first, second };
+    char message[BUFFER_SIZE * 3];
+    binlog_render(event, NULL, args, 2, message, sizeof(message));
+    logger_line(LOGGER_SERVER_LOG, 1, "%s", message);
 }
 
 // Function to update connection count
@@ -335,10 +692,18 @@ void monitor_server() {
 void upload_metadata(const char *filename, const char *metadata) {
     char abs_path[BUFFER_SIZE];
     realpath(filename, abs_path);
-    FILE *file = fopen(abs_path, "w");
-    if (file) {
-        fprintf(file, "%s", metadata);
-        fclose(file);
+    // Committed over the old file, which may share its inode with the conversion cache
+    savefile_t file;
+    filelock_t lock;
+    int ok = filelock_write(abs_path, &lock) && savefile_open(&file, abs_path);
+    if (ok && !savefile_write(&file, metadata, strlen(metadata))) {
+        savefile_abort(&file);
+        ok = 0;
+    }
+    ok = ok && savefile_commit(&file, 1);
+    filelock_release(&lock);
+    if (ok) {
+        log_change(abs_path, "upload", "Metadata uploaded");
         log_activity("Metadata uploaded and file created.");
     } else {
         perror("Failed to upload metadata");
@@ -358,47 +723,47 @@ int file_exists(const char *filename) {
 }
 
 // Function to edit a file
+// Write the edited document to a new file and commit it over the old one, whose mapping the pieces still read
+static int save_edited(const char *abs_path, const ptable_t *table) {
+    savefile_t file;
+    if (!savefile_open(&file, abs_path))
+        return 0;
+    if (!ptable_write(table, file.fd)) {
+        savefile_abort(&file);
+        return 0;
+    }
+    return savefile_commit(&file, 1);
+}
+
 void edit_file(const char *filename, int client_socket) {
     char abs_path[BUFFER_SIZE];
     realpath(filename, abs_path);
 
-    // Send current content to client
-    char buffer[BUFFER_SIZE];
-    FILE *file = fopen(abs_path, "r");
-    if (file) {
-        send(client_socket, "Current content:\n", strlen("Current content:\n"), 0);
-        while (fgets(buffer, sizeof(buffer), file)) {
-            send(client_socket, buffer, strlen(buffer), 0);
-        }
-        fclose(file);
-    } else {
+    // The file is mapped and edited as a piece table, it is never copied into a buffer.
+    // The descriptor stays open until the end, so the version read cannot be mistaken for a later one
+    filelock_t snapshot;
+    int fd = filelock_read(abs_path, &snapshot);
+    ptable_t *table = fd >= 0 ? ptable_open(fd) : NULL;
+    if (!table) {
         send(client_socket, "Failed to open file.\n", strlen("Failed to open file.\n"), 0);
         perror("Failed to open file");
+        if (fd >= 0) {
+            close(fd);
+            filelock_release(&snapshot);
+        }
         return;
     }
 
+    // Send current content to client
+    send(client_socket, "Current content:\n", strlen("Current content:\n"), 0);
+    ptable_write(table, client_socket);
+
     send(client_socket, "\nEnter 'add <text>', 'delete <line number>', 'replace <line number> <new text>', or 'save' to save changes.\n", strlen("\nEnter 'add <text>', 'delete <line number>', 'replace <line number> <new text>', or 'save' to save changes.\n"), 0);
 
     // Start editing loop
-    char edit_buffer[BUFFER_SIZE * 10] = {0};
-    char current_file_content[BUFFER_SIZE * 10] = {0};
-    
-    // Read file content for later modifications
-    file = fopen(abs_path, "r");
-    if (file) {
-        while (fgets(buffer, sizeof(buffer), file)) {
-            strncat(current_file_content, buffer, sizeof(current_file_content) - strlen(current_file_content) - 1);
-        }
-        fclose(file);
-    } else {
-        send(client_socket, "Failed to open file for reading.\n", strlen("Failed to open file for reading.\n"), 0);
-        perror("Failed to open file for reading");
-        return;
-    }
-
-    strcpy(edit_buffer, current_file_content);
-
+    char buffer[BUFFER_SIZE];
     int bytes_read;
+    size_t start, end;
     while (1) {
         memset(buffer, 0, sizeof(buffer));
         bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
@@ -407,65 +772,55 @@ void edit_file(const char *filename, int client_socket) {
         trim_newline(buffer);
 
         if (strncmp(buffer, "add ", 4) == 0) {
-            // Add text to a new line
-            strncat(edit_buffer, buffer + 4, sizeof(edit_buffer) - strlen(edit_buffer) - 1);
-            strncat(edit_buffer, "\n", sizeof(edit_buffer) - strlen(edit_buffer) - 1);
+            // Add text as a new last line
+            size_t length = ptable_length(table);
+            if (length > 0 && ptable_char_at(table, length - 1) != '\n')
+                ptable_insert(table, length++, "\n", 1);
+            ptable_insert(table, length, buffer + 4, strlen(buffer + 4));
+            ptable_insert(table, length + strlen(buffer + 4), "\n", 1);
         } else if (strncmp(buffer, "delete ", 7) == 0) {
             // Delete specified line
-            int line_number = atoi(buffer + 7);
-            if (line_number > 0) {
-                char *line = strtok(current_file_content, "\n");
-                int current_line = 1;
-                char new_buffer[BUFFER_SIZE * 10] = {0};
-                while (line) {
-                    if (current_line != line_number) {
-                        strncat(new_buffer, line, sizeof(new_buffer) - strlen(new_buffer) - 1);
-                        strncat(new_buffer, "\n", sizeof(new_buffer) - strlen(new_buffer) - 1);
-                    }
-                    line = strtok(NULL, "\n");
-                    current_line++;
-                }
-                strcpy(edit_buffer, new_buffer);
-                strcpy(current_file_content, new_buffer);
-            }
+            long line_number = atol(buffer + 7);
+            if (line_number > 0 && ptable_line_span(table, line_number, &start, &end))
+                ptable_erase(table, start, end - start);
         } else if (strncmp(buffer, "replace ", 8) == 0) {
-            // Replace text in specified line with new text
-            int line_number;
-            char new_text[BUFFER_SIZE];
-            sscanf(buffer, "replace %d %[^\n]", &line_number, new_text);
-            if (line_number > 0) {
-                char *line = strtok(current_file_content, "\n");
-                int current_line = 1;
-                char new_buffer[BUFFER_SIZE * 10] = {0};
-                while (line) {
-                    if (current_line == line_number) {
-                        strncat(new_buffer, new_text, sizeof(new_buffer) - strlen(new_buffer) - 1);
-                    } else {
-                        strncat(new_buffer, line, sizeof(new_buffer) - strlen(new_buffer) - 1);
-                    }
-                    strncat(new_buffer, "\n", sizeof(new_buffer) - strlen(new_buffer) - 1);
-                    line = strtok(NULL, "\n");
-                    current_line++;
-                }
-                strcpy(edit_buffer, new_buffer);
-                strcpy(current_file_content, new_buffer);
+            // Replace text in specified line with new text, its newline stays
+            char *text;
+            long line_number = strtol(buffer + 8, &text, 10);
+            if (*text == ' ')
+                text++;
+            if (line_number > 0 && ptable_line_span(table, line_number, &start, &end)) {
+                if (end > start && ptable_char_at(table, end - 1) == '\n')
+                    end--;
+                ptable_erase(table, start, end - start);
+                ptable_insert(table, start, text, strlen(text));
             }
         } else if (strcmp(buffer, "save") == 0) {
-            // Save new content and exit editing
-            file = fopen(abs_path, "w");
-            if (file) {
-                fwrite(edit_buffer, 1, strlen(edit_buffer), file);
-                fclose(file);
+            // Save new content and exit editing; the new file does not share the inode of a cached conversion
+            filelock_t lock;
+            if (!filelock_write(abs_path, &lock)) {
+                send(client_socket, "Failed to save file.\n", strlen("Failed to save file.\n"), 0);
+                perror("Failed to lock file");
+            } else if (!filelock_same(&snapshot, &lock)) {
+                /* Saving would throw away what was published since the file was opened */
+                send(client_socket, "The file was changed or deleted while it was edited, nothing was saved.\n", strlen("The file was changed or deleted while it was edited, nothing was saved.\n"), 0);
+            } else if (save_edited(abs_path, table)) {
+                catalog_refresh(abs_path); /* The metadata may have changed */
+                log_change(abs_path, "edit", "Saved edited content");
                 send(client_socket, "File saved and updated.\n", strlen("File saved and updated.\n"), 0);
             } else {
                 send(client_socket, "Failed to save file.\n", strlen("Failed to save file.\n"), 0);
                 perror("Failed to save file");
             }
+            filelock_release(&lock);
             break;
         } else {
             send(client_socket, "Unknown command. Use 'add', 'delete', 'replace', or 'save'.\n", strlen("Unknown command. Use 'add', 'delete', 'replace', or 'save'.\n"), 0);
         }
     }
+    ptable_close(table);
+    close(fd);
+    filelock_release(&snapshot);
 }
 
 // Handle error messages
@@ -477,7 +832,7 @@ void handle_error(const char *abs_path, int client_socket, const char *format) {
     len = snprintf(error_message, sizeof(error_message), format, abs_path, strerror(errno));
 
     // Check if the message was truncated
-    if (len >= sizeof(error_message)) {
+    if (len >= 0 && (size_t)len >= sizeof(error_message)) {
         // Calculate remaining space in the buffer
         size_t remaining_space = sizeof(error_message) - strlen(error_message) - 1;
 
@@ -501,32 +856,45 @@ void delete_file_or_directory(const char *path, int client_socket) {
     }
 
     if (S_ISDIR(st.st_mode)) {
-        // If directory, delete recursively
-        DIR *d = opendir(abs_path);
-        if (d) {
-            struct dirent *dir;
-            while ((dir = readdir(d)) != NULL) {
-                if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0) {
-                    continue;
-                }
-                char sub_path[BUFFER_SIZE];
-                if (snprintf(sub_path, sizeof(sub_path), "%s/%s", abs_path, dir->d_name) >= sizeof(sub_path)) {
-                    handle_error(abs_path, client_socket, "Path too long: %s/%s\n");
-                    continue;
-                }
-                delete_file_or_directory(sub_path, client_socket);
-            }
-            closedir(d);
-            if (rmdir(abs_path) == 0) {
-                send(client_socket, "Directory deleted.\n", strlen("Directory deleted.\n"), 0);
-                log_activity("Directory deleted.");
-            } else {
-                handle_error(abs_path, client_socket, "Failed to delete directory %s: %s\n");
-            }
+        // If directory, delete its subtrees in parallel and send one summary; the catalog drops the whole subtree at once
+        rmtree_result_t result;
+        char summary[BUFFER_SIZE + RMTREE_ERROR_LENGTH];
+        int complete = rmtree_delete(abs_path, &result);
+        catalog_refresh(abs_path);
+        if (complete) {
+            snprintf(summary, sizeof(summary), "Directory deleted: %ld files and %ld directories removed.\n", result.files, result.directories);
+            log_activity("Directory deleted.");
+        } else {
+            snprintf(summary, sizeof(summary), "Directory partly deleted: %ld files and %ld directories removed, %ld entries could not be removed:\n", result.files, result.directories, result.errors);
+            log_activity("Directory partly deleted.");
+        }
+        send(client_socket, summary, strlen(summary), 0);
+        for (int i = 0; i < result.reported; i++) {
+            snprintf(summary, sizeof(summary), "  %s\n", result.messages[i]);
+            send(client_socket, summary, strlen(summary), 0);
+        }
+        if (result.errors > result.reported) {
+            snprintf(summary, sizeof(summary), "  ... and %ld more\n", result.errors - result.reported);
+            send(client_socket, summary, strlen(summary), 0);
         }
+        snprintf(summary, sizeof(summary), "%ld files and %ld directories removed", result.files, result.directories);
+        log_change(abs_path, "delete", summary);
     } else {
-    // If file, delete it
-    if (remove(abs_path) == 0) {
+    // If file, delete it; readers that opened it finish with the version they have
+    filelock_t lock;
+    int removed = filelock_write(abs_path, &lock) && remove(abs_path) == 0;
+    filelock_release(&lock);
+    if (removed) {
+        catalog_refresh(abs_path);
+        log_change(abs_path, "delete", "File deleted");
+        if (ends_with(abs_path, ".json")) { /* The sidecar path index and tape go with their JSON file */
+            char sidecar_path[BUFFER_SIZE + sizeof(JTAPE_SUFFIX)];
+            snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", abs_path, PATHINDEX_SUFFIX);
+            unlink(sidecar_path);
+            snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", abs_path, JTAPE_SUFFIX);
+            unlink(sidecar_path);
+        }
+
         // Prepare to delete the log file
         char log_filename[MAX_BUFFER_LENGTH + 64];
         char *extension_position = strrchr(abs_path, '.'); // Find last occurrence of '.'
@@ -553,12 +921,37 @@ void delete_file_or_directory(const char *path, int client_socket) {
 
 }
 
+// Send the names of a directory from the catalog, 0 if it is not catalogued
+static int send_catalog_listing(const char *dirname, int client_socket) {
+    catalog_listing_t listing;
+    if (!catalog_list(dirname, &listing))
+        return 0;
+
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!out) {
+        catalog_listing_free(&listing);
+        return 0;
+    }
+    outbuf_init(out, client_socket, 1);
+    for (size_t i = 0; i < listing.count; i++) {
+        outbuf_puts(out, listing.names[i]);
+        outbuf_putc(out, '\n');
+    }
+    outbuf_flush(out);
+    free(out);
+    catalog_listing_free(&listing);
+    return 1;
+}
+
 // List files and directories in a directory
 void list_directory(const char *dirname, int client_socket) {
     DIR *d;
     struct dirent *dir;
     char buffer[BUFFER_SIZE];
 
+    if (send_catalog_listing(dirname, client_socket))
+        return;
+
     d = opendir(dirname);
     if (d) {
         while ((dir = readdir(d)) != NULL) {
@@ -580,6 +973,9 @@ void list_directory_contents(const char *dirname, int client_socket) {
     struct dirent *dir;
     char buffer[BUFFER_SIZE];
 
+    if (send_catalog_listing(dirname, client_socket))
+        return;
+
     d = opendir(dirname);
     if (d) {
         while ((dir = readdir(d)) != NULL) {
@@ -618,9 +1014,7 @@ void block_user(const char *username) {
     pthread_mutex_lock(&blocked_users_mutex);
     if (blocked_count < MAX_BLOCKED_USERS) {
         blocked_users[blocked_count++] = strdup(username);
-        char log_message[BUFFER_SIZE];
-        snprintf(log_message, sizeof(log_message), "User %s has been blocked.", username);
-        log_activity(log_message);
+        log_event(BINLOG_USER_BLOCKED, username, NULL);
         pthread_mutex_unlock(&blocked_users_mutex);
 
         // Disconnect the blocked user if they are currently connected
@@ -648,9 +1042,7 @@ void unblock_user(const char *username) {
         if (strcmp(blocked_users[i], username) == 0) {
             free(blocked_users[i]);
             blocked_users[i] = blocked_users[--blocked_count];
-            char log_message[BUFFER_SIZE];
-            snprintf(log_message, sizeof(log_message), "User %s has been unblocked.", username);
-            log_activity(log_message);
+            log_event(BINLOG_USER_UNBLOCKED, username, NULL);
             pthread_mutex_unlock(&blocked_users_mutex);
             return;
         }
@@ -658,13 +1050,155 @@ void unblock_user(const char *username) {
     pthread_mutex_unlock(&blocked_users_mutex);
 }
 
+// Send what the catalog knows about a path
+void send_catalog_info(const char *path, int client_socket) {
+    static const char *formats[] = { "other", "directory", "xml", "json" };
+    char buffer[BUFFER_SIZE * 2];
+    char modified[64];
+    catalog_info_t info;
+
+    if (!catalog_lookup(path, &info)) {
+        snprintf(buffer, sizeof(buffer), "Not in the catalog: %s\n", path);
+        send(client_socket, buffer, strlen(buffer), 0);
+        return;
+    }
+
+    struct tm tm;
+    localtime_r(&info.mtime.tv_sec, &tm);
+    strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buffer, sizeof(buffer), "Format: %s\nSize: %lld bytes\nModified: %s\n", formats[info.format], info.size, modified);
+    send(client_socket, buffer, strlen(buffer), 0);
+
+    int readers, writing;
+    filelock_status(path, &readers, &writing);
+    if (readers || writing) {
+        snprintf(buffer, sizeof(buffer), "In use: %d reader(s)%s\n", readers, writing ? ", being written" : "");
+        send(client_socket, buffer, strlen(buffer), 0);
+    }
+
+    const FileMetadata *metadata = &info.metadata;
+    if (metadata->found & METADATA_AUTHOR) {
+        snprintf(buffer, sizeof(buffer), "Author: %s\n", metadata->author);
+        send(client_socket, buffer, strlen(buffer), 0);
+    }
+    if (metadata->found & METADATA_TITLE) {
+        snprintf(buffer, sizeof(buffer), "Title: %s\n", metadata->title);
+        send(client_socket, buffer, strlen(buffer), 0);
+    }
+    if (metadata->found & METADATA_DESCRIPTION) {
+        snprintf(buffer, sizeof(buffer), "Description: %s\n", metadata->description);
+        send(client_socket, buffer, strlen(buffer), 0);
+    }
+    if (metadata->found & METADATA_FILE_SIZE) {
+        snprintf(buffer, sizeof(buffer), "File size: %lld\n", metadata->file_size);
+        send(client_socket, buffer, strlen(buffer), 0);
+    }
+}
+
+// Send the counters of the conversion cache
+void send_convcache_stats(int client_socket) {
+    char buffer[BUFFER_SIZE];
+    convcache_stats_t stats;
+    convcache_stats(&stats);
+    long lookups = stats.hits + stats.misses;
+    snprintf(buffer, sizeof(buffer), "Conversion cache: %ld entries, %.1f MB, %ld hits, %ld misses (%.1f%% hit rate), %ld evictions\n",
+             stats.entries, stats.bytes / 1e6, stats.hits, stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0, stats.evictions);
+    send(client_socket, buffer, strlen(buffer), 0);
+}
+
+// Read the start of a history query: seconds since the epoch, or a local date with an optional time
+static int parse_since(const char *text, time_t *since) {
+    struct tm tm;
+    int length = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &length) == 3) {
+        int time_length = 0;
+        if (text[length] != '\0' && sscanf(text + length, " %d:%d%n:%d%n", &tm.tm_hour, &tm.tm_min, &time_length, &tm.tm_sec, &time_length) < 2)
+            return 0;
+        if (text[length + time_length] != '\0')
+            return 0;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        *since = mktime(&tm);
+        return *since != (time_t)-1;
+    }
+    char *end;
+    long long seconds = strtoll(text, &end, 10);
+    if (end == text || *end != '\0')
+        return 0;
+    *since = (time_t)seconds;
+    return 1;
+}
+
+// Print a change the way changes.log holds it
+static void send_change(const ChangeLog *change, void *arg) {
+    char stamp[64];
+    struct tm tm;
+    localtime_r(&change->timestamp, &tm);
+    strftime(stamp, sizeof(stamp), "%a %b %e %H:%M:%S %Y", &tm);
+    outbuf_t *out = (outbuf_t *)arg;
+    outbuf_puts(out, "[");
+    outbuf_puts(out, stamp);
+    outbuf_puts(out, "] File: ");
+    outbuf_puts(out, change->filename);
+    outbuf_puts(out, ", Change: ");
+    outbuf_puts(out, change->change_type);
+    outbuf_puts(out, ", Details: ");
+    outbuf_puts(out, change->details);
+    outbuf_putc(out, '\n');
+}
+
+// Split the since off the end of "<file> [since]", the name may hold spaces; returns 0 without a since
+static int split_since(char *arguments, time_t *since) {
+    // A date and a time are two words, seconds or a date alone one
+    char *last = strrchr(arguments, ' ');
+    if (!last)
+        return 0;
+    char *before = last;
+    while (before > arguments && before[-1] != ' ')
+        before--;
+    if (before > arguments && parse_since(before, since)) {
+        before[-1] = '\0';
+        return 1;
+    }
+    if (parse_since(last + 1, since)) {
+        *last = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+// Send the changes of a file, "<file> [since]"; a line that does not end with a time is all the name
+void send_history(char *arguments, int client_socket) {
+    char buffer[BUFFER_SIZE * 2];
+    time_t since = 0;
+    split_since(arguments, &since);
+
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!out) {
+        send(client_socket, "Out of memory.\n", strlen("Out of memory.\n"), 0);
+        return;
+    }
+    outbuf_init(out, client_socket, 1);
+    long count = history_query(arguments, since, send_change, out);
+    outbuf_flush(out);
+    free(out);
+    if (count == 0) {
+        snprintf(buffer, sizeof(buffer), "No changes recorded for %s.\n", arguments);
+        send(client_socket, buffer, strlen(buffer), 0);
+    }
+}
+
 // List connected users
 void list_connected_users(int client_socket) {
     char buffer[BUFFER_SIZE];
     pthread_mutex_lock(&connection_mutex);
     for (int i = 0; i < client_count; i++) {
-        snprintf(buffer, sizeof(buffer), "User: %s, Socket: %d\n", client_usernames[i], client_sockets[i]);
-        send(client_socket, buffer, strlen(buffer), 0);
+        int length = snprintf(buffer, sizeof(buffer), "User: %s, Socket: %d\n", client_usernames[i], client_sockets[i]);
+        if (length < 0 || length >= (int)sizeof(buffer))
+            continue;
+        send(client_socket, buffer, length, 0);
     }
     pthread_mutex_unlock(&connection_mutex);
 }
@@ -712,7 +1246,7 @@ void client_handler(void *arg) {
 
     pthread_mutex_lock(&connection_mutex);
     client_sockets[client_count] = client_socket;
-    strncpy(client_usernames[client_count], username, sizeof(client_usernames[0]) - 1);
+    snprintf(client_usernames[client_count], sizeof(client_usernames[0]), "%s", username); /* username already fits */
     client_count++;
     pthread_mutex_unlock(&connection_mutex);
 
@@ -727,7 +1261,7 @@ void client_handler(void *arg) {
         active_admins++;
         pthread_mutex_unlock(&admin_mutex);
 
-        snprintf(response, sizeof(response), "Hello Admin! You have full access. Type 'list' to list all files and directories, 'view <filename>' to view a file, 'edit <filename>' to edit a file, 'delete <path>' to delete a file or directory, 'block <username>' to block a user, 'unblock <username>' to unblock a user, 'users' to list connected users, 'cd <dirname>' to change directory, or 'exit' to disconnect.\n");
+        snprintf(response, sizeof(response), "Hello Admin! You have full access. Type 'list' to list all files and directories, 'view <filename>' to view a file, 'info <path>' to show the catalogued size, date and metadata of a path, 'edit <filename>' to edit a file, 'delete <path>' to delete a file or directory, 'block <username>' to block a user, 'unblock <username>' to unblock a user, 'users' to list connected users, 'cache' to show the conversion cache counters, 'history <filename> [since]' to list the changes of a file, 'cd <dirname>' to change directory, or 'exit' to disconnect.\n");
         send(client_socket, response, strlen(response), 0);
         log_activity("Admin user authenticated");
 
@@ -745,6 +1279,9 @@ void client_handler(void *arg) {
             } else if (strncmp(buffer, "view ", 5) == 0) {
                 char *filename = buffer + 5;
                 extract_metadata(filename, client_socket);
+            } else if (strncmp(buffer, "info ", 5) == 0) {
+                char *path = buffer + 5;
+                send_catalog_info(path, client_socket);
             } else if (strncmp(buffer, "edit ", 5) == 0) {
                 char *filename = buffer + 5;
                 if (!file_exists(filename)) {
@@ -765,6 +1302,10 @@ void client_handler(void *arg) {
                 send(client_socket, "User unblocked.\n", strlen("User unblocked.\n"), 0);
             } else if (strcmp(buffer, "users") == 0) {
                 list_connected_users(client_socket);
+            } else if (strcmp(buffer, "cache") == 0) {
+                send_convcache_stats(client_socket);
+            } else if (strncmp(buffer, "history ", 8) == 0) {
+                send_history(buffer + 8, client_socket);
             } else if (strncmp(buffer, "cd ", 3) == 0) {
                 char *dirname = buffer + 3;
                 list_directory_contents(dirname, client_socket);
@@ -782,7 +1323,7 @@ void client_handler(void *arg) {
         active_admins--;
         pthread_mutex_unlock(&admin_mutex);
     } else if (strcmp(role, "simple") == 0) {
-        snprintf(response, sizeof(response), "Hello Simple User! You can upload a new metadata file or extract metadata. Type 'upload' to upload a new metadata file, 'extract' to extract metadata. Type 'search' to view things based on json path or 'exit' to disconnect.\n");
+        snprintf(response, sizeof(response), "Hello Simple User! You can upload a new metadata file or extract metadata. Type 'upload' to upload a new metadata file, 'convert-all <dir>' to convert every XML file of a directory to JSON, 'extract' to extract metadata. Type 'search' to view things based on json path, 'batch' to search several paths at once, 'xpath' to search an XML file, 'searchdir' to search every file of a directory, 'find' to find files by author, title, description or size or 'exit' to disconnect.\n");
         send(client_socket, response, strlen(response), 0);
         log_activity("Simple user authenticated");
 
@@ -804,7 +1345,10 @@ void client_handler(void *arg) {
                 trim_newline(buffer);
 
                 char xml_path[BUFFER_SIZE];
-                strncpy(xml_path, buffer, sizeof(xml_path) - 1);
+                if (snprintf(xml_path, sizeof(xml_path), "%s", buffer) >= (int)sizeof(xml_path)) {
+                    send(client_socket, "Path too long.\n", strlen("Path too long.\n"), 0);
+                    continue;
+                }
 
                 send(client_socket, "Enter the name of the output JSON file (without extension):\n", strlen("Enter the name of the output JSON file (without extension):\n"), 0);
                 memset(buffer, 0, sizeof(buffer));
@@ -819,38 +1363,16 @@ void client_handler(void *arg) {
                 }
 
                 char json_filename[MAX_BUFFER_LENGTH];
-                if (snprintf(json_filename, sizeof(json_filename), "%s.json", buffer) >= sizeof(json_filename)) {
+                if (snprintf(json_filename, sizeof(json_filename), "%s.json", buffer) >= (int)sizeof(json_filename)) {
                     send(client_socket, "Filename too long.\n", strlen("Filename too long.\n"), 0);
                     continue;
                 }
 
                 convert_xml_to_json(xml_path, json_filename);
 
-                // Create log file for XML
-                char log_filename_xml[BUFFER_SIZE * 2];
-                char *xml_filename_without_extension = strrchr(xml_path, '.');
-                if (xml_filename_without_extension) {
-                    *xml_filename_without_extension = '\0'; // Remove extension
-                }
-                snprintf(log_filename_xml, sizeof(log_filename_xml), "%s.log", xml_path);
-                FILE *log_file_xml = fopen(log_filename_xml, "a");
-                if (log_file_xml) {
-                    fprintf(log_file_xml, "Uploaded XML file '%s' and created JSON file '%s'\n", xml_path, json_filename);
-                    fclose(log_file_xml);
-                }
-
-                // Create log file for JSON
-                char log_filename_json[BUFFER_SIZE * 2];
-                char *json_filename_without_extension = strrchr(json_filename, '.');
-                if (json_filename_without_extension) {
-                    *json_filename_without_extension = '\0'; // Remove extension
-                }
-                snprintf(log_filename_json, sizeof(log_filename_json), "%s.log", json_filename);
-                FILE *log_file_json = fopen(log_filename_json, "a");
-                if (log_file_json) {
-                    fprintf(log_file_json, "Created JSON file '%s' from XML '%s'\n", json_filename, xml_path);
-                    fclose(log_file_json);
-                }
+                // Log to the files of the XML and of the JSON document
+                logger_sidecar(xml_path, "Uploaded XML file '%s' and created JSON file '%s'", xml_path, json_filename);
+                logger_sidecar(json_filename, "Created JSON file '%s' from XML '%s'", json_filename, xml_path);
 
                 send(client_socket, "XML file converted to JSON and saved.\n", strlen("XML file converted to JSON and saved.\n"), 0);
             } else if (strcmp(buffer, "extract") == 0) {
@@ -864,12 +1386,12 @@ void client_handler(void *arg) {
                     char xml_filename[MAX_BUFFER_LENGTH];
                     char json_filename[MAX_BUFFER_LENGTH];
 
-                    if (snprintf(xml_filename, sizeof(xml_filename), "%s.xml", buffer) >= sizeof(xml_filename)) {
+                    if (snprintf(xml_filename, sizeof(xml_filename), "%s.xml", buffer) >= (int)sizeof(xml_filename)) {
                         send(client_socket, "Filename too long.\n", strlen("Filename too long.\n"), 0);
                         return;
                     }
 
-                    if (snprintf(json_filename, sizeof(json_filename), "%s.json", buffer) >= sizeof(json_filename)) {
+                    if (snprintf(json_filename, sizeof(json_filename), "%s.json", buffer) >= (int)sizeof(json_filename)) {
                         send(client_socket, "Filename too long.\n", strlen("Filename too long.\n"), 0);
                         return;
                     }
@@ -905,18 +1427,117 @@ void client_handler(void *arg) {
     search_and_print_json(json_filename, buffer, client_socket);
 
     // Log the search operation
-    char log_filename_json[BUFFER_SIZE * 2];
-    char *json_filename_without_extension = strrchr(json_filename, '.');
-    if (json_filename_without_extension) {
-        *json_filename_without_extension = '\0'; // Remove extension
+    logger_sidecar(json_filename, "Searched in '%s' for '%s'", json_filename, buffer);
+}
+                 else if (strcmp(buffer, "batch") == 0) {
+    send(client_socket, "Enter the name of the JSON file (without extension):\n", strlen("Enter the name of the JSON file (without extension):\n"), 0);
+    memset(buffer, 0, sizeof(buffer));
+    bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
+    if (bytes_read <= 0) break;
+    buffer[bytes_read] = '\0';
+    trim_newline(buffer);
+    char json_filename[MAX_BUFFER_LENGTH];
+    snprintf(json_filename, sizeof(json_filename), "%.*s.json", (int)(sizeof(json_filename) - 6), buffer);
+
+    send(client_socket, "Enter the search paths, one per line, followed by an empty line:\n", strlen("Enter the search paths, one per line, followed by an empty line:\n"), 0);
+    char path_list[BUFFER_SIZE * 16];
+    int listed = read_path_list(client_socket, path_list, sizeof(path_list));
+    if (listed == 0) break;
+    if (listed < 0) {
+        char error_msg[BUFFER_SIZE];
+        snprintf(error_msg, sizeof(error_msg), "Path list too long (at most %zu bytes).\n", sizeof(path_list) - 1);
+        send(client_socket, error_msg, strlen(error_msg), 0);
+        continue;
     }
-    snprintf(log_filename_json, sizeof(log_filename_json), "%s.log", json_filename); // Use the original filename without extension
 
-    FILE *log_file_json = fopen(log_filename_json, "a");
-    if (log_file_json) {
-        fprintf(log_file_json, "Searched in '%s' for '%s'\n", json_filename, buffer); // Use the original filename
-        fclose(log_file_json);
+    // Answer every path from one walk of the file
+    search_and_print_json_batch(json_filename, path_list, client_socket);
+
+    // Log the search operation
+    logger_sidecar(json_filename, "Batch searched in '%s'", json_filename);
+}
+                 else if (strcmp(buffer, "xpath") == 0) {
+    send(client_socket, "Enter the name of the XML file (without extension):\n", strlen("Enter the name of the XML file (without extension):\n"), 0);
+    memset(buffer, 0, sizeof(buffer));
+    bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
+    if (bytes_read <= 0) break;
+    buffer[bytes_read] = '\0';
+    trim_newline(buffer);
+    char xml_filename[MAX_BUFFER_LENGTH];
+    snprintf(xml_filename, sizeof(xml_filename), "%.*s.xml", (int)(sizeof(xml_filename) - 5), buffer);
+
+    send(client_socket, "Enter the XPath expression:\n", strlen("Enter the XPath expression:\n"), 0);
+    memset(buffer, 0, sizeof(buffer));
+    bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
+    if (bytes_read <= 0) break;
+    buffer[bytes_read] = '\0';
+    trim_newline(buffer);
+
+    // Search XML and send result to client
+    search_and_print_xpath(xml_filename, buffer, client_socket);
+
+    // Log the search operation
+    logger_sidecar(xml_filename, "XPath searched in '%s' for '%s'", xml_filename, buffer);
+}
+                 else if (strcmp(buffer, "searchdir") == 0) {
+    send(client_socket, "Enter the directory:\n", strlen("Enter the directory:\n"), 0);
+    memset(buffer, 0, sizeof(buffer));
+    bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
+    if (bytes_read <= 0) break;
+    buffer[bytes_read] = '\0';
+    trim_newline(buffer);
+    char dirname[MAX_BUFFER_LENGTH];
+    snprintf(dirname, sizeof(dirname), "%s", buffer);
+
+    send(client_socket, "Enter 'json <path>' or 'xpath <expression>':\n", strlen("Enter 'json <path>' or 'xpath <expression>':\n"), 0);
+    memset(buffer, 0, sizeof(buffer));
+    bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
+    if (bytes_read <= 0) break;
+    buffer[bytes_read] = '\0';
+    trim_newline(buffer);
+    char expression[BUFFER_SIZE];
+    fanout_kind kind;
+    if (strncmp(buffer, "json ", 5) == 0) {
+        kind = FANOUT_JSON;
+    } else if (strncmp(buffer, "xpath ", 6) == 0) {
+        kind = FANOUT_XPATH;
+    } else {
+        send(client_socket, "Unknown search type\n", strlen("Unknown search type\n"), 0);
+        continue;
     }
+    snprintf(expression, sizeof(expression), "%s", strchr(buffer, ' ') + 1);
+
+    send(client_socket, "Enter the maximum number of results (0 for no limit):\n", strlen("Enter the maximum number of results (0 for no limit):\n"), 0);
+    memset(buffer, 0, sizeof(buffer));
+    bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
+    if (bytes_read <= 0) break;
+    buffer[bytes_read] = '\0';
+    trim_newline(buffer);
+
+    // Search the files on the worker pool, results come back in file order
+    fanout_search(dirname, kind, expression, atol(buffer), client_socket);
+
+    log_event(BINLOG_SEARCH_DIRECTORY, dirname, expression);
+}
+                 else if (strcmp(buffer, "find") == 0) {
+    send(client_socket, "Enter the query (e.g. author:doe AND title:xml*, size:1000..5000, a OR b):\n", strlen("Enter the query (e.g. author:doe AND title:xml*, size:1000..5000, a OR b):\n"), 0);
+    memset(buffer, 0, sizeof(buffer));
+    bytes_read = read(client_socket, buffer, sizeof(buffer) - 1);
+    if (bytes_read <= 0) break;
+    buffer[bytes_read] = '\0';
+    trim_newline(buffer);
+
+    // Answer from the metadata index, no file is opened
+    find_documents(buffer, client_socket);
+    log_activity("Metadata search");
+}
+                 else if (strncmp(buffer, "convert-all ", 12) == 0) {
+    char dirname[MAX_BUFFER_LENGTH];
+    snprintf(dirname, sizeof(dirname), "%s", buffer + 12);
+
+    // Every XML file of the directory goes through the conversion pipeline, progress is streamed back
+    if (convert_all(dirname, client_socket))
+        log_event(BINLOG_CONVERT_DIRECTORY, dirname, NULL);
 }
                  else if (strcmp(buffer, "exit") == 0) {
                 break;
@@ -963,6 +1584,12 @@ void start_server() {
     printf("=             Server is Starting Up                =\n");
     printf("====================================================\n");
 
+    if (getenv(BINLOG_ENV) && binlog_open(BINLOG_PATH)) /* Before anything is logged */
+        printf("Logging to the binary log %s.\n", BINLOG_PATH);
+    xmlInitParser(); /* Once, before any thread parses XML; never cleaned up while clients are served */
+    printf("Loaded the history of %d changes.\n", history_init("."));
+    printf("Catalogued %d documents.\n", catalog_start("."));
+    printf("Loaded %d cached conversions.\n", convcache_init("."));
     threadpool_t *pool = threadpool_create(THREAD_COUNT, QUEUE_SIZE);
 
     pthread_t monitor_thread;
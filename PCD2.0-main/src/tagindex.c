@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "tagindex.h"
+
+// FNV-1a hash of a tag, folded to lower case when the table ignores case
+static unsigned int tag_hash(const char *tag, size_t tag_len, int nocase) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < tag_len; i++) {
+        unsigned char c = (unsigned char)tag[i];
+        hash ^= nocase ? (unsigned char)tolower(c) : c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int tag_equal(const tagindex_entry_t *entry, const char *tag, size_t tag_len, int nocase) {
+    if (entry->tag_len != tag_len)
+        return 0;
+    if (!nocase)
+        return !memcmp(entry->tag, tag, tag_len);
+    for (size_t i = 0; i < tag_len; i++) {
+        if (tolower((unsigned char)entry->tag[i]) != tolower((unsigned char)tag[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// Rebuild the slots table with `slot_count` slots
+static int tagindex_rehash(tagindex_t *index, int slot_count) {
+    int *slots = (int *)malloc(sizeof(int) * slot_count);
+    if (!slots)
+        return 0;
+    memset(slots, -1, sizeof(int) * slot_count);
+
+    for (int i = 0; i < index->size; i++) {
+        tagindex_entry_t *entry = &index->entries[i];
+        unsigned int slot = tag_hash(entry->tag, entry->tag_len, index->nocase) & (slot_count - 1);
+        while (slots[slot] != -1) /* Linear probing */
+            slot = (slot + 1) & (slot_count - 1);
+        slots[slot] = i;
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->slot_count = slot_count;
+    return 1;
+}
+
+int tagindex_init(tagindex_t *index, int expected, int nocase) {
+    int slot_count = 16;
+    while (slot_count < expected * 2) /* Keep the load factor under one half */
+        slot_count *= 2;
+
+    index->size = 0;
+    index->capacity = expected > 4 ? expected : 4;
+    index->nocase = nocase;
+    index->slots = NULL;
+    index->slot_count = 0;
+    index->entries = (tagindex_entry_t *)malloc(sizeof(tagindex_entry_t) * index->capacity);
+    if (!index->entries)
+        return 0;
+    if (!tagindex_rehash(index, slot_count)) {
+        free(index->entries);
+        index->entries = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+tagindex_entry_t *tagindex_get(tagindex_t *index, const char *tag, size_t tag_len, int *created) {
+    unsigned int hash = tag_hash(tag, tag_len, index->nocase);
+    unsigned int slot = hash & (index->slot_count - 1);
+
+    while (index->slots[slot] != -1) {
+        tagindex_entry_t *entry = &index->entries[index->slots[slot]];
+        if (tag_equal(entry, tag, tag_len, index->nocase)) {
+            if (created)
+                *created = 0;
+            return entry;
+        }
+        slot = (slot + 1) & (index->slot_count - 1);
+    }
+
+    /* Not found, append a new group */
+    if (index->size == index->capacity) {
+        tagindex_entry_t *entries = (tagindex_entry_t *)realloc(index->entries, sizeof(tagindex_entry_t) * index->capacity * 2);
+        if (!entries)
+            return NULL;
+        index->entries = entries;
+        index->capacity *= 2;
+    }
+
+    tagindex_entry_t *entry = &index->entries[index->size];
+    entry->tag = tag;
+    entry->tag_len = tag_len;
+    entry->count = 0;
+    entry->first = -1;
+    entry->last = -1;
+    entry->value = NULL;
+    index->slots[slot] = index->size++;
+
+    if (index->size * 2 > index->slot_count && !tagindex_rehash(index, index->slot_count * 2)) {
+        index->size--; /* Could not grow, forget the new group */
+        index->slots[slot] = -1;
+        return NULL;
+    }
+
+    if (created)
+        *created = 1;
+    return &index->entries[index->size - 1];
+}
+
+void tagindex_free(tagindex_t *index) {
+    free(index->entries);
+    free(index->slots);
+    index->entries = NULL;
+    index->slots = NULL;
+    index->size = index->capacity = index->slot_count = 0;
+}
@@ -54,7 +54,8 @@ int threadpool_add(threadpool_t *pool, void (*routine)(void *), void *arg) {
 
     next = (pool->tail + 1) % pool->task_queue_size;
 
-    if (pool->count == pool->task_queue_size) {
+    if (pool->count == pool->task_queue_size) { /* The queue is full, the caller decides what to do */
+        pthread_mutex_unlock(&(pool->lock));
         return -1;
     }
 
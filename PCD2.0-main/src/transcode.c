@@ -0,0 +1,518 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "transcode.h"
+#include "xmlstream.h"
+#include "tagindex.h"
+#include "convcache.h"
+#include "savefile.h"
+
+/* An element of the document, only offsets into the input are kept, never the content */
+typedef struct {
+    const char *name; /* Tag name */
+    size_t name_len;
+    const char *attrs; /* Raw attribute area */
+    size_t attrs_len;
+    int empty; /* Inline tag, it has neither text nor children */
+    int has_text; /* Text directly inside, whitespace included */
+    int has_visible_text; /* Text directly inside that is not only whitespace */
+    int first_text; /* Runs of text directly inside, -1 when there are none */
+    int last_text;
+    int first_group; /* Position of the groups of its children in `heads` */
+    int group_count;
+    int next_in_group; /* Next sibling with the same tag, -1 at the end of the group */
+    int group_size; /* For the first sibling of a group: number of siblings in the group */
+    const char *group_tag; /* For the first sibling of a group: key of the group */
+    size_t group_tag_len;
+} element_t;
+
+/* A run of text directly inside an element */
+typedef struct {
+    const char *text;
+    size_t len;
+    int next; /* Next run of the same element, -1 at the end */
+} text_run_t;
+
+/* The document read in one pass: its elements in document order and their text */
+typedef struct {
+    element_t *elements;
+    int element_count;
+    int element_capacity;
+    text_run_t *texts;
+    int text_count;
+    int text_capacity;
+    int *heads; /* First sibling of each group, the groups of an element are consecutive */
+    int head_count;
+    int head_capacity;
+} document_t;
+
+/* An element whose end tag has not been read yet */
+typedef struct {
+    int element;
+    int has_groups; /* `groups` is allocated once the element has a child */
+    tagindex_t groups;
+} open_element_t;
+
+/* An element whose value is being written */
+typedef struct {
+    int element;
+    int depth; /* cJSON print depth of the value */
+    int members; /* Members written so far */
+    int group; /* Group being written */
+    int item; /* Sibling of the group whose value was written last, -1 before the first */
+} write_frame_t;
+
+// Make room for one more item in a growing array
+static int reserve(void **array, int *capacity, int count, size_t size) {
+    if (count < *capacity)
+        return 1;
+    int grown_capacity = *capacity ? *capacity * 2 : 16;
+    void *grown = realloc(*array, grown_capacity * size);
+    if (!grown)
+        return 0;
+    *array = grown;
+    *capacity = grown_capacity;
+    return 1;
+}
+
+static int add_element(document_t *doc, const xml_event_t *event) {
+    if (!reserve((void **)&doc->elements, &doc->element_capacity, doc->element_count, sizeof(element_t)))
+        return -1;
+    element_t *element = &doc->elements[doc->element_count];
+    memset(element, 0, sizeof(*element));
+    element->name = event->name;
+    element->name_len = event->name_len;
+    element->attrs = event->attrs;
+    element->attrs_len = event->attrs_len;
+    element->empty = event->type == XML_EVENT_EMPTY;
+    element->first_text = element->last_text = -1;
+    element->next_in_group = -1;
+    return doc->element_count++;
+}
+
+static int add_text(document_t *doc, int index, const xml_event_t *event) {
+    if (!reserve((void **)&doc->texts, &doc->text_capacity, doc->text_count, sizeof(text_run_t)))
+        return 0;
+    element_t *element = &doc->elements[index];
+    text_run_t *run = &doc->texts[doc->text_count];
+    run->text = event->text;
+    run->len = event->text_len;
+    run->next = -1;
+    if (element->last_text < 0)
+        element->first_text = doc->text_count;
+    else
+        doc->texts[element->last_text].next = doc->text_count;
+    element->last_text = doc->text_count++;
+    element->has_text = 1;
+    for (size_t i = 0; i < event->text_len && !element->has_visible_text; i++) {
+        if (!isspace((unsigned char)event->text[i]))
+            element->has_visible_text = 1;
+    }
+    return 1;
+}
+
+// Add a child to the group of its tag, the groups decide which keys become arrays
+static int group_child(document_t *doc, open_element_t *parent, int child, const xml_event_t *event) {
+    if (!parent->has_groups) {
+        if (!tagindex_init(&parent->groups, 8, 1))
+            return 0;
+        parent->has_groups = 1;
+    }
+    tagindex_entry_t *group = tagindex_get(&parent->groups, event->name, event->name_len, NULL);
+    if (!group)
+        return 0;
+    if (group->count == 0) {
+        group->first = child;
+    } else {
+        doc->elements[group->last].next_in_group = child;
+        if (group->count == 1) { /* cJSON_ReplaceItemInObject names the array after the second sibling */
+            group->tag = event->name;
+            group->tag_len = event->name_len;
+        }
+    }
+    group->last = child;
+    group->count++;
+    return 1;
+}
+
+// Record the groups of an element whose end tag was read
+static int close_element(document_t *doc, open_element_t *open) {
+    element_t *element = &doc->elements[open->element];
+    element->first_group = doc->head_count;
+    if (!open->has_groups)
+        return 1;
+    int ok = 1;
+    for (int g = 0; g < open->groups.size && ok; g++) {
+        tagindex_entry_t *group = &open->groups.entries[g];
+        ok = reserve((void **)&doc->heads, &doc->head_capacity, doc->head_count, sizeof(int));
+        if (ok) {
+            element_t *head = &doc->elements[group->first];
+            head->group_size = group->count;
+            head->group_tag = group->tag;
+            head->group_tag_len = group->tag_len;
+            doc->heads[doc->head_count++] = group->first;
+            element->group_count++;
+        }
+    }
+    tagindex_free(&open->groups);
+    open->has_groups = 0;
+    return ok;
+}
+
+// Read everything nested in the element whose start tag was just read, with a stack of open elements instead of recursion
+static int read_element(document_t *doc, xml_stream_t *stream, int root) {
+    open_element_t *open = NULL;
+    int depth = 0, capacity = 0, ok = 1;
+
+    if (!reserve((void **)&open, &capacity, depth, sizeof(open_element_t)))
+        return 0;
+    open[depth].element = root;
+    open[depth++].has_groups = 0;
+
+    while (ok && depth > 0) {
+        open_element_t *top = &open[depth - 1];
+        xml_event_t event;
+        xml_stream_next(stream, &event);
+        if (event.type == XML_EVENT_TEXT) {
+            ok = add_text(doc, top->element, &event);
+        } else if (event.type == XML_EVENT_START || event.type == XML_EVENT_EMPTY) {
+            int child = add_element(doc, &event);
+            ok = child >= 0 && group_child(doc, top, child, &event);
+            if (ok && event.type == XML_EVENT_START) {
+                ok = reserve((void **)&open, &capacity, depth, sizeof(open_element_t));
+                if (ok) {
+                    open[depth].element = child;
+                    open[depth++].has_groups = 0;
+                }
+            }
+        } else if (event.type == XML_EVENT_END) {
+            const element_t *element = &doc->elements[top->element];
+            if (event.name_len != element->name_len || memcmp(event.name, element->name, element->name_len)) {
+                fprintf(stderr, "Error! Mismatched tags (%.*s != %.*s)\n", (int)element->name_len, element->name, (int)event.name_len, event.name);
+                ok = 0;
+            } else {
+                ok = close_element(doc, top);
+                depth--;
+            }
+        } else if (event.type != XML_EVENT_DECL) { /* End of input before the closing tag */
+            ok = 0;
+        }
+    }
+
+    while (depth > 0) { /* Left open by an error */
+        if (open[--depth].has_groups)
+            tagindex_free(&open[depth].groups);
+    }
+    free(open);
+    return ok;
+}
+
+static void free_document(document_t *doc) {
+    free(doc->elements);
+    free(doc->texts);
+    free(doc->heads);
+}
+
+static void write_indent(outbuf_t *out, int depth) {
+    for (int i = 0; i < depth; i++)
+        outbuf_putc(out, '\t');
+}
+
+// Write bytes escaped the same way cJSON prints strings, whitespace is dropped when `strip` is set
+static void write_escaped(outbuf_t *out, const char *text, size_t len, int strip) {
+    size_t run = 0; /* Start of the bytes that can be copied as they are */
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        int is_space = strip && isspace(c);
+        if (c >= 32 && c != '"' && c != '\\' && !is_space)
+            continue;
+
+        outbuf_write(out, text + run, i - run);
+        run = i + 1;
+        if (is_space)
+            continue;
+
+        switch (c) {
+            case '"': outbuf_puts(out, "\\\""); break;
+            case '\\': outbuf_puts(out, "\\\\"); break;
+            case '\b': outbuf_puts(out, "\\b"); break;
+            case '\f': outbuf_puts(out, "\\f"); break;
+            case '\n': outbuf_puts(out, "\\n"); break;
+            case '\r': outbuf_puts(out, "\\r"); break;
+            case '\t': outbuf_puts(out, "\\t"); break;
+            default: {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                outbuf_puts(out, code);
+            }
+        }
+    }
+    outbuf_write(out, text + run, len - run);
+}
+
+// Start an object member: separator, indentation and the quoted key
+static void write_key(outbuf_t *out, int depth, int *members, const char *prefix, const char *key, size_t key_len) {
+    if ((*members)++ > 0)
+        outbuf_puts(out, ",\n");
+    write_indent(out, depth);
+    outbuf_putc(out, '"');
+    outbuf_puts(out, prefix);
+    write_escaped(out, key, key_len, 0);
+    outbuf_puts(out, "\":\t");
+}
+
+static void write_object_end(outbuf_t *out, int depth, int members) {
+    if (members > 0)
+        outbuf_putc(out, '\n');
+    write_indent(out, depth);
+    outbuf_putc(out, '}');
+}
+
+// Write the runs of text directly inside an element as one JSON string
+static void write_text(outbuf_t *out, const document_t *doc, const element_t *element, int strip) {
+    outbuf_putc(out, '"');
+    for (int i = element->first_text; i >= 0; i = doc->texts[i].next)
+        write_escaped(out, doc->texts[i].text, doc->texts[i].len, strip);
+    outbuf_putc(out, '"');
+}
+
+// Write the start of the value of an element at cJSON print depth `depth`; returns 1 if it is an object whose groups are still to be written
+static int write_value_start(outbuf_t *out, const document_t *doc, int index, int depth, int *members) {
+    const element_t *element = &doc->elements[index];
+    *members = 0;
+    if (element->empty) { /* Inline tags have neither text nor children */
+        outbuf_puts(out, "{\n");
+        write_object_end(out, depth, 0);
+        return 0;
+    }
+
+    if (element->group_count == 0 && element->has_text) {
+        /* Text only node: a string, or an object with `__text` and the attributes */
+        const char *attrs = element->attrs, *attrs_end = element->attrs + element->attrs_len, *key, *value;
+        size_t key_len, value_len;
+        if (!xml_attr_next(&attrs, attrs_end, &key, &key_len, &value, &value_len)) {
+            write_text(out, doc, element, 0);
+            return 0;
+        }
+        outbuf_puts(out, "{\n");
+        write_key(out, depth + 1, members, "", "__text", 6);
+        write_text(out, doc, element, 0);
+        attrs = element->attrs;
+        while (xml_attr_next(&attrs, attrs_end, &key, &key_len, &value, &value_len)) {
+            write_key(out, depth + 1, members, "_", key, key_len);
+            outbuf_putc(out, '"');
+            write_escaped(out, value, value_len, 0);
+            outbuf_putc(out, '"');
+        }
+        write_object_end(out, depth, *members);
+        return 0;
+    }
+
+    /* Node with children: whitespace stripped text first, then one key per group of siblings */
+    outbuf_puts(out, "{\n");
+    if (element->has_visible_text) {
+        write_key(out, depth + 1, members, "", "__text", 6);
+        write_text(out, doc, element, 1);
+    }
+    if (element->group_count == 0) {
+        write_object_end(out, depth, *members);
+        return 0;
+    }
+    return 1;
+}
+
+// Write the value of an element and everything nested in it, with a stack of open objects instead of recursion
+static int write_element(outbuf_t *out, const document_t *doc, int root, int depth) {
+    write_frame_t *stack = NULL;
+    int count = 0, capacity = 0, members, ok = 1;
+
+    if (!write_value_start(out, doc, root, depth, &members))
+        return !out->error;
+    if (!reserve((void **)&stack, &capacity, count, sizeof(write_frame_t)))
+        return 0;
+    stack[count++] = (write_frame_t){ root, depth, members, 0, -1 };
+
+    while (count > 0 && ok && !out->error) {
+        write_frame_t *top = &stack[count - 1];
+        const element_t *element = &doc->elements[top->element];
+        int child = -1, child_depth = top->depth + 2;
+
+        if (top->item >= 0) { /* The value of a sibling was just written */
+            const element_t *head = &doc->elements[doc->heads[element->first_group + top->group]];
+            child = doc->elements[top->item].next_in_group;
+            if (child >= 0) {
+                outbuf_puts(out, ", ");
+            } else {
+                if (head->group_size > 1)
+                    outbuf_putc(out, ']');
+                top->group++;
+            }
+        }
+        if (child < 0) {
+            if (top->group == element->group_count) {
+                write_object_end(out, top->depth, top->members);
+                count--;
+                continue;
+            }
+            child = doc->heads[element->first_group + top->group];
+            const element_t *head = &doc->elements[child];
+            write_key(out, top->depth + 1, &top->members, "", head->group_tag, head->group_tag_len);
+            if (head->group_size == 1)
+                child_depth = top->depth + 1;
+            else
+                outbuf_putc(out, '[');
+        }
+
+        top->item = child;
+        if (write_value_start(out, doc, child, child_depth, &members)) {
+            ok = reserve((void **)&stack, &capacity, count, sizeof(write_frame_t));
+            if (ok)
+                stack[count++] = (write_frame_t){ child, child_depth, members, 0, -1 };
+        }
+    }
+
+    free(stack);
+    return ok && !out->error;
+}
+
+// Copy the value of the attribute `name` of the declaration, returns 0 if it is missing
+static int decl_attr(const xml_event_t *decl, const char *name, const char **value, size_t *value_len) {
+    const char *attrs = decl->attrs, *key;
+    size_t key_len;
+    while (xml_attr_next(&attrs, decl->attrs + decl->attrs_len, &key, &key_len, value, value_len)) {
+        if (key_len == strlen(name) && !memcmp(key, name, key_len))
+            return 1;
+    }
+    return 0;
+}
+
+int transcode_xml_buffer(const char *data, size_t size, outbuf_t *out) {
+    xml_stream_t stream;
+    xml_event_t event, decl;
+    document_t doc = {0};
+    int *roots = NULL, root_count = 0, root_capacity = 0;
+    tagindex_t top_tags;
+    int has_decl = 0, duplicates = 0, ok = 1;
+
+    if (!tagindex_init(&top_tags, 4, 0))
+        return 0;
+
+    /* Read the declaration and the top level elements with everything in them, in one pass over the input */
+    xml_stream_init(&stream, data, size);
+    while (ok) {
+        xml_stream_next(&stream, &event);
+        if (event.type == XML_EVENT_EOF)
+            break;
+        if (event.type == XML_EVENT_DECL) {
+            if (!has_decl)
+                decl = event;
+            has_decl = 1;
+        } else if (event.type == XML_EVENT_START || event.type == XML_EVENT_EMPTY) {
+            int created = 0, root = add_element(&doc, &event);
+            if (root < 0 || !reserve((void **)&roots, &root_capacity, root_count, sizeof(int)) || !tagindex_get(&top_tags, event.name, event.name_len, &created)) {
+                ok = 0;
+                break;
+            }
+            roots[root_count++] = root;
+            if (!created)
+                duplicates = 1;
+            if (event.type == XML_EVENT_START)
+                ok = read_element(&doc, &stream, root);
+        } else if (event.type != XML_EVENT_TEXT) { /* Stray closing tag or broken markup */
+            ok = 0;
+        }
+    }
+
+    if (ok) {
+        const char *value;
+        size_t value_len;
+        int members = 0;
+
+        outbuf_puts(out, "{\n");
+        if (has_decl && decl_attr(&decl, "version", &value, &value_len)) {
+            write_key(out, 1, &members, "", "version", 7);
+            outbuf_putc(out, '"');
+            write_escaped(out, value, value_len, 0);
+            outbuf_putc(out, '"');
+        }
+        if (has_decl && decl_attr(&decl, "encoding", &value, &value_len)) {
+            write_key(out, 1, &members, "", "encoding", 8);
+            outbuf_putc(out, '"');
+            write_escaped(out, value, value_len, 0);
+            outbuf_putc(out, '"');
+        }
+
+        /* Same rule as XMLDocumentToJSON: duplicated top level tags leave only the declaration */
+        for (int i = 0; i < root_count && !duplicates && ok; i++) {
+            const element_t *root = &doc.elements[roots[i]];
+            write_key(out, 1, &members, "", root->name, root->name_len);
+            ok = write_element(out, &doc, roots[i], 1);
+        }
+        write_object_end(out, 0, members);
+    }
+
+    free(roots);
+    free_document(&doc);
+    tagindex_free(&top_tags);
+    return ok && !out->error;
+}
+
+int transcode_xml_to_file(const char *data, size_t size, const char *json_path) {
+    // Written to a new file renamed over the old one, so an output shared with the cache is replaced, not written through
+    savefile_t *file = (savefile_t *)malloc(sizeof(savefile_t));
+    if (!file || !savefile_open(file, json_path)) {
+        perror("Could not create JSON file");
+        free(file);
+        return 0;
+    }
+
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    int ok = out != NULL;
+    if (ok) {
+        outbuf_init(out, file->fd, 0);
+        ok = transcode_xml_buffer(data, size, out);
+        ok = outbuf_flush(out) && ok;
+        free(out);
+    }
+
+    if (ok) /* A failed conversion leaves the previous document in place */
+        ok = savefile_commit(file, 1);
+    else
+        savefile_abort(file);
+    free(file);
+    return ok;
+}
+
+int transcode_xml_to_json(const char *xml_path, const char *json_path) {
+    int xml_fd = open(xml_path, O_RDONLY);
+    if (xml_fd < 0) { /* If the file could not be oppened, print an error message and exit */
+        fprintf(stderr, "Error! Could not load file from '%s'\n", xml_path);
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(xml_fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "Error! Could not read file data from '%s'\n", xml_path);
+        close(xml_fd);
+        return 0;
+    }
+
+    /* Map the input instead of copying it, the kernel pages it in as the tokenizer advances */
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, xml_fd, 0);
+    close(xml_fd);
+    if (data == MAP_FAILED) {
+        perror("Could not map XML file");
+        return 0;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    int ok = transcode_xml_to_file(data, st.st_size, json_path);
+    munmap(data, st.st_size);
+    return ok;
+}
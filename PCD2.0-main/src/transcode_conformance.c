@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "json.h"
+#include "transcode.h"
+
+// Function to read the entire file into a string
+static char *read_file(const char *filename, size_t *length) {
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *content = (char *)malloc(*length + 1);
+    if (content) {
+        *length = fread(content, 1, *length, file);
+        content[*length] = '\0';
+    }
+    fclose(file);
+    return content;
+}
+
+// Convert one XML file both ways and check that the transcoder prints what the tree based converter prints
+static int conforms(const char *filename) {
+    size_t length;
+    char *xml = read_file(filename, &length);
+    if (!xml) {
+        printf("%s: could not read file\n", filename);
+        return 0;
+    }
+
+    // XMLDocument_load and cJSON_Print are the reference
+    XMLDocument document;
+    char *expected = NULL;
+    if (XMLDocument_load(&document, filename)) {
+        cJSON *json = XMLDocumentToJSON(&document);
+        expected = cJSON_Print(json);
+        cJSON_Delete(json);
+        XMLDocument_free(&document);
+    }
+
+    outbuf_t *out = (outbuf_t *)malloc(sizeof(outbuf_t));
+    if (!out) {
+        free(xml);
+        free(expected);
+        return 0;
+    }
+    outbuf_init_memory(out, SIZE_MAX);
+    int ok = transcode_xml_buffer(xml, length, out);
+    ok = outbuf_flush(out) && ok;
+
+    int same;
+    if (!expected || !ok) { /* Both must reject the document */
+        same = !expected && !ok;
+        printf("%s: %s\n", filename, same ? "rejected by both" : expected ? "rejected by the transcoder only" : "rejected by the tree converter only");
+    } else {
+        size_t expected_length = strlen(expected), at = 0;
+        while (at < expected_length && at < out->memory_length && expected[at] == out->memory[at])
+            at++;
+        same = at == expected_length && at == out->memory_length;
+        if (same)
+            printf("%s: same %zu bytes\n", filename, expected_length);
+        else
+            printf("%s: differs at byte %zu (%zu bytes expected, %zu transcoded)\n", filename, at, expected_length, out->memory_length);
+    }
+
+    free(out->memory);
+    free(out);
+    free(expected);
+    free(xml);
+    return same;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) { /* The files must be sent from the command line */
+        printf("Usage: %s <file.xml> [file.xml ...]\n", argv[0]);
+        return 1;
+    }
+    int failed = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!conforms(argv[i]))
+            failed++;
+    }
+    return failed ? 1 : 0;
+}
+/*
+gcc -o transcode_conformance transcode_conformance.c transcode.c xmlstream.c tagindex.c outbuf.c convcache.c savefile.c jwrite.c jcursor.c jindex.c -I../include -I/home/alex/cJSON -L/home/alex/cJSON -lcjson -lpthread -lm
+./transcode_conformance fisier1.xml fisier2.xml
+*/
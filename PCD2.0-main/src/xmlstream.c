@@ -0,0 +1,225 @@
+#include <string.h>
+#include <ctype.h>
+#include "xmlstream.h"
+
+void xml_stream_init(xml_stream_t *stream, const char *data, size_t size) {
+    stream->pos = data;
+    stream->end = data + size;
+}
+
+// Find `needle` in [from, end), returns NULL if it is not there
+static const char *find_sequence(const char *from, const char *end, const char *needle) {
+    size_t needle_len = strlen(needle);
+    while (from + needle_len <= end) {
+        const char *hit = memchr(from, needle[0], end - from);
+        if (!hit || hit + needle_len > end)
+            return NULL;
+        if (!memcmp(hit, needle, needle_len))
+            return hit;
+        from = hit + 1;
+    }
+    return NULL;
+}
+
+static int starts_with(const char *pos, const char *end, const char *prefix) {
+    size_t prefix_len = strlen(prefix);
+    return (size_t)(end - pos) >= prefix_len && !memcmp(pos, prefix, prefix_len);
+}
+
+// Find the '>' closing a tag, ignoring the ones inside quoted attribute values
+static const char *find_tag_end(const char *pos, const char *end) {
+    char quote = 0;
+    for (; pos < end; pos++) {
+        if (quote) {
+            if (*pos == quote)
+                quote = 0;
+        } else if (*pos == '"' || *pos == '\'') {
+            quote = *pos;
+        } else if (*pos == '>') {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+xml_event_type xml_stream_next(xml_stream_t *stream, xml_event_t *event) {
+    const char *end = stream->end;
+
+    memset(event, 0, sizeof(*event));
+
+    while (stream->pos < end) {
+        const char *pos = stream->pos;
+        event->start = pos;
+
+        /* Text runs until the next tag */
+        if (*pos != '<') {
+            const char *lt = memchr(pos, '<', end - pos);
+            if (!lt)
+                lt = end;
+            event->type = XML_EVENT_TEXT;
+            event->text = pos;
+            event->text_len = lt - pos;
+            stream->pos = lt;
+            return event->type;
+        }
+
+        /* Comments are dropped */
+        if (starts_with(pos, end, "<!--")) {
+            const char *close = find_sequence(pos + 4, end, "-->");
+            if (!close)
+                break;
+            stream->pos = close + 3;
+            continue;
+        }
+
+        /* CDATA sections are reported as text */
+        if (starts_with(pos, end, "<![CDATA[")) {
+            const char *close = find_sequence(pos + 9, end, "]]>");
+            if (!close)
+                break;
+            stream->pos = close + 3;
+            if (close == pos + 9) /* Empty section, nothing to report */
+                continue;
+            event->type = XML_EVENT_TEXT;
+            event->text = pos + 9;
+            event->text_len = close - (pos + 9);
+            return event->type;
+        }
+
+        /* Other declarations (<!DOCTYPE ...>) are skipped, including an internal subset */
+        if (starts_with(pos, end, "<!")) {
+            int brackets = 0;
+            const char *scan = pos + 2;
+            while (scan < end && (*scan != '>' || brackets > 0)) {
+                if (*scan == '[') brackets++;
+                else if (*scan == ']') brackets--;
+                scan++;
+            }
+            if (scan >= end)
+                break;
+            stream->pos = scan + 1;
+            continue;
+        }
+
+        /* Processing instructions, only the xml declaration is reported */
+        if (starts_with(pos, end, "<?")) {
+            const char *close = find_sequence(pos + 2, end, "?>");
+            if (!close)
+                break;
+            stream->pos = close + 2;
+            if (close - pos >= 5 && !memcmp(pos + 2, "xml", 3) && (close == pos + 5 || isspace((unsigned char)pos[5]))) {
+                event->type = XML_EVENT_DECL;
+                event->attrs = pos + 5;
+                event->attrs_len = close - (pos + 5);
+                return event->type;
+            }
+            continue;
+        }
+
+        /* Closing tag */
+        if (starts_with(pos, end, "</")) {
+            const char *name = pos + 2;
+            const char *scan = name;
+            while (scan < end && *scan != '>' && !isspace((unsigned char)*scan))
+                scan++;
+            event->name = name;
+            event->name_len = scan - name;
+            while (scan < end && isspace((unsigned char)*scan))
+                scan++;
+            if (scan >= end || *scan != '>' || event->name_len == 0)
+                break;
+            event->type = XML_EVENT_END;
+            stream->pos = scan + 1;
+            return event->type;
+        }
+
+        /* Opening or inline tag */
+        const char *name = pos + 1;
+        const char *scan = name;
+        while (scan < end && *scan != '>' && *scan != '/' && !isspace((unsigned char)*scan))
+            scan++;
+        const char *close = find_tag_end(scan, end);
+        if (!close || scan == name)
+            break;
+
+        event->name = name;
+        event->name_len = scan - name;
+        event->attrs = scan;
+        if (close > scan && close[-1] == '/') {
+            event->type = XML_EVENT_EMPTY;
+            event->attrs_len = (close - 1) - scan;
+        } else {
+            event->type = XML_EVENT_START;
+            event->attrs_len = close - scan;
+        }
+        stream->pos = close + 1;
+        return event->type;
+    }
+
+    if (stream->pos < end) { /* One of the constructs above was not terminated */
+        event->type = XML_EVENT_ERROR;
+        stream->pos = end;
+        return event->type;
+    }
+
+    event->type = XML_EVENT_EOF;
+    return event->type;
+}
+
+int xml_stream_skip(xml_stream_t *stream) {
+    xml_event_t event;
+    int depth = 0;
+
+    while (1) {
+        switch (xml_stream_next(stream, &event)) {
+            case XML_EVENT_START:
+                depth++;
+                break;
+            case XML_EVENT_END:
+                if (depth == 0) /* This closes the element we were skipping */
+                    return 1;
+                depth--;
+                break;
+            case XML_EVENT_EOF:
+            case XML_EVENT_ERROR:
+                return 0;
+            default:
+                break;
+        }
+    }
+}
+
+int xml_attr_next(const char **pos, const char *end, const char **key, size_t *key_len, const char **value, size_t *value_len) {
+    const char *scan = *pos;
+
+    while (scan < end && isspace((unsigned char)*scan)) /* Skip the separators */
+        scan++;
+    if (scan >= end)
+        return 0;
+
+    *key = scan;
+    while (scan < end && *scan != '=' && !isspace((unsigned char)*scan))
+        scan++;
+    *key_len = scan - *key;
+
+    while (scan < end && isspace((unsigned char)*scan))
+        scan++;
+    if (scan >= end || *scan != '=' || *key_len == 0) /* Attribute without a value */
+        return 0;
+    scan++;
+    while (scan < end && isspace((unsigned char)*scan))
+        scan++;
+    if (scan >= end || (*scan != '"' && *scan != '\''))
+        return 0;
+
+    char quote = *scan++;
+    *value = scan;
+    while (scan < end && *scan != quote)
+        scan++;
+    if (scan >= end)
+        return 0;
+    *value_len = scan - *value;
+
+    *pos = scan + 1;
+    return 1;
+}
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libxml/parser.h>
+#include "xpathcache.h"
+
+// Parse the open file straight from its descriptor and number its elements for document order sorting
+static void *load_xml(int fd, const struct stat *st, size_t *bytes) {
+    if (st->st_size <= 0)
+        return NULL;
+
+    xmlDocPtr doc = xmlReadFd(fd, NULL, NULL, XML_PARSE_NONET);
+    if (!doc)
+        return NULL;
+    xmlXPathOrderDocElems(doc); /* Writes into the tree, done before the document is shared */
+
+    *bytes = (size_t)st->st_size * XPATHCACHE_DOC_FACTOR;
+    return doc;
+}
+
+static void free_xml(void *document) {
+    xmlFreeDoc((xmlDocPtr)document);
+}
+
+const doccache_type_t doccache_xml = { "xml", load_xml, free_xml };
+
+static void free_expr(xpath_expr_t *expr) {
+    if (!expr)
+        return;
+    xmlXPathFreeCompExpr(expr->comp);
+    free(expr->text);
+    free(expr);
+}
+
+/* Cache of compiled expressions, the least recently used one is replaced when it is full */
+static struct {
+    xpath_expr_t *expr;
+    unsigned long used; /* Value of `clock` at the last lookup */
+} cache[XPATHCACHE_SIZE];
+static unsigned long cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+xpath_expr_t *xpathcache_acquire(const char *text) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < XPATHCACHE_SIZE; i++) {
+        if (cache[i].expr && strcmp(cache[i].expr->text, text) == 0) {
+            cache[i].used = ++cache_clock;
+            cache[i].expr->refs++;
+            pthread_mutex_unlock(&cache_lock);
+            return cache[i].expr;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // Compile outside of the lock
+    xpath_expr_t *expr = (xpath_expr_t *)calloc(1, sizeof(xpath_expr_t));
+    if (!expr)
+        return NULL;
+    expr->text = strdup(text);
+    expr->comp = xmlXPathCompile((const xmlChar *)text);
+    if (!expr->text || !expr->comp) {
+        free_expr(expr);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int slot = 0;
+    for (int i = 1; i < XPATHCACHE_SIZE; i++) {
+        if (!cache[slot].expr)
+            break;
+        if (!cache[i].expr || cache[i].used < cache[slot].used)
+            slot = i;
+    }
+    xpath_expr_t *evicted = cache[slot].expr;
+    if (evicted && --evicted->refs > 0) /* Still in use, freed by its last xpathcache_release */
+        evicted = NULL;
+    cache[slot].expr = expr;
+    cache[slot].used = ++cache_clock;
+    expr->refs = 2; /* One for the cache, one for the caller */
+    pthread_mutex_unlock(&cache_lock);
+
+    free_expr(evicted);
+    return expr;
+}
+
+void xpathcache_release(xpath_expr_t *expr) {
+    pthread_mutex_lock(&cache_lock);
+    int last = --expr->refs == 0;
+    pthread_mutex_unlock(&cache_lock);
+    if (last)
+        free_expr(expr);
+}
+
+/* XPath context of each thread, freed when the thread exits */
+static pthread_key_t context_key;
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+
+static void free_context(void *context) {
+    xmlXPathFreeContext((xmlXPathContextPtr)context);
+}
+
+static void create_context_key(void) {
+    pthread_key_create(&context_key, free_context);
+}
+
+xmlXPathObjectPtr xpathcache_eval(const xpath_expr_t *expr, xmlDocPtr doc) {
+    pthread_once(&context_once, create_context_key);
+    xmlXPathContextPtr context = (xmlXPathContextPtr)pthread_getspecific(context_key);
+    if (!context) {
+        context = xmlXPathNewContext(NULL);
+        if (!context)
+            return NULL;
+        xmlXPathContextSetCache(context, 1, -1, 0); /* Keep evaluation objects between searches */
+        pthread_setspecific(context_key, context);
+    }
+
+    // Point the context at this document, evaluation starts from its root
+    context->doc = doc;
+    context->node = (xmlNodePtr)doc;
+    context->contextSize = -1;
+    context->proximityPosition = -1;
+    return xmlXPathCompiledEval(expr->comp, context);
+}
+
+void xpathcache_write_content(xmlNodePtr node, outbuf_t *out) {
+    switch (node->type) {
+        case XML_TEXT_NODE:
+        case XML_CDATA_SECTION_NODE:
+            if (node->content)
+                outbuf_puts(out, (const char *)node->content);
+            return;
+        case XML_ELEMENT_NODE:
+        case XML_ATTRIBUTE_NODE:
+        case XML_DOCUMENT_NODE:
+        case XML_DOCUMENT_FRAG_NODE:
+            for (xmlNodePtr child = node->children; child; child = child->next) {
+                if (child->type != XML_COMMENT_NODE && child->type != XML_PI_NODE && child->type != XML_DTD_NODE)
+                    xpathcache_write_content(child, out);
+            }
+            return;
+        default: { /* Comments, entity references, namespaces: rare enough to take the copy */
+            xmlChar *content = xmlNodeGetContent(node);
+            if (content) {
+                outbuf_puts(out, (const char *)content);
+                xmlFree(content);
+            }
+            return;
+        }
+    }
+}